@@ -29,6 +29,12 @@ typedef void (*cache_mng_on_retrieve_file_buf_cb) (unsigned char *buf, size_t si
 void cache_mng_retrieve_file_buf (CacheMng *cmng, fuse_ino_t ino, size_t size, off_t off,
     cache_mng_on_retrieve_file_buf_cb on_retrieve_file_buf_cb, void *ctx);
 
+// retrieve file data as a list of buffers, which refer to the cache files (FUSE_BUF_IS_FD)
+// "bufv" is valid only during the callback
+typedef void (*cache_mng_on_retrieve_file_bufvec_cb) (struct fuse_bufvec *bufv, gboolean success, void *ctx);
+void cache_mng_retrieve_file_bufvec (CacheMng *cmng, fuse_ino_t ino, size_t size, off_t off,
+    cache_mng_on_retrieve_file_bufvec_cb on_retrieve_file_bufvec_cb, void *ctx);
+
 // store file buffer into local storage
 // if success == TRUE then "buf" successfuly stored on disc
 typedef void (*cache_mng_on_store_file_buf_cb) (gboolean success, void *ctx);
@@ -38,20 +44,44 @@ void cache_mng_store_file_buf (CacheMng *cmng, fuse_ino_t ino, size_t size, off_
 // removes file from local storage
 void cache_mng_remove_file (CacheMng *cmng, fuse_ino_t ino);
 
+// data of pinned file is not evicted, removal of pinned file is postponed until it's unpinned
+// used by writers, which upload data straight from the cache files
+void cache_mng_pin_file (CacheMng *cmng, fuse_ino_t ino);
+void cache_mng_unpin_file (CacheMng *cmng, fuse_ino_t ino);
+
 // get current size of cache
 guint64 cache_mng_size (CacheMng *cmng);
 
 // return total size of cached file
 guint64 cache_mng_get_file_length (CacheMng *cmng, fuse_ino_t ino);
 
-// return MD5 of cached file.
-// if result is TRUE then md5str will containd string with MD5 sum
-gboolean cache_mng_get_md5 (CacheMng *cmng, fuse_ino_t ino, gchar **md5str);
+// return TRUE if [off, off + size] range of file is stored in local cache
+gboolean cache_mng_contains (CacheMng *cmng, fuse_ino_t ino, size_t size, off_t off);
+
+// calculate MD5 of cached file in background
+// "md5str" is NULL if the file is not cached completely or on error, it's valid only during the callback
+typedef void (*cache_mng_on_get_md5_cb) (const gchar *md5str, void *ctx);
+void cache_mng_get_md5 (CacheMng *cmng, fuse_ino_t ino, cache_mng_on_get_md5_cb on_md5_cb, void *ctx);
+
+// register download of a block, used to avoid downloading the same data by several readers
+// return TRUE if caller must download the block and call cache_mng_fetch_done ()
+// return FALSE if the block is already being downloaded,
+// on_fetch_done_cb is called when the download is done (if it's not NULL)
+typedef void (*cache_mng_on_fetch_done_cb) (gboolean success, void *ctx);
+gboolean cache_mng_fetch_begin (CacheMng *cmng, fuse_ino_t ino, guint64 block,
+    cache_mng_on_fetch_done_cb on_fetch_done_cb, void *ctx);
+void cache_mng_fetch_done (CacheMng *cmng, fuse_ino_t ino, guint64 block, gboolean success);
 
 // return version ID of cached file
 // return NULL if version ID is not set
 const gchar *cache_mng_get_version_id (CacheMng *cmng, fuse_ino_t ino);
 void cache_mng_update_version_id (CacheMng *cmng, fuse_ino_t ino, const gchar *version_id);
+void cache_mng_update_etag (CacheMng *cmng, fuse_ino_t ino, const gchar *etag);
+
+// check that cached file matches the remote object, look it up in the persistent cache by the key
+// outdated file is removed from the cache
+gboolean cache_mng_validate_file (CacheMng *cmng, fuse_ino_t ino, const gchar *key,
+    const gchar *etag, const gchar *version_id);
 
 void cache_mng_get_stats (CacheMng *cmng, guint32 *entries_num, guint64 *total_size, guint64 *cache_hits, guint64 *cache_miss);
 #endif
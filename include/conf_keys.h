@@ -31,7 +31,18 @@ const gchar *conf_keys_str[] = {
     "pool.max_requests_per_pool",
     "s3.endpoint",
     "s3.keys_per_request",
+    "s3.dir_list_max_requests_inflight",
     "s3.part_size",
+    "s3.read_block_size",
+    "s3.readahead_enabled",
+    "s3.readahead_max_window",
+    "s3.readahead_max_requests",
+    "s3.parallel_get_parts",
+    "s3.upload_max_parts_inflight",
+    "s3.upload_from_cache",
+    "s3.copy_part_size",
+    "s3.copy_max_requests_inflight",
+    "s3.delete_batch_window",
     "s3.check_empty_files",
     "s3.storage_type",
     "connection.timeout",
@@ -39,12 +50,23 @@ const gchar *conf_keys_str[] = {
     "connection.max_redirects",
     "connection.max_retries",
     "filesystem.dir_cache_max_time",
+    "filesystem.dir_cache_max_stale_time",
+    "filesystem.dir_refresh_queue_size",
+    "filesystem.dir_refresh_rate",
     "filesystem.file_cache_max_time",
     "filesystem.md5_enabled",
+    "filesystem.md5_threads",
     "filesystem.cache_enabled",
     "filesystem.cache_dir",
     "filesystem.cache_dir_max_size",
+    "filesystem.cache_block_size",
+    "filesystem.cache_mem_max_size",
+    "filesystem.cache_io_threads",
+    "filesystem.cache_persistent",
     "filesystem.cache_object_ttl",
+    "filesystem.write_back_enabled",
+    "filesystem.write_back_dir",
+    "filesystem.write_back_max_uploads",
     "filesystem.uid",
     "filesystem.gid",
     "filesystem.dir_mode",
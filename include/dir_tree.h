@@ -30,8 +30,9 @@ typedef struct _DirEntry DirEntry;
 DirTree *dir_tree_create (Application *app);
 void dir_tree_destroy (DirTree *dtree);
 
+// "etag" is the ETag from the listing (without quotes), NULL if unknown
 DirEntry *dir_tree_update_entry (DirTree *dtree, const gchar *path, DirEntryType type,
-    fuse_ino_t parent_ino, const gchar *entry_name, long long size, time_t last_modified);
+    fuse_ino_t parent_ino, const gchar *entry_name, long long size, time_t last_modified, const gchar *etag);
 
 void dir_tree_entry_update_xattrs (DirEntry *en, struct evkeyvalq *headers);
 
@@ -66,7 +67,7 @@ void dir_tree_setattr (DirTree *dtree, fuse_ino_t ino,
     dir_tree_setattr_cb setattr_cb, fuse_req_t req, void *fi);
 
 
-typedef void (*DirTree_file_read_cb) (fuse_req_t req, gboolean success, const char *buf, size_t buf_size);
+typedef void (*DirTree_file_read_cb) (fuse_req_t req, gboolean success, struct fuse_bufvec *bufv);
 void dir_tree_file_read (DirTree *dtree, fuse_ino_t ino,
     size_t size, off_t off,
     DirTree_file_read_cb getattr_cb, fuse_req_t req,
@@ -82,10 +83,19 @@ void dir_tree_file_write (DirTree *dtree, fuse_ino_t ino,
     DirTree_file_write_cb file_write_cb, fuse_req_t req,
     struct fuse_file_info *fi);
 
+// space is not reserved, the expected size of the file is used to choose the part size of the upload
+// unless "keep_size" is set, the file grows to "offset + length"
+typedef void (*DirTree_file_fallocate_cb) (fuse_req_t req, gboolean success);
+void dir_tree_file_fallocate (DirTree *dtree, fuse_ino_t ino, off_t offset, off_t length, gboolean keep_size,
+    DirTree_file_fallocate_cb file_fallocate_cb, fuse_req_t req,
+    struct fuse_file_info *fi);
+
 typedef void (*DirTree_file_open_cb) (fuse_req_t req, gboolean success, struct fuse_file_info *fi);
 void dir_tree_file_open (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *fi, DirTree_file_open_cb file_open_cb, fuse_req_t req);
 
-void dir_tree_file_release (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *fi);
+// return FALSE if written data is lost
+gboolean dir_tree_file_release (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *fi);
+gboolean dir_tree_file_flush (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *fi);
 
 typedef void (*DirTree_file_remove_cb) (fuse_req_t req, gboolean success);
 void dir_tree_file_remove (DirTree *dtree, fuse_ino_t ino, DirTree_file_remove_cb file_remove_cb, fuse_req_t req);
@@ -97,6 +107,8 @@ typedef void (*dir_tree_mkdir_cb) (fuse_req_t req, gboolean success, fuse_ino_t
 void dir_tree_dir_create (DirTree *dtree, fuse_ino_t parent_ino, const char *name, mode_t mode,
      dir_tree_mkdir_cb mkdir_cb, fuse_req_t req);
 
+// return TRUE if "name" is a directory, which contains files opened for writing
+gboolean dir_tree_rename_is_busy (DirTree *dtree, fuse_ino_t parent_ino, const char *name);
 typedef void (*DirTree_rename_cb) (fuse_req_t req, gboolean success);
 void dir_tree_rename (DirTree *dtree,
     fuse_ino_t parent_ino, const char *name, fuse_ino_t newparent_ino, const char *newname,
@@ -25,18 +25,40 @@ typedef struct _FileIO FileIO;
 FileIO *fileio_create (Application *app, const gchar *fname, fuse_ino_t ino, gboolean assume_new);
 void fileio_destroy (FileIO *fop);
 
-void fileio_release (FileIO *fop);
+// size of the existing object, its data is kept by random writes and truncates
+void fileio_set_object_size (FileIO *fop, guint64 object_size);
+// expected final size of the file (fallocate), parts of the multipart upload are large enough to fit it
+void fileio_set_size_hint (FileIO *fop, guint64 size);
+// size of the written file
+guint64 fileio_get_current_size (FileIO *fop);
+
+// return FALSE if the data is known to be lost, the upload continues in background otherwise
+gboolean fileio_release (FileIO *fop);
+// file descriptor is closed, return FALSE if the written data is known to be lost
+gboolean fileio_flush (FileIO *fop);
 
 typedef void (*FileIO_on_buffer_written_cb) (FileIO *fop, gpointer ctx, gboolean success, size_t count);
 void fileio_write_buffer (FileIO *fop,
     const char *buf, size_t buf_size, off_t off, fuse_ino_t ino,
     FileIO_on_buffer_written_cb on_buffer_written_cb, gpointer ctx);
 
-typedef void (*FileIO_on_buffer_read_cb) (gpointer ctx, gboolean success, char *buf, size_t size);
+typedef void (*FileIO_on_truncated_cb) (FileIO *fop, gpointer ctx, gboolean success);
+void fileio_truncate (FileIO *fop, guint64 size, FileIO_on_truncated_cb on_truncated_cb, gpointer ctx);
+// grow the file to "size" (fallocate), the file is never shrunk
+void fileio_allocate (FileIO *fop, guint64 size, FileIO_on_truncated_cb on_allocated_cb, gpointer ctx);
+
+// "bufv" is valid only during the callback
+typedef void (*FileIO_on_buffer_read_cb) (gpointer ctx, gboolean success, struct fuse_bufvec *bufv);
 void fileio_read_buffer (FileIO *fop,
     size_t size, off_t off, fuse_ino_t ino,
     FileIO_on_buffer_read_cb on_buffer_read_cb, gpointer ctx);
 
+// upload "size" bytes of the local file "fd" as the object "fname", used by write-back uploader
+// parts are sent straight from "fd", it must not be closed or modified until the callback is called
+typedef void (*FileIO_on_upload_file_cb) (gpointer ctx, gboolean success);
+void fileio_upload_file (Application *app, const gchar *fname, fuse_ino_t ino, int fd, guint64 size,
+    FileIO_on_upload_file_cb on_upload_file_cb, gpointer ctx);
+
 typedef void (*FileIO_simple_on_upload_cb) (gpointer ctx, gboolean success);
 void fileio_simple_upload (Application *app, const gchar *fname, const char *str, mode_t mode,
     FileIO_simple_on_upload_cb on_upload_cb, gpointer ctx);
@@ -71,6 +71,7 @@
 #include <netinet/tcp.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/file.h>
 #include <math.h>
 #include <ftw.h>
 //#include <sys/xattr.h>
@@ -127,6 +128,8 @@ typedef enum _LogLevel LogLevel;
 typedef struct _ConfData ConfData;
 typedef struct _CacheMng CacheMng;
 typedef struct _StatSrv StatSrv;
+typedef struct _WriteBack WriteBack;
+typedef struct _HashPool HashPool;
 
 struct event_base *application_get_evbase (Application *app);
 struct evdns_base *application_get_dnsbase (Application *app);
@@ -138,6 +141,9 @@ ClientPool *application_get_ops_client_pool (Application *app);
 DirTree *application_get_dir_tree (Application *app);
 CacheMng *application_get_cache_mng (Application *app);
 StatSrv *application_get_stat_srv (Application *app);
+// returns NULL if write-back mode is disabled
+WriteBack *application_get_write_back (Application *app);
+HashPool *application_get_hash_pool (Application *app);
 RFuse *application_get_rfuse (Application *app);
 
 #ifdef SSL_ENABLED
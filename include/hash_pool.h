@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2012-2014 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012-2014 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _HASH_POOL_H_
+#define _HASH_POOL_H_
+
+#include "global.h"
+#include "md5_mb.h"
+
+HashPool *hash_pool_create (Application *app);
+void hash_pool_destroy (HashPool *hpool);
+
+// "md5str" is hex encoded MD5 sum, "md5b" is base64 encoded (Content-MD5 header)
+// both are NULL on error and valid only during the callback
+typedef void (*HashPool_on_md5_cb) (gpointer ctx, const gchar *md5str, const gchar *md5b);
+
+// calculate MD5 sum of "buf" and add "buf" to the running MD5 sum "md5_ctx" (if not NULL),
+// buffers of the same running MD5 sum are processed in the order they are submitted
+// data is read directly from "buf" chains, "buf" and "md5_ctx" must not be modified until the callback is called
+// if "hpool" is NULL, MD5 sum is calculated in the calling thread
+// pending jobs of a worker thread are hashed together by the multi-buffer MD5 (see md5_mb.h)
+void hash_pool_md5_evbuffer (HashPool *hpool, struct evbuffer *buf, Md5MbCtx *md5_ctx,
+    HashPool_on_md5_cb on_md5_cb, gpointer ctx);
+
+// the same as hash_pool_md5_evbuffer (), but data is read from "bufv" buffers,
+// FUSE_BUF_IS_FD buffers are read from their files at "pos" (FUSE_BUF_FD_SEEK is assumed)
+void hash_pool_md5_bufvec (HashPool *hpool, struct fuse_bufvec *bufv, Md5MbCtx *md5_ctx,
+    HashPool_on_md5_cb on_md5_cb, gpointer ctx);
+
+// calculate MD5 sum of the content of files "l_paths" (list of gchar *), one after another
+void hash_pool_md5_files (HashPool *hpool, GList *l_paths,
+    HashPool_on_md5_cb on_md5_cb, gpointer ctx);
+
+#endif
@@ -25,6 +25,11 @@ typedef enum {
     RT_list = 0,
 } RequestType;
 
+// called for every part of a successful response body as soon as it's received,
+// "offset" is the position of the part inside the body (it starts from 0 again if the request is re-sent)
+typedef void (*HttpConnection_on_chunk_cb) (HttpConnection *con, gpointer ctx,
+        const gchar *buf, size_t buf_len, guint64 offset);
+
 struct _HttpConnection {
     Application *app;
 
@@ -36,6 +41,8 @@ struct _HttpConnection {
     // is taken by high level
     gboolean is_acquired;
     GList *l_output_headers;
+    GList *l_output_body; // body segments of the next request
+    HttpConnection_on_chunk_cb on_chunk_cb;
 
     // statistics info
     enum evhttp_cmd_type cur_cmd_type;
@@ -54,6 +61,14 @@ gpointer http_connection_create (Application *app);
 void http_connection_destroy (gpointer data);
 
 void http_connection_add_output_header (HttpConnection *con, const gchar *key, const gchar *value);
+// body of the next request is built from memory buffers and file ranges, in the order they are added
+// the content of "buf" is moved without copying, "buf" is left empty
+void http_connection_add_output_buffer (HttpConnection *con, struct evbuffer *buf);
+// the range is sent straight from the file (read into memory over SSL), "fd" is owned (and closed) by HttpConnection
+void http_connection_add_output_file (HttpConnection *con, int fd, off_t offset, size_t length);
+// deliver the body of the next request using on_chunk_cb,
+// responce_cb is called with an empty buffer when the whole body is received
+void http_connection_set_on_chunk_cb (HttpConnection *con, HttpConnection_on_chunk_cb on_chunk_cb);
 
 void http_connection_set_on_released_cb (gpointer client, ClientPool_on_released_cb client_on_released_cb, gpointer ctx);
 gboolean http_connection_check_rediness (gpointer client);
@@ -70,10 +85,29 @@ gboolean http_connection_connect (HttpConnection *con);
 
 void http_connection_send (HttpConnection *con, struct evbuffer *outbuf);
 
+// "directory_listing_page_callback" (if not NULL) is called every time entries of a received page are added to DirTree,
+// "directory_listing_callback" is called once the listing is finished
+typedef void (*HttpConnection_directory_listing_page_callback) (gpointer callback_data);
 typedef void (*HttpConnection_directory_listing_callback) (gpointer callback_data, gboolean success);
 void http_connection_get_directory_listing (HttpConnection *con, const gchar *path, fuse_ino_t ino,
+    HttpConnection_directory_listing_page_callback directory_listing_page_callback,
     HttpConnection_directory_listing_callback directory_listing_callback, gpointer callback_data);
 
+// object of the recursive key listing, "key" is relative to "s3.key_prefix"
+typedef struct {
+    gchar *key;
+    guint64 size;
+    time_t last_modified; // 0 if not set
+    gchar *etag; // NULL if not set
+} HttpConnectionKey;
+void http_connection_key_free (HttpConnectionKey *key);
+
+// list all objects which keys start with "prefix", including objects of the nested "directories"
+// "l_keys" (list of HttpConnectionKey) is passed to the callback, which must free it
+typedef void (*HttpConnection_key_listing_callback) (gpointer callback_data, gboolean success, GList *l_keys);
+void http_connection_get_key_listing (HttpConnection *con, const gchar *prefix,
+    HttpConnection_key_listing_callback key_listing_callback, gpointer callback_data);
+
 typedef void (*BucketClient_on_cb) (gpointer ctx, gboolean success, const gchar *buf, size_t buf_len);
 void bucket_client_get (HttpConnection *con, const gchar *req_str, BucketClient_on_cb on_cb, gpointer ctx);
 
@@ -83,6 +117,8 @@ void http_connection_file_send (HttpConnection *con, int fd, const gchar *resour
 
 typedef void (*HttpConnection_responce_cb) (HttpConnection *con, gpointer ctx, gboolean success,
         const gchar *buf, size_t buf_len, struct evkeyvalq *headers);
+// the content of "out_buffer" is moved to the request without copying, "out_buffer" is left empty
+// it's appended to the body added by http_connection_add_output_buffer / http_connection_add_output_file
 gboolean http_connection_make_request (HttpConnection *con,
     const gchar *resource_path,
     const gchar *http_cmd,
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2012-2014 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012-2014 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _LIST_PARSER_H_
+#define _LIST_PARSER_H_
+
+#include "global.h"
+
+// single pass parser of ListBucket responses: objects and common prefixes are reported
+// while the document is scanned, no DOM is built
+
+typedef struct {
+    const gchar *key; // full object name, entities are decoded
+    guint64 size;
+    time_t last_modified; // 0 if not set
+    const gchar *etag; // without quotes, NULL if not set
+} ListParserObject;
+
+// "obj" and "prefix" are valid only during the callback
+typedef void (*ListParser_on_object_cb) (gpointer ctx, const ListParserObject *obj);
+typedef void (*ListParser_on_prefix_cb) (gpointer ctx, const gchar *prefix);
+
+typedef struct {
+    gboolean is_truncated;
+    gchar *next_marker; // NULL if not set
+    gchar *last_key; // name of the last object, NULL if the page has no objects
+    guint objects_count;
+    guint prefixes_count;
+} ListParserResult;
+
+// parse ListBucketResult document "xml", callbacks can be NULL
+// returns FALSE if the document is not a complete ListBucketResult, objects can be already reported
+// "result" must be freed by list_parser_result_clear () in any case
+gboolean list_parser_parse (const gchar *xml, size_t xml_len,
+    ListParser_on_object_cb on_object_cb, ListParser_on_prefix_cb on_prefix_cb, gpointer ctx,
+    ListParserResult *result);
+
+// parse only elements which precede the first Contents or CommonPrefixes (S3 returns IsTruncated and NextMarker there),
+// objects are not reported, "last_key" is not set
+// returns FALSE if IsTruncated is not found there or the document is incorrect
+gboolean list_parser_parse_head (const gchar *xml, size_t xml_len, ListParserResult *result);
+
+void list_parser_result_clear (ListParserResult *result);
+
+#endif
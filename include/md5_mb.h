@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2012-2014 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012-2014 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _MD5_MB_H_
+#define _MD5_MB_H_
+
+#include "global.h"
+
+// multi-buffer MD5: several independent MD5 sums are calculated at once,
+// one per SIMD lane, a single MD5 sum is calculated by the scalar code
+
+#define MD5_MB_DIGEST_LENGTH 16
+#define MD5_MB_BLOCK_SIZE 64
+// the widest backend (AVX-512) has 16 lanes
+#define MD5_MB_MAX_LANES 16
+
+typedef struct {
+    guint32 state[4];
+    guint64 len; // number of hashed bytes
+    unsigned char block[MD5_MB_BLOCK_SIZE]; // incomplete block
+} Md5MbCtx;
+
+void md5_mb_init (Md5MbCtx *ctx);
+void md5_mb_update (Md5MbCtx *ctx, const void *data, size_t len);
+void md5_mb_final (unsigned char *digest, Md5MbCtx *ctx);
+
+// add "data[i]" of "lens[i]" bytes to "ctxs[i]", for all "n" contexts
+// buffers may be the same, contexts must be different
+void md5_mb_update_multi (Md5MbCtx **ctxs, const unsigned char **data, const size_t *lens, guint n);
+
+// calculate MD5 sum of the buffer
+void md5_mb (const void *buf, size_t len, unsigned char *digest);
+
+// name of the used backend: "avx512", "avx2", "sse2", "vec4" or "scalar"
+const gchar *md5_mb_get_backend (void);
+// number of MD5 sums calculated at once by the used backend
+guint md5_mb_get_lanes (void);
+// select backend by name, "auto" selects the best one supported by CPU
+// return FALSE if backend is not supported
+gboolean md5_mb_set_backend (const gchar *name);
+
+#endif
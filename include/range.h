@@ -33,4 +33,8 @@ gint range_count (Range *range);
 guint64 range_length (Range *range);
 void range_print (Range *range);
 
+// call func for each interval of range
+typedef void (*RangeFunc) (guint64 start, guint64 end, gpointer ctx);
+void range_foreach (Range *range, RangeFunc func, gpointer ctx);
+
 #endif
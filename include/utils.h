@@ -33,6 +33,12 @@ int utils_del_tree (const gchar *path, int depth);
 // returns the difference in milliseconds
 guint64 timeval_diff (struct timeval *starttime, struct timeval *finishtime);
 
+// return value of the first node matching "xpath" in S3 XML response, NULL if not found
+// "s3" prefix is bound to the S3 namespace, result must be freed with g_free ()
+gchar *xml_get_value (const char *xml, size_t xml_len, const gchar *xpath);
+// return values of all nodes matching "xpath", list must be freed with g_list_free_full (l, g_free)
+GList *xml_get_values (const char *xml, size_t xml_len, const gchar *xpath);
+
 // removes leading and trailing double quotes from str
 gchar *str_remove_quotes (gchar *str);
 
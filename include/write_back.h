@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2012-2014 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012-2014 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _WRITE_BACK_H_
+#define _WRITE_BACK_H_
+
+#include "global.h"
+
+typedef struct _WriteBackFile WriteBackFile;
+
+WriteBack *write_back_create (Application *app);
+void write_back_destroy (WriteBack *wb);
+
+// create a local staging file for the object "fname"
+WriteBackFile *write_back_file_create (WriteBack *wb, const gchar *fname, fuse_ino_t ino);
+gboolean write_back_file_write (WriteBackFile *wfile, const char *buf, size_t size, off_t off);
+gboolean write_back_file_truncate (WriteBackFile *wfile, guint64 size);
+// copy up to "max_size" bytes of the previous staged version of the object,
+// return the number of copied bytes or -1 if the object has no committed staged files
+gssize write_back_file_copy_committed (WriteBackFile *wfile, guint64 max_size);
+// flush written data to disk
+gboolean write_back_file_sync (WriteBackFile *wfile);
+// file is closed, store it in the upload queue
+// return FALSE if the file is not stored persistently, it's removed if its data is not synced
+gboolean write_back_file_commit (WriteBackFile *wfile);
+// file is closed, but its data is not valid, remove it
+void write_back_file_abort (WriteBackFile *wfile);
+
+// return TRUE if the object has local data which is not uploaded yet
+gboolean write_back_is_staged (WriteBack *wb, const gchar *fname);
+
+// read data of the staged object, return -1 if the object is not staged
+gssize write_back_read (WriteBack *wb, const gchar *fname, char *buf, size_t size, off_t off);
+
+// upload the object right away, callback is called when all its staged files are uploaded
+typedef void (*WriteBack_on_flushed_cb) (gpointer ctx, gboolean success);
+void write_back_flush (WriteBack *wb, const gchar *fname, WriteBack_on_flushed_cb on_flushed_cb, gpointer ctx);
+
+// drop staged files of the object which are not being uploaded
+void write_back_discard (WriteBack *wb, const gchar *fname);
+
+#endif
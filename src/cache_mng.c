@@ -19,17 +19,38 @@
 #include "range.h"
 #include "utils.h"
 #include "conf.h"
+#include "hash_pool.h"
 
 /*{{{ structs / func defs */
 
 struct _CacheMng {
     Application *app;
-    GHashTable *h_entries;
-    GQueue *q_lru;
+    GHashTable *h_files; // file ID -> _CacheEntry, owns entries
+    GHashTable *h_entries; // inode -> _CacheEntry
+    GHashTable *h_keys; // object key -> _CacheEntry
+    GQueue *q_lru; // LRU list of _CacheBlock
     guint64 size;
     guint64 max_size;
+    GQueue *q_mem; // LRU list of _CacheBlock which data is kept in memory
+    guint64 mem_size; // size of blocks kept in memory
+    guint64 mem_max_size;
+    guint64 block_size; // size of cache blocks
     gchar *cache_dir;
     time_t check_time; // last check time of stored objects
+    GHashTable *h_fetches; // blocks which are being downloaded (_CacheFetch)
+    GHashTable *h_pins; // inode -> _CachePin, files which data must not be removed
+    gboolean persistent; // keep cache between mounts
+    time_t index_save_time; // last time the index was saved
+    int lock_fd; // locked file in the persistent cache directory, -1 if not locked
+
+    // disk I/O
+    GThreadPool **lanes; // jobs of the same block file always go to the same lane, so they are ordered
+    guint lanes_num; // 0 if disk I/O is done in the main thread
+    GAsyncQueue *q_done; // completed _CacheIOJob
+    int done_fds[2]; // pipe, used to wake up the main thread
+    struct event *ev_done;
+    guint jobs_inflight;
+    gboolean destroying; // do not call user callbacks
 
     // stats
     guint64 cache_hits;
@@ -37,29 +58,122 @@ struct _CacheMng {
 };
 
 struct _CacheEntry {
-    fuse_ino_t ino;
-    Range *avail_range;
+    fuse_ino_t ino; // 0 if entry is loaded from the index, but the object is not opened yet
+    gchar *file_id; // used to name block files
+    gchar *key; // object key, NULL if not known
+    GHashTable *h_blocks; // block index -> _CacheBlock
+    guint64 length; // total number of cached bytes
     time_t modification_time;
-    GList *ll_lru;
     gchar *version_id;
+    gchar *etag;
+};
+
+// fixed size, aligned part of a file
+struct _CacheBlock {
+    struct _CacheEntry *entry;
+    guint64 block;
+    Range *avail_range; // stored data, relative to the block start
+    GList *ll_lru;
+    unsigned char *mem; // copy of the block file [0, mem_len), NULL if the block is not in memory
+    guint64 mem_len;
+    GList *ll_mem;
+    guint pending; // number of disk I/O jobs which refer to this block
+    gboolean removed; // block is removed, but disk I/O jobs are not finished yet
+    guint64 write_seq; // number of write jobs, used to detect outdated memory loads
 };
 
 struct _CacheContext {
     guint64 size;
     unsigned char *buf;
+    struct fuse_bufvec *bufv;
     gboolean success;
     union {
         cache_mng_on_retrieve_file_buf_cb retrieve_cb;
+        cache_mng_on_retrieve_file_bufvec_cb retrieve_bufvec_cb;
         cache_mng_on_store_file_buf_cb store_cb;
     } cb;
     void *user_ctx;
     struct event *ev;
+    guint jobs_left; // disk I/O jobs which are not completed yet
+    event_callback_fn done_cb; // called when all jobs are completed
+};
+
+typedef enum {
+    CIO_write = 0, // write buf to file
+    CIO_read = 1, // read file into buf
+    CIO_open = 2, // open file and pass its descriptor to fbuf
+    CIO_load = 3, // read [0, len) of file into a newly allocated buf
+    CIO_unlink = 4,
+} CacheIOType;
+
+// disk I/O job, executed by one of the worker threads
+struct _CacheIOJob {
+    CacheIOType type;
+    gchar *path;
+    struct _CacheBlock *cblock; // NULL for unlink
+    struct _CacheContext *context; // request, NULL for unlink
+    unsigned char *buf;
+    guint64 start; // offset in file
+    guint64 len;
+    guint64 write_seq; // load: block write_seq at the moment the job was created
+    struct fuse_buf *fbuf; // open / load: buffer of the request to fill
+    guint64 fbuf_start; // load: part of the block which is requested
+    guint64 fbuf_len;
+    int fd;
+    gboolean success;
+};
+
+// block which is being downloaded from the server
+struct _CacheFetch {
+    fuse_ino_t ino;
+    guint64 block;
+    GList *l_waiters; // list of _CacheFetchWaiter
+};
+
+struct _CacheFetchWaiter {
+    cache_mng_on_fetch_done_cb fetch_done_cb;
+    void *ctx;
+};
+
+// file is pinned by its writer, which uploads data from the cache files
+struct _CachePin {
+    guint refs;
+    gboolean remove_pending; // file was removed while it was pinned
 };
 
 #define CMNG_LOG "cmng"
 
+// used if "filesystem.cache_block_size" is not set
+#define CACHE_MNG_DEFAULT_BLOCK_SIZE 1048576
+
+// reads up to this size load the whole block into memory
+#define CACHE_MNG_MEM_LOAD_MAX_READ 32768
+
+// persistent cache index
+#define CACHE_MNG_INDEX_FILE "index"
+#define CACHE_MNG_INDEX_GROUP "index" // file IDs are longer, so it can't clash with entries
+#define CACHE_MNG_LOCK_FILE "lock"
+#define CACHE_MNG_INDEX_SAVE_INTERVAL 60
+#define CACHE_MNG_FILE_PREFIX "cache_mng_"
+
 static void cache_entry_destroy (gpointer data);
+static void cache_block_destroy (gpointer data);
+static void cache_fetch_destroy (gpointer data);
+static guint cache_fetch_hash (gconstpointer key);
+static gboolean cache_fetch_equal (gconstpointer a, gconstpointer b);
 static void cache_mng_rm_cache_dir (CacheMng *cmng);
+static gboolean cache_mng_lock_cache_dir (CacheMng *cmng);
+static void cache_mng_load_index (CacheMng *cmng);
+static void cache_mng_save_index (CacheMng *cmng);
+static void cache_mng_remove_orphans (CacheMng *cmng);
+static void cache_mng_remove_entry (CacheMng *cmng, struct _CacheEntry *entry);
+static void cache_block_mem_free (CacheMng *cmng, struct _CacheBlock *cblock);
+static void cache_mng_remove_block (CacheMng *cmng, struct _CacheBlock *cblock);
+static gboolean cache_mng_entry_is_pinned (CacheMng *cmng, struct _CacheEntry *entry);
+static int cache_mng_file_name (CacheMng *cmng, char *buf, int buflen, struct _CacheEntry *entry, guint64 block);
+static void cache_io_worker (gpointer data, gpointer user_data);
+static void cache_io_on_done_cb (evutil_socket_t fd, short flags, void *ctx);
+static void cache_io_drain (CacheMng *cmng);
 /*}}}*/
 
 /*{{{ create / destroy */
@@ -70,47 +184,166 @@ CacheMng *cache_mng_create (Application *app)
 
     cmng = g_new0 (CacheMng, 1);
     cmng->app = app;
-    cmng->h_entries = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, cache_entry_destroy);
+    cmng->lock_fd = -1;
+    cmng->h_files = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, cache_entry_destroy);
+    cmng->h_entries = g_hash_table_new (g_direct_hash, g_direct_equal);
+    cmng->h_keys = g_hash_table_new (g_str_hash, g_str_equal);
     cmng->q_lru = g_queue_new ();
+    cmng->q_mem = g_queue_new ();
+    cmng->h_fetches = g_hash_table_new_full (cache_fetch_hash, cache_fetch_equal, NULL, cache_fetch_destroy);
+    cmng->h_pins = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
     cmng->size = 0;
     cmng->check_time = time (NULL);
     cmng->max_size = conf_get_uint (application_get_conf (cmng->app), "filesystem.cache_dir_max_size");
-    // generate random folder name for storing cache
-    rnd_str = get_random_string (20, TRUE);
-    cmng->cache_dir = g_strdup_printf ("%s/%s",
-        conf_get_string (application_get_conf (cmng->app), "filesystem.cache_dir"), rnd_str);
-    g_free (rnd_str);
+    cmng->block_size = conf_get_uint (application_get_conf (cmng->app), "filesystem.cache_block_size");
+    if (!cmng->block_size)
+        cmng->block_size = CACHE_MNG_DEFAULT_BLOCK_SIZE;
+    cmng->mem_size = 0;
+    cmng->mem_max_size = conf_get_uint (application_get_conf (cmng->app), "filesystem.cache_mem_max_size");
+    cmng->persistent = conf_get_boolean (application_get_conf (cmng->app), "filesystem.cache_persistent");
+    cmng->index_save_time = time (NULL);
+
+    if (cmng->persistent) {
+        const gchar *bucket_name = conf_get_string (application_get_conf (cmng->app), "s3.bucket_name");
+        const gchar *key_prefix = conf_get_string (application_get_conf (cmng->app), "s3.key_prefix");
+        gchar *name;
+
+        // the same folder is used for the same bucket and prefix
+        name = g_strdup_printf ("%s%s", bucket_name ? bucket_name : "default", key_prefix ? key_prefix : "");
+        g_strdelimit (name, "/", '_');
+        cmng->cache_dir = g_strdup_printf ("%s/%s",
+            conf_get_string (application_get_conf (cmng->app), "filesystem.cache_dir"), name);
+        g_free (name);
+
+        // the directory can be used by one mount only, other mounts of the same bucket get private cache
+        if (!cache_mng_lock_cache_dir (cmng)) {
+            LOG_msg (CMNG_LOG, "Cache directory %s is used by another process, persistent cache is disabled",
+                cmng->cache_dir);
+            g_free (cmng->cache_dir);
+            cmng->cache_dir = NULL;
+            cmng->persistent = FALSE;
+        }
+    }
+
+    if (!cmng->persistent) {
+        // generate random folder name for storing cache
+        rnd_str = get_random_string (20, TRUE);
+        cmng->cache_dir = g_strdup_printf ("%s/%s",
+            conf_get_string (application_get_conf (cmng->app), "filesystem.cache_dir"), rnd_str);
+        g_free (rnd_str);
+    }
     cmng->cache_hits = 0;
     cmng->cache_miss = 0;
 
-    cache_mng_rm_cache_dir (cmng);
+    // disk I/O workers
+    cmng->q_done = g_async_queue_new ();
+    if (pipe (cmng->done_fds) != 0) {
+        LOG_err (CMNG_LOG, "Failed to create pipe: %s", strerror (errno));
+        cmng->done_fds[0] = cmng->done_fds[1] = -1;
+        cache_mng_destroy (cmng);
+        return NULL;
+    }
+    evutil_make_socket_nonblocking (cmng->done_fds[0]);
+    evutil_make_socket_nonblocking (cmng->done_fds[1]);
+    cmng->ev_done = event_new (application_get_evbase (cmng->app), cmng->done_fds[0], EV_READ | EV_PERSIST,
+        cache_io_on_done_cb, cmng);
+    cmng->jobs_inflight = 0;
+    cmng->destroying = FALSE;
+
+    cmng->lanes_num = conf_get_uint (application_get_conf (cmng->app), "filesystem.cache_io_threads");
+    if (cmng->lanes_num) {
+        guint i;
+
+        cmng->lanes = g_new0 (GThreadPool *, cmng->lanes_num);
+        for (i = 0; i < cmng->lanes_num; i++)
+            cmng->lanes[i] = g_thread_pool_new (cache_io_worker, cmng, 1, FALSE, NULL);
+    }
+
+    if (!cmng->persistent)
+        cache_mng_rm_cache_dir (cmng);
     if (g_mkdir_with_parents (cmng->cache_dir, 0700) != 0) {
         LOG_err (CMNG_LOG, "Failed to create directory: %s", cmng->cache_dir);
         cache_mng_destroy (cmng);
         return NULL;
     }
 
+    if (cmng->persistent) {
+        cache_mng_load_index (cmng);
+        cache_mng_remove_orphans (cmng);
+    }
+
     return cmng;
 }
 
 void cache_mng_destroy (CacheMng *cmng)
 {
-    cache_mng_rm_cache_dir (cmng);
+    // wait for all disk I/O jobs, before freeing blocks
+    cmng->destroying = TRUE;
+    if (cmng->lanes) {
+        guint i;
+
+        for (i = 0; i < cmng->lanes_num; i++)
+            g_thread_pool_free (cmng->lanes[i], FALSE, TRUE);
+        g_free (cmng->lanes);
+        cmng->lanes = NULL;
+        // the rest of jobs are executed in the main thread
+        cmng->lanes_num = 0;
+    }
+    if (cmng->q_done) {
+        cache_io_drain (cmng);
+        g_async_queue_unref (cmng->q_done);
+    }
+    if (cmng->ev_done)
+        event_free (cmng->ev_done);
+    if (cmng->done_fds[0] >= 0) {
+        close (cmng->done_fds[0]);
+        close (cmng->done_fds[1]);
+    }
+
+    if (cmng->persistent)
+        cache_mng_save_index (cmng);
+    else
+        cache_mng_rm_cache_dir (cmng);
+    // the lock is released when the file is closed
+    if (cmng->lock_fd >= 0)
+        close (cmng->lock_fd);
     g_free (cmng->cache_dir);
     g_queue_free (cmng->q_lru);
+    g_queue_free (cmng->q_mem);
     g_hash_table_destroy (cmng->h_entries);
+    g_hash_table_destroy (cmng->h_keys);
+    g_hash_table_destroy (cmng->h_files);
+    g_hash_table_destroy (cmng->h_fetches);
+    g_hash_table_destroy (cmng->h_pins);
     g_free (cmng);
 }
 
-static struct _CacheEntry* cache_entry_create (fuse_ino_t ino)
+static struct _CacheEntry* cache_entry_create (CacheMng *cmng, fuse_ino_t ino, const gchar *file_id)
 {
     struct _CacheEntry* entry = g_malloc (sizeof (struct _CacheEntry));
 
     entry->ino = ino;
-    entry->avail_range = range_create ();
-    entry->ll_lru = NULL;
+    entry->key = NULL;
+    entry->h_blocks = g_hash_table_new_full (g_int64_hash, g_int64_equal, NULL, cache_block_destroy);
+    entry->length = 0;
     entry->modification_time = time (NULL);
     entry->version_id = NULL; // version not set
+    entry->etag = NULL;
+
+    if (file_id)
+        entry->file_id = g_strdup (file_id);
+    // file ID must be unique between mounts
+    else if (cmng->persistent) {
+        do {
+            entry->file_id = get_random_string (16, TRUE);
+            if (!g_hash_table_lookup (cmng->h_files, entry->file_id))
+                break;
+            g_free (entry->file_id);
+        } while (TRUE);
+    } else
+        entry->file_id = g_strdup_printf ("%"INO_FMT, INO ino);
+
+    g_hash_table_insert (cmng->h_files, entry->file_id, entry);
 
     return entry;
 }
@@ -119,12 +352,82 @@ static void cache_entry_destroy (gpointer data)
 {
     struct _CacheEntry * entry = (struct _CacheEntry*) data;
 
-    range_destroy(entry->avail_range);
+    g_hash_table_destroy (entry->h_blocks);
     if (entry->version_id)
         g_free (entry->version_id);
+    if (entry->etag)
+        g_free (entry->etag);
+    if (entry->key)
+        g_free (entry->key);
+    g_free (entry->file_id);
     g_free(entry);
 }
 
+static struct _CacheBlock *cache_block_create (struct _CacheEntry *entry, guint64 block)
+{
+    struct _CacheBlock *cblock = g_new0 (struct _CacheBlock, 1);
+
+    cblock->entry = entry;
+    cblock->block = block;
+    cblock->avail_range = range_create ();
+    cblock->ll_lru = NULL;
+    cblock->mem = NULL;
+    cblock->mem_len = 0;
+    cblock->ll_mem = NULL;
+    cblock->pending = 0;
+    cblock->removed = FALSE;
+    cblock->write_seq = 0;
+
+    return cblock;
+}
+
+static void cache_block_destroy (gpointer data)
+{
+    struct _CacheBlock *cblock = (struct _CacheBlock *) data;
+
+    range_destroy (cblock->avail_range);
+    if (cblock->mem)
+        g_free (cblock->mem);
+    g_free (cblock);
+}
+
+static struct _CacheFetch *cache_fetch_create (fuse_ino_t ino, guint64 block)
+{
+    struct _CacheFetch *fetch = g_new0 (struct _CacheFetch, 1);
+
+    fetch->ino = ino;
+    fetch->block = block;
+    fetch->l_waiters = NULL;
+
+    return fetch;
+}
+
+static void cache_fetch_destroy (gpointer data)
+{
+    struct _CacheFetch *fetch = (struct _CacheFetch *) data;
+    GList *l;
+
+    for (l = g_list_first (fetch->l_waiters); l; l = g_list_next (l))
+        g_free (l->data);
+    g_list_free (fetch->l_waiters);
+    g_free (fetch);
+}
+
+static guint cache_fetch_hash (gconstpointer key)
+{
+    const struct _CacheFetch *fetch = (const struct _CacheFetch *) key;
+
+    return (guint) fetch->ino ^ (guint) (fetch->block * 2654435761U);
+}
+
+static gboolean cache_fetch_equal (gconstpointer a, gconstpointer b)
+{
+    const struct _CacheFetch *fa = (const struct _CacheFetch *) a;
+    const struct _CacheFetch *fb = (const struct _CacheFetch *) b;
+
+    return fa->ino == fb->ino && fa->block == fb->block;
+}
+
 static struct _CacheContext* cache_context_create (guint64 size, void *user_ctx)
 {
     struct _CacheContext *context = g_malloc (sizeof (struct _CacheContext));
@@ -133,25 +436,295 @@ static struct _CacheContext* cache_context_create (guint64 size, void *user_ctx)
     context->success = FALSE;
     context->size = size;
     context->buf = NULL;
+    context->bufv = NULL;
     context->ev = NULL;
+    // released when all jobs are submitted
+    context->jobs_left = 1;
+    context->done_cb = NULL;
 
     return context;
 }
 
+static void cache_bufvec_free (struct fuse_bufvec *bufv)
+{
+    size_t i;
+
+    for (i = 0; i < bufv->count; i++) {
+        if (bufv->buf[i].flags & FUSE_BUF_IS_FD)
+            close (bufv->buf[i].fd);
+        else
+            g_free (bufv->buf[i].mem);
+    }
+    g_free (bufv);
+}
+
 static void cache_context_destroy (struct _CacheContext* context)
 {
     if (context->ev)
         event_free (context->ev);
     if (context->buf)
         g_free (context->buf);
+    if (context->bufv)
+        cache_bufvec_free (context->bufv);
     g_free (context);
 }
 /*}}}*/
 
+/*{{{ disk I/O */
+// block files are read and written by worker threads, all cache state is modified in the main thread only:
+// state is updated when a job is submitted, failed jobs remove the block when the job is completed
+
+static struct _CacheIOJob *cache_io_job_create (CacheIOType type, struct _CacheBlock *cblock,
+    struct _CacheContext *context)
+{
+    struct _CacheIOJob *job = g_new0 (struct _CacheIOJob, 1);
+
+    job->type = type;
+    job->cblock = cblock;
+    job->context = context;
+    job->fd = -1;
+    job->success = FALSE;
+
+    if (cblock)
+        cblock->pending++;
+    if (context)
+        context->jobs_left++;
+
+    return job;
+}
+
+// executed in a worker thread
+static void cache_io_job_run (struct _CacheIOJob *job)
+{
+    ssize_t res;
+    int fd;
+
+    switch (job->type) {
+        case CIO_write:
+            fd = open (job->path, O_WRONLY|O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+            if (fd < 0)
+                break;
+            res = pwrite (fd, job->buf, job->len, job->start);
+            close (fd);
+            job->success = (res == (ssize_t) job->len);
+            break;
+
+        case CIO_read:
+        case CIO_load:
+            fd = open (job->path, O_RDONLY);
+            if (fd < 0)
+                break;
+            if (job->type == CIO_load)
+                job->buf = g_malloc (job->len);
+            res = pread (fd, job->buf, job->len, job->start);
+            close (fd);
+            job->success = (res == (ssize_t) job->len);
+            break;
+
+        case CIO_open:
+            job->fd = open (job->path, O_RDONLY);
+            job->success = (job->fd >= 0);
+            break;
+
+        case CIO_unlink:
+            unlink (job->path);
+            job->success = TRUE;
+            break;
+    }
+}
+
+static void cache_io_worker (gpointer data, gpointer user_data)
+{
+    struct _CacheIOJob *job = (struct _CacheIOJob *) data;
+    CacheMng *cmng = (CacheMng *) user_data;
+    char c = 0;
+    G_GNUC_UNUSED ssize_t res;
+
+    cache_io_job_run (job);
+
+    g_async_queue_push (cmng->q_done, job);
+    // write fails only if the pipe is full: the main thread has wake ups to process already
+    res = write (cmng->done_fds[1], &c, 1);
+}
+
+static void cache_io_submit (CacheMng *cmng, struct _CacheEntry *entry, guint64 block, struct _CacheIOJob *job)
+{
+    char path[PATH_MAX];
+
+    cache_mng_file_name (cmng, path, sizeof (path), entry, block);
+    job->path = g_strdup (path);
+
+    if (!cmng->jobs_inflight)
+        event_add (cmng->ev_done, NULL);
+    cmng->jobs_inflight++;
+
+    if (cmng->lanes_num) {
+        guint lane = (g_str_hash (entry->file_id) ^ (guint) (block * 2654435761U)) % cmng->lanes_num;
+
+        g_thread_pool_push (cmng->lanes[lane], job, NULL);
+    } else {
+        cache_io_worker (job, cmng);
+    }
+}
+
+// remove block file
+static void cache_io_unlink (CacheMng *cmng, struct _CacheEntry *entry, guint64 block)
+{
+    cache_io_submit (cmng, entry, block, cache_io_job_create (CIO_unlink, NULL, NULL));
+}
+
+static void cache_block_release (struct _CacheBlock *cblock)
+{
+    cblock->pending--;
+    if (cblock->removed && !cblock->pending)
+        cache_block_destroy (cblock);
+}
+
+// block is removed from its entry, free it when all jobs are completed
+static void cache_block_detach (struct _CacheBlock *cblock)
+{
+    if (cblock->pending) {
+        cblock->removed = TRUE;
+        cblock->entry = NULL;
+    } else
+        cache_block_destroy (cblock);
+}
+
+// called when all submitted jobs of the request are completed
+static void cache_context_job_done (CacheMng *cmng, struct _CacheContext *context)
+{
+    context->jobs_left--;
+    if (context->jobs_left)
+        return;
+
+    if (cmng->destroying) {
+        cache_context_destroy (context);
+        return;
+    }
+
+    context->done_cb (-1, 0, context);
+}
+
+// all jobs of the request are submitted
+// if there are no jobs left, the request is completed in the next loop iteration
+static void cache_context_submitted (CacheMng *cmng, struct _CacheContext *context, event_callback_fn done_cb)
+{
+    context->done_cb = done_cb;
+
+    if (context->jobs_left > 1) {
+        context->jobs_left--;
+        return;
+    }
+
+    context->ev = event_new (application_get_evbase (cmng->app), -1,  0,
+                    done_cb, context);
+    // fire this event at once
+    event_active (context->ev, 0, 0);
+    event_add (context->ev, NULL);
+}
+
+static void cache_block_mem_install (CacheMng *cmng, struct _CacheBlock *cblock, unsigned char *buf, guint64 len);
+
+static void cache_io_job_complete (CacheMng *cmng, struct _CacheIOJob *job)
+{
+    struct _CacheBlock *cblock = job->cblock;
+
+    cmng->jobs_inflight--;
+
+    switch (job->type) {
+        case CIO_write:
+            g_free (job->buf);
+            // cached data is not reliable anymore,
+            // the writer of a pinned file is told about the failure by the store callback and aborts the upload
+            if (!job->success && !cblock->removed) {
+                LOG_err (CMNG_LOG, INO_H"Failed to write block file: %s", INO_T (cblock->entry->ino), job->path);
+                cache_mng_remove_block (cmng, cblock);
+            }
+            break;
+
+        case CIO_read:
+            if (cblock->removed)
+                job->success = FALSE;
+            break;
+
+        case CIO_open:
+            if (job->success && cblock->removed) {
+                close (job->fd);
+                job->success = FALSE;
+            }
+            if (job->success) {
+                job->fbuf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+                job->fbuf->fd = job->fd;
+            }
+            break;
+
+        case CIO_load:
+            if (job->success && cblock->removed)
+                job->success = FALSE;
+            if (job->success) {
+                if (job->fbuf)
+                    job->fbuf->mem = g_memdup (job->buf + job->fbuf_start, job->fbuf_len);
+                // block was not changed while it was loading
+                if (!cblock->mem && cblock->write_seq == job->write_seq && cmng->mem_max_size) {
+                    cache_block_mem_install (cmng, cblock, job->buf, job->len);
+                    job->buf = NULL;
+                }
+            }
+            g_free (job->buf);
+            break;
+
+        case CIO_unlink:
+            break;
+    }
+
+    // block file can't be read, forget its ranges so the data is downloaded again
+    // instead of being requested from the cache over and over
+    if (!job->success && cblock && !cblock->removed &&
+        (job->type == CIO_read || job->type == CIO_open || job->type == CIO_load)) {
+        LOG_err (CMNG_LOG, INO_H"Failed to read block file: %s", INO_T (cblock->entry->ino), job->path);
+        cache_mng_remove_block (cmng, cblock);
+    }
+
+    if (job->context) {
+        if (!job->success)
+            job->context->success = FALSE;
+        cache_context_job_done (cmng, job->context);
+    }
+    if (cblock)
+        cache_block_release (cblock);
+
+    g_free (job->path);
+    g_free (job);
+}
+
+// process all completed jobs
+static void cache_io_drain (CacheMng *cmng)
+{
+    struct _CacheIOJob *job;
+
+    while ((job = g_async_queue_try_pop (cmng->q_done)))
+        cache_io_job_complete (cmng, job);
+}
+
+static void cache_io_on_done_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short flags, void *ctx)
+{
+    CacheMng *cmng = (CacheMng *) ctx;
+    char buf[256];
+
+    while (read (cmng->done_fds[0], buf, sizeof (buf)) > 0);
+
+    cache_io_drain (cmng);
+
+    // do not keep the event loop running without jobs
+    if (!cmng->jobs_inflight)
+        event_del (cmng->ev_done);
+}
+/*}}}*/
+
 /*{{{ utils */
-static int cache_mng_file_name (CacheMng *cmng, char *buf, int buflen, fuse_ino_t ino)
+static int cache_mng_file_name (CacheMng *cmng, char *buf, int buflen, struct _CacheEntry *entry, guint64 block)
 {
-    return snprintf (buf, buflen, "%s/cache_mng_%"INO_FMT"", cmng->cache_dir, INO ino);
+    return snprintf (buf, buflen, "%s/"CACHE_MNG_FILE_PREFIX"%s_%"G_GUINT64_FORMAT"", cmng->cache_dir, entry->file_id, block);
 }
 
 guint64 cache_mng_size (CacheMng *cmng)
@@ -167,7 +740,60 @@ guint64 cache_mng_get_file_length (CacheMng *cmng, fuse_ino_t ino)
     if (!entry)
         return 0;
 
-    return range_length (entry->avail_range);
+    return entry->length;
+}
+
+static struct _CacheBlock *cache_entry_get_block (struct _CacheEntry *entry, guint64 block)
+{
+    return g_hash_table_lookup (entry->h_blocks, &block);
+}
+
+// calls func for each block which covers [off, off + size] range
+// start and len are relative to the block start, pos is relative to off
+// stops and returns FALSE if func returns FALSE
+typedef gboolean (*CacheBlockFunc) (CacheMng *cmng, struct _CacheEntry *entry, guint64 block,
+    guint64 start, guint64 len, guint64 pos, gpointer ctx);
+static gboolean cache_mng_foreach_block (CacheMng *cmng, struct _CacheEntry *entry, size_t size, off_t off,
+    CacheBlockFunc func, gpointer ctx)
+{
+    guint64 block;
+    guint64 end = (guint64) off + size;
+    guint64 cur = (guint64) off;
+
+    for (block = cur / cmng->block_size; cur < end; block++) {
+        guint64 block_start = block * cmng->block_size;
+        guint64 block_end = MIN (block_start + cmng->block_size, end);
+
+        if (!func (cmng, entry, block, cur - block_start, block_end - cur, cur - (guint64) off, ctx))
+            return FALSE;
+
+        cur = block_end;
+    }
+
+    return TRUE;
+}
+
+static gboolean cache_block_contains (G_GNUC_UNUSED CacheMng *cmng, struct _CacheEntry *entry, guint64 block,
+    guint64 start, guint64 len, G_GNUC_UNUSED guint64 pos, G_GNUC_UNUSED gpointer ctx)
+{
+    struct _CacheBlock *cblock;
+
+    cblock = cache_entry_get_block (entry, block);
+    if (!cblock)
+        return FALSE;
+
+    return range_contain (cblock->avail_range, start, start + len);
+}
+
+gboolean cache_mng_contains (CacheMng *cmng, fuse_ino_t ino, size_t size, off_t off)
+{
+    struct _CacheEntry *entry;
+
+    entry = g_hash_table_lookup (cmng->h_entries, GUINT_TO_POINTER (ino));
+    if (!entry)
+        return FALSE;
+
+    return cache_mng_foreach_block (cmng, entry, size, off, cache_block_contains, NULL);
 }
 
 static void cache_mng_rm_cache_dir (CacheMng *cmng)
@@ -179,50 +805,63 @@ static void cache_mng_rm_cache_dir (CacheMng *cmng)
     }
 }
 
+// we can only get md5 of an object which is stored from the beginning without gaps
+typedef struct {
+    cache_mng_on_get_md5_cb on_md5_cb;
+    void *ctx;
+} CacheMD5Data;
+
+static void cache_mng_on_md5_done_cb (gpointer ctx, const gchar *md5str, G_GNUC_UNUSED const gchar *md5b)
+{
+    CacheMD5Data *mdata = (CacheMD5Data *) ctx;
+
+    mdata->on_md5_cb (md5str, mdata->ctx);
+    g_free (mdata);
+}
 
-// we can only get md5 of an object containing 1 range
-// XXX: move code to separate thread
-gboolean cache_mng_get_md5 (CacheMng *cmng, fuse_ino_t ino, gchar **md5str)
+void cache_mng_get_md5 (CacheMng *cmng, fuse_ino_t ino, cache_mng_on_get_md5_cb on_md5_cb, void *ctx)
 {
     struct _CacheEntry *entry;
-    unsigned char digest[MD5_DIGEST_LENGTH];
-    MD5_CTX md5ctx;
-    ssize_t bytes;
-    unsigned char data[1024];
     char path[PATH_MAX];
-    size_t i;
-    gchar *out;
-    FILE *in;
+    guint64 block;
+    GHashTableIter iter;
+    gpointer value;
+    GList *l_paths = NULL;
+    CacheMD5Data *mdata;
 
     entry = g_hash_table_lookup (cmng->h_entries, GUINT_TO_POINTER (ino));
-    if (!entry)
-        return FALSE;
-
-    if (range_count (entry->avail_range) != 1) {
-        LOG_debug (CMNG_LOG, INO_H"Entry contains more than 1 range, can't take MD5 sum of such object !", INO_T (ino));
-        return FALSE;
+    if (!entry) {
+        on_md5_cb (NULL, ctx);
+        return;
     }
 
-    cache_mng_file_name (cmng, path, sizeof (path), ino);
-    in = fopen (path, "rb");
-    if (in == NULL) {
-        LOG_debug (CMNG_LOG, INO_H"Can't open file for reading: %s", INO_T (ino), path);
-        return FALSE;
+    if (!entry->length || !cache_mng_contains (cmng, ino, entry->length, 0)) {
+        LOG_debug (CMNG_LOG, INO_H"Entry is not stored continuously, can't take MD5 sum of such object !", INO_T (ino));
+        on_md5_cb (NULL, ctx);
+        return;
     }
 
-    MD5_Init (&md5ctx);
-    while ((bytes = fread (data, 1, 1024, in)) != 0)
-        MD5_Update (&md5ctx, data, bytes);
-    MD5_Final (digest, &md5ctx);
-    fclose (in);
-
-    out = g_malloc (33);
-    for (i = 0; i < 16; ++i)
-        sprintf (&out[i*2], "%02x", (unsigned int)digest[i]);
+    // block files are read directly, so all writes must be finished
+    g_hash_table_iter_init (&iter, entry->h_blocks);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        if (((struct _CacheBlock *) value)->pending) {
+            LOG_debug (CMNG_LOG, INO_H"Entry is being written, can't take MD5 sum !", INO_T (ino));
+            on_md5_cb (NULL, ctx);
+            return;
+        }
+    }
 
-    *md5str = out;
+    for (block = 0; block * cmng->block_size < entry->length; block++) {
+        cache_mng_file_name (cmng, path, sizeof (path), entry, block);
+        l_paths = g_list_append (l_paths, g_strdup (path));
+    }
 
-    return TRUE;
+    // block files are hashed by HashPool worker threads
+    mdata = g_new0 (CacheMD5Data, 1);
+    mdata->on_md5_cb = on_md5_cb;
+    mdata->ctx = ctx;
+    hash_pool_md5_files (application_get_hash_pool (cmng->app), l_paths, cache_mng_on_md5_done_cb, mdata);
+    g_list_free_full (l_paths, g_free);
 }
 
 // return version ID of cached file
@@ -254,100 +893,755 @@ void cache_mng_update_version_id (CacheMng *cmng, fuse_ino_t ino, const gchar *v
     } else
         entry->version_id = g_strdup (version_id);
 }
-/*}}}*/
-
-/*{{{ retrieve_file_buf */
-static void cache_read_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short flags, void *ctx)
-{
-    struct _CacheContext *context = (struct _CacheContext *) ctx;
-
-    if (context->cb.retrieve_cb)
-        context->cb.retrieve_cb (context->buf, context->size, context->success, context->user_ctx);
-    cache_context_destroy (context);
-}
 
-// retrieve file buffer from local storage
-// if success == TRUE then "buf" contains "size" bytes of data
-void cache_mng_retrieve_file_buf (CacheMng *cmng, fuse_ino_t ino, size_t size, off_t off,
-    cache_mng_on_retrieve_file_buf_cb on_retrieve_file_buf_cb, void *ctx)
+// set ETag of cached file, NULL to reset it
+void cache_mng_update_etag (CacheMng *cmng, fuse_ino_t ino, const gchar *etag)
 {
-    struct _CacheContext *context;
     struct _CacheEntry *entry;
 
-    context = cache_context_create (size, ctx);
-    context->cb.retrieve_cb = on_retrieve_file_buf_cb;
     entry = g_hash_table_lookup (cmng->h_entries, GUINT_TO_POINTER (ino));
+    if (!entry)
+        return;
 
-    if (entry && range_contain (entry->avail_range, off, off + size)) {
-        int fd;
-        ssize_t res;
-        char path[PATH_MAX];
-
-        if (ino != entry->ino) {
-            LOG_err (CMNG_LOG, INO_H"Requested inode doesn't match hashed key!", INO_T (ino));
-            if (context->cb.retrieve_cb)
-                context->cb.retrieve_cb (NULL, 0, FALSE, context->user_ctx);
-            cache_context_destroy (context);
-            cmng->cache_miss++;
-            return;
-        }
-
-        cache_mng_file_name (cmng, path, sizeof (path), ino);
-        fd = open (path, O_RDONLY);
-        if (fd < 0) {
-            LOG_err (CMNG_LOG, INO_H"Failed to open file for reading! Path: %s", INO_T (ino), path);
-            if (context->cb.retrieve_cb)
-                context->cb.retrieve_cb (NULL, 0, FALSE, context->user_ctx);
-            cache_context_destroy (context);
-            cmng->cache_miss++;
-            return;
-        }
+    if (entry->etag && etag && !strcmp (entry->etag, etag))
+        return;
 
-        context->buf = g_malloc (size);
-        res = pread (fd, context->buf, size, off);
-        close (fd);
-        context->success = (res == (ssize_t) size);
+    if (entry->etag)
+        g_free (entry->etag);
+    entry->etag = etag ? g_strdup (etag) : NULL;
+}
 
-        LOG_debug (CMNG_LOG, INO_H"Read [%"OFF_FMT":%zu] bytes, result: %s",
-            INO_T (ino), off, size, context->success ? "OK" : "Failed");
+// bind entry to the object key, entry with the same key is removed
+// pinned entry is only unbound from the key: its data is not uploaded yet
+static void cache_mng_entry_set_key (CacheMng *cmng, struct _CacheEntry *entry, const gchar *key)
+{
+    struct _CacheEntry *other;
 
-        if (!context->success) {
-            g_free (context->buf);
-            context->buf = NULL;
+    if (entry->key && !strcmp (entry->key, key))
+        return;
 
-            cmng->cache_miss++;
+    other = g_hash_table_lookup (cmng->h_keys, key);
+    if (other && other != entry) {
+        if (cache_mng_entry_is_pinned (cmng, other)) {
+            g_hash_table_remove (cmng->h_keys, other->key);
+            g_free (other->key);
+            other->key = NULL;
         } else
-            cmng->cache_hits++;
-
-        // move entry to the front of q_lru
-        g_queue_unlink (cmng->q_lru, entry->ll_lru);
-        g_queue_push_head_link (cmng->q_lru, entry->ll_lru);
-    } else {
-        LOG_debug (CMNG_LOG, INO_H"Entry isn't found or doesn't contain requested range: [%"OFF_FMT": %"OFF_FMT"]",
-            INO_T (ino), off, off + size);
-
-        cmng->cache_miss++;
+            cache_mng_remove_entry (cmng, other);
     }
 
-    context->ev = event_new (application_get_evbase (cmng->app), -1,  0,
-                    cache_read_cb, context);
-    // fire this event at once
-    event_active (context->ev, 0, 0);
-    event_add (context->ev, NULL);
+    if (entry->key) {
+        if (g_hash_table_lookup (cmng->h_keys, entry->key) == entry)
+            g_hash_table_remove (cmng->h_keys, entry->key);
+        g_free (entry->key);
+    }
+    entry->key = g_strdup (key);
+    g_hash_table_insert (cmng->h_keys, entry->key, entry);
 }
-/*}}}*/
 
-/*{{{ store_file_buf */
-static void cache_write_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short flags, void *ctx)
+// check that cached file is identical to the remote object
+// if the object is not cached yet, look for it in the persistent cache
+// return TRUE if cached file matches either version ID or ETag of the object
+gboolean cache_mng_validate_file (CacheMng *cmng, fuse_ino_t ino, const gchar *key,
+    const gchar *etag, const gchar *version_id)
 {
-    struct _CacheContext *context = (struct _CacheContext *) ctx;
+    struct _CacheEntry *entry;
+    gboolean match;
 
-    if (context->cb.store_cb)
-        context->cb.store_cb (context->success, context->user_ctx);
+    entry = g_hash_table_lookup (cmng->h_entries, GUINT_TO_POINTER (ino));
+    if (!entry && key) {
+        entry = g_hash_table_lookup (cmng->h_keys, key);
+        // object is found in the persistent cache
+        if (entry && !entry->ino) {
+            LOG_debug (CMNG_LOG, INO_H"Found cached object: %s", INO_T (ino), key);
+            entry->ino = ino;
+            g_hash_table_insert (cmng->h_entries, GUINT_TO_POINTER (ino), entry);
+        } else
+            entry = NULL;
+    }
+
+    if (!entry)
+        return FALSE;
+
+    if (key)
+        cache_mng_entry_set_key (cmng, entry, key);
+
+    if (version_id && entry->version_id)
+        match = !strcmp (version_id, entry->version_id);
+    else if (etag && entry->etag)
+        match = !strcmp (etag, entry->etag);
+    else
+        return FALSE;
+
+    // data of a pinned file is newer than the remote object
+    if (!match && !cache_mng_entry_is_pinned (cmng, entry)) {
+        LOG_debug (CMNG_LOG, INO_H"Cached object is outdated, removing", INO_T (ino));
+        cache_mng_remove_entry (cmng, entry);
+    }
+
+    return match;
+}
+/*}}}*/
+
+/*{{{ persistent index */
+// take an exclusive lock on the persistent cache directory, it's held until the cache is destroyed
+static gboolean cache_mng_lock_cache_dir (CacheMng *cmng)
+{
+    gchar *path;
+    int fd;
+
+    if (g_mkdir_with_parents (cmng->cache_dir, 0700) != 0) {
+        LOG_err (CMNG_LOG, "Failed to create directory: %s", cmng->cache_dir);
+        return FALSE;
+    }
+
+    path = g_strdup_printf ("%s/%s", cmng->cache_dir, CACHE_MNG_LOCK_FILE);
+    fd = open (path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        LOG_err (CMNG_LOG, "Failed to open lock file %s: %s", path, strerror (errno));
+        g_free (path);
+        return FALSE;
+    }
+
+    if (flock (fd, LOCK_EX | LOCK_NB) != 0) {
+        LOG_debug (CMNG_LOG, "Failed to lock %s: %s", path, strerror (errno));
+        close (fd);
+        g_free (path);
+        return FALSE;
+    }
+
+    cmng->lock_fd = fd;
+    g_free (path);
+
+    return TRUE;
+}
+
+typedef struct {
+    GString *str;
+    guint64 block;
+} CacheIndexBlockData;
+
+static void cache_mng_index_add_interval (guint64 start, guint64 end, gpointer ctx)
+{
+    CacheIndexBlockData *data = (CacheIndexBlockData *) ctx;
+
+    g_string_append_printf (data->str, "%"G_GUINT64_FORMAT":%"G_GUINT64_FORMAT"-%"G_GUINT64_FORMAT",",
+        data->block, start, end);
+}
+
+// save the list of cached objects
+// entries which can't be validated later (without key, ETag or version ID) are not saved
+static void cache_mng_save_index (CacheMng *cmng)
+{
+    GKeyFile *key_file;
+    GHashTableIter iter;
+    gpointer value;
+    gchar *data;
+    gsize len;
+    gchar *path;
+    GError *error = NULL;
+    guint saved = 0;
+
+    key_file = g_key_file_new ();
+
+    // block ranges are valid only for the same block size
+    g_key_file_set_uint64 (key_file, CACHE_MNG_INDEX_GROUP, "block_size", cmng->block_size);
+
+    g_hash_table_iter_init (&iter, cmng->h_files);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        struct _CacheEntry *entry = (struct _CacheEntry *) value;
+        CacheIndexBlockData block_data;
+        GHashTableIter block_iter;
+        gpointer block_value;
+
+        if (!entry->key || (!entry->etag && !entry->version_id) || !entry->length)
+            continue;
+
+        g_key_file_set_string (key_file, entry->file_id, "key", entry->key);
+        if (entry->etag)
+            g_key_file_set_string (key_file, entry->file_id, "etag", entry->etag);
+        if (entry->version_id)
+            g_key_file_set_string (key_file, entry->file_id, "version", entry->version_id);
+
+        block_data.str = g_string_new (NULL);
+        g_hash_table_iter_init (&block_iter, entry->h_blocks);
+        while (g_hash_table_iter_next (&block_iter, NULL, &block_value)) {
+            struct _CacheBlock *cblock = (struct _CacheBlock *) block_value;
+
+            block_data.block = cblock->block;
+            range_foreach (cblock->avail_range, cache_mng_index_add_interval, &block_data);
+        }
+        g_key_file_set_string (key_file, entry->file_id, "blocks", block_data.str->str);
+        g_string_free (block_data.str, TRUE);
+        saved++;
+    }
+
+    data = g_key_file_to_data (key_file, &len, NULL);
+    g_key_file_free (key_file);
+
+    path = g_strdup_printf ("%s/%s", cmng->cache_dir, CACHE_MNG_INDEX_FILE);
+    // g_file_set_contents () replaces the file atomically
+    if (!g_file_set_contents (path, data, len, &error)) {
+        LOG_err (CMNG_LOG, "Failed to save cache index %s: %s", path, error->message);
+        g_error_free (error);
+    } else {
+        LOG_debug (CMNG_LOG, "Cache index is saved, entries: %u", saved);
+    }
+
+    g_free (path);
+    g_free (data);
+}
+
+// parse "block:start-end,block:start-end,.." string and add blocks to entry
+static void cache_mng_index_parse_blocks (CacheMng *cmng, struct _CacheEntry *entry, const gchar *str)
+{
+    const gchar *p = str;
+    gchar *end;
+    char path[PATH_MAX];
+    struct stat st;
+
+    while (*p) {
+        guint64 block, start, stop;
+        struct _CacheBlock *cblock;
+        guint64 old_length, new_length;
+
+        block = g_ascii_strtoull (p, &end, 10);
+        if (*end != ':')
+            break;
+        start = g_ascii_strtoull (end + 1, &end, 10);
+        if (*end != '-')
+            break;
+        stop = g_ascii_strtoull (end + 1, &end, 10);
+        if (*end == ',')
+            end++;
+        p = end;
+
+        if (start >= stop || stop > cmng->block_size)
+            continue;
+
+        // the block file could be removed or truncated while the filesystem was not mounted
+        cache_mng_file_name (cmng, path, sizeof (path), entry, block);
+        if (stat (path, &st) != 0 || (guint64) st.st_size < stop) {
+            LOG_debug (CMNG_LOG, "Block file %s is missing or truncated, skipping", path);
+            continue;
+        }
+
+        cblock = cache_entry_get_block (entry, block);
+        if (!cblock) {
+            cblock = cache_block_create (entry, block);
+            g_queue_push_tail (cmng->q_lru, cblock);
+            cblock->ll_lru = g_queue_peek_tail_link (cmng->q_lru);
+            g_hash_table_insert (entry->h_blocks, &cblock->block, cblock);
+        }
+
+        old_length = range_length (cblock->avail_range);
+        range_add (cblock->avail_range, start, stop);
+        new_length = range_length (cblock->avail_range);
+        cmng->size += new_length - old_length;
+        entry->length += new_length - old_length;
+    }
+}
+
+// load the list of cached objects, stored by the previous mount
+static void cache_mng_load_index (CacheMng *cmng)
+{
+    GKeyFile *key_file;
+    gchar *path;
+    gchar **groups;
+    gsize groups_len, i;
+    GError *error = NULL;
+    guint64 block_size;
+
+    path = g_strdup_printf ("%s/%s", cmng->cache_dir, CACHE_MNG_INDEX_FILE);
+    key_file = g_key_file_new ();
+
+    if (!g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, &error)) {
+        LOG_debug (CMNG_LOG, "Failed to load cache index %s: %s", path, error->message);
+        g_error_free (error);
+        g_key_file_free (key_file);
+        g_free (path);
+        return;
+    }
+
+    // blocks of a different size can't be used, orphan files are removed later
+    block_size = g_key_file_get_uint64 (key_file, CACHE_MNG_INDEX_GROUP, "block_size", NULL);
+    if (block_size != cmng->block_size) {
+        LOG_msg (CMNG_LOG, "Cache index %s is created for block size %"G_GUINT64_FORMAT
+            ", current block size: %"G_GUINT64_FORMAT", discarding it", path, block_size, cmng->block_size);
+        g_key_file_free (key_file);
+        g_free (path);
+        return;
+    }
+
+    groups = g_key_file_get_groups (key_file, &groups_len);
+    for (i = 0; i < groups_len; i++) {
+        struct _CacheEntry *entry;
+        gchar *key, *blocks;
+
+        if (!strcmp (groups[i], CACHE_MNG_INDEX_GROUP))
+            continue;
+
+        key = g_key_file_get_string (key_file, groups[i], "key", NULL);
+        blocks = g_key_file_get_string (key_file, groups[i], "blocks", NULL);
+        if (!key || !blocks || g_hash_table_lookup (cmng->h_keys, key) || g_hash_table_lookup (cmng->h_files, groups[i])) {
+            g_free (key);
+            g_free (blocks);
+            continue;
+        }
+
+        entry = cache_entry_create (cmng, 0, groups[i]);
+        entry->key = key;
+        entry->etag = g_key_file_get_string (key_file, groups[i], "etag", NULL);
+        entry->version_id = g_key_file_get_string (key_file, groups[i], "version", NULL);
+        g_hash_table_insert (cmng->h_keys, entry->key, entry);
+
+        cache_mng_index_parse_blocks (cmng, entry, blocks);
+        g_free (blocks);
+
+        // none of the block files is usable
+        if (!g_hash_table_size (entry->h_blocks))
+            cache_mng_remove_entry (cmng, entry);
+    }
+
+    LOG_msg (CMNG_LOG, "Loaded cache index, entries: %u, size: %"G_GUINT64_FORMAT,
+        g_hash_table_size (cmng->h_files), cmng->size);
+
+    g_strfreev (groups);
+    g_key_file_free (key_file);
+    g_free (path);
+}
 
+// remove files which are not listed in the index
+static void cache_mng_remove_orphans (CacheMng *cmng)
+{
+    GDir *dir;
+    const gchar *name;
+
+    dir = g_dir_open (cmng->cache_dir, 0, NULL);
+    if (!dir)
+        return;
+
+    while ((name = g_dir_read_name (dir))) {
+        gboolean keep = FALSE;
+
+        if (!strcmp (name, CACHE_MNG_INDEX_FILE) || !strcmp (name, CACHE_MNG_LOCK_FILE))
+            continue;
+
+        // CACHE_MNG_FILE_PREFIX<file_id>_<block>
+        if (g_str_has_prefix (name, CACHE_MNG_FILE_PREFIX)) {
+            gchar *file_id = g_strdup (name + strlen (CACHE_MNG_FILE_PREFIX));
+            gchar *p = strrchr (file_id, '_');
+
+            if (p) {
+                struct _CacheEntry *entry;
+                guint64 block;
+
+                *p = '\0';
+                block = g_ascii_strtoull (p + 1, NULL, 10);
+                entry = g_hash_table_lookup (cmng->h_files, file_id);
+                keep = entry && cache_entry_get_block (entry, block);
+            }
+            g_free (file_id);
+        }
+
+        if (!keep) {
+            gchar *path = g_strdup_printf ("%s/%s", cmng->cache_dir, name);
+            unlink (path);
+            g_free (path);
+        }
+    }
+
+    g_dir_close (dir);
+}
+/*}}}*/
+
+/*{{{ memory tier */
+// the most recently used blocks are kept in memory, up to "filesystem.cache_mem_max_size" bytes
+// block files on disk are always up-to-date, so memory copies can be dropped at any time
+
+static void cache_block_mem_free (CacheMng *cmng, struct _CacheBlock *cblock)
+{
+    if (!cblock->mem)
+        return;
+
+    g_queue_delete_link (cmng->q_mem, cblock->ll_mem);
+    cblock->ll_mem = NULL;
+    cmng->mem_size -= cblock->mem_len;
+    g_free (cblock->mem);
+    cblock->mem = NULL;
+    cblock->mem_len = 0;
+}
+
+// remove the least recently used blocks from memory, but keep "keep" block
+static void cache_mng_mem_evict (CacheMng *cmng, struct _CacheBlock *keep)
+{
+    while (cmng->mem_size > cmng->mem_max_size && g_queue_peek_tail (cmng->q_mem)) {
+        struct _CacheBlock *cblock = (struct _CacheBlock *) g_queue_peek_tail (cmng->q_mem);
+
+        if (cblock == keep)
+            break;
+        cache_block_mem_free (cmng, cblock);
+    }
+}
+
+static void cache_block_range_end (G_GNUC_UNUSED guint64 start, guint64 end, gpointer ctx)
+{
+    guint64 *max_end = (guint64 *) ctx;
+
+    if (end > *max_end)
+        *max_end = end;
+}
+
+// keep the whole block file in memory
+static void cache_block_mem_install (CacheMng *cmng, struct _CacheBlock *cblock, unsigned char *buf, guint64 len)
+{
+    cblock->mem = buf;
+    cblock->mem_len = len;
+    cmng->mem_size += len;
+    g_queue_push_head (cmng->q_mem, cblock);
+    cblock->ll_mem = g_queue_peek_head_link (cmng->q_mem);
+
+    cache_mng_mem_evict (cmng, cblock);
+}
+
+// create job, which reads the whole block file into memory
+// return NULL if the block doesn't fit
+static struct _CacheIOJob *cache_block_mem_load_job (CacheMng *cmng, struct _CacheBlock *cblock,
+    struct _CacheContext *context)
+{
+    struct _CacheIOJob *job;
+    guint64 len = 0;
+
+    range_foreach (cblock->avail_range, cache_block_range_end, &len);
+    if (!len || len > cmng->mem_max_size)
+        return NULL;
+
+    job = cache_io_job_create (CIO_load, cblock, context);
+    job->start = 0;
+    job->len = len;
+    job->write_seq = cblock->write_seq;
+
+    return job;
+}
+
+// update the memory copy of the block after the block file is written
+static void cache_block_mem_write (CacheMng *cmng, struct _CacheBlock *cblock,
+    const unsigned char *buf, guint64 start, guint64 len)
+{
+    if (!cblock->mem)
+        return;
+
+    // file is extended, gap between the old and the new end of file is filled with zeros
+    if (start + len > cblock->mem_len) {
+        cblock->mem = g_realloc (cblock->mem, start + len);
+        if (start > cblock->mem_len)
+            memset (cblock->mem + cblock->mem_len, 0, start - cblock->mem_len);
+        cmng->mem_size += start + len - cblock->mem_len;
+        cblock->mem_len = start + len;
+    }
+    memcpy (cblock->mem + start, buf, len);
+
+    g_queue_unlink (cmng->q_mem, cblock->ll_mem);
+    g_queue_push_head_link (cmng->q_mem, cblock->ll_mem);
+
+    cache_mng_mem_evict (cmng, cblock);
+    // the block alone doesn't fit
+    if (cmng->mem_size > cmng->mem_max_size)
+        cache_block_mem_free (cmng, cblock);
+}
+/*}}}*/
+
+/*{{{ retrieve_file_buf */
+static void cache_read_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short flags, void *ctx)
+{
+    struct _CacheContext *context = (struct _CacheContext *) ctx;
+
+    if (context->cb.retrieve_cb) {
+        if (context->success)
+            context->cb.retrieve_cb (context->buf, context->size, TRUE, context->user_ctx);
+        else
+            context->cb.retrieve_cb (NULL, 0, FALSE, context->user_ctx);
+    }
     cache_context_destroy (context);
 }
 
+static gboolean cache_block_read (CacheMng *cmng, struct _CacheEntry *entry, guint64 block,
+    guint64 start, guint64 len, guint64 pos, gpointer ctx)
+{
+    struct _CacheContext *context = (struct _CacheContext *) ctx;
+    struct _CacheBlock *cblock;
+    struct _CacheIOJob *job;
+
+    cblock = cache_entry_get_block (entry, block);
+
+    // move block to the front of q_lru
+    g_queue_unlink (cmng->q_lru, cblock->ll_lru);
+    g_queue_push_head_link (cmng->q_lru, cblock->ll_lru);
+
+    if (cblock->mem && start + len <= cblock->mem_len) {
+        memcpy (context->buf + pos, cblock->mem + start, len);
+        g_queue_unlink (cmng->q_mem, cblock->ll_mem);
+        g_queue_push_head_link (cmng->q_mem, cblock->ll_mem);
+        return TRUE;
+    }
+
+    // keep the block in memory for the next reads
+    // it's loaded by a separate job, the requested data is read directly into the buffer
+    cache_block_mem_free (cmng, cblock);
+    if (cmng->mem_max_size) {
+        job = cache_block_mem_load_job (cmng, cblock, NULL);
+        if (job)
+            cache_io_submit (cmng, entry, block, job);
+    }
+
+    job = cache_io_job_create (CIO_read, cblock, context);
+    job->buf = context->buf + pos;
+    job->start = start;
+    job->len = len;
+    cache_io_submit (cmng, entry, block, job);
+
+    return TRUE;
+}
+
+// retrieve file buffer from local storage
+// if success == TRUE then "buf" contains "size" bytes of data
+void cache_mng_retrieve_file_buf (CacheMng *cmng, fuse_ino_t ino, size_t size, off_t off,
+    cache_mng_on_retrieve_file_buf_cb on_retrieve_file_buf_cb, void *ctx)
+{
+    struct _CacheContext *context;
+    struct _CacheEntry *entry;
+
+    context = cache_context_create (size, ctx);
+    context->cb.retrieve_cb = on_retrieve_file_buf_cb;
+    entry = g_hash_table_lookup (cmng->h_entries, GUINT_TO_POINTER (ino));
+
+    if (entry && cache_mng_foreach_block (cmng, entry, size, off, cache_block_contains, NULL)) {
+        if (ino != entry->ino) {
+            LOG_err (CMNG_LOG, INO_H"Requested inode doesn't match hashed key!", INO_T (ino));
+            if (context->cb.retrieve_cb)
+                context->cb.retrieve_cb (NULL, 0, FALSE, context->user_ctx);
+            cache_context_destroy (context);
+            cmng->cache_miss++;
+            return;
+        }
+
+        context->buf = g_malloc (size);
+        context->success = cache_mng_foreach_block (cmng, entry, size, off, cache_block_read, context);
+
+        LOG_debug (CMNG_LOG, INO_H"Reading [%"OFF_FMT":%zu] bytes, jobs: %u",
+            INO_T (ino), off, size, context->jobs_left - 1);
+
+        cmng->cache_hits++;
+    } else {
+        LOG_debug (CMNG_LOG, INO_H"Entry isn't found or doesn't contain requested range: [%"OFF_FMT": %"OFF_FMT"]",
+            INO_T (ino), off, off + size);
+
+        cmng->cache_miss++;
+    }
+
+    cache_context_submitted (cmng, context, cache_read_cb);
+}
+
+static void cache_read_bufvec_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short flags, void *ctx)
+{
+    struct _CacheContext *context = (struct _CacheContext *) ctx;
+
+    if (context->cb.retrieve_bufvec_cb)
+        context->cb.retrieve_bufvec_cb (context->success ? context->bufv : NULL, context->success, context->user_ctx);
+    cache_context_destroy (context);
+}
+
+// add buffer which refers to the block file (or to the copy of memory block) to bufvec
+static gboolean cache_block_read_fd (CacheMng *cmng, struct _CacheEntry *entry, guint64 block,
+    guint64 start, guint64 len, G_GNUC_UNUSED guint64 pos, gpointer ctx)
+{
+    struct _CacheContext *context = (struct _CacheContext *) ctx;
+    struct fuse_buf *fbuf = &context->bufv->buf[context->bufv->count];
+    struct _CacheBlock *cblock;
+    struct _CacheIOJob *job;
+
+    cblock = cache_entry_get_block (entry, block);
+
+    // move block to the front of q_lru
+    g_queue_unlink (cmng->q_lru, cblock->ll_lru);
+    g_queue_push_head_link (cmng->q_lru, cblock->ll_lru);
+
+    fbuf->size = len;
+    fbuf->flags = 0;
+    fbuf->mem = NULL;
+    context->bufv->count++;
+
+    // memory block can be evicted before the reply is sent, so copy it
+    if (cblock->mem && start + len <= cblock->mem_len) {
+        fbuf->mem = g_memdup (cblock->mem + start, len);
+        g_queue_unlink (cmng->q_mem, cblock->ll_mem);
+        g_queue_push_head_link (cmng->q_mem, cblock->ll_mem);
+        return TRUE;
+    }
+
+    // small random reads are served from memory next time
+    if (cmng->mem_max_size && len <= CACHE_MNG_MEM_LOAD_MAX_READ) {
+        cache_block_mem_free (cmng, cblock);
+        job = cache_block_mem_load_job (cmng, cblock, context);
+        if (job) {
+            job->fbuf = fbuf;
+            job->fbuf_start = start;
+            job->fbuf_len = len;
+            cache_io_submit (cmng, entry, block, job);
+            return TRUE;
+        }
+    }
+
+    // data is spliced from the file by FUSE
+    fbuf->pos = start;
+    job = cache_io_job_create (CIO_open, cblock, context);
+    job->fbuf = fbuf;
+    cache_io_submit (cmng, entry, block, job);
+
+    return TRUE;
+}
+
+// retrieve file data from local storage without copying it
+// if success == TRUE then "bufv" refers to "size" bytes of data
+void cache_mng_retrieve_file_bufvec (CacheMng *cmng, fuse_ino_t ino, size_t size, off_t off,
+    cache_mng_on_retrieve_file_bufvec_cb on_retrieve_file_bufvec_cb, void *ctx)
+{
+    struct _CacheContext *context;
+    struct _CacheEntry *entry;
+    size_t blocks;
+
+    context = cache_context_create (size, ctx);
+    context->cb.retrieve_bufvec_cb = on_retrieve_file_bufvec_cb;
+    entry = g_hash_table_lookup (cmng->h_entries, GUINT_TO_POINTER (ino));
+
+    if (entry && cache_mng_foreach_block (cmng, entry, size, off, cache_block_contains, NULL)) {
+        // one buffer per block
+        blocks = size ? (off + size - 1) / cmng->block_size - off / cmng->block_size + 1 : 1;
+        context->bufv = g_malloc0 (sizeof (struct fuse_bufvec) + (blocks - 1) * sizeof (struct fuse_buf));
+        context->bufv->count = 0;
+        context->bufv->idx = 0;
+        context->bufv->off = 0;
+
+        context->success = cache_mng_foreach_block (cmng, entry, size, off, cache_block_read_fd, context);
+
+        LOG_debug (CMNG_LOG, INO_H"Reading [%"OFF_FMT":%zu] bytes, buffers: %zu, jobs: %u",
+            INO_T (ino), off, size, context->bufv->count, context->jobs_left - 1);
+
+        cmng->cache_hits++;
+    } else {
+        LOG_debug (CMNG_LOG, INO_H"Entry isn't found or doesn't contain requested range: [%"OFF_FMT": %"OFF_FMT"]",
+            INO_T (ino), off, off + size);
+
+        cmng->cache_miss++;
+    }
+
+    cache_context_submitted (cmng, context, cache_read_bufvec_cb);
+}
+/*}}}*/
+
+/*{{{ store_file_buf */
+static void cache_write_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short flags, void *ctx)
+{
+    struct _CacheContext *context = (struct _CacheContext *) ctx;
+
+    if (context->cb.store_cb)
+        context->cb.store_cb (context->success, context->user_ctx);
+
+    cache_context_destroy (context);
+}
+
+// cache state is updated at once, the data is written by a job
+static gboolean cache_block_write (CacheMng *cmng, struct _CacheEntry *entry, guint64 block,
+    guint64 start, guint64 len, guint64 pos, gpointer ctx)
+{
+    struct _CacheContext *context = (struct _CacheContext *) ctx;
+    struct _CacheBlock *cblock;
+    struct _CacheIOJob *job;
+    guint64 old_length, new_length;
+
+    cblock = cache_entry_get_block (entry, block);
+    if (!cblock) {
+        cblock = cache_block_create (entry, block);
+        g_queue_push_head (cmng->q_lru, cblock);
+        cblock->ll_lru = g_queue_peek_head_link (cmng->q_lru);
+        g_hash_table_insert (entry->h_blocks, &cblock->block, cblock);
+    } else {
+        // move block to the front of q_lru
+        g_queue_unlink (cmng->q_lru, cblock->ll_lru);
+        g_queue_push_head_link (cmng->q_lru, cblock->ll_lru);
+    }
+    cache_block_mem_write (cmng, cblock, context->buf + pos, start, len);
+
+    job = cache_io_job_create (CIO_write, cblock, context);
+    job->buf = g_memdup (context->buf + pos, len);
+    job->start = start;
+    job->len = len;
+    cblock->write_seq++;
+    cache_io_submit (cmng, entry, block, job);
+
+    old_length = range_length (cblock->avail_range);
+    range_add (cblock->avail_range, start, start + len);
+    new_length = range_length (cblock->avail_range);
+    if (new_length >= old_length) {
+        cmng->size += new_length - old_length;
+        entry->length += new_length - old_length;
+    } else {
+        LOG_err (CMNG_LOG, INO_H"New length is less than the old length !: %"G_GUINT64_FORMAT" <= %"G_GUINT64_FORMAT,
+            INO_T (entry->ino), new_length, old_length);
+    }
+
+    return TRUE;
+}
+
+// remove entry and all its blocks from local storage
+static void cache_mng_remove_entry (CacheMng *cmng, struct _CacheEntry *entry)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init (&iter, entry->h_blocks);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        struct _CacheBlock *cblock = (struct _CacheBlock *) value;
+
+        cmng->size -= range_length (cblock->avail_range);
+        g_queue_delete_link (cmng->q_lru, cblock->ll_lru);
+        cache_block_mem_free (cmng, cblock);
+        cache_io_unlink (cmng, entry, cblock->block);
+        g_hash_table_iter_steal (&iter);
+        cache_block_detach (cblock);
+    }
+
+    if (entry->ino)
+        g_hash_table_remove (cmng->h_entries, GUINT_TO_POINTER (entry->ino));
+    if (entry->key && g_hash_table_lookup (cmng->h_keys, entry->key) == entry)
+        g_hash_table_remove (cmng->h_keys, entry->key);
+    g_hash_table_remove (cmng->h_files, entry->file_id);
+}
+
+// remove block from local storage
+static void cache_mng_remove_block (CacheMng *cmng, struct _CacheBlock *cblock)
+{
+    struct _CacheEntry *entry = cblock->entry;
+    guint64 length;
+
+    length = range_length (cblock->avail_range);
+    cmng->size -= length;
+    entry->length -= length;
+
+    cache_io_unlink (cmng, entry, cblock->block);
+
+    LOG_debug (CMNG_LOG, INO_H"Block %"G_GUINT64_FORMAT" is removed", INO_T (entry->ino), cblock->block);
+
+    g_queue_delete_link (cmng->q_lru, cblock->ll_lru);
+    cache_block_mem_free (cmng, cblock);
+    g_hash_table_steal (entry->h_blocks, &cblock->block);
+    cache_block_detach (cblock);
+
+    // no data left
+    if (!g_hash_table_size (entry->h_blocks))
+        cache_mng_remove_entry (cmng, entry);
+}
+
 // store file buffer into local storage
 // if success == TRUE then "buf" successfuly stored on disc
 void cache_mng_store_file_buf (CacheMng *cmng, fuse_ino_t ino, size_t size, off_t off, unsigned char *buf,
@@ -355,74 +1649,53 @@ void cache_mng_store_file_buf (CacheMng *cmng, fuse_ino_t ino, size_t size, off_
 {
     struct _CacheContext *context;
     struct _CacheEntry *entry;
-    ssize_t res;
-    int fd;
-    char path[PATH_MAX];
-    guint64 old_length, new_length;
-    guint64 range_size;
     time_t now;
 
-    range_size = (guint64)(off + size);
-
     // limit the number of cache checks
     now = time (NULL);
     if (cmng->check_time < now && now - cmng->check_time >= 10) {
-        // remove data until we have at least size bytes of max_size left
-        while (cmng->max_size < cmng->size + size && g_queue_peek_tail (cmng->q_lru)) {
-            entry = (struct _CacheEntry *) g_queue_peek_tail (cmng->q_lru);
+        GList *l = g_queue_peek_tail_link (cmng->q_lru);
 
-            cache_mng_remove_file (cmng, entry->ino);
+        // remove the least recently used blocks until we have at least size bytes of max_size left
+        // blocks of pinned files are kept, they are being uploaded
+        while (cmng->max_size < cmng->size + size && l) {
+            struct _CacheBlock *cblock = (struct _CacheBlock *) l->data;
+
+            l = g_list_previous (l);
+            if (!cache_mng_entry_is_pinned (cmng, cblock->entry))
+                cache_mng_remove_block (cmng, cblock);
         }
         cmng->check_time = now;
+
+        if (cmng->persistent && now - cmng->index_save_time >= CACHE_MNG_INDEX_SAVE_INTERVAL) {
+            cache_mng_save_index (cmng);
+            cmng->index_save_time = now;
+        }
     }
 
     context = cache_context_create (size, ctx);
     context->cb.store_cb = on_store_file_buf_cb;
-
-    cache_mng_file_name (cmng, path, sizeof (path), ino);
-    fd = open (path, O_WRONLY|O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    if (fd < 0) {
-        LOG_err (CMNG_LOG, INO_H"Failed to create / open file for writing! Path: %s", INO_T (ino), path);
-        if (context->cb.store_cb)
-            context->cb.store_cb (FALSE, context->user_ctx);
-        cache_context_destroy (context);
-        return;
-    }
-    res = pwrite(fd, buf, size, off);
-    close (fd);
+    context->success = TRUE;
 
     entry = g_hash_table_lookup (cmng->h_entries, GUINT_TO_POINTER (ino));
 
     if (!entry) {
-        entry = cache_entry_create (ino);
-        g_queue_push_head (cmng->q_lru, entry);
-        entry->ll_lru = g_queue_peek_head_link (cmng->q_lru);
+        entry = cache_entry_create (cmng, ino, NULL);
         g_hash_table_insert (cmng->h_entries, GUINT_TO_POINTER (ino), entry);
     }
 
-    old_length = range_length (entry->avail_range);
-    range_add (entry->avail_range, off, range_size);
-    new_length = range_length (entry->avail_range);
-    if (new_length >= old_length)
-        cmng->size += new_length - old_length;
-    else {
-        LOG_err (CMNG_LOG, INO_H"New length is less than the old length !: %"G_GUINT64_FORMAT" <= %"G_GUINT64_FORMAT,
-            INO_T (ino), new_length, old_length);
-    }
+    // buffer is not owned by context
+    context->buf = buf;
+    context->success = cache_mng_foreach_block (cmng, entry, size, off, cache_block_write, context);
+    context->buf = NULL;
 
     // update modification time
     entry->modification_time = time (NULL);
 
-    context->success = (res == (ssize_t) size);
+    LOG_debug (CMNG_LOG, INO_H"Writing [%"OFF_FMT":%zu] bytes, jobs: %u",
+        INO_T (ino), off, size, context->jobs_left - 1);
 
-    LOG_debug (CMNG_LOG, INO_H"Written [%"OFF_FMT":%zu] bytes, result: %s",
-        INO_T (ino), off, size, context->success ? "OK" : "Failed");
-
-    context->ev = event_new (application_get_evbase (cmng->app), -1,  0,
-                    cache_write_cb, context);
-    // fire this event at once
-    event_active (context->ev, 0, 0);
-    event_add (context->ev, NULL);
+    cache_context_submitted (cmng, context, cache_write_cb);
 }
 /*}}}*/
 
@@ -431,15 +1704,19 @@ void cache_mng_store_file_buf (CacheMng *cmng, fuse_ino_t ino, size_t size, off_
 void cache_mng_remove_file (CacheMng *cmng, fuse_ino_t ino)
 {
     struct _CacheEntry *entry;
-    char path[PATH_MAX];
+    struct _CachePin *pin;
+
+    // removed when the file is unpinned
+    pin = g_hash_table_lookup (cmng->h_pins, GUINT_TO_POINTER (ino));
+    if (pin) {
+        LOG_debug (CMNG_LOG, INO_H"Entry is pinned, postponing removal", INO_T (ino));
+        pin->remove_pending = TRUE;
+        return;
+    }
 
     entry = g_hash_table_lookup (cmng->h_entries, GUINT_TO_POINTER (ino));
     if (entry) {
-        cmng->size -= range_length (entry->avail_range);
-        g_queue_delete_link (cmng->q_lru, entry->ll_lru);
-        g_hash_table_remove (cmng->h_entries, GUINT_TO_POINTER (ino));
-        cache_mng_file_name (cmng, path, sizeof (path), ino);
-        unlink (path);
+        cache_mng_remove_entry (cmng, entry);
         LOG_debug (CMNG_LOG, INO_H"Entry is removed", INO_T (ino));
     } else {
         LOG_debug (CMNG_LOG, INO_H"Entry not found", INO_T (ino));
@@ -447,6 +1724,112 @@ void cache_mng_remove_file (CacheMng *cmng, fuse_ino_t ino)
 }
 /*}}}*/
 
+/*{{{ pin / unpin */
+static gboolean cache_mng_entry_is_pinned (CacheMng *cmng, struct _CacheEntry *entry)
+{
+    return entry->ino && g_hash_table_lookup (cmng->h_pins, GUINT_TO_POINTER (entry->ino));
+}
+
+void cache_mng_pin_file (CacheMng *cmng, fuse_ino_t ino)
+{
+    struct _CachePin *pin;
+
+    pin = g_hash_table_lookup (cmng->h_pins, GUINT_TO_POINTER (ino));
+    if (!pin) {
+        pin = g_new0 (struct _CachePin, 1);
+        g_hash_table_insert (cmng->h_pins, GUINT_TO_POINTER (ino), pin);
+    }
+    pin->refs++;
+}
+
+void cache_mng_unpin_file (CacheMng *cmng, fuse_ino_t ino)
+{
+    struct _CachePin *pin;
+    gboolean remove_pending;
+
+    pin = g_hash_table_lookup (cmng->h_pins, GUINT_TO_POINTER (ino));
+    if (!pin) {
+        LOG_err (CMNG_LOG, INO_H"Entry is not pinned !", INO_T (ino));
+        return;
+    }
+
+    pin->refs--;
+    if (pin->refs)
+        return;
+
+    remove_pending = pin->remove_pending;
+    g_hash_table_remove (cmng->h_pins, GUINT_TO_POINTER (ino));
+
+    if (remove_pending)
+        cache_mng_remove_file (cmng, ino);
+}
+/*}}}*/
+
+/*{{{ single-flight downloads */
+// register download of a block
+// return TRUE if caller must download the block and call cache_mng_fetch_done ()
+// return FALSE if the block is already being downloaded,
+// on_fetch_done_cb is called when the download is done (if it's not NULL)
+gboolean cache_mng_fetch_begin (CacheMng *cmng, fuse_ino_t ino, guint64 block,
+    cache_mng_on_fetch_done_cb on_fetch_done_cb, void *ctx)
+{
+    struct _CacheFetch key;
+    struct _CacheFetch *fetch;
+    struct _CacheFetchWaiter *waiter;
+
+    key.ino = ino;
+    key.block = block;
+
+    fetch = g_hash_table_lookup (cmng->h_fetches, &key);
+    if (!fetch) {
+        fetch = cache_fetch_create (ino, block);
+        g_hash_table_insert (cmng->h_fetches, fetch, fetch);
+        return TRUE;
+    }
+
+    if (on_fetch_done_cb) {
+        LOG_debug (CMNG_LOG, INO_H"Block %"G_GUINT64_FORMAT" is being downloaded, waiting", INO_T (ino), block);
+
+        waiter = g_new0 (struct _CacheFetchWaiter, 1);
+        waiter->fetch_done_cb = on_fetch_done_cb;
+        waiter->ctx = ctx;
+        fetch->l_waiters = g_list_append (fetch->l_waiters, waiter);
+    }
+
+    return FALSE;
+}
+
+// block is downloaded (and stored if success is TRUE), notify waiters
+void cache_mng_fetch_done (CacheMng *cmng, fuse_ino_t ino, guint64 block, gboolean success)
+{
+    struct _CacheFetch key;
+    struct _CacheFetch *fetch;
+    GList *l_waiters, *l;
+
+    key.ino = ino;
+    key.block = block;
+
+    fetch = g_hash_table_lookup (cmng->h_fetches, &key);
+    if (!fetch) {
+        LOG_err (CMNG_LOG, INO_H"Block %"G_GUINT64_FORMAT" is not being downloaded !", INO_T (ino), block);
+        return;
+    }
+
+    // remove from the table before calling waiters, they might request the same block again
+    l_waiters = fetch->l_waiters;
+    fetch->l_waiters = NULL;
+    g_hash_table_remove (cmng->h_fetches, &key);
+
+    for (l = g_list_first (l_waiters); l; l = g_list_next (l)) {
+        struct _CacheFetchWaiter *waiter = (struct _CacheFetchWaiter *) l->data;
+
+        waiter->fetch_done_cb (success, waiter->ctx);
+        g_free (waiter);
+    }
+    g_list_free (l_waiters);
+}
+/*}}}*/
+
 /*{{{ get_stats*/
 void cache_mng_get_stats (CacheMng *cmng, guint32 *entries_num, guint64 *total_size, guint64 *cache_hits, guint64 *cache_miss)
 {
@@ -454,15 +1837,15 @@ void cache_mng_get_stats (CacheMng *cmng, guint32 *entries_num, guint64 *total_s
     struct _CacheEntry *entry;
     gpointer value;
 
-    *entries_num = g_hash_table_size (cmng->h_entries);
+    *entries_num = g_hash_table_size (cmng->h_files);
     *cache_hits = cmng->cache_hits;
     *cache_miss = cmng->cache_miss;
     *total_size = 0;
 
-    g_hash_table_iter_init (&iter, cmng->h_entries);
+    g_hash_table_iter_init (&iter, cmng->h_files);
     while (g_hash_table_iter_next (&iter, NULL, &value)) {
         entry = (struct _CacheEntry *) value;
-        *total_size = *total_size + range_length (entry->avail_range);
+        *total_size = *total_size + entry->length;
     }
 
 }/*}}}*/
@@ -21,6 +21,7 @@
 #include "client_pool.h"
 #include "file_io_ops.h"
 #include "cache_mng.h"
+#include "write_back.h"
 #include "utils.h"
 
 /*{{{ struct / defines*/
@@ -59,6 +60,10 @@ struct _DirEntry {
     gchar *version_id;
     gchar *content_type;
     time_t xattr_time; // time when XAttrs were updated
+
+    // for type == DET_dir, the last subtree prefetch
+    time_t prefetch_time;
+    guint prefetch_objects;
 };
 
 struct _DirTree {
@@ -73,11 +78,34 @@ struct _DirTree {
     // files and directories mode, -1 to use the default value
     gint fmode;
     gint dmode;
+
+    // unlinks which wait to be sent by a Multi-Object Delete request
+    GQueue *q_deletes; // FileRemoveData
+    struct event *ev_deletes; // batch window timer
+    guint delete_batches_inflight;
+
+    GHashTable *h_listings; // directory inode -> DirTreeListing, directories which are being listed
+    GHashTable *h_prefetches; // directory inode -> PrefetchData, subtrees which are being prefetched
+
+    // directories which wait to be listed in the background
+    GQueue *q_refresh; // fuse_ino_t
+    GHashTable *h_refresh; // set of fuse_ino_t in "q_refresh"
+    struct event *ev_refresh; // rate limit timer
+    guint refresh_queue_size;
+    guint refresh_rate; // listings per second
+
+    GHashTable *h_writers; // FileIO -> inode, files which are opened for writing
 };
 
+typedef struct _DirTreeListing DirTreeListing;
+
 #define DIR_TREE_LOG "dir_tree"
 #define DIR_DEFAULT_MODE S_IFDIR | 0755
 #define FILE_DEFAULT_MODE S_IFREG | 0644
+#define DIR_TREE_MIN_COPY_PART_SIZE (5 * 1024 * 1024) // the minimal size of multipart upload part
+#define DIR_TREE_MAX_COPY_PARTS 10000 // the maximal number of multipart upload parts
+#define DIR_TREE_MAX_DELETE_KEYS 1000 // the maximal number of objects in Multi-Object Delete request
+#define DIR_TREE_REFRESH_AHEAD_PCT 80 // directory accessed after this percent of the cache lifetime is refreshed ahead
 /*}}}*/
 
 /*{{{ func declarations */
@@ -85,6 +113,10 @@ static DirEntry *dir_tree_add_entry (DirTree *dtree, const gchar *basename, mode
     DirEntryType type, fuse_ino_t parent_ino, off_t size, time_t ctime);
 static void dir_tree_entry_modified (DirTree *dtree, DirEntry *en);
 static void dir_entry_destroy (gpointer data);
+static void dir_tree_on_deletes_timer_cb (evutil_socket_t fd, short event, void *ctx);
+static void dir_tree_listing_add (DirTree *dtree, DirEntry *parent_en, DirEntry *en);
+static void dir_tree_on_refresh_timer_cb (evutil_socket_t fd, short event, void *ctx);
+static void dir_tree_refresh_check (DirTree *dtree, DirEntry *en);
 /*}}}*/
 
 /*{{{ create / destroy */
@@ -114,6 +146,19 @@ DirTree *dir_tree_create (Application *app)
 
     dtree->root = dir_tree_add_entry (dtree, "/", dtree->dmode, DET_dir, 0, 0, time (NULL));
 
+    dtree->q_deletes = g_queue_new ();
+    dtree->ev_deletes = evtimer_new (application_get_evbase (app), dir_tree_on_deletes_timer_cb, dtree);
+
+    dtree->h_listings = g_hash_table_new (g_direct_hash, g_direct_equal);
+    dtree->h_prefetches = g_hash_table_new (g_direct_hash, g_direct_equal);
+    dtree->h_writers = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    dtree->q_refresh = g_queue_new ();
+    dtree->h_refresh = g_hash_table_new (g_direct_hash, g_direct_equal);
+    dtree->ev_refresh = evtimer_new (application_get_evbase (app), dir_tree_on_refresh_timer_cb, dtree);
+    dtree->refresh_queue_size = conf_get_uint (application_get_conf (app), "filesystem.dir_refresh_queue_size");
+    dtree->refresh_rate = MAX (conf_get_uint (application_get_conf (app), "filesystem.dir_refresh_rate"), 1);
+
     LOG_debug (DIR_TREE_LOG, "DirTree created");
 
     return dtree;
@@ -121,6 +166,14 @@ DirTree *dir_tree_create (Application *app)
 
 void dir_tree_destroy (DirTree *dtree)
 {
+    event_free (dtree->ev_deletes);
+    g_queue_free_full (dtree->q_deletes, (GDestroyNotify) file_remove_data_destroy);
+    g_hash_table_destroy (dtree->h_listings);
+    g_hash_table_destroy (dtree->h_prefetches);
+    g_hash_table_destroy (dtree->h_writers);
+    event_free (dtree->ev_refresh);
+    g_queue_free (dtree->q_refresh);
+    g_hash_table_destroy (dtree->h_refresh);
     g_hash_table_destroy (dtree->h_inodes);
     dir_entry_destroy (dtree->root);
     g_free (dtree);
@@ -268,6 +321,26 @@ static gboolean dir_tree_is_cache_expired (DirTree *dtree, DirEntry *en)
     return FALSE;
 }
 
+// expired directory cache, which can be returned while the directory is listed in the background
+static gboolean dir_tree_is_cache_stale (DirTree *dtree, DirEntry *en)
+{
+    time_t t;
+
+    if (!dtree->refresh_queue_size)
+        return FALSE;
+
+    if (!en->dir_cache_size || !en->dir_cache_created || en->is_modified)
+        return FALSE;
+
+    t = time (NULL);
+    if (t < en->dir_cache_created)
+        return FALSE;
+
+    return t - en->dir_cache_created <=
+        (time_t)(conf_get_uint (application_get_conf (dtree->app), "filesystem.dir_cache_max_time") +
+        conf_get_uint (application_get_conf (dtree->app), "filesystem.dir_cache_max_stale_time"));
+}
+
 // increase the age of directory
 void dir_tree_start_update (DirEntry *en, G_GNUC_UNUSED const gchar *dir_path)
 {
@@ -277,6 +350,17 @@ void dir_tree_start_update (DirEntry *en, G_GNUC_UNUSED const gchar *dir_path)
     LOG_debug (DIR_TREE_LOG, "UPDATED CURRENT AGE: %"G_GUINT64_FORMAT, en->age);
 }
 
+// file has local data in the write-back staging directory which is not uploaded yet
+static gboolean dir_tree_entry_is_staged (DirTree *dtree, DirEntry *en)
+{
+    WriteBack *wb = application_get_write_back (dtree->app);
+
+    if (!wb || en->type != DET_file)
+        return FALSE;
+
+    return write_back_is_staged (wb, en->fullpath);
+}
+
 // remove DirEntry, which age is lower than the current
 static gboolean dir_tree_stop_update_on_remove_child_cb (gpointer key, gpointer value, gpointer ctx)
 {
@@ -298,6 +382,7 @@ static gboolean dir_tree_stop_update_on_remove_child_cb (gpointer key, gpointer
     // process files only
     if (en->age < parent_en->age &&
         !en->is_modified &&
+        !dir_tree_entry_is_staged (dtree, en) &&
         now > en->access_time &&
         (guint32)(now - en->access_time) >= conf_get_uint (application_get_conf (dtree->app), "filesystem.dir_cache_max_time") &&
         en->type != DET_dir) {
@@ -344,7 +429,7 @@ void dir_tree_stop_update (DirTree *dtree, fuse_ino_t parent_ino)
 }
 
 DirEntry *dir_tree_update_entry (DirTree *dtree, G_GNUC_UNUSED const gchar *path, DirEntryType type,
-    fuse_ino_t parent_ino, const gchar *entry_name, long long size, time_t last_modified)
+    fuse_ino_t parent_ino, const gchar *entry_name, long long size, time_t last_modified, const gchar *etag)
 {
     DirEntry *parent_en;
     DirEntry *en;
@@ -360,8 +445,13 @@ DirEntry *dir_tree_update_entry (DirTree *dtree, G_GNUC_UNUSED const gchar *path
     // get child
     en = g_hash_table_lookup (parent_en->h_dir_tree, entry_name);
     if (en) {
+        // the first time the entry is got during this update
+        if (en->age < parent_en->age)
+            dir_tree_listing_add (dtree, parent_en, en);
         en->age = parent_en->age;
-        en->size = size;
+        // server has an older version of the staged file, keep the local size
+        if (!dir_tree_entry_is_staged (dtree, en))
+            en->size = size;
         // we got this entry from the server, mark as existing file
         en->removed = FALSE;
     } else {
@@ -374,6 +464,14 @@ DirEntry *dir_tree_update_entry (DirTree *dtree, G_GNUC_UNUSED const gchar *path
 
         en = dir_tree_add_entry (dtree, entry_name, mode,
             type, parent_ino, size, last_modified);
+        if (en)
+            dir_tree_listing_add (dtree, parent_en, en);
+    }
+
+    if (etag && en->type == DET_file && !dir_tree_entry_is_staged (dtree, en) &&
+        (!en->etag || strcmp (en->etag, etag))) {
+        g_free (en->etag);
+        en->etag = g_strdup (etag);
     }
 
     LOG_debug (DIR_TREE_LOG, INO_H"Updating %s, size: %lld", INO_T (en->ino), entry_name, size);
@@ -408,9 +506,16 @@ static void dir_tree_entry_modified (DirTree *dtree, DirEntry *en)
 
 /*{{{ dir_tree_fill_dir_buf */
 
+// readdir is served while the directory is being listed:
+// every opened directory handle follows the listing and gets the entries in the order they are listed,
+// entries are appended to the handle buffer, so offsets which are returned to FUSE stay valid,
+// readdir request beyond the end of the buffer waits for the next page of the listing
+
 typedef struct {
     gchar *buf;
     size_t size;
+    DirTreeListing *listing; // listing which adds entries to "buf", NULL if "buf" is complete
+    guint listed_pos; // the number of listed entries, which are added to "buf"
 } DirOpData;
 
 typedef struct {
@@ -424,6 +529,18 @@ typedef struct {
     DirOpData *dop;
 } DirTreeFillDirData;
 
+// directory listing which is in progress
+struct _DirTreeListing {
+    DirTree *dtree;
+    fuse_ino_t ino;
+    GArray *a_listed; // fuse_ino_t of entries, in the order they are listed
+    GHashTable *h_listed; // set of fuse_ino_t in "a_listed"
+    GList *l_dops; // DirOpData, handles which follow the listing
+    GList *l_waiting; // DirTreeFillDirData, requests which wait for more entries
+    gboolean done; // listing is finished
+    guint refs; // the running listing and every following handle hold a reference
+};
+
 // callback: directory structure
 void dir_tree_fill_on_dir_buf_cb (gpointer callback_data, gboolean success)
 {
@@ -524,25 +641,240 @@ void dir_tree_fill_on_dir_buf_cb (gpointer callback_data, gboolean success)
     g_free (dir_fill_data);
 }
 
-static void dir_tree_fill_dir_on_http_ready (gpointer client, gpointer ctx)
+/*{{{ listing */
+
+static DirTreeListing *dir_tree_listing_create (DirTree *dtree, fuse_ino_t ino)
 {
-    HttpConnection *con = (HttpConnection *) client;
-    DirTreeFillDirData *dir_fill_data = (DirTreeFillDirData *) ctx;
-    DirEntry *en;
+    DirTreeListing *listing;
 
-    en = g_hash_table_lookup (dir_fill_data->dtree->h_inodes, GUINT_TO_POINTER (dir_fill_data->ino));
-    if (!en) {
-        LOG_err (DIR_TREE_LOG, INO_H"Entry not found!", INO_T (dir_fill_data->ino));
-        dir_fill_data->readdir_cb (dir_fill_data->req, FALSE, dir_fill_data->size, dir_fill_data->off, NULL, 0, dir_fill_data->ctx);
-        g_free (dir_fill_data);
+    listing = g_new0 (DirTreeListing, 1);
+    listing->dtree = dtree;
+    listing->ino = ino;
+    listing->a_listed = g_array_new (FALSE, FALSE, sizeof (fuse_ino_t));
+    listing->h_listed = g_hash_table_new (g_direct_hash, g_direct_equal);
+    listing->refs = 1;
+
+    g_hash_table_insert (dtree->h_listings, GUINT_TO_POINTER (ino), listing);
+
+    return listing;
+}
+
+static void dir_tree_listing_unref (DirTreeListing *listing)
+{
+    if (--listing->refs)
         return;
+
+    g_array_free (listing->a_listed, TRUE);
+    g_hash_table_destroy (listing->h_listed);
+    g_free (listing);
+}
+
+// entry is got from the server, add it to the listing of the parent directory (if any)
+static void dir_tree_listing_add (DirTree *dtree, DirEntry *parent_en, DirEntry *en)
+{
+    DirTreeListing *listing;
+
+    listing = g_hash_table_lookup (dtree->h_listings, GUINT_TO_POINTER (parent_en->ino));
+    if (listing && !g_hash_table_lookup (listing->h_listed, GUINT_TO_POINTER (en->ino))) {
+        g_array_append_val (listing->a_listed, en->ino);
+        g_hash_table_insert (listing->h_listed, GUINT_TO_POINTER (en->ino), GUINT_TO_POINTER (en->ino));
     }
+}
 
-    en = g_hash_table_lookup (dir_fill_data->dtree->h_inodes, GUINT_TO_POINTER (dir_fill_data->ino));
+// the handle follows the listing, its buffer starts with "." and ".."
+static void dir_tree_dop_attach (DirOpData *dop, DirTreeListing *listing, fuse_req_t req)
+{
+    struct dirbuf b;
+
+    memset (&b, 0, sizeof(b));
+    rfuse_add_dirbuf (req, &b, ".", listing->ino, 0);
+    rfuse_add_dirbuf (req, &b, "..", listing->ino, 0);
+
+    if (dop->buf)
+        g_free (dop->buf);
+    dop->buf = b.p;
+    dop->size = b.size;
+    dop->listing = listing;
+    dop->listed_pos = 0;
+
+    listing->l_dops = g_list_prepend (listing->l_dops, dop);
+    listing->refs++;
+}
+
+static void dir_tree_dop_detach (DirOpData *dop)
+{
+    DirTreeListing *listing = dop->listing;
+
+    listing->l_dops = g_list_remove (listing->l_dops, dop);
+    dop->listing = NULL;
+    dir_tree_listing_unref (listing);
+}
+
+// add entries, which are listed since the last update, to the handle buffer
+static void dir_tree_dop_update (DirOpData *dop, fuse_req_t req)
+{
+    DirTreeListing *listing = dop->listing;
+    struct dirbuf b;
+
+    b.p = dop->buf;
+    b.size = dop->size;
+
+    for (; dop->listed_pos < listing->a_listed->len; dop->listed_pos++) {
+        fuse_ino_t ino = g_array_index (listing->a_listed, fuse_ino_t, dop->listed_pos);
+        DirEntry *en;
+
+        // entry could be removed after it was listed
+        en = g_hash_table_lookup (listing->dtree->h_inodes, GUINT_TO_POINTER (ino));
+        if (!en || en->removed)
+            continue;
+
+        rfuse_add_dirbuf (req, &b, en->basename, en->ino, en->size);
+    }
+
+    // entries which are kept locally, but are not returned by the server:
+    // local directories, files which are being written or staged and recently accessed ones
+    if (listing->done) {
+        DirEntry *dir_en;
+
+        dir_en = g_hash_table_lookup (listing->dtree->h_inodes, GUINT_TO_POINTER (listing->ino));
+        if (dir_en && dir_en->type == DET_dir) {
+            GHashTableIter iter;
+            gpointer value;
+
+            g_hash_table_iter_init (&iter, dir_en->h_dir_tree);
+            while (g_hash_table_iter_next (&iter, NULL, &value)) {
+                DirEntry *en = (DirEntry *) value;
+
+                if (en->removed || g_hash_table_lookup (listing->h_listed, GUINT_TO_POINTER (en->ino)))
+                    continue;
+
+                rfuse_add_dirbuf (req, &b, en->basename, en->ino, en->size);
+            }
+        }
+    }
+
+    dop->buf = b.p;
+    dop->size = b.size;
+
+    // all entries are added, the buffer is complete
+    if (listing->done)
+        dir_tree_dop_detach (dop);
+}
+
+// reply to the readdir request of the handle which follows the listing
+// return FALSE if the request must wait for more entries
+static gboolean dir_tree_listing_reply (DirTreeFillDirData *dir_fill_data)
+{
+    DirOpData *dop = dir_fill_data->dop;
+
+    if (dop->listing)
+        dir_tree_dop_update (dop, dir_fill_data->req);
+
+    if (dop->listing && (size_t) dir_fill_data->off >= dop->size)
+        return FALSE;
+
+    // listing failed
+    if (!dop->buf) {
+        LOG_debug (DIR_TREE_LOG, INO_H"Failed to fill directory listing !", INO_T (dir_fill_data->ino));
+        dir_fill_data->readdir_cb (dir_fill_data->req, FALSE, dir_fill_data->size, dir_fill_data->off,
+            NULL, 0, dir_fill_data->ctx);
+    } else {
+        dir_fill_data->readdir_cb (dir_fill_data->req, TRUE, dir_fill_data->size, dir_fill_data->off,
+            dop->buf, dop->size, dir_fill_data->ctx);
+    }
+
+    g_free (dir_fill_data);
+
+    return TRUE;
+}
+
+// callback: a page of the listing is added to the directory tree
+static void dir_tree_on_listing_page_cb (gpointer ctx)
+{
+    DirTreeListing *listing = (DirTreeListing *) ctx;
+    GList *l, *l_next;
+
+    for (l = listing->l_waiting; l; l = l_next) {
+        DirTreeFillDirData *dir_fill_data = (DirTreeFillDirData *) l->data;
+
+        l_next = g_list_next (l);
+        // lookup requests wait for the complete listing
+        if (!dir_fill_data->dop)
+            continue;
+
+        if (dir_tree_listing_reply (dir_fill_data))
+            listing->l_waiting = g_list_delete_link (listing->l_waiting, l);
+    }
+}
+
+// callback: listing is finished
+static void dir_tree_on_listing_done_cb (gpointer ctx, gboolean success)
+{
+    DirTreeListing *listing = (DirTreeListing *) ctx;
+    DirTree *dtree = listing->dtree;
+    DirEntry *en;
+    GList *l_waiting, *l;
+
+    LOG_debug (DIR_TREE_LOG, INO_H"Directory listing is done: %s, entries: %u",
+        INO_T (listing->ino), success ? "SUCCESS" : "FAILED", listing->a_listed->len);
+
+    g_hash_table_remove (dtree->h_listings, GUINT_TO_POINTER (listing->ino));
+    listing->done = TRUE;
+
+    en = g_hash_table_lookup (dtree->h_inodes, GUINT_TO_POINTER (listing->ino));
+    if (en) {
+        en->dir_cache_updating = FALSE;
+        // directory is updated
+        en->is_modified = FALSE;
+        // directory cache is built from the local tree by the next request,
+        // the stale cache is kept until then if the directory was refreshed in the background
+        if (success) {
+            if (en->dir_cache)
+                g_free (en->dir_cache);
+            en->dir_cache = NULL;
+            en->dir_cache_size = 0;
+            en->dir_cache_created = time (NULL);
+        }
+    }
+
+    // entries which are already added to the handle buffers could be incomplete,
+    // handles have to start over
+    if (!success) {
+        while (listing->l_dops) {
+            DirOpData *dop = (DirOpData *) listing->l_dops->data;
+
+            dir_tree_dop_detach (dop);
+            g_free (dop->buf);
+            dop->buf = NULL;
+            dop->size = 0;
+        }
+    }
+
+    l_waiting = listing->l_waiting;
+    listing->l_waiting = NULL;
+    for (l = l_waiting; l; l = g_list_next (l)) {
+        DirTreeFillDirData *dir_fill_data = (DirTreeFillDirData *) l->data;
+
+        if (dir_fill_data->dop)
+            dir_tree_listing_reply (dir_fill_data);
+        else
+            dir_tree_fill_on_dir_buf_cb (dir_fill_data, success);
+    }
+    g_list_free (l_waiting);
+
+    dir_tree_listing_unref (listing);
+}
+
+static void dir_tree_fill_dir_on_http_ready (gpointer client, gpointer ctx)
+{
+    HttpConnection *con = (HttpConnection *) client;
+    DirTreeListing *listing = (DirTreeListing *) ctx;
+    DirEntry *en;
+
+    en = g_hash_table_lookup (listing->dtree->h_inodes, GUINT_TO_POINTER (listing->ino));
     if (!en) {
-        LOG_err (DIR_TREE_LOG, INO_H"Entry not found!", INO_T (dir_fill_data->ino));
-        dir_fill_data->readdir_cb (dir_fill_data->req, FALSE, dir_fill_data->size, dir_fill_data->off, NULL, 0, dir_fill_data->ctx);
-        g_free (dir_fill_data);
+        LOG_err (DIR_TREE_LOG, INO_H"Entry not found!", INO_T (listing->ino));
+        dir_tree_on_listing_done_cb (listing, FALSE);
         return;
     }
 
@@ -550,10 +882,105 @@ static void dir_tree_fill_dir_on_http_ready (gpointer client, gpointer ctx)
     dir_tree_start_update (en, NULL);
     //send http request
     http_connection_get_directory_listing (con,
-        en->fullpath, dir_fill_data->ino,
-        dir_tree_fill_on_dir_buf_cb, dir_fill_data
+        en->fullpath, listing->ino,
+        dir_tree_on_listing_page_cb, dir_tree_on_listing_done_cb, listing
     );
 }
+/*}}}*/
+
+/*{{{ background refresh */
+
+// directories are listed in the background before their cache expires (if they are accessed)
+// or while their stale cache is returned, the queue is bounded and listings are started at "refresh_rate"
+
+// directory cache is expired or is going to expire soon
+static gboolean dir_tree_refresh_is_due (DirTree *dtree, DirEntry *en)
+{
+    time_t t;
+    guint max_time;
+
+    if (en->dir_cache_updating || !en->dir_cache_created)
+        return FALSE;
+
+    t = time (NULL);
+    max_time = conf_get_uint (application_get_conf (dtree->app), "filesystem.dir_cache_max_time");
+
+    // make sure "now" is greater than cache time
+    if (t < en->dir_cache_created)
+        return FALSE;
+
+    return (guint64)(t - en->dir_cache_created) * 100 >= (guint64)max_time * DIR_TREE_REFRESH_AHEAD_PCT;
+}
+
+static void dir_tree_refresh_timer_add (DirTree *dtree)
+{
+    struct timeval tv;
+    guint usec = 1000000 / dtree->refresh_rate;
+
+    tv.tv_sec = usec / 1000000;
+    tv.tv_usec = usec % 1000000;
+    evtimer_add (dtree->ev_refresh, &tv);
+}
+
+static void dir_tree_refresh_start (DirTree *dtree, DirEntry *en)
+{
+    DirTreeListing *listing;
+
+    LOG_debug (DIR_TREE_LOG, INO_H"Refreshing directory %s in the background ..", INO_T (en->ino), en->fullpath);
+
+    en->dir_cache_updating = TRUE;
+    listing = dir_tree_listing_create (dtree, en->ino);
+
+    if (!client_pool_get_client (application_get_ops_client_pool (dtree->app), dir_tree_fill_dir_on_http_ready, listing)) {
+        LOG_debug (DIR_TREE_LOG, INO_H"Failed to get http client !", INO_T (en->ino));
+        dir_tree_on_listing_done_cb (listing, FALSE);
+    }
+}
+
+static void dir_tree_on_refresh_timer_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short event, void *ctx)
+{
+    DirTree *dtree = (DirTree *) ctx;
+    gpointer ino;
+    DirEntry *en;
+
+    ino = g_queue_pop_head (dtree->q_refresh);
+    g_hash_table_remove (dtree->h_refresh, ino);
+
+    if (!g_queue_is_empty (dtree->q_refresh))
+        dir_tree_refresh_timer_add (dtree);
+
+    // directory could be removed or listed since it was queued
+    en = g_hash_table_lookup (dtree->h_inodes, ino);
+    if (!en || en->type != DET_dir || !dir_tree_refresh_is_due (dtree, en))
+        return;
+
+    dir_tree_refresh_start (dtree, en);
+}
+
+// queue the background listing of the directory, which cache is returned to the caller,
+// if the cache is expired or is going to expire soon
+static void dir_tree_refresh_check (DirTree *dtree, DirEntry *en)
+{
+    if (!dtree->refresh_queue_size || !dir_tree_refresh_is_due (dtree, en))
+        return;
+
+    if (g_hash_table_lookup (dtree->h_refresh, GUINT_TO_POINTER (en->ino)))
+        return;
+
+    if (g_queue_get_length (dtree->q_refresh) >= dtree->refresh_queue_size) {
+        LOG_debug (DIR_TREE_LOG, INO_H"Refresh queue is full !", INO_T (en->ino));
+        return;
+    }
+
+    g_queue_push_tail (dtree->q_refresh, GUINT_TO_POINTER (en->ino));
+    g_hash_table_insert (dtree->h_refresh, GUINT_TO_POINTER (en->ino), GUINT_TO_POINTER (en->ino));
+
+    if (evtimer_pending (dtree->ev_refresh, NULL))
+        return;
+
+    dir_tree_refresh_timer_add (dtree);
+}
+/*}}}*/
 
 gboolean dir_tree_opendir (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *fi)
 {
@@ -579,6 +1006,8 @@ gboolean dir_tree_releasedir (G_GNUC_UNUSED DirTree *dtree, G_GNUC_UNUSED fuse_i
 
     dop = (DirOpData *) fi->fh;
     if (dop) {
+        if (dop->listing)
+            dir_tree_dop_detach (dop);
         if (dop->buf)
             g_free (dop->buf);
         g_free (dop);
@@ -597,6 +1026,7 @@ void dir_tree_fill_dir_buf (DirTree *dtree,
     DirEntry *en;
     DirTreeFillDirData *dir_fill_data;
     DirOpData *dop = NULL;
+    DirTreeListing *listing;
 
     LOG_debug (DIR_TREE_LOG, INO_H"Requesting directory buffer: [%zu: %"OFF_FMT"]", INO_T (ino), size, off);
 
@@ -615,17 +1045,38 @@ void dir_tree_fill_dir_buf (DirTree *dtree,
         dop = (DirOpData *) fi->fh;
     }
 
+    dir_fill_data = g_new0 (DirTreeFillDirData, 1);
+    dir_fill_data->dtree = dtree;
+    dir_fill_data->ino = ino;
+    dir_fill_data->size = size;
+    dir_fill_data->off = off;
+    dir_fill_data->readdir_cb = readdir_cb;
+    dir_fill_data->req = req;
+    dir_fill_data->ctx = ctx;
+    dir_fill_data->dop = dop;
+
+    // handle follows the directory listing, return entries as soon as they are listed
+    if (dop && dop->listing) {
+        if (!dir_tree_listing_reply (dir_fill_data))
+            dop->listing->l_waiting = g_list_append (dop->listing->l_waiting, dir_fill_data);
+        return;
+    }
+
     // if request buffer is set - return it right away
     if (dop && dop->buf) {
         LOG_debug (DIR_TREE_LOG, INO_H"Returning request cache ..", INO_T (ino));
         readdir_cb (req, TRUE, size, off, dop->buf, dop->size, ctx);
+        g_free (dir_fill_data);
         return;
     }
 
-    // already have directory buffer in the cache
-    if (!dir_tree_is_cache_expired (dtree, en)) {
+    // already have directory buffer in the cache,
+    // the expired one is returned while the directory is listed in the background
+    if (!dir_tree_is_cache_expired (dtree, en) || dir_tree_is_cache_stale (dtree, en)) {
         LOG_debug (DIR_TREE_LOG, INO_H"Sending directory buffer from cache !", INO_T (ino));
 
+        dir_tree_refresh_check (dtree, en);
+
         // Fuse request
         if (dop) {
             // cache is empty
@@ -637,19 +1088,16 @@ void dir_tree_fill_dir_buf (DirTree *dtree,
             readdir_cb (req, TRUE, size, off, dop->buf, dop->size, ctx);
         } else
             readdir_cb (req, TRUE, size, off, en->dir_cache, en->dir_cache_size, ctx);
+        g_free (dir_fill_data);
         return;
     }
 
     // make sure that subsequent requests return the same directory structure
     if (off > 0) {
         // must be set !
-        if (!dop || !dop->buf) {
-            LOG_err (DIR_TREE_LOG, INO_H"Dir cache is not set !", INO_T (ino));
-            readdir_cb (req, FALSE, size, off, NULL, 0, ctx);
-            return;
-        }
-        LOG_debug (DIR_TREE_LOG, INO_H"Sending directory buffer from cache !", INO_T (ino));
-        readdir_cb (req, TRUE, size, off, dop->buf, dop->size, ctx);
+        LOG_err (DIR_TREE_LOG, INO_H"Dir cache is not set !", INO_T (ino));
+        readdir_cb (req, FALSE, size, off, NULL, 0, ctx);
+        g_free (dir_fill_data);
         return;
     }
 
@@ -660,19 +1108,11 @@ void dir_tree_fill_dir_buf (DirTree *dtree,
     en->dir_cache_size = 0;
     //en->dir_cache_created = 0;
 
-    dir_fill_data = g_new0 (DirTreeFillDirData, 1);
-    dir_fill_data->dtree = dtree;
-    dir_fill_data->ino = ino;
-    dir_fill_data->size = size;
-    dir_fill_data->off = off;
-    dir_fill_data->readdir_cb = readdir_cb;
-    dir_fill_data->req = req;
-    dir_fill_data->ctx = ctx;
-    dir_fill_data->dop = dop;
+    listing = g_hash_table_lookup (dtree->h_listings, GUINT_TO_POINTER (ino));
 
     // if no request is being sent
     // and it's new or expired
-    if (!en->dir_cache_updating &&
+    if (!listing &&
         (!en->dir_cache_created ||
         time (NULL) - en->dir_cache_created >
         (time_t)conf_get_uint (application_get_conf (dtree->app), "filesystem.dir_cache_max_time")))
@@ -680,13 +1120,25 @@ void dir_tree_fill_dir_buf (DirTree *dtree,
         LOG_debug (DIR_TREE_LOG, INO_H"Directory cache is expired, getting a fresh list from the server !", INO_T (en->ino));
 
         en->dir_cache_updating = TRUE;
+        listing = dir_tree_listing_create (dtree, ino);
+        if (dop)
+            dir_tree_dop_attach (dop, listing, req);
+        // the first request waits for the first page
+        listing->l_waiting = g_list_append (listing->l_waiting, dir_fill_data);
 
-        if (!client_pool_get_client (application_get_ops_client_pool (dtree->app), dir_tree_fill_dir_on_http_ready, dir_fill_data)) {
+        if (!client_pool_get_client (application_get_ops_client_pool (dtree->app), dir_tree_fill_dir_on_http_ready, listing)) {
             LOG_err (DIR_TREE_LOG, "Failed to get http client !");
-            readdir_cb (req, FALSE, size, off, NULL, 0, ctx);
-            en->dir_cache_updating = FALSE;
-            g_free (dir_fill_data);
+            dir_tree_on_listing_done_cb (listing, FALSE);
+        }
+    } else if (listing) {
+        LOG_debug (DIR_TREE_LOG, INO_H"Directory is being listed, following the listing !", INO_T (en->ino));
+
+        if (dop) {
+            dir_tree_dop_attach (dop, listing, req);
+            if (dir_tree_listing_reply (dir_fill_data))
+                return;
         }
+        listing->l_waiting = g_list_append (listing->l_waiting, dir_fill_data);
     } else {
         LOG_debug (DIR_TREE_LOG, INO_H"Returning directory cache from local tree !", INO_T (en->ino));
         dir_tree_fill_on_dir_buf_cb (dir_fill_data, TRUE);
@@ -904,7 +1356,7 @@ static void dir_tree_on_lookup_not_found_cb (HttpConnection *con, void *ctx, gbo
     }
 
     en = dir_tree_update_entry (op_data->dtree, parent_en->fullpath, DET_file,
-        op_data->parent_ino, op_data->name, size, last_modified);
+        op_data->parent_ino, op_data->name, size, last_modified, NULL);
 
     if (!en) {
         LOG_err (DIR_TREE_LOG, INO_H"Failed to create FileEntry parent ino: %"INO_FMT" !",
@@ -1029,7 +1481,7 @@ void dir_tree_lookup (DirTree *dtree, fuse_ino_t parent_ino, const char *name,
 
     // directory cache is expired
     // XXX: add recursion protection !!
-    if (dir_tree_is_cache_expired (dtree, dir_en)) {
+    if (dir_tree_is_cache_expired (dtree, dir_en) && !dir_tree_is_cache_stale (dtree, dir_en)) {
 
         LookupOpData *op_data;
 
@@ -1047,6 +1499,8 @@ void dir_tree_lookup (DirTree *dtree, fuse_ino_t parent_ino, const char *name,
         return;
     }
 
+    dir_tree_refresh_check (dtree, dir_en);
+
     en = g_hash_table_lookup (dir_en->h_dir_tree, name);
     if (!en) {
         LookupOpData *op_data;
@@ -1117,6 +1571,12 @@ void dir_tree_lookup (DirTree *dtree, fuse_ino_t parent_ino, const char *name,
     }
     */
 
+    // staged file is not on the server yet, local information is the most recent one
+    if (dir_tree_entry_is_staged (dtree, en)) {
+        lookup_cb (req, TRUE, en->ino, en->mode, en->size, en->ctime);
+        return;
+    }
+
     if (en->is_modified && !en->is_updating && en->type != DET_dir) {
 
         LookupOpData *op_data;
@@ -1240,9 +1700,47 @@ void dir_tree_getattr (DirTree *dtree, fuse_ino_t ino,
 // set entry's attributes
 // update directory cache
 // XXX: not fully implemented
+typedef struct {
+    DirTree *dtree;
+    fuse_ino_t ino;
+    guint64 size;
+    gboolean is_temp; // FileIO is created for this operation
+    dir_tree_setattr_cb setattr_cb;
+    fuse_req_t req;
+} SetAttrData;
+
+static void dir_tree_setattr_on_truncated_cb (FileIO *fop, gpointer ctx, gboolean success)
+{
+    SetAttrData *sdata = (SetAttrData *) ctx;
+    DirEntry *en;
+
+    // the file is not opened, upload the result right away
+    if (sdata->is_temp)
+        fileio_release (fop);
+
+    en = g_hash_table_lookup (sdata->dtree->h_inodes, GUINT_TO_POINTER (sdata->ino));
+    if (!en) {
+        LOG_msg (DIR_TREE_LOG, INO_H"Entry not found !", INO_T (sdata->ino));
+        sdata->setattr_cb (sdata->req, FALSE, 0, 0, 0);
+        g_free (sdata);
+        return;
+    }
+
+    if (success) {
+        en->size = sdata->size;
+        en->updated_time = time (NULL);
+        dir_tree_entry_modified (sdata->dtree, en);
+    } else {
+        LOG_err (DIR_TREE_LOG, INO_H"Failed to truncate file !", INO_T (sdata->ino));
+    }
+
+    sdata->setattr_cb (sdata->req, success, en->ino, en->mode, en->size);
+    g_free (sdata);
+}
+
 void dir_tree_setattr (DirTree *dtree, fuse_ino_t ino,
-    G_GNUC_UNUSED struct stat *attr, G_GNUC_UNUSED int to_set,
-    dir_tree_setattr_cb setattr_cb, fuse_req_t req, G_GNUC_UNUSED void *fi)
+    struct stat *attr, int to_set,
+    dir_tree_setattr_cb setattr_cb, fuse_req_t req, void *fi)
 {
     DirEntry  *en;
 
@@ -1256,17 +1754,44 @@ void dir_tree_setattr (DirTree *dtree, fuse_ino_t ino,
         setattr_cb (req, FALSE, 0, 0, 0);
         return;
     }
-    //XXX: en->mode
-    setattr_cb (req, TRUE, en->ino, en->mode, en->size);
-}
-/*}}}*/
 
-/*{{{ dir_tree_file_create */
+    // truncate: data is modified in the local staging file, which is uploaded when FileIO is released
+    if ((to_set & FUSE_SET_ATTR_SIZE) && en->type == DET_file) {
+        SetAttrData *sdata;
+        FileIO *fop;
 
-// add new file entry to directory
-void dir_tree_file_create (DirTree *dtree, fuse_ino_t parent_ino, const char *name, mode_t mode,
-    DirTree_file_create_cb file_create_cb, fuse_req_t req, struct fuse_file_info *fi)
-{
+        sdata = g_new0 (SetAttrData, 1);
+        sdata->dtree = dtree;
+        sdata->ino = ino;
+        sdata->size = attr->st_size;
+        sdata->setattr_cb = setattr_cb;
+        sdata->req = req;
+
+        if (fi) {
+            fop = (FileIO *) ((struct fuse_file_info *) fi)->fh;
+        } else {
+            fop = fileio_create (dtree->app, en->fullpath, en->ino, FALSE);
+            fileio_set_object_size (fop, en->size);
+            sdata->is_temp = TRUE;
+        }
+
+        LOG_debug (DIR_TREE_LOG, INO_FOP_H"Truncating to %"G_GUINT64_FORMAT, INO_T (ino), fop, sdata->size);
+
+        fileio_truncate (fop, sdata->size, dir_tree_setattr_on_truncated_cb, sdata);
+        return;
+    }
+
+    //XXX: en->mode
+    setattr_cb (req, TRUE, en->ino, en->mode, en->size);
+}
+/*}}}*/
+
+/*{{{ dir_tree_file_create */
+
+// add new file entry to directory
+void dir_tree_file_create (DirTree *dtree, fuse_ino_t parent_ino, const char *name, mode_t mode,
+    DirTree_file_create_cb file_create_cb, fuse_req_t req, struct fuse_file_info *fi)
+{
     DirEntry *dir_en, *en;
     FileIO *fop;
 
@@ -1305,6 +1830,7 @@ void dir_tree_file_create (DirTree *dtree, fuse_ino_t parent_ino, const char *na
 
     fop = fileio_create (dtree->app, en->fullpath, en->ino, TRUE);
     fi->fh = (uint64_t) fop;
+    g_hash_table_insert (dtree->h_writers, fop, GUINT_TO_POINTER (en->ino));
 
     LOG_debug (DIR_TREE_LOG, INO_FOP_H"New Entry created: %s, directory ino: %"INO_FMT, INO_T (en->ino), fop, name, INO parent_ino);
 
@@ -1330,8 +1856,19 @@ void dir_tree_file_open (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *
         return;
     }
 
-    fop = fileio_create (dtree->app, en->fullpath, en->ino, FALSE);
+    // O_TRUNC: the file is replaced, it's uploaded on release even if nothing is written
+    if (fi->flags & O_TRUNC) {
+        fop = fileio_create (dtree->app, en->fullpath, en->ino, TRUE);
+        en->size = 0;
+        dir_tree_entry_modified (dtree, en);
+    } else {
+        fop = fileio_create (dtree->app, en->fullpath, en->ino, FALSE);
+        // writes keep the rest of the existing object
+        fileio_set_object_size (fop, en->size);
+    }
     fi->fh = (uint64_t) fop;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC))
+        g_hash_table_insert (dtree->h_writers, fop, GUINT_TO_POINTER (en->ino));
 
     LOG_debug (DIR_TREE_LOG, INO_FOP_H"dir_tree_open", INO_T (en->ino), fop);
 
@@ -1341,11 +1878,13 @@ void dir_tree_file_open (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *
 
 /*{{{ dir_tree_file_release*/
 // file is closed, free context data
-void dir_tree_file_release (DirTree *dtree, fuse_ino_t ino, G_GNUC_UNUSED struct fuse_file_info *fi)
+gboolean dir_tree_file_release (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *fi)
 {
     DirEntry *en;
     FileIO *fop;
 
+    g_hash_table_remove (dtree->h_writers, (FileIO *)fi->fh);
+
     en = g_hash_table_lookup (dtree->h_inodes, GUINT_TO_POINTER (ino));
 
     // if entry does not exist
@@ -1353,14 +1892,44 @@ void dir_tree_file_release (DirTree *dtree, fuse_ino_t ino, G_GNUC_UNUSED struct
     if (!en) {
         LOG_msg (DIR_TREE_LOG, INO_H"Entry not found !", INO_T (ino));
         //XXX
-        return;
+        return TRUE;
     }
 
     fop = (FileIO *)fi->fh;
 
     LOG_debug (DIR_TREE_LOG, INO_FOP_H"dir_tree_file_release", INO_T (ino), fop);
 
-    fileio_release (fop);
+    if (!fileio_release (fop)) {
+        LOG_err (DIR_TREE_LOG, INO_H"Failed to store file data !", INO_T (ino));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+/*}}}*/
+
+/*{{{ dir_tree_file_flush */
+gboolean dir_tree_file_flush (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    DirEntry *en;
+    FileIO *fop;
+
+    en = g_hash_table_lookup (dtree->h_inodes, GUINT_TO_POINTER (ino));
+    if (!en || en->type != DET_file) {
+        LOG_msg (DIR_TREE_LOG, INO_H"Entry not found !", INO_T (ino));
+        return TRUE;
+    }
+
+    fop = (FileIO *)fi->fh;
+
+    LOG_debug (DIR_TREE_LOG, INO_FOP_H"dir_tree_file_flush", INO_T (ino), fop);
+
+    if (!fileio_flush (fop)) {
+        LOG_err (DIR_TREE_LOG, INO_H"Failed to store file data !", INO_T (ino));
+        return FALSE;
+    }
+
+    return TRUE;
 }
 /*}}}*/
 
@@ -1373,7 +1942,7 @@ typedef struct {
     fuse_ino_t ino;
 } FileReadOpData;
 
-static void dir_tree_on_buffer_read_cb (gpointer ctx, gboolean success, char *buf, size_t size)
+static void dir_tree_on_buffer_read_cb (gpointer ctx, gboolean success, struct fuse_bufvec *bufv)
 {
     FileReadOpData *op_data = (FileReadOpData *)ctx;
 
@@ -1381,12 +1950,12 @@ static void dir_tree_on_buffer_read_cb (gpointer ctx, gboolean success, char *bu
 
     if (!success) {
         LOG_err (DIR_TREE_LOG, INO_FROP_H"Failed to read file !", INO_T (op_data->ino), op_data);
-        op_data->file_read_cb (op_data->req, FALSE, NULL, 0);
+        op_data->file_read_cb (op_data->req, FALSE, NULL);
         g_free (op_data);
         return;
     }
 
-    op_data->file_read_cb (op_data->req, TRUE, buf, size);
+    op_data->file_read_cb (op_data->req, TRUE, bufv);
     g_free (op_data);
 }
 
@@ -1406,7 +1975,7 @@ void dir_tree_file_read (DirTree *dtree, fuse_ino_t ino,
     // or it's not a directory type ?
     if (!en) {
         LOG_err (DIR_TREE_LOG, INO_H"Entry not found !", INO_T (ino));
-        file_read_cb (req, FALSE, NULL, 0);
+        file_read_cb (req, FALSE, NULL);
         return;
     }
 
@@ -1446,8 +2015,6 @@ static void dir_tree_on_buffer_written_cb (FileIO *fop, gpointer ctx, gboolean s
 
     // we need to update entry size !
     if (success) {
-        guint64 len;
-
         en = g_hash_table_lookup (op_data->dtree->h_inodes, GUINT_TO_POINTER (op_data->ino));
         if (!en) {
             LOG_msg (DIR_TREE_LOG, INO_H"Entry not found !", INO_T (op_data->ino));
@@ -1455,16 +2022,8 @@ static void dir_tree_on_buffer_written_cb (FileIO *fop, gpointer ctx, gboolean s
             return;
         }
 
-        // try to get file size from CacheMng
-        len = cache_mng_get_file_length (application_get_cache_mng (op_data->dtree->app), op_data->ino);
-
-        // calculate current size in case of CacheMng is disabled or the file is not stored in CacheMng
-        if (len == 0) {
-            len = op_data->off + count;
-            LOG_debug (DIR_TREE_LOG, INO_H"Recalculating file size !", INO_T (op_data->ino));
-        }
-
-        en->size = len;
+        // random writes don't extend the file
+        en->size = fileio_get_current_size (fop);
         //en->ctime = time (NULL);
     }
 
@@ -1509,31 +2068,236 @@ void dir_tree_file_write (DirTree *dtree, fuse_ino_t ino,
 }
 /*}}}*/
 
+/*{{{ dir_tree_file_fallocate */
+typedef struct {
+    DirTree *dtree;
+    fuse_ino_t ino;
+    guint64 size;
+    DirTree_file_fallocate_cb file_fallocate_cb;
+    fuse_req_t req;
+} FallocateData;
+
+static void dir_tree_file_fallocate_on_allocated_cb (G_GNUC_UNUSED FileIO *fop, gpointer ctx, gboolean success)
+{
+    FallocateData *fdata = (FallocateData *) ctx;
+    DirEntry *en;
+
+    en = g_hash_table_lookup (fdata->dtree->h_inodes, GUINT_TO_POINTER (fdata->ino));
+    if (!en) {
+        LOG_msg (DIR_TREE_LOG, INO_H"Entry not found !", INO_T (fdata->ino));
+        fdata->file_fallocate_cb (fdata->req, FALSE);
+        g_free (fdata);
+        return;
+    }
+
+    if (success) {
+        if (fdata->size > en->size) {
+            en->size = fdata->size;
+            en->updated_time = time (NULL);
+            dir_tree_entry_modified (fdata->dtree, en);
+        }
+    } else {
+        LOG_err (DIR_TREE_LOG, INO_H"Failed to allocate file !", INO_T (fdata->ino));
+    }
+
+    fdata->file_fallocate_cb (fdata->req, success);
+    g_free (fdata);
+}
+
+void dir_tree_file_fallocate (DirTree *dtree, fuse_ino_t ino, off_t offset, off_t length, gboolean keep_size,
+    DirTree_file_fallocate_cb file_fallocate_cb, fuse_req_t req,
+    struct fuse_file_info *fi)
+{
+    DirEntry *en;
+    FileIO *fop;
+    FallocateData *fdata;
+
+    en = g_hash_table_lookup (dtree->h_inodes, GUINT_TO_POINTER (ino));
+    if (!en || en->type != DET_file) {
+        LOG_msg (DIR_TREE_LOG, INO_H"Entry not found !", INO_T (ino));
+        file_fallocate_cb (req, FALSE);
+        return;
+    }
+
+    fop = (FileIO *)fi->fh;
+
+    LOG_debug (DIR_TREE_LOG, INO_FOP_H"fallocate, off: %"OFF_FMT", len: %"OFF_FMT", keep size: %s",
+        INO_T (ino), fop, offset, length, keep_size ? "YES" : "NO");
+
+    if (keep_size) {
+        fileio_set_size_hint (fop, offset + length);
+        file_fallocate_cb (req, TRUE);
+        return;
+    }
+
+    // the file grows the same way as by truncate, in the local staging file
+    fdata = g_new0 (FallocateData, 1);
+    fdata->dtree = dtree;
+    fdata->ino = ino;
+    fdata->size = offset + length;
+    fdata->file_fallocate_cb = file_fallocate_cb;
+    fdata->req = req;
+
+    fileio_allocate (fop, fdata->size, dir_tree_file_fallocate_on_allocated_cb, fdata);
+}
+/*}}}*/
+
+// full name of the object, "path" is relative to "s3.key_prefix"
+static gchar *dir_tree_get_object_key (DirTree *dtree, const gchar *path)
+{
+    const gchar *key_prefix = conf_get_string (application_get_conf (dtree->app), "s3.key_prefix");
+
+    // skip leading '/'
+    if (strlen (key_prefix))
+        key_prefix++;
+
+    return g_strdup_printf ("%s%s", key_prefix, path);
+}
+
+/*{{{ delete objects */
+
+// "success" is TRUE if all objects are deleted,
+// "h_failed" is a set of full names of the objects which failed to delete, NULL if the whole request failed
+typedef void (*DirTree_delete_cb) (gpointer ctx, gboolean success, GHashTable *h_failed);
+
+typedef struct {
+    DirTree *dtree;
+    struct evbuffer *xml_buf;
+    guint keys_count;
+    DirTree_delete_cb delete_cb;
+    gpointer ctx;
+} DeleteData;
+
+static void dir_tree_delete_done (DeleteData *ddata, gboolean success, GHashTable *h_failed)
+{
+    if (ddata->delete_cb)
+        ddata->delete_cb (ddata->ctx, success, h_failed);
+    evbuffer_free (ddata->xml_buf);
+    g_free (ddata);
+}
+
+static void dir_tree_on_delete_objects_cb (HttpConnection *con, gpointer ctx, gboolean success,
+    const gchar *buf, size_t buf_len,
+    G_GNUC_UNUSED struct evkeyvalq *headers)
+{
+    DeleteData *ddata = (DeleteData *) ctx;
+    GHashTable *h_failed;
+    GList *l_failed;
+    GList *l;
+
+    http_connection_release (con);
+
+    if (!success) {
+        LOG_err (DIR_TREE_LOG, CON_H"Failed to delete %u objects !", con, ddata->keys_count);
+        dir_tree_delete_done (ddata, FALSE, NULL);
+        return;
+    }
+
+    // in the quiet mode the response contains only objects which failed to delete
+    l_failed = xml_get_values (buf, buf_len, "//s3:Error/s3:Key");
+    h_failed = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    for (l = g_list_first (l_failed); l; l = g_list_next (l)) {
+        LOG_err (DIR_TREE_LOG, CON_H"Failed to delete object: %s", con, (gchar *) l->data);
+        g_hash_table_insert (h_failed, l->data, l->data);
+    }
+    // keys are owned by the hash table
+    g_list_free (l_failed);
+
+    LOG_debug (DIR_TREE_LOG, CON_H"Deleted %u objects, failed: %u", con,
+        ddata->keys_count - g_hash_table_size (h_failed), g_hash_table_size (h_failed));
+
+    dir_tree_delete_done (ddata, g_hash_table_size (h_failed) == 0, h_failed);
+    g_hash_table_destroy (h_failed);
+}
+
+static void dir_tree_on_delete_objects_con_cb (gpointer client, gpointer ctx)
+{
+    HttpConnection *con = (HttpConnection *) client;
+    DeleteData *ddata = (DeleteData *) ctx;
+    gchar *md5b = NULL;
+    gboolean res;
+
+    http_connection_acquire (con);
+
+    // Content-MD5 is required for Multi-Object Delete requests
+    get_md5_sum ((const gchar *) evbuffer_pullup (ddata->xml_buf, -1), evbuffer_get_length (ddata->xml_buf), NULL, &md5b);
+    http_connection_add_output_header (con, "Content-MD5", md5b);
+    g_free (md5b);
+
+    res = http_connection_make_request (con,
+        "/?delete", "POST", ddata->xml_buf, TRUE, NULL,
+        dir_tree_on_delete_objects_cb,
+        ddata
+    );
+
+    // dir_tree_on_delete_objects_cb () is already called
+    if (!res)
+        LOG_err (DIR_TREE_LOG, CON_H"Failed to create http request !", con);
+}
+
+// delete objects "l_paths" (list of gchar *, relative to "s3.key_prefix") by a single Multi-Object Delete request,
+// the list must contain at most DIR_TREE_MAX_DELETE_KEYS paths
+static void dir_tree_delete_objects (DirTree *dtree, GList *l_paths, DirTree_delete_cb delete_cb, gpointer ctx)
+{
+    DeleteData *ddata;
+    GList *l;
+
+    ddata = g_new0 (DeleteData, 1);
+    ddata->dtree = dtree;
+    ddata->delete_cb = delete_cb;
+    ddata->ctx = ctx;
+
+    ddata->xml_buf = evbuffer_new ();
+    evbuffer_add_printf (ddata->xml_buf, "%s", "<?xml version=\"1.0\" encoding=\"UTF-8\"?><Delete><Quiet>true</Quiet>");
+    for (l = g_list_first (l_paths); l; l = g_list_next (l)) {
+        gchar *key;
+        gchar *escaped;
+
+        key = dir_tree_get_object_key (dtree, (const gchar *) l->data);
+        escaped = g_markup_escape_text (key, -1);
+        evbuffer_add_printf (ddata->xml_buf, "<Object><Key>%s</Key></Object>", escaped);
+        g_free (escaped);
+        g_free (key);
+        ddata->keys_count++;
+    }
+    evbuffer_add_printf (ddata->xml_buf, "%s", "</Delete>");
+
+    if (!client_pool_get_client (application_get_ops_client_pool (dtree->app),
+        dir_tree_on_delete_objects_con_cb, ddata)) {
+        LOG_err (DIR_TREE_LOG, "Failed to get HTTP client !");
+        dir_tree_delete_done (ddata, FALSE, NULL);
+        return;
+    }
+}
+/*}}}*/
+
 /*{{{ dir_tree_file_remove */
 
 typedef struct {
     DirTree *dtree;
     fuse_ino_t ino;
+    gchar *path; // object to delete, set for batched deletes
     DirTree_file_remove_cb file_remove_cb;
     fuse_req_t req;
 } FileRemoveData;
 
-// file is removed
-static void dir_tree_file_remove_on_con_data_cb (HttpConnection *con, gpointer ctx, gboolean success,
-    G_GNUC_UNUSED const gchar *buf, G_GNUC_UNUSED size_t buf_len,
-    G_GNUC_UNUSED struct evkeyvalq *headers)
+static void file_remove_data_destroy (FileRemoveData *data)
 {
-    FileRemoveData *data = (FileRemoveData *) ctx;
-    DirEntry *en;
+    g_free (data->path);
+    g_free (data);
+}
 
-    http_connection_release (con);
+// object is deleted (or failed to delete), update the entry and reply
+static void dir_tree_file_remove_done (FileRemoveData *data, gboolean success)
+{
+    DirEntry *en;
 
     en = g_hash_table_lookup (data->dtree->h_inodes, GUINT_TO_POINTER (data->ino));
     if (!en) {
         LOG_err (DIR_TREE_LOG, INO_H"Entry not found !", INO_T (data->ino));
         if (data->file_remove_cb)
             data->file_remove_cb (data->req, FALSE);
-		g_free (data);
+        file_remove_data_destroy (data);
         return;
     }
 
@@ -1547,7 +2311,19 @@ static void dir_tree_file_remove_on_con_data_cb (HttpConnection *con, gpointer c
     if (data->file_remove_cb)
         data->file_remove_cb (data->req, success);
 
-    g_free (data);
+    file_remove_data_destroy (data);
+}
+
+// file is removed
+static void dir_tree_file_remove_on_con_data_cb (HttpConnection *con, gpointer ctx, gboolean success,
+    G_GNUC_UNUSED const gchar *buf, G_GNUC_UNUSED size_t buf_len,
+    G_GNUC_UNUSED struct evkeyvalq *headers)
+{
+    FileRemoveData *data = (FileRemoveData *) ctx;
+
+    http_connection_release (con);
+
+    dir_tree_file_remove_done (data, success);
 }
 
 // http client is ready for a new request
@@ -1564,7 +2340,7 @@ static void dir_tree_file_remove_on_con_cb (gpointer client, gpointer ctx)
         LOG_err (DIR_TREE_LOG, INO_H"Entry not found !", INO_T (data->ino));
         if (data->file_remove_cb)
             data->file_remove_cb (data->req, FALSE);
-        g_free (data);
+        file_remove_data_destroy (data);
         return;
     }
 
@@ -1579,13 +2355,145 @@ static void dir_tree_file_remove_on_con_cb (gpointer client, gpointer ctx)
     );
     g_free (req_path);
 
-    if (!res) {
+    // dir_tree_file_remove_on_con_data_cb () is already called
+    if (!res)
         LOG_err (DIR_TREE_LOG, "Failed to create http request !");
-        data->file_remove_cb (data->req, FALSE);
+}
 
-        http_connection_release (con);
-        g_free (data);
+/*{{{ batched deletes */
+
+// unlinks are sent by Multi-Object Delete requests: an unlink is sent right away if no batch is in flight,
+// otherwise it waits for the batches in flight (but not longer than "s3.delete_batch_window"),
+// so concurrent unlinks (rm -rf of several processes, parallel cleanups) are gathered in batches,
+// and a single process is not delayed
+
+typedef struct {
+    DirTree *dtree;
+    GList *l_items; // FileRemoveData
+} DeleteBatch;
+
+static void dir_tree_deletes_send (DirTree *dtree);
+
+static void dir_tree_on_delete_batch_cb (gpointer ctx, gboolean success, GHashTable *h_failed)
+{
+    DeleteBatch *batch = (DeleteBatch *) ctx;
+    DirTree *dtree = batch->dtree;
+    GList *l;
+
+    dtree->delete_batches_inflight--;
+
+    for (l = g_list_first (batch->l_items); l; l = g_list_next (l)) {
+        FileRemoveData *data = (FileRemoveData *) l->data;
+        gboolean deleted = success;
+
+        // the request is sent, check if this object is in the list of errors
+        if (!deleted && h_failed) {
+            gchar *key = dir_tree_get_object_key (dtree, data->path);
+            deleted = !g_hash_table_lookup (h_failed, key);
+            g_free (key);
+        }
+
+        dir_tree_file_remove_done (data, deleted);
+    }
+    g_list_free (batch->l_items);
+    g_free (batch);
+
+    // send unlinks gathered while this batch was in flight
+    if (!g_queue_is_empty (dtree->q_deletes))
+        dir_tree_deletes_send (dtree);
+}
+
+// send all pending unlinks, by batches of DIR_TREE_MAX_DELETE_KEYS objects
+static void dir_tree_deletes_send (DirTree *dtree)
+{
+    evtimer_del (dtree->ev_deletes);
+
+    while (!g_queue_is_empty (dtree->q_deletes)) {
+        DeleteBatch *batch;
+        GList *l_paths = NULL;
+        guint i;
+
+        batch = g_new0 (DeleteBatch, 1);
+        batch->dtree = dtree;
+        for (i = 0; i < DIR_TREE_MAX_DELETE_KEYS && !g_queue_is_empty (dtree->q_deletes); i++) {
+            FileRemoveData *data = (FileRemoveData *) g_queue_pop_head (dtree->q_deletes);
+            batch->l_items = g_list_prepend (batch->l_items, data);
+            l_paths = g_list_prepend (l_paths, data->path);
+        }
+
+        LOG_debug (DIR_TREE_LOG, "Sending %u deletes, batches in flight: %u", i, dtree->delete_batches_inflight);
+
+        dtree->delete_batches_inflight++;
+        dir_tree_delete_objects (dtree, l_paths, dir_tree_on_delete_batch_cb, batch);
+        // paths are owned by FileRemoveData
+        g_list_free (l_paths);
+    }
+}
+
+static void dir_tree_on_deletes_timer_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short event, void *ctx)
+{
+    DirTree *dtree = (DirTree *) ctx;
+
+    dir_tree_deletes_send (dtree);
+}
+
+static void dir_tree_deletes_add (DirTree *dtree, FileRemoveData *data)
+{
+    guint window;
+    struct timeval tv;
+
+    g_queue_push_tail (dtree->q_deletes, data);
+
+    if (!dtree->delete_batches_inflight || g_queue_get_length (dtree->q_deletes) >= DIR_TREE_MAX_DELETE_KEYS) {
+        dir_tree_deletes_send (dtree);
+        return;
+    }
+
+    if (evtimer_pending (dtree->ev_deletes, NULL))
+        return;
+
+    window = conf_get_uint (application_get_conf (dtree->app), "s3.delete_batch_window");
+    tv.tv_sec = window / 1000;
+    tv.tv_usec = (window % 1000) * 1000;
+    evtimer_add (dtree->ev_deletes, &tv);
+}
+/*}}}*/
+
+// delete the object of the entry
+static void dir_tree_file_remove_send (FileRemoveData *data)
+{
+    DirEntry *en;
+
+    if (!conf_get_uint (application_get_conf (data->dtree->app), "s3.delete_batch_window")) {
+        if (!client_pool_get_client (application_get_ops_client_pool (data->dtree->app),
+            dir_tree_file_remove_on_con_cb, data)) {
+            LOG_err (DIR_TREE_LOG, INO_H"Failed to get PoolClient !", INO_T (data->ino));
+            if (data->file_remove_cb)
+                data->file_remove_cb (data->req, FALSE);
+            file_remove_data_destroy (data);
+        }
+        return;
+    }
+
+    en = g_hash_table_lookup (data->dtree->h_inodes, GUINT_TO_POINTER (data->ino));
+    if (!en) {
+        LOG_err (DIR_TREE_LOG, INO_H"Entry not found !", INO_T (data->ino));
+        if (data->file_remove_cb)
+            data->file_remove_cb (data->req, FALSE);
+        file_remove_data_destroy (data);
+        return;
     }
+
+    data->path = g_strdup (en->fullpath);
+    dir_tree_deletes_add (data->dtree, data);
+}
+
+// staged file upload is finished, remove the object from the server
+static void dir_tree_file_remove_on_flushed_cb (gpointer ctx, G_GNUC_UNUSED gboolean success)
+{
+    FileRemoveData *data = (FileRemoveData *) ctx;
+
+    dir_tree_file_remove_send (data);
 }
 
 // remove file
@@ -1621,13 +2529,20 @@ void dir_tree_file_remove (DirTree *dtree, fuse_ino_t ino, DirTree_file_remove_c
     data->file_remove_cb = file_remove_cb;
     data->req = req;
 
-    if (!client_pool_get_client (application_get_ops_client_pool (dtree->app),
-        dir_tree_file_remove_on_con_cb, data)) {
-        LOG_err (DIR_TREE_LOG, INO_H"Failed to get PoolClient !", INO_T (ino));
-        file_remove_cb (req, FALSE);
-        g_free (data);
-        return;
+    if (application_get_write_back (dtree->app)) {
+        WriteBack *wb = application_get_write_back (dtree->app);
+
+        // queued staged files are not needed anymore,
+        // but wait for the one which is being uploaded, otherwise it re-creates the object
+        write_back_discard (wb, en->fullpath);
+        if (write_back_is_staged (wb, en->fullpath)) {
+            LOG_debug (DIR_TREE_LOG, INO_H"Waiting for staged file upload: %s", INO_T (ino), en->fullpath);
+            write_back_flush (wb, en->fullpath, dir_tree_file_remove_on_flushed_cb, data);
+            return;
+        }
     }
+
+    dir_tree_file_remove_send (data);
 }
 
 void dir_tree_file_unlink (DirTree *dtree, fuse_ino_t parent_ino, const char *name,
@@ -1778,15 +2693,56 @@ typedef struct {
     char *newname;
     DirTree_rename_cb rename_cb;
     fuse_req_t req;
+
+    fuse_ino_t ino; // source entry
+
+    // directory rename
+    gchar *src_dir; // path of the source directory, with the trailing '/'
+    gchar *dst_dir; // path of the destination directory, with the trailing '/'
+    guint flushes_pending; // staged files of the directory which are being uploaded
+    GList *l_keys; // HttpConnectionKey, objects of the directory
+    GList *l_next_key; // the next object to copy
+    GList *l_copied; // gchar *, paths of the copied source objects
+    GList *l_delete; // gchar *, paths of the objects to delete
+    GList *l_next_delete; // the next object to delete
+    guint requests_inflight;
+    gboolean sending_requests;
+    gboolean copy_failed;
+    gboolean delete_failed;
 } RenameData;
 
 static void rename_data_destroy (RenameData *rdata)
 {
+    g_list_free_full (rdata->l_keys, (GDestroyNotify) http_connection_key_free);
+    g_list_free_full (rdata->l_copied, g_free);
+    g_list_free_full (rdata->l_delete, g_free);
+    g_free (rdata->src_dir);
+    g_free (rdata->dst_dir);
     g_free (rdata->name);
     g_free (rdata->newname);
     g_free (rdata);
 }
 
+static void dir_tree_rename_done (RenameData *rdata, gboolean success)
+{
+    if (rdata->rename_cb)
+        rdata->rename_cb (rdata->req, success);
+    rename_data_destroy (rdata);
+}
+
+// maximum number of copy (or delete) requests which are sent at once for each renamed entry,
+// limited by the number of "operations" connections
+static guint dir_tree_copy_max_requests (DirTree *dtree)
+{
+    guint max_requests;
+
+    max_requests = conf_get_uint (application_get_conf (dtree->app), "s3.copy_max_requests_inflight");
+    if (max_requests > (guint) client_pool_get_client_count (application_get_ops_client_pool (dtree->app)))
+        max_requests = client_pool_get_client_count (application_get_ops_client_pool (dtree->app));
+
+    return MAX (max_requests, 1);
+}
+
 /*{{{ delete object */
 
 static void dir_tree_on_rename_delete_cb (HttpConnection *con, gpointer ctx, gboolean success,
@@ -1897,137 +2853,994 @@ static void dir_tree_on_rename_delete_con_cb (gpointer client, gpointer ctx)
 /*}}}*/
 
 /*{{{ copy object */
-static void dir_tree_on_rename_copy_cb (HttpConnection *con, gpointer ctx, gboolean success,
-    G_GNUC_UNUSED const gchar *buf, G_GNUC_UNUSED size_t buf_len,
-    G_GNUC_UNUSED struct evkeyvalq *headers)
-{
-    RenameData *rdata = (RenameData *) ctx;
-    DirEntry *newparent_en;
-    DirEntry *en;
 
-    http_connection_release (con);
+// object is copied, or copy is failed
+typedef void (*DirTree_copy_cb) (gpointer ctx, gboolean success);
 
-    if (!success) {
-        LOG_err (DIR_TREE_LOG, "Failed to rename !");
-        if (rdata->rename_cb)
-            rdata->rename_cb (rdata->req, FALSE);
-        rename_data_destroy (rdata);
-        return;
+typedef struct {
+    DirTree *dtree;
+    fuse_ino_t ino; // for logging only, 0 if the object is not known
+    gchar *src_path; // "x-amz-copy-source" value
+    gchar *dst_path;
+    guint64 size;
+
+    // multipart copy
+    gchar *src_fname; // source object, its headers are requested by HEAD
+    GHashTable *h_headers; // header name -> value, metadata of the source object which is set on the copy
+    guint64 part_size;
+    guint parts_count;
+    gchar *uploadid;
+    gchar **part_etags; // parts_count elements
+    guint next_part; // number of the next part to copy, starting from 1
+    guint parts_inflight;
+    gboolean sending_parts;
+    gboolean copy_failed;
+
+    DirTree_copy_cb copy_cb;
+    gpointer ctx;
+} CopyData;
+
+typedef struct {
+    CopyData *cdata;
+    guint part_number;
+} CopyPart;
+
+static void copy_data_destroy (CopyData *cdata)
+{
+    guint i;
+
+    if (cdata->part_etags) {
+        for (i = 0; i < cdata->parts_count; i++)
+            g_free (cdata->part_etags[i]);
+        g_free (cdata->part_etags);
+    }
+    g_free (cdata->uploadid);
+    if (cdata->h_headers)
+        g_hash_table_destroy (cdata->h_headers);
+    g_free (cdata->src_fname);
+    g_free (cdata->src_path);
+    g_free (cdata->dst_path);
+    g_free (cdata);
+}
+
+static void dir_tree_copy_done (CopyData *cdata, gboolean success)
+{
+    if (cdata->copy_cb)
+        cdata->copy_cb (cdata->ctx, success);
+    copy_data_destroy (cdata);
+}
+
+static void dir_tree_on_copy_cb (HttpConnection *con, gpointer ctx, gboolean success,
+    const gchar *buf, size_t buf_len,
+    G_GNUC_UNUSED struct evkeyvalq *headers)
+{
+    CopyData *cdata = (CopyData *) ctx;
+    gchar *etag = NULL;
+
+    http_connection_release (con);
+
+    // a 200 OK response can contain an error, ETag is returned only on success
+    if (success)
+        etag = xml_get_value (buf, buf_len, "//s3:CopyObjectResult/s3:ETag");
+
+    if (!etag) {
+        LOG_err (DIR_TREE_LOG, INO_CON_H"Failed to copy %s to %s !", INO_T (cdata->ino), con, cdata->src_path, cdata->dst_path);
+        dir_tree_copy_done (cdata, FALSE);
+        return;
+    }
+    g_free (etag);
+
+    dir_tree_copy_done (cdata, TRUE);
+}
+
+static void dir_tree_on_copy_con_cb (gpointer client, gpointer ctx)
+{
+    HttpConnection *con = (HttpConnection *) client;
+    CopyData *cdata = (CopyData *) ctx;
+    gboolean res;
+
+    http_connection_acquire (con);
+
+    http_connection_add_output_header (con, "x-amz-copy-source", cdata->src_path);
+
+    http_connection_add_output_header (con, "x-amz-storage-class", conf_get_string (application_get_conf (cdata->dtree->app), "s3.storage_type"));
+
+    LOG_debug (DIR_TREE_LOG, INO_CON_H"Rename: coping %s to %s", INO_T (cdata->ino), con, cdata->src_path, cdata->dst_path);
+
+    res = http_connection_make_request (con,
+        cdata->dst_path, "PUT",
+        NULL, TRUE, NULL,
+        dir_tree_on_copy_cb,
+        cdata
+    );
+
+    // dir_tree_on_copy_cb () is already called
+    if (!res)
+        LOG_err (DIR_TREE_LOG, INO_CON_H"Failed to create http request !", INO_T (cdata->ino), con);
+}
+
+/*{{{ multipart copy */
+
+// abort is sent, the copy is failed anyway
+static void dir_tree_on_copy_abort_cb (HttpConnection *con, gpointer ctx, gboolean success,
+    G_GNUC_UNUSED const gchar *buf, G_GNUC_UNUSED size_t buf_len,
+    G_GNUC_UNUSED struct evkeyvalq *headers)
+{
+    CopyData *cdata = (CopyData *) ctx;
+
+    http_connection_release (con);
+
+    if (!success)
+        LOG_err (DIR_TREE_LOG, INO_CON_H"Failed to abort multipart copy: %s", INO_T (cdata->ino), con, cdata->dst_path);
+
+    dir_tree_copy_done (cdata, FALSE);
+}
+
+static void dir_tree_on_copy_abort_con_cb (gpointer client, gpointer ctx)
+{
+    HttpConnection *con = (HttpConnection *) client;
+    CopyData *cdata = (CopyData *) ctx;
+    gchar *path;
+    gboolean res;
+
+    http_connection_acquire (con);
+
+    path = g_strdup_printf ("%s?uploadId=%s", cdata->dst_path, cdata->uploadid);
+    res = http_connection_make_request (con,
+        path, "DELETE", NULL, TRUE, NULL,
+        dir_tree_on_copy_abort_cb,
+        cdata
+    );
+    g_free (path);
+
+    // dir_tree_on_copy_abort_cb () is already called
+    if (!res)
+        LOG_err (DIR_TREE_LOG, INO_CON_H"Failed to create http request !", INO_T (cdata->ino), con);
+}
+
+// remove already copied parts from the server
+static void dir_tree_copy_multipart_failed (CopyData *cdata)
+{
+    LOG_err (DIR_TREE_LOG, INO_H"Failed to copy %s to %s !", INO_T (cdata->ino), cdata->src_path, cdata->dst_path);
+
+    if (!cdata->uploadid) {
+        dir_tree_copy_done (cdata, FALSE);
+        return;
+    }
+
+    if (!client_pool_get_client (application_get_ops_client_pool (cdata->dtree->app),
+        dir_tree_on_copy_abort_con_cb, cdata)) {
+        LOG_err (DIR_TREE_LOG, INO_H"Failed to get HTTP client !", INO_T (cdata->ino));
+        dir_tree_copy_done (cdata, FALSE);
+        return;
+    }
+}
+
+static void dir_tree_on_copy_complete_cb (HttpConnection *con, gpointer ctx, gboolean success,
+    const gchar *buf, size_t buf_len,
+    G_GNUC_UNUSED struct evkeyvalq *headers)
+{
+    CopyData *cdata = (CopyData *) ctx;
+    gchar *etag;
+
+    http_connection_release (con);
+
+    if (!success) {
+        dir_tree_copy_multipart_failed (cdata);
+        return;
+    }
+
+    // a 200 OK response can contain an error, ETag is returned only on success
+    etag = xml_get_value (buf, buf_len, "//s3:ETag");
+    if (!etag) {
+        LOG_err (DIR_TREE_LOG, INO_CON_H"Failed to complete multipart copy !", INO_T (cdata->ino), con);
+        dir_tree_copy_multipart_failed (cdata);
+        return;
+    }
+    g_free (etag);
+
+    LOG_debug (DIR_TREE_LOG, INO_CON_H"Multipart copy is done: %s", INO_T (cdata->ino), con, cdata->dst_path);
+
+    dir_tree_copy_done (cdata, TRUE);
+}
+
+static void dir_tree_on_copy_complete_con_cb (gpointer client, gpointer ctx)
+{
+    HttpConnection *con = (HttpConnection *) client;
+    CopyData *cdata = (CopyData *) ctx;
+    struct evbuffer *xml_buf;
+    gchar *path;
+    gboolean res;
+    guint i;
+
+    xml_buf = evbuffer_new ();
+    evbuffer_add_printf (xml_buf, "%s", "<CompleteMultipartUpload>");
+    for (i = 0; i < cdata->parts_count; i++) {
+        evbuffer_add_printf (xml_buf,
+            "<Part><PartNumber>%u</PartNumber><ETag>\"%s\"</ETag></Part>",
+            i + 1, cdata->part_etags[i]);
+    }
+    evbuffer_add_printf (xml_buf, "%s", "</CompleteMultipartUpload>");
+
+    http_connection_acquire (con);
+
+    path = g_strdup_printf ("%s?uploadId=%s", cdata->dst_path, cdata->uploadid);
+    res = http_connection_make_request (con,
+        path, "POST", xml_buf, TRUE, NULL,
+        dir_tree_on_copy_complete_cb,
+        cdata
+    );
+    g_free (path);
+    evbuffer_free (xml_buf);
+
+    // dir_tree_on_copy_complete_cb () is already called
+    if (!res)
+        LOG_err (DIR_TREE_LOG, INO_CON_H"Failed to create http request !", INO_T (cdata->ino), con);
+}
+
+static void dir_tree_copy_parts (CopyData *cdata);
+
+static void dir_tree_on_copy_part_cb (HttpConnection *con, gpointer ctx, gboolean success,
+    const gchar *buf, size_t buf_len,
+    G_GNUC_UNUSED struct evkeyvalq *headers)
+{
+    CopyPart *cpart = (CopyPart *) ctx;
+    CopyData *cdata = cpart->cdata;
+    gchar *etag = NULL;
+
+    http_connection_release (con);
+    cdata->parts_inflight--;
+
+    // a 200 OK response can contain an error, ETag is returned only on success
+    if (success)
+        etag = xml_get_value (buf, buf_len, "//s3:CopyPartResult/s3:ETag");
+
+    if (!etag) {
+        LOG_err (DIR_TREE_LOG, INO_CON_H"Failed to copy part %u !", INO_T (cdata->ino), con, cpart->part_number);
+        cdata->copy_failed = TRUE;
+    } else {
+        cdata->part_etags[cpart->part_number - 1] = str_remove_quotes (etag);
+    }
+
+    g_free (cpart);
+    dir_tree_copy_parts (cdata);
+}
+
+static void dir_tree_on_copy_part_con_cb (gpointer client, gpointer ctx)
+{
+    HttpConnection *con = (HttpConnection *) client;
+    CopyPart *cpart = (CopyPart *) ctx;
+    CopyData *cdata = cpart->cdata;
+    guint64 first, last;
+    gchar *range;
+    gchar *path;
+    gboolean res;
+
+    first = (guint64) (cpart->part_number - 1) * cdata->part_size;
+    last = MIN (first + cdata->part_size, cdata->size) - 1;
+
+    http_connection_acquire (con);
+
+    http_connection_add_output_header (con, "x-amz-copy-source", cdata->src_path);
+    range = g_strdup_printf ("bytes=%"G_GUINT64_FORMAT"-%"G_GUINT64_FORMAT, first, last);
+    http_connection_add_output_header (con, "x-amz-copy-source-range", range);
+    g_free (range);
+
+    LOG_debug (DIR_TREE_LOG, INO_CON_H"Copying part %u [%"G_GUINT64_FORMAT" - %"G_GUINT64_FORMAT"] of %s",
+        INO_T (cdata->ino), con, cpart->part_number, first, last, cdata->src_path);
+
+    path = g_strdup_printf ("%s?partNumber=%u&uploadId=%s",
+        cdata->dst_path, cpart->part_number, cdata->uploadid);
+    res = http_connection_make_request (con,
+        path, "PUT", NULL, TRUE, NULL,
+        dir_tree_on_copy_part_cb,
+        cpart
+    );
+    g_free (path);
+
+    // dir_tree_on_copy_part_cb () is already called
+    if (!res)
+        LOG_err (DIR_TREE_LOG, INO_CON_H"Failed to create http request !", INO_T (cdata->ino), con);
+}
+
+// copy the next parts using several connections, complete the upload when all parts are copied
+static void dir_tree_copy_parts (CopyData *cdata)
+{
+    CopyPart *cpart;
+
+    // a part might be completed while the next ones are being requested
+    if (cdata->sending_parts)
+        return;
+
+    cdata->sending_parts = TRUE;
+    while (!cdata->copy_failed && cdata->next_part <= cdata->parts_count &&
+        cdata->parts_inflight < dir_tree_copy_max_requests (cdata->dtree)) {
+
+        cpart = g_new0 (CopyPart, 1);
+        cpart->cdata = cdata;
+        cpart->part_number = cdata->next_part++;
+        cdata->parts_inflight++;
+
+        if (!client_pool_get_client (application_get_ops_client_pool (cdata->dtree->app),
+            dir_tree_on_copy_part_con_cb, cpart)) {
+            LOG_err (DIR_TREE_LOG, INO_H"Failed to get HTTP client !", INO_T (cdata->ino));
+            cdata->parts_inflight--;
+            cdata->copy_failed = TRUE;
+            g_free (cpart);
+        }
+    }
+    cdata->sending_parts = FALSE;
+
+    // wait for the parts in flight
+    if (cdata->parts_inflight)
+        return;
+
+    if (cdata->copy_failed) {
+        dir_tree_copy_multipart_failed (cdata);
+        return;
+    }
+
+    if (!client_pool_get_client (application_get_ops_client_pool (cdata->dtree->app),
+        dir_tree_on_copy_complete_con_cb, cdata)) {
+        LOG_err (DIR_TREE_LOG, INO_H"Failed to get HTTP client !", INO_T (cdata->ino));
+        dir_tree_copy_multipart_failed (cdata);
+        return;
+    }
+}
+
+static void dir_tree_on_copy_init_cb (HttpConnection *con, gpointer ctx, gboolean success,
+    const gchar *buf, size_t buf_len,
+    G_GNUC_UNUSED struct evkeyvalq *headers)
+{
+    CopyData *cdata = (CopyData *) ctx;
+
+    http_connection_release (con);
+
+    if (!success) {
+        dir_tree_copy_multipart_failed (cdata);
+        return;
+    }
+
+    cdata->uploadid = xml_get_value (buf, buf_len, "//s3:UploadId");
+    if (!cdata->uploadid) {
+        LOG_err (DIR_TREE_LOG, INO_CON_H"Failed to parse multipart init data !", INO_T (cdata->ino), con);
+        dir_tree_copy_multipart_failed (cdata);
+        return;
+    }
+
+    cdata->part_etags = g_new0 (gchar *, cdata->parts_count);
+    cdata->next_part = 1;
+    dir_tree_copy_parts (cdata);
+}
+
+static void dir_tree_on_copy_init_con_cb (gpointer client, gpointer ctx)
+{
+    HttpConnection *con = (HttpConnection *) client;
+    CopyData *cdata = (CopyData *) ctx;
+    gchar *path;
+    gboolean res;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    http_connection_acquire (con);
+
+    http_connection_add_output_header (con, "x-amz-storage-class", conf_get_string (application_get_conf (cdata->dtree->app), "s3.storage_type"));
+
+    // UploadPartCopy doesn't copy metadata, it's set when the upload is initiated
+    g_hash_table_iter_init (&iter, cdata->h_headers);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        http_connection_add_output_header (con, (const gchar *) key, (const gchar *) value);
+
+    LOG_debug (DIR_TREE_LOG, INO_CON_H"Rename: copying %s to %s by %u parts", INO_T (cdata->ino), con,
+        cdata->src_path, cdata->dst_path, cdata->parts_count);
+
+    path = g_strdup_printf ("%s?uploads", cdata->dst_path);
+    res = http_connection_make_request (con,
+        path, "POST", NULL, TRUE, NULL,
+        dir_tree_on_copy_init_cb,
+        cdata
+    );
+    g_free (path);
+
+    // dir_tree_on_copy_init_cb () is already called
+    if (!res)
+        LOG_err (DIR_TREE_LOG, INO_CON_H"Failed to create http request !", INO_T (cdata->ino), con);
+}
+
+// headers of the source object are received, initiate the upload with the same metadata
+static void dir_tree_on_copy_head_cb (HttpConnection *con, gpointer ctx, gboolean success,
+    G_GNUC_UNUSED const gchar *buf, G_GNUC_UNUSED size_t buf_len,
+    struct evkeyvalq *headers)
+{
+    CopyData *cdata = (CopyData *) ctx;
+    struct evkeyval *header;
+
+    http_connection_release (con);
+
+    if (!success || !headers) {
+        LOG_err (DIR_TREE_LOG, INO_CON_H"Failed to get headers of %s !", INO_T (cdata->ino), con, cdata->src_fname);
+        dir_tree_copy_multipart_failed (cdata);
+        return;
+    }
+
+    cdata->h_headers = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    TAILQ_FOREACH (header, headers, next) {
+        if (!g_ascii_strncasecmp (header->key, "x-amz-meta-", strlen ("x-amz-meta-")) ||
+            !g_ascii_strcasecmp (header->key, "Content-Type") ||
+            !g_ascii_strcasecmp (header->key, "Cache-Control") ||
+            !g_ascii_strcasecmp (header->key, "Content-Encoding") ||
+            !g_ascii_strcasecmp (header->key, "Content-Disposition"))
+            g_hash_table_replace (cdata->h_headers, g_strdup (header->key), g_strdup (header->value));
+    }
+
+    if (!client_pool_get_client (application_get_ops_client_pool (cdata->dtree->app),
+        dir_tree_on_copy_init_con_cb, cdata)) {
+        LOG_err (DIR_TREE_LOG, INO_H"Failed to get HTTP client !", INO_T (cdata->ino));
+        dir_tree_copy_multipart_failed (cdata);
+        return;
+    }
+}
+
+static void dir_tree_on_copy_head_con_cb (gpointer client, gpointer ctx)
+{
+    HttpConnection *con = (HttpConnection *) client;
+    CopyData *cdata = (CopyData *) ctx;
+    gboolean res;
+
+    http_connection_acquire (con);
+
+    res = http_connection_make_request (con,
+        cdata->src_fname, "HEAD", NULL, TRUE, NULL,
+        dir_tree_on_copy_head_cb,
+        cdata
+    );
+
+    // dir_tree_on_copy_head_cb () is already called
+    if (!res)
+        LOG_err (DIR_TREE_LOG, INO_CON_H"Failed to create http request !", INO_T (cdata->ino), con);
+}
+
+// size of a single copied range, the number of parts is limited to DIR_TREE_MAX_COPY_PARTS
+static guint64 dir_tree_copy_part_size (DirTree *dtree, guint64 size)
+{
+    guint64 part_size;
+
+    part_size = conf_get_uint (application_get_conf (dtree->app), "s3.copy_part_size");
+    part_size = MAX (part_size, DIR_TREE_MIN_COPY_PART_SIZE);
+
+    if (size > part_size * DIR_TREE_MAX_COPY_PARTS)
+        part_size = (size + DIR_TREE_MAX_COPY_PARTS - 1) / DIR_TREE_MAX_COPY_PARTS;
+
+    return MIN (part_size, FIVEG);
+}
+/*}}}*/
+
+// server-side copy of "src" object of "size" bytes to "dst" (paths are relative to "s3.key_prefix"),
+// objects larger than "s3.copy_part_size" are copied by ranges in parallel (UploadPartCopy),
+// a single copy request is limited to 5 GB anyway
+// metadata of the source object is requested first, multipart copy doesn't preserve it
+static void dir_tree_copy_object (DirTree *dtree, fuse_ino_t ino, const gchar *src, const gchar *dst, guint64 size,
+    DirTree_copy_cb copy_cb, gpointer ctx)
+{
+    ClientPool_on_client_ready on_con_cb;
+    CopyData *cdata;
+    gchar *key;
+
+    cdata = g_new0 (CopyData, 1);
+    cdata->dtree = dtree;
+    cdata->ino = ino;
+    cdata->size = size;
+    cdata->copy_cb = copy_cb;
+    cdata->ctx = ctx;
+
+    key = dir_tree_get_object_key (dtree, src);
+    cdata->src_path = g_strdup_printf ("%s/%s", conf_get_string (application_get_conf (dtree->app), "s3.bucket_name"), key);
+    g_free (key);
+    cdata->dst_path = g_strdup_printf ("/%s", dst);
+
+    cdata->part_size = dir_tree_copy_part_size (dtree, size);
+    if (size > cdata->part_size) {
+        cdata->parts_count = (size + cdata->part_size - 1) / cdata->part_size;
+        cdata->src_fname = g_strdup_printf ("/%s", src);
+        on_con_cb = dir_tree_on_copy_head_con_cb;
+    } else {
+        on_con_cb = dir_tree_on_copy_con_cb;
+    }
+
+    if (!client_pool_get_client (application_get_ops_client_pool (dtree->app),
+        on_con_cb, cdata)) {
+        LOG_err (DIR_TREE_LOG, INO_H"Failed to get HTTP client !", INO_T (ino));
+        dir_tree_copy_done (cdata, FALSE);
+        return;
+    }
+}
+/*}}}*/
+
+/*{{{ rename file */
+
+// object is copied, update the new entry and delete the source object
+static void dir_tree_on_rename_copied_cb (gpointer ctx, gboolean success)
+{
+    RenameData *rdata = (RenameData *) ctx;
+    DirEntry *newparent_en;
+    DirEntry *en;
+
+    if (!success) {
+        LOG_err (DIR_TREE_LOG, "Failed to rename !");
+        dir_tree_rename_done (rdata, FALSE);
+        return;
+    }
+
+    // Update new entry
+    newparent_en = g_hash_table_lookup (rdata->dtree->h_inodes, GUINT_TO_POINTER (rdata->newparent_ino));
+    if (!newparent_en || newparent_en->type != DET_dir) {
+        LOG_err (DIR_TREE_LOG, INO_H"Entry not found !", INO_T (rdata->newparent_ino));
+        dir_tree_rename_done (rdata, FALSE);
+        return;
+    }
+
+    en = g_hash_table_lookup (newparent_en->h_dir_tree, rdata->newname);
+    if (!en) {
+        LOG_debug (DIR_TREE_LOG, "Entry '%s' not found, parent_ino: %"INO_FMT, rdata->newname, INO rdata->newparent_ino);
+        dir_tree_rename_done (rdata, FALSE);
+        return;
+    }
+
+    en->removed = FALSE;
+    en->access_time = time (NULL);
+
+    // inform the parent that his dir cache is no longer up-to-dated
+    dir_tree_entry_modified (rdata->dtree, newparent_en);
+
+    //XXX: reuse file_delete code
+    if (!client_pool_get_client (application_get_ops_client_pool (rdata->dtree->app),
+        dir_tree_on_rename_delete_con_cb, rdata)) {
+        LOG_debug (DIR_TREE_LOG, "Failed to get HTTPPool !");
+        dir_tree_rename_done (rdata, FALSE);
+        return;
+    }
+}
+
+// copy source object to the new location
+static void dir_tree_rename_file (RenameData *rdata)
+{
+    DirEntry *en;
+    DirEntry *parent_en;
+    DirEntry *newparent_en;
+    gchar *dst;
+
+    parent_en = g_hash_table_lookup (rdata->dtree->h_inodes, GUINT_TO_POINTER (rdata->parent_ino));
+    if (!parent_en || parent_en->type != DET_dir) {
+        LOG_err (DIR_TREE_LOG, INO_H"Entry not found !", INO_T (rdata->parent_ino));
+        dir_tree_rename_done (rdata, FALSE);
+        return;
+    }
+
+    en = g_hash_table_lookup (parent_en->h_dir_tree, rdata->name);
+    if (!en) {
+        LOG_debug (DIR_TREE_LOG, "Entry '%s' not found, parent_ino: %"INO_FMT, rdata->name, INO rdata->parent_ino);
+        dir_tree_rename_done (rdata, FALSE);
+        return;
+    }
+
+    newparent_en = g_hash_table_lookup (rdata->dtree->h_inodes, GUINT_TO_POINTER (rdata->newparent_ino));
+    if (!newparent_en || newparent_en->type != DET_dir) {
+        LOG_err (DIR_TREE_LOG, INO_H"Entry not found !", INO_T (rdata->newparent_ino));
+        dir_tree_rename_done (rdata, FALSE);
+        return;
+    }
+
+    if (rdata->newparent_ino == FUSE_ROOT_ID)
+        dst = g_strdup (rdata->newname);
+    else
+        dst = g_strdup_printf ("%s/%s", newparent_en->fullpath, rdata->newname);
+
+    dir_tree_copy_object (rdata->dtree, en->ino, en->fullpath, dst, en->size,
+        dir_tree_on_rename_copied_cb, rdata);
+    g_free (dst);
+}
+
+// staged source file is uploaded, copy it now
+static void dir_tree_on_rename_flushed_cb (gpointer ctx, gboolean success)
+{
+    RenameData *rdata = (RenameData *) ctx;
+
+    if (!success) {
+        LOG_err (DIR_TREE_LOG, "Failed to upload staged file: %s", rdata->name);
+        dir_tree_rename_done (rdata, FALSE);
+        return;
+    }
+
+    dir_tree_rename_file (rdata);
+}
+/*}}}*/
+
+/*{{{ rename directory */
+
+// there is no rename operation in S3: every object of the directory is copied to the new prefix
+// (several objects at once), source objects are deleted by Multi-Object Delete requests,
+// and the DirTree subtree is moved to the new parent
+
+typedef struct {
+    RenameData *rdata;
+    gchar *src;
+} RenameObject;
+
+// update "fullpath" of the entry and all its descendants
+static void dir_tree_entry_update_fullpath (DirEntry *en, DirEntry *parent_en)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    g_free (en->fullpath);
+    if (parent_en->ino == FUSE_ROOT_ID)
+        en->fullpath = g_strdup (en->basename);
+    else
+        en->fullpath = g_strdup_printf ("%s/%s", parent_en->fullpath, en->basename);
+
+    if (en->type != DET_dir)
+        return;
+
+    g_hash_table_iter_init (&iter, en->h_dir_tree);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+        dir_tree_entry_update_fullpath ((DirEntry *) value, en);
+}
+
+// move directory entry to the new parent under the new name, inodes of the subtree are preserved
+static gboolean dir_tree_rename_dir_move (RenameData *rdata)
+{
+    DirEntry *en;
+    DirEntry *parent_en;
+    DirEntry *newparent_en;
+    gpointer orig_key;
+    gpointer value;
+
+    parent_en = g_hash_table_lookup (rdata->dtree->h_inodes, GUINT_TO_POINTER (rdata->parent_ino));
+    newparent_en = g_hash_table_lookup (rdata->dtree->h_inodes, GUINT_TO_POINTER (rdata->newparent_ino));
+    if (!parent_en || parent_en->type != DET_dir || !newparent_en || newparent_en->type != DET_dir) {
+        LOG_err (DIR_TREE_LOG, INO_H"Parent entry not found !", INO_T (rdata->ino));
+        return FALSE;
+    }
+
+    if (!g_hash_table_lookup_extended (parent_en->h_dir_tree, rdata->name, &orig_key, &value) ||
+        ((DirEntry *) value)->ino != rdata->ino) {
+        LOG_err (DIR_TREE_LOG, INO_H"Entry '%s' not found !", INO_T (rdata->ino), rdata->name);
+        dir_tree_entry_modified (rdata->dtree, parent_en);
+        dir_tree_entry_modified (rdata->dtree, newparent_en);
+        return FALSE;
+    }
+
+    // an entry with the same name was created during the rename, let the next listing sort it out
+    if (g_hash_table_lookup (newparent_en->h_dir_tree, rdata->newname)) {
+        LOG_err (DIR_TREE_LOG, INO_H"Entry '%s' already exists !", INO_T (rdata->newparent_ino), rdata->newname);
+        dir_tree_entry_modified (rdata->dtree, parent_en);
+        dir_tree_entry_modified (rdata->dtree, newparent_en);
+        return FALSE;
+    }
+
+    en = (DirEntry *) value;
+
+    // parent's hash table owns the key
+    g_hash_table_steal (parent_en->h_dir_tree, rdata->name);
+    g_free (orig_key);
+
+    g_free (en->basename);
+    en->basename = g_strdup (rdata->newname);
+    en->parent_ino = rdata->newparent_ino;
+    en->age = newparent_en->age;
+    en->access_time = time (NULL);
+    g_hash_table_insert (newparent_en->h_dir_tree, g_strdup (en->basename), en);
+
+    dir_tree_entry_update_fullpath (en, newparent_en);
+
+    dir_tree_entry_modified (rdata->dtree, parent_en);
+    dir_tree_entry_modified (rdata->dtree, newparent_en);
+
+    return TRUE;
+}
+
+// all objects are deleted (or failed to delete)
+static void dir_tree_rename_dir_deleted (RenameData *rdata)
+{
+    // copied objects are removed, sources are untouched
+    if (rdata->copy_failed) {
+        LOG_err (DIR_TREE_LOG, INO_H"Failed to rename directory %s to %s !", INO_T (rdata->ino), rdata->src_dir, rdata->dst_dir);
+        dir_tree_rename_done (rdata, FALSE);
+        return;
+    }
+
+    // objects are at the new location already, some of the source objects might be left
+    if (rdata->delete_failed)
+        LOG_err (DIR_TREE_LOG, INO_H"Failed to delete source objects of %s !", INO_T (rdata->ino), rdata->src_dir);
+
+    if (!dir_tree_rename_dir_move (rdata)) {
+        dir_tree_rename_done (rdata, FALSE);
+        return;
+    }
+
+    LOG_debug (DIR_TREE_LOG, INO_H"Directory %s is renamed to %s", INO_T (rdata->ino), rdata->src_dir, rdata->dst_dir);
+
+    dir_tree_rename_done (rdata, !rdata->delete_failed);
+}
+
+static void dir_tree_rename_dir_delete_next (RenameData *rdata);
+
+static void dir_tree_on_rename_dir_deleted_cb (gpointer ctx, gboolean success, G_GNUC_UNUSED GHashTable *h_failed)
+{
+    RenameData *rdata = (RenameData *) ctx;
+
+    rdata->requests_inflight--;
+    if (!success)
+        rdata->delete_failed = TRUE;
+
+    dir_tree_rename_dir_delete_next (rdata);
+}
+
+// delete "l_delete" objects by batches, several batches at once
+static void dir_tree_rename_dir_delete_next (RenameData *rdata)
+{
+    // a batch might be completed while the next ones are being requested
+    if (rdata->sending_requests)
+        return;
+
+    rdata->sending_requests = TRUE;
+    while (rdata->l_next_delete && rdata->requests_inflight < dir_tree_copy_max_requests (rdata->dtree)) {
+        GList *l_batch = NULL;
+        guint i;
+
+        for (i = 0; i < DIR_TREE_MAX_DELETE_KEYS && rdata->l_next_delete; i++) {
+            l_batch = g_list_prepend (l_batch, rdata->l_next_delete->data);
+            rdata->l_next_delete = g_list_next (rdata->l_next_delete);
+        }
+
+        rdata->requests_inflight++;
+        dir_tree_delete_objects (rdata->dtree, l_batch, dir_tree_on_rename_dir_deleted_cb, rdata);
+        // paths are owned by "l_delete"
+        g_list_free (l_batch);
+    }
+    rdata->sending_requests = FALSE;
+
+    // wait for the batches in flight
+    if (rdata->requests_inflight)
+        return;
+
+    dir_tree_rename_dir_deleted (rdata);
+}
+
+// all objects are copied (or failed to copy)
+static void dir_tree_rename_dir_copied (RenameData *rdata)
+{
+    GList *l;
+
+    if (rdata->copy_failed) {
+        // remove copies, the source directory is left as it was
+        LOG_err (DIR_TREE_LOG, INO_H"Failed to copy objects of %s, removing %u copied objects",
+            INO_T (rdata->ino), rdata->src_dir, g_list_length (rdata->l_copied));
+
+        for (l = g_list_first (rdata->l_copied); l; l = g_list_next (l)) {
+            const gchar *src = (const gchar *) l->data;
+            rdata->l_delete = g_list_prepend (rdata->l_delete,
+                g_strdup_printf ("%s%s", rdata->dst_dir, src + strlen (rdata->src_dir)));
+        }
+        g_list_free_full (rdata->l_copied, g_free);
+    } else {
+        rdata->l_delete = rdata->l_copied;
+    }
+    rdata->l_copied = NULL;
+
+    rdata->l_next_delete = rdata->l_delete;
+    dir_tree_rename_dir_delete_next (rdata);
+}
+
+static void dir_tree_rename_dir_copy_next (RenameData *rdata);
+
+static void dir_tree_on_rename_dir_copied_cb (gpointer ctx, gboolean success)
+{
+    RenameObject *robj = (RenameObject *) ctx;
+    RenameData *rdata = robj->rdata;
+
+    rdata->requests_inflight--;
+
+    if (success) {
+        rdata->l_copied = g_list_prepend (rdata->l_copied, robj->src);
+    } else {
+        rdata->copy_failed = TRUE;
+        g_free (robj->src);
     }
+    g_free (robj);
 
-    //XXX: a 200 OK response can contain either a success or an error
+    dir_tree_rename_dir_copy_next (rdata);
+}
 
-    // Update new entry
-    newparent_en = g_hash_table_lookup (rdata->dtree->h_inodes, GUINT_TO_POINTER (rdata->newparent_ino));
-    if (!newparent_en || newparent_en->type != DET_dir) {
-        LOG_err (DIR_TREE_LOG, INO_H"Entry not found !", INO_T (rdata->newparent_ino));
-        if (rdata->rename_cb)
-            rdata->rename_cb (rdata->req, FALSE);
-        rename_data_destroy (rdata);
+// copy the next objects of the directory, several objects at once
+static void dir_tree_rename_dir_copy_next (RenameData *rdata)
+{
+    // an object might be copied while the next ones are being requested
+    if (rdata->sending_requests)
         return;
+
+    rdata->sending_requests = TRUE;
+    while (!rdata->copy_failed && rdata->l_next_key &&
+        rdata->requests_inflight < dir_tree_copy_max_requests (rdata->dtree)) {
+        HttpConnectionKey *obj = (HttpConnectionKey *) rdata->l_next_key->data;
+        RenameObject *robj;
+        gchar *dst;
+
+        rdata->l_next_key = g_list_next (rdata->l_next_key);
+
+        // objects are listed by the directory prefix
+        if (strncmp (obj->key, rdata->src_dir, strlen (rdata->src_dir)))
+            continue;
+
+        robj = g_new0 (RenameObject, 1);
+        robj->rdata = rdata;
+        robj->src = g_strdup (obj->key);
+        dst = g_strdup_printf ("%s%s", rdata->dst_dir, obj->key + strlen (rdata->src_dir));
+
+        rdata->requests_inflight++;
+        dir_tree_copy_object (rdata->dtree, 0, robj->src, dst, obj->size,
+            dir_tree_on_rename_dir_copied_cb, robj);
+        g_free (dst);
     }
+    rdata->sending_requests = FALSE;
 
-    en = g_hash_table_lookup (newparent_en->h_dir_tree, rdata->newname);
-    if (!en) {
-        LOG_debug (DIR_TREE_LOG, "Entry '%s' not found, parent_ino: %"INO_FMT, rdata->newname, INO rdata->newparent_ino);
-        if (rdata->rename_cb)
-            rdata->rename_cb (rdata->req, FALSE);
-        rename_data_destroy (rdata);
+    // wait for the objects in flight
+    if (rdata->requests_inflight)
         return;
-    }
 
-    en->removed = FALSE;
-    en->access_time = time (NULL);
+    dir_tree_rename_dir_copied (rdata);
+}
 
-    // inform the parent that his dir cache is no longer up-to-dated
-    dir_tree_entry_modified (rdata->dtree, newparent_en);
+static void dir_tree_on_rename_dir_listed_cb (gpointer ctx, gboolean success, GList *l_keys)
+{
+    RenameData *rdata = (RenameData *) ctx;
 
-    //XXX: reuse file_delete code
-    if (!client_pool_get_client (application_get_ops_client_pool (rdata->dtree->app),
-        dir_tree_on_rename_delete_con_cb, rdata)) {
-        LOG_debug (DIR_TREE_LOG, "Failed to get HTTPPool !");
-        if (rdata->rename_cb)
-           rdata->rename_cb (rdata->req, FALSE);
-        rename_data_destroy (rdata);
+    if (!success) {
+        LOG_err (DIR_TREE_LOG, INO_H"Failed to get the list of objects of %s !", INO_T (rdata->ino), rdata->src_dir);
+        dir_tree_rename_done (rdata, FALSE);
         return;
     }
+
+    LOG_debug (DIR_TREE_LOG, INO_H"Rename: copying %u objects of %s to %s", INO_T (rdata->ino),
+        g_list_length (l_keys), rdata->src_dir, rdata->dst_dir);
+
+    rdata->l_keys = l_keys;
+    rdata->l_next_key = l_keys;
+    dir_tree_rename_dir_copy_next (rdata);
 }
 
-static void dir_tree_on_rename_copy_con_cb (gpointer client, gpointer ctx)
+static void dir_tree_on_rename_dir_list_con_cb (gpointer client, gpointer ctx)
 {
     HttpConnection *con = (HttpConnection *) client;
     RenameData *rdata = (RenameData *) ctx;
-    gchar *dst_path = NULL;
-    gchar *src_path = NULL;
-    gchar *key_prefix = conf_get_string(application_get_conf (rdata->dtree->app), "s3.key_prefix" );
-    gboolean res;
-    DirEntry *en;
-    DirEntry *parent_en;
-    DirEntry *newparent_en;
 
-    parent_en = g_hash_table_lookup (rdata->dtree->h_inodes, GUINT_TO_POINTER (rdata->parent_ino));
-    if (!parent_en || parent_en->type != DET_dir) {
-        LOG_err (DIR_TREE_LOG, INO_H"Entry not found !", INO_T (rdata->parent_ino));
-        if (rdata->rename_cb)
-            rdata->rename_cb (rdata->req, FALSE);
-        rename_data_destroy (rdata);
+    http_connection_get_key_listing (con, rdata->src_dir, dir_tree_on_rename_dir_listed_cb, rdata);
+}
+
+// staged files of the directory are uploaded, get the list of objects
+static void dir_tree_on_rename_dir_flushed_cb (gpointer ctx, gboolean success)
+{
+    RenameData *rdata = (RenameData *) ctx;
+
+    if (!success)
+        rdata->copy_failed = TRUE;
+
+    if (--rdata->flushes_pending)
+        return;
+
+    if (rdata->copy_failed) {
+        LOG_err (DIR_TREE_LOG, INO_H"Failed to upload staged files of %s !", INO_T (rdata->ino), rdata->src_dir);
+        dir_tree_rename_done (rdata, FALSE);
         return;
     }
 
-    en = g_hash_table_lookup (parent_en->h_dir_tree, rdata->name);
-    if (!en) {
-        LOG_debug (DIR_TREE_LOG, "Entry '%s' not found, parent_ino: %"INO_FMT, rdata->name, INO rdata->parent_ino);
-        if (rdata->rename_cb)
-            rdata->rename_cb (rdata->req, FALSE);
-        rename_data_destroy (rdata);
+    if (!client_pool_get_client (application_get_ops_client_pool (rdata->dtree->app),
+        dir_tree_on_rename_dir_list_con_cb, rdata)) {
+        LOG_err (DIR_TREE_LOG, INO_H"Failed to get HTTP client !", INO_T (rdata->ino));
+        dir_tree_rename_done (rdata, FALSE);
         return;
     }
+}
 
-    newparent_en = g_hash_table_lookup (rdata->dtree->h_inodes, GUINT_TO_POINTER (rdata->newparent_ino));
-    if (!newparent_en || newparent_en->type != DET_dir) {
-        LOG_err (DIR_TREE_LOG, INO_H"Entry not found !", INO_T (rdata->newparent_ino));
-        if (rdata->rename_cb)
-            rdata->rename_cb (rdata->req, FALSE);
-        rename_data_destroy (rdata);
+// collect paths of the staged files of the directory
+static void dir_tree_entry_get_staged (DirTree *dtree, DirEntry *en, GList **l_paths)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    if (en->type != DET_dir) {
+        if (dir_tree_entry_is_staged (dtree, en))
+            *l_paths = g_list_prepend (*l_paths, g_strdup (en->fullpath));
         return;
     }
 
-    http_connection_acquire (con);
+    g_hash_table_iter_init (&iter, en->h_dir_tree);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+        dir_tree_entry_get_staged (dtree, (DirEntry *) value, l_paths);
+}
 
-    // source
-    if( strlen(key_prefix) )
-	    src_path = g_strdup_printf ("%s%s%s", conf_get_string (application_get_conf (rdata->dtree->app), "s3.bucket_name"), key_prefix, en->fullpath);
-    else
-	    src_path = g_strdup_printf ("%s/%s", conf_get_string (application_get_conf (rdata->dtree->app), "s3.bucket_name"), en->fullpath);
+// files, which are opened for writing, would be uploaded under the old path after the directory is moved
+gboolean dir_tree_rename_is_busy (DirTree *dtree, fuse_ino_t parent_ino, const char *name)
+{
+    DirEntry *parent_en, *en;
+    GHashTableIter iter;
+    gpointer value;
+    gchar *src_dir;
+    gboolean busy = FALSE;
 
-    http_connection_add_output_header (con, "x-amz-copy-source", src_path);
+    parent_en = g_hash_table_lookup (dtree->h_inodes, GUINT_TO_POINTER (parent_ino));
+    if (!parent_en || parent_en->type != DET_dir)
+        return FALSE;
 
-    http_connection_add_output_header (con, "x-amz-storage-class", conf_get_string (application_get_conf (rdata->dtree->app), "s3.storage_type"));
+    en = g_hash_table_lookup (parent_en->h_dir_tree, name);
+    if (!en || en->type != DET_dir)
+        return FALSE;
 
-    if (rdata->newparent_ino == FUSE_ROOT_ID)
-        dst_path = g_strdup_printf ("%s/%s", newparent_en->fullpath, rdata->newname);
-    else
-        dst_path = g_strdup_printf ("/%s/%s", newparent_en->fullpath, rdata->newname);
+    src_dir = g_strdup_printf ("%s/", en->fullpath);
+    g_hash_table_iter_init (&iter, dtree->h_writers);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        DirEntry *file_en = g_hash_table_lookup (dtree->h_inodes, value);
 
-    LOG_debug (DIR_TREE_LOG, INO_CON_H"Rename: coping %s (%s) to %s", INO_T (en->ino), con, en->fullpath, src_path, dst_path);
-    g_free (src_path);
+        if (file_en && g_str_has_prefix (file_en->fullpath, src_dir)) {
+            LOG_msg (DIR_TREE_LOG, INO_H"Can't rename directory %s, file %s is opened for writing !",
+                INO_T (en->ino), en->fullpath, file_en->fullpath);
+            busy = TRUE;
+            break;
+        }
+    }
+    g_free (src_dir);
 
-    res = http_connection_make_request (con,
-        dst_path, "PUT",
-        NULL, TRUE, NULL,
-        dir_tree_on_rename_copy_cb,
-        rdata
-    );
-    g_free (dst_path);
+    return busy;
+}
 
-    if (!res) {
-        LOG_err (DIR_TREE_LOG, "Failed to create http request !");
-        if (rdata->rename_cb)
-            rdata->rename_cb (rdata->req, FALSE);
-        http_connection_release (con);
-        rename_data_destroy (rdata);
+static void dir_tree_rename_dir (RenameData *rdata, DirEntry *en, DirEntry *newparent_en)
+{
+    GList *l_paths = NULL;
+    GList *l;
+    DirEntry *tmp_en;
+
+    // directory can't be moved into itself
+    for (tmp_en = newparent_en; tmp_en; tmp_en = g_hash_table_lookup (rdata->dtree->h_inodes, GUINT_TO_POINTER (tmp_en->parent_ino))) {
+        if (tmp_en->ino == en->ino) {
+            LOG_err (DIR_TREE_LOG, INO_H"Can't move directory %s into itself !", INO_T (en->ino), en->fullpath);
+            dir_tree_rename_done (rdata, FALSE);
+            return;
+        }
+        if (tmp_en->ino == FUSE_ROOT_ID)
+            break;
+    }
+
+    // directories are not merged
+    if (g_hash_table_lookup (newparent_en->h_dir_tree, rdata->newname)) {
+        LOG_err (DIR_TREE_LOG, INO_H"Entry '%s' already exists !", INO_T (newparent_en->ino), rdata->newname);
+        dir_tree_rename_done (rdata, FALSE);
         return;
     }
+
+    rdata->ino = en->ino;
+    rdata->src_dir = g_strdup_printf ("%s/", en->fullpath);
+    if (newparent_en->ino == FUSE_ROOT_ID)
+        rdata->dst_dir = g_strdup_printf ("%s/", rdata->newname);
+    else
+        rdata->dst_dir = g_strdup_printf ("%s/%s/", newparent_en->fullpath, rdata->newname);
+
+    LOG_debug (DIR_TREE_LOG, INO_H"Renaming directory %s to %s", INO_T (en->ino), rdata->src_dir, rdata->dst_dir);
+
+    // server-side copy needs objects on the server, upload the staged files first
+    // extra reference is dropped below, after all flushes are requested
+    rdata->flushes_pending = 1;
+    if (application_get_write_back (rdata->dtree->app))
+        dir_tree_entry_get_staged (rdata->dtree, en, &l_paths);
+
+    for (l = g_list_first (l_paths); l; l = g_list_next (l)) {
+        LOG_debug (DIR_TREE_LOG, INO_H"Flushing staged file before rename: %s", INO_T (en->ino), (const gchar *) l->data);
+        rdata->flushes_pending++;
+        write_back_flush (application_get_write_back (rdata->dtree->app), (const gchar *) l->data,
+            dir_tree_on_rename_dir_flushed_cb, rdata);
+    }
+    g_list_free_full (l_paths, g_free);
+
+    dir_tree_on_rename_dir_flushed_cb (rdata, TRUE);
 }
 /*}}}*/
 
@@ -2067,41 +3880,233 @@ void dir_tree_rename (DirTree *dtree,
         return;
     }
 
+    rdata = g_new0 (RenameData, 1);
+    rdata->dtree = dtree;
+    rdata->parent_ino = parent_ino;
+    rdata->name = g_strdup (name);
+    rdata->newparent_ino = newparent_ino;
+    rdata->newname = g_strdup (newname);
+    rdata->rename_cb = rename_cb;
+    rdata->req = req;
+
     // we need to rename each object, which contains this directory in the path
     // could take a quite amount of time
     if (en->type == DET_dir) {
-        LOG_err (DIR_TREE_LOG, "Removing directories is not supported !");
-        if (rename_cb)
-            rename_cb (req, FALSE);
+        dir_tree_rename_dir (rdata, en, newparent_en);
         return;
     }
 
-    // You create a copy of your object up to 5 GB in size in a single atomic operation using this API.
-    // However, for copying an object greater than 5 GB, you must use the multipart upload API
-    if (en->size >= FIVEG) {
-        LOG_err (DIR_TREE_LOG, "Removing files larger than 5Gb is not currently supported !");
-        if (rename_cb)
-            rename_cb (req, FALSE);
+    // server-side copy needs the object on the server, upload the staged file first
+    if (dir_tree_entry_is_staged (dtree, en)) {
+        LOG_debug (DIR_TREE_LOG, INO_H"Flushing staged file before rename: %s", INO_T (en->ino), en->fullpath);
+        write_back_flush (application_get_write_back (dtree->app), en->fullpath, dir_tree_on_rename_flushed_cb, rdata);
         return;
     }
 
-    rdata = g_new0 (RenameData, 1);
-    rdata->dtree = dtree;
-    rdata->parent_ino = parent_ino;
-    rdata->name = g_strdup (name);
-    rdata->newparent_ino = newparent_ino;
-    rdata->newname = g_strdup (newname);
-    rdata->rename_cb = rename_cb;
-    rdata->req = req;
+    dir_tree_rename_file (rdata);
+}
+/*}}}*/
 
-    if (!client_pool_get_client (application_get_ops_client_pool (dtree->app),
-        dir_tree_on_rename_copy_con_cb, rdata)) {
-        LOG_debug (DIR_TREE_LOG, "Failed to get HTTPPool !");
-        if (rename_cb)
-           rename_cb (req, FALSE);
-        rename_data_destroy (rdata);
+/*{{{ dir_tree_prefetch */
+
+// subtree prefetch: a single recursive (not delimited) listing of the directory prefix
+// populates all nested directories, instead of a listing request per directory
+
+typedef void (*DirTree_prefetch_cb) (gpointer ctx, gboolean success, guint objects);
+
+typedef struct {
+    DirTree_prefetch_cb prefetch_cb;
+    gpointer ctx;
+} PrefetchWaiter;
+
+typedef struct {
+    DirTree *dtree;
+    fuse_ino_t ino;
+    gchar *prefix; // path of the directory, with the trailing '/', empty for the root directory
+    GHashTable *h_dirs; // inode -> DirEntry, directories which are populated by the listing
+    guint objects;
+    GList *l_waiting; // PrefetchWaiter
+} PrefetchData;
+
+static void dir_tree_prefetch_done (PrefetchData *pdata, gboolean success)
+{
+    GList *l;
+
+    g_hash_table_remove (pdata->dtree->h_prefetches, GUINT_TO_POINTER (pdata->ino));
+
+    for (l = pdata->l_waiting; l; l = g_list_next (l)) {
+        PrefetchWaiter *waiter = (PrefetchWaiter *) l->data;
+
+        waiter->prefetch_cb (waiter->ctx, success, pdata->objects);
+    }
+
+    g_list_free_full (pdata->l_waiting, g_free);
+    if (pdata->h_dirs)
+        g_hash_table_destroy (pdata->h_dirs);
+    g_free (pdata->prefix);
+    g_free (pdata);
+}
+
+// directory is populated by the listing, start its update once
+static void dir_tree_prefetch_add_dir (PrefetchData *pdata, DirEntry *dir_en)
+{
+    if (g_hash_table_lookup (pdata->h_dirs, GUINT_TO_POINTER (dir_en->ino)))
+        return;
+
+    dir_tree_start_update (dir_en, NULL);
+    g_hash_table_insert (pdata->h_dirs, GUINT_TO_POINTER (dir_en->ino), dir_en);
+}
+
+// add object and all its parent directories to DirTree
+static void dir_tree_prefetch_add_key (PrefetchData *pdata, DirEntry *root_en, HttpConnectionKey *key)
+{
+    DirEntry *parent_en = root_en;
+    gchar **names;
+    gint i;
+
+    if (strncmp (key->key, pdata->prefix, strlen (pdata->prefix)))
+        return;
+
+    names = g_strsplit (key->key + strlen (pdata->prefix), "/", -1);
+    for (i = 0; names[i]; i++) {
+        DirEntry *en;
+
+        // directory object itself ("dir/") or a wrong name ("dir//file")
+        if (!*names[i])
+            break;
+
+        // object
+        if (!names[i + 1]) {
+            dir_tree_update_entry (pdata->dtree, NULL, DET_file, parent_en->ino, names[i],
+                key->size, key->last_modified ? key->last_modified : time (NULL), key->etag);
+            pdata->objects++;
+            break;
+        }
+
+        // directory, which is already populated, must not be updated again: it would reset its age
+        en = g_hash_table_lookup (parent_en->h_dir_tree, names[i]);
+        if (!en || !g_hash_table_lookup (pdata->h_dirs, GUINT_TO_POINTER (en->ino)))
+            // XXX: save / restore directory mtime
+            en = dir_tree_update_entry (pdata->dtree, NULL, DET_dir, parent_en->ino, names[i],
+                0, time (NULL), NULL);
+
+        if (!en || en->type != DET_dir) {
+            LOG_debug (DIR_TREE_LOG, INO_H"Failed to add directory %s of %s !", INO_T (parent_en->ino), names[i], key->key);
+            break;
+        }
+
+        dir_tree_prefetch_add_dir (pdata, en);
+        parent_en = en;
+    }
+
+    g_strfreev (names);
+}
+
+static void dir_tree_prefetch_on_listed_cb (gpointer ctx, gboolean success, GList *l_keys)
+{
+    PrefetchData *pdata = (PrefetchData *) ctx;
+    DirEntry *en;
+    GHashTableIter iter;
+    gpointer value;
+    GList *l;
+    time_t now = time (NULL);
+
+    if (!success) {
+        LOG_err (DIR_TREE_LOG, INO_H"Failed to list keys of %s !", INO_T (pdata->ino), pdata->prefix);
+        dir_tree_prefetch_done (pdata, FALSE);
+        return;
+    }
+
+    en = g_hash_table_lookup (pdata->dtree->h_inodes, GUINT_TO_POINTER (pdata->ino));
+    if (!en || en->type != DET_dir) {
+        LOG_err (DIR_TREE_LOG, INO_H"Directory not found !", INO_T (pdata->ino));
+        g_list_free_full (l_keys, (GDestroyNotify) http_connection_key_free);
+        dir_tree_prefetch_done (pdata, FALSE);
+        return;
+    }
+
+    pdata->h_dirs = g_hash_table_new (g_direct_hash, g_direct_equal);
+    dir_tree_prefetch_add_dir (pdata, en);
+
+    for (l = l_keys; l; l = g_list_next (l))
+        dir_tree_prefetch_add_key (pdata, en, (HttpConnectionKey *) l->data);
+    g_list_free_full (l_keys, (GDestroyNotify) http_connection_key_free);
+
+    // the listing is complete for every populated directory:
+    // remove entries which are not listed, directory cache is built from the local tree by the next request
+    g_hash_table_iter_init (&iter, pdata->h_dirs);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        DirEntry *dir_en = (DirEntry *) value;
+
+        dir_tree_stop_update (pdata->dtree, dir_en->ino);
+
+        if (dir_en->dir_cache)
+            g_free (dir_en->dir_cache);
+        dir_en->dir_cache = NULL;
+        dir_en->dir_cache_size = 0;
+        dir_en->dir_cache_created = now;
+        dir_en->is_modified = FALSE;
+    }
+
+    en->prefetch_time = now;
+    en->prefetch_objects = pdata->objects;
+
+    LOG_debug (DIR_TREE_LOG, INO_H"Prefetched %s: %u objects, %u directories", INO_T (pdata->ino),
+        pdata->prefix, pdata->objects, g_hash_table_size (pdata->h_dirs));
+
+    dir_tree_prefetch_done (pdata, TRUE);
+}
+
+static void dir_tree_prefetch_on_con_cb (gpointer client, gpointer ctx)
+{
+    HttpConnection *con = (HttpConnection *) client;
+    PrefetchData *pdata = (PrefetchData *) ctx;
+
+    http_connection_get_key_listing (con, pdata->prefix, dir_tree_prefetch_on_listed_cb, pdata);
+}
+
+// populate the directory and all its subdirectories,
+// requests for the directory, which is being prefetched, wait for the running prefetch
+static void dir_tree_prefetch (DirTree *dtree, fuse_ino_t ino, DirTree_prefetch_cb prefetch_cb, gpointer ctx)
+{
+    DirEntry *en;
+    PrefetchData *pdata;
+    PrefetchWaiter *waiter;
+
+    en = g_hash_table_lookup (dtree->h_inodes, GUINT_TO_POINTER (ino));
+    if (!en || en->type != DET_dir) {
+        LOG_msg (DIR_TREE_LOG, INO_H"Directory not found !", INO_T (ino));
+        prefetch_cb (ctx, FALSE, 0);
+        return;
+    }
+
+    waiter = g_new0 (PrefetchWaiter, 1);
+    waiter->prefetch_cb = prefetch_cb;
+    waiter->ctx = ctx;
+
+    pdata = g_hash_table_lookup (dtree->h_prefetches, GUINT_TO_POINTER (ino));
+    if (pdata) {
+        pdata->l_waiting = g_list_append (pdata->l_waiting, waiter);
         return;
     }
+
+    pdata = g_new0 (PrefetchData, 1);
+    pdata->dtree = dtree;
+    pdata->ino = ino;
+    if (ino == FUSE_ROOT_ID)
+        pdata->prefix = g_strdup ("");
+    else
+        pdata->prefix = g_strdup_printf ("%s/", en->fullpath);
+    pdata->l_waiting = g_list_append (pdata->l_waiting, waiter);
+    g_hash_table_insert (dtree->h_prefetches, GUINT_TO_POINTER (ino), pdata);
+
+    LOG_debug (DIR_TREE_LOG, INO_H"Prefetching subtree of %s ..", INO_T (ino), pdata->prefix);
+
+    if (!client_pool_get_client (application_get_ops_client_pool (dtree->app),
+        dir_tree_prefetch_on_con_cb, pdata)) {
+        LOG_err (DIR_TREE_LOG, INO_H"Failed to get HTTP client !", INO_T (ino));
+        dir_tree_prefetch_done (pdata, FALSE);
+    }
 }
 /*}}}*/
 
@@ -2217,6 +4222,19 @@ static void dir_tree_on_getxattr_cb (HttpConnection *con, void *ctx, gboolean su
     g_free (xattr_data);
 }
 
+static void dir_tree_getxattr_on_prefetch_cb (gpointer ctx, gboolean success, guint objects)
+{
+    XAttrData *xattr_data = (XAttrData *) ctx;
+    gchar *str;
+
+    // the number of prefetched objects
+    str = g_strdup_printf ("%u", objects);
+    xattr_data->getxattr_cb (xattr_data->req, success, xattr_data->ino, str, xattr_data->size);
+    g_free (str);
+
+    g_free (xattr_data);
+}
+
 static void dir_tree_on_getxattr_con_cb (gpointer client, gpointer ctx)
 {
     HttpConnection *con = (HttpConnection *) client;
@@ -2273,6 +4291,32 @@ void dir_tree_getxattr (DirTree *dtree, fuse_ino_t ino,
         getxattr_cb (req, FALSE, ino, NULL, 0);
         return;
     }
+
+    // "user.riofs.prefetch" of a directory populates the whole subtree by a recursive listing
+    // the value is the number of objects in the subtree
+    if (en->type == DET_dir && !strcmp (name, "user.riofs.prefetch")) {
+        t = time (NULL);
+        // already prefetched, the second call after the value size request must not list it again
+        if (en->prefetch_time && t >= en->prefetch_time &&
+            t - en->prefetch_time < (time_t)conf_get_uint (application_get_conf (dtree->app), "filesystem.dir_cache_max_time")) {
+            gchar *str = g_strdup_printf ("%u", en->prefetch_objects);
+
+            getxattr_cb (req, TRUE, ino, str, size);
+            g_free (str);
+            return;
+        }
+
+        xattr_data = g_new0 (XAttrData, 1);
+        xattr_data->dtree = dtree;
+        xattr_data->ino = ino;
+        xattr_data->req = req;
+        xattr_data->getxattr_cb = getxattr_cb;
+        xattr_data->size = size;
+
+        dir_tree_prefetch (dtree, ino, dir_tree_getxattr_on_prefetch_cb, xattr_data);
+        return;
+    }
+
     // Xattr for directories not supported
     if (en->type == DET_dir) {
         LOG_debug (DIR_TREE_LOG, "Xattr for directories not supported!");
@@ -20,8 +20,19 @@
 #include "cache_mng.h"
 #include "utils.h"
 #include "dir_tree.h"
+#include "write_back.h"
+#include "hash_pool.h"
+#include "md5_mb.h"
 
 /*{{{ struct */
+
+// where data of parts of sequentially written file is taken from
+typedef enum {
+    FPS_memory = 0, // write buffer
+    FPS_cache = 1, // cache files, written data is stored there anyway
+    FPS_file = 2, // file which is uploaded by fileio_upload_file ()
+} FileIOPartSource;
+
 struct _FileIO {
     Application *app;
     gchar *fname;
@@ -31,27 +42,93 @@ struct _FileIO {
 
     // write
     guint64 current_size;
-    struct evbuffer *write_buf;
+    guint64 part_start; // data before this offset is handed off to the uploader
+    FileIOPartSource part_source;
+    struct evbuffer *write_buf; // FPS_memory: data which is not handed off to the uploader yet
+    gboolean cache_pinned; // FPS_cache: written data is kept in the cache until it's uploaded
+    int upload_fd; // FPS_file: not owned by FileIO
+    GQueue *q_parts_loading; // FileUploadPart, parts which are not hashed yet, in order of part numbers
     gboolean multipart_initiated;
     gchar *uploadid;
     guint part_number;
+    guint64 size_hint; // expected size of the file, 0 if not known
     GList *l_parts; // list of FileIOPart
-    MD5_CTX md5;
+    Md5MbCtx md5;
+    guint parts_inflight; // number of parts which are being uploaded
+    GQueue *q_writers; // FileWriteData, writers which wait for Multipart Init or for a free upload slot
+    gboolean upload_failed;
+    gboolean release_pending; // FileIO is released, complete the upload when all parts are sent
+
+    // write-back
+    WriteBackFile *wb_file; // local staging file, which is uploaded when FileIO is released
+    gboolean is_staged_upload; // FileIO uploads staged data, it's not stored in local cache
+    FileIO_on_upload_file_cb on_upload_file_cb;
+    gpointer upload_file_ctx;
+
+    // staging file, used for random writes, overwrites and truncates
+    guint64 object_size; // size of the existing object, its data is kept
+    int stage_fd; // -1 if not used, or if the staging file is WriteBackFile
+    guint64 stage_size;
+    gboolean stage_loading; // the existing object is being downloaded to the staging file
+    GQueue *q_stage_ops; // FileStageOp, which wait for the download
 
     // read
     gboolean head_req_sent;
     guint64 file_size;
+
+    // read-ahead
+    guint64 ra_next_off; // expected offset of the next sequential read
+    guint ra_seq_count; // number of sequential reads in a row
+    guint64 ra_window; // current read-ahead window size, 0 if disabled
+    guint64 ra_end; // offset up to which data is requested from the server
+    guint ra_inflight; // number of read-ahead requests in flight
+    guint64 ra_best_rate; // best observed read-ahead throughput (bytes / sec)
+
+    GList *l_fetches; // list of FileReadFetch, blocks which are being downloaded
+
+    // FileIO is released, but has requests in flight
+    gboolean destroy_pending;
 };
 
 typedef struct {
     guint part_number;
     gchar *md5str;
     gchar *md5b;
+    gchar *etag; // returned by the server
 } FileIOPart;
+
+// part which is handed off to the uploader
+typedef struct {
+    FileIO *fop;
+    FileIOPart *part;
+    gboolean is_single; // the whole object is sent by a single PUT request
+    guint64 off;
+    guint64 size;
+    struct evbuffer *buf; // FPS_memory: data of the part
+    struct fuse_bufvec *bufv; // FPS_cache, FPS_file: files (or memory blocks) which contain the data, owned by the part
+    gboolean loaded; // data is retrieved, NULL "buf" and "bufv" mean an error
+} FileUploadPart;
 /*}}}*/
 
 #define FIO_LOG "fio"
 
+// the number of sequential reads in a row to enable read-ahead
+#define FIO_RA_SEQ_THRESHOLD 2
+
+// alignment of sub-ranges of parallel GET requests
+#define FIO_FANOUT_ALIGN 65536
+
+// the beginning of file which is used to guess its MIME type
+#define FIO_MAGIC_PEEK_SIZE 4096
+
+// S3 limits of multipart uploads
+#define FIO_MAX_PARTS 10000
+#define FIO_MAX_PART_SIZE (5ULL * 1024 * 1024 * 1024)
+// part size is doubled every this number of parts
+#define FIO_PART_SIZE_STEP 1000
+// part size is rounded up to this value
+#define FIO_PART_SIZE_ALIGN 1048576
+
 /*{{{ create / destroy */
 
 FileIO *fileio_create (Application *app, const gchar *fname, fuse_ino_t ino, gboolean assume_new)
@@ -61,32 +138,85 @@ FileIO *fileio_create (Application *app, const gchar *fname, fuse_ino_t ino, gbo
     fop = g_new0 (FileIO, 1);
     fop->app = app;
     fop->current_size = 0;
+    fop->part_start = 0;
+    fop->part_source = conf_get_boolean (application_get_conf (app), "s3.upload_from_cache") ? FPS_cache : FPS_memory;
     fop->write_buf = evbuffer_new ();
+    fop->cache_pinned = FALSE;
+    fop->upload_fd = -1;
+    fop->q_parts_loading = g_queue_new ();
     fop->fname = g_strdup_printf ("/%s", fname);
     fop->content_type = NULL;
     fop->file_size = 0;
     fop->head_req_sent = FALSE;
     fop->multipart_initiated = FALSE;
     fop->uploadid = NULL;
+    fop->size_hint = 0;
     fop->l_parts = NULL;
     fop->ino = ino;
     fop->assume_new = assume_new;
-    MD5_Init (&fop->md5);
+    md5_mb_init (&fop->md5);
+    fop->parts_inflight = 0;
+    fop->q_writers = g_queue_new ();
+    fop->upload_failed = FALSE;
+    fop->release_pending = FALSE;
+    fop->wb_file = NULL;
+    fop->is_staged_upload = FALSE;
+    fop->on_upload_file_cb = NULL;
+    fop->upload_file_ctx = NULL;
+    fop->object_size = 0;
+    fop->stage_fd = -1;
+    fop->stage_size = 0;
+    fop->stage_loading = FALSE;
+    fop->q_stage_ops = g_queue_new ();
+    fop->ra_next_off = 0;
+    fop->ra_seq_count = 0;
+    fop->ra_window = 0;
+    fop->ra_end = 0;
+    fop->ra_inflight = 0;
+    fop->ra_best_rate = 0;
+    fop->l_fetches = NULL;
+    fop->destroy_pending = FALSE;
 
     return fop;
 }
 
+// return TRUE if there are GET requests which use FileIO
+static gboolean fileio_requests_inflight (FileIO *fop)
+{
+    return fop->ra_inflight || fop->l_fetches;
+}
+
 void fileio_destroy (FileIO *fop)
 {
     GList *l;
 
+    // wait for GET requests to finish
+    if (fileio_requests_inflight (fop)) {
+        LOG_debug (FIO_LOG, INO_H"GET requests are in flight, postponing destroy", INO_T (fop->ino));
+        fop->destroy_pending = TRUE;
+        return;
+    }
+
+    // staged data is uploaded
+    if (fop->on_upload_file_cb)
+        fop->on_upload_file_cb (fop->upload_file_ctx, !fop->upload_failed);
+
     for (l = g_list_first (fop->l_parts); l; l = g_list_next (l)) {
         FileIOPart *part = (FileIOPart *) l->data;
         g_free (part->md5str);
         g_free (part->md5b);
+        g_free (part->etag);
         g_free (part);
     }
     g_list_free(fop->l_parts);
+    g_queue_free (fop->q_writers);
+    g_queue_free (fop->q_stage_ops);
+    g_queue_free (fop->q_parts_loading);
+    if (fop->stage_fd >= 0)
+        close (fop->stage_fd);
+    // uploaded data stays in the cache
+    if (fop->cache_pinned)
+        cache_mng_unpin_file (application_get_cache_mng (fop->app), fop->ino);
     evbuffer_free (fop->write_buf);
     g_free (fop->fname);
     if (fop->content_type)
@@ -95,287 +225,921 @@ void fileio_destroy (FileIO *fop)
         g_free (fop->uploadid);
     g_free (fop);
 }
+
+void fileio_set_object_size (FileIO *fop, guint64 object_size)
+{
+    fop->object_size = object_size;
+}
+
+void fileio_set_size_hint (FileIO *fop, guint64 size)
+{
+    if (size > fop->size_hint) {
+        LOG_debug (FIO_LOG, INO_H"Expected file size: %"G_GUINT64_FORMAT, INO_T (fop->ino), size);
+        fop->size_hint = size;
+    }
+}
 /*}}}*/
 
-/*{{{ fileio_release*/
+/*{{{ staging file */
 
-/*{{{ update headers on uploaded object */
-static void fileio_release_on_update_header_cb (HttpConnection *con, void *ctx, gboolean success,
-    G_GNUC_UNUSED const gchar *buf, G_GNUC_UNUSED size_t buf_len,
-    G_GNUC_UNUSED struct evkeyvalq *headers)
+// operation, which waits for the existing object to be downloaded to the staging file
+typedef enum {
+    FSO_write = 0,
+    FSO_truncate = 1,
+    FSO_allocate = 2, // truncate, which never shrinks the file
+} FileStageOpType;
+
+typedef struct {
+    FileStageOpType type;
+    gchar *buf;
+    size_t buf_size;
+    off_t off;
+    guint64 size;
+    FileIO_on_buffer_written_cb on_buffer_written_cb;
+    FileIO_on_truncated_cb on_truncated_cb;
+    gpointer ctx;
+} FileStageOp;
+
+// written data is stored in the local file (write-back staging file or a temporary one)
+static gboolean fileio_is_staged (FileIO *fop)
 {
-    FileIO *fop = (FileIO *) ctx;
+    return fop->wb_file || fop->stage_fd >= 0;
+}
 
-    http_connection_release (con);
+guint64 fileio_get_current_size (FileIO *fop)
+{
+    return fileio_is_staged (fop) ? fop->stage_size : fop->current_size;
+}
 
-    if (!success) {
-        LOG_err (FIO_LOG, INO_CON_H"Failed to update headers on the server !", INO_T (fop->ino), con);
-        fileio_destroy (fop);
-        return;
+static gboolean fileio_stage_pwrite (FileIO *fop, const char *buf, size_t size, off_t off)
+{
+    size_t written = 0;
+    ssize_t res;
+
+    if (fop->wb_file) {
+        if (!write_back_file_write (fop->wb_file, buf, size, off))
+            return FALSE;
+    } else {
+        while (written < size) {
+            res = pwrite (fop->stage_fd, buf + written, size - written, off + written);
+            if (res < 0) {
+                if (errno == EINTR)
+                    continue;
+                LOG_err (FIO_LOG, INO_H"Failed to write staging file: %s", INO_T (fop->ino), strerror (errno));
+                return FALSE;
+            }
+            written += res;
+        }
     }
 
-    // done
-    LOG_debug (FIO_LOG, INO_CON_H"Headers are updated !", INO_T (fop->ino), con);
+    if ((guint64) off + size > fop->stage_size)
+        fop->stage_size = off + size;
 
-    fileio_destroy (fop);
+    return TRUE;
 }
 
-// got HttpConnection object
-static void fileio_release_on_update_headers_con_cb (gpointer client, gpointer ctx)
+static gboolean fileio_stage_truncate (FileIO *fop, guint64 size)
 {
-    HttpConnection *con = (HttpConnection *) client;
-    FileIO *fop = (FileIO *) ctx;
-    gchar *path;
-    gchar *cpy_path;
-    gboolean res;
-    unsigned char digest[16];
-    gchar *md5str;
-    size_t i;
-    const gchar *cc_header = NULL;
-    const gchar *cp_src = NULL;
-    const gchar *key_prefix = NULL;
+    if (fop->wb_file) {
+        if (!write_back_file_truncate (fop->wb_file, size))
+            return FALSE;
+    } else if (ftruncate (fop->stage_fd, size) != 0) {
+        LOG_err (FIO_LOG, INO_H"Failed to truncate staging file: %s", INO_T (fop->ino), strerror (errno));
+        return FALSE;
+    }
 
-    LOG_debug (FIO_LOG, INO_CON_H"Updating object's headers..", INO_T (fop->ino), con);
+    fop->stage_size = size;
 
-    http_connection_acquire (con);
+    return TRUE;
+}
 
-    if (fop->content_type)
-        http_connection_add_output_header (con, "Content-Type", fop->content_type);
-    http_connection_add_output_header (con, "x-amz-metadata-directive", "REPLACE");
-    http_connection_add_output_header (con, "x-amz-storage-class", conf_get_string (application_get_conf (con->app), "s3.storage_type"));
+// staging file is not valid if the download of the existing object failed
+static void fileio_stage_run_write (FileIO *fop, const char *buf, size_t buf_size, off_t off,
+    FileIO_on_buffer_written_cb on_buffer_written_cb, gpointer ctx)
+{
+    gboolean success;
 
-    cc_header = conf_get_string(application_get_conf(con->app),"s3.cache_control");
-    if( cc_header != NULL && strlen(cc_header) ) {
-    	http_connection_add_output_header(con,"Cache-Control",cc_header);
-    }
+    success = !fop->upload_failed && fileio_stage_pwrite (fop, buf, buf_size, off);
 
-    MD5_Final (digest, &fop->md5);
-    md5str = g_malloc (33);
-    for (i = 0; i < 16; ++i)
-        sprintf(&md5str[i*2], "%02x", (unsigned int)digest[i]);
-    http_connection_add_output_header (con, "x-amz-meta-md5", md5str);
-    g_free (md5str);
+    LOG_debug (FIO_LOG, INO_H"Staged write [%"OFF_FMT" %zu], file size: %"G_GUINT64_FORMAT,
+        INO_T (fop->ino), off, buf_size, fop->stage_size);
 
-    key_prefix = conf_get_string(application_get_conf(fop->app),"s3.key_prefix");
-    if( strlen(key_prefix) )
-        cpy_path = g_strdup_printf ("%s%s%s", conf_get_string (application_get_conf (fop->app), "s3.bucket_name"), key_prefix, fop->fname+1);
-    else
-        cpy_path = g_strdup_printf ("%s%s", conf_get_string (application_get_conf (fop->app), "s3.bucket_name"), fop->fname);
+    on_buffer_written_cb (fop, ctx, success, success ? buf_size : 0);
+}
 
-    http_connection_add_output_header (con, "x-amz-copy-source", cpy_path);
-    g_free (cpy_path);
+static void fileio_stage_run_truncate (FileIO *fop, guint64 size, gboolean grow_only,
+    FileIO_on_truncated_cb on_truncated_cb, gpointer ctx)
+{
+    gboolean success;
 
-    path = g_strdup_printf ("%s", fop->fname);
-    res = http_connection_make_request (con,
-        path, "PUT", NULL, TRUE, NULL,
-        fileio_release_on_update_header_cb,
-        fop
-    );
-    g_free (path);
+    success = !fop->upload_failed &&
+        ((grow_only && size <= fop->stage_size) || fileio_stage_truncate (fop, size));
 
-    if (!res) {
-        LOG_err (FIO_LOG, INO_CON_H"Failed to create HTTP request !", INO_T (fop->ino), con);
-        http_connection_release (con);
-        fileio_destroy (fop);
-        return;
-    }
+    LOG_debug (FIO_LOG, INO_H"Staged truncate to %"G_GUINT64_FORMAT, INO_T (fop->ino), size);
+
+    on_truncated_cb (fop, ctx, success);
 }
 
-static void fileio_release_update_headers (FileIO *fop)
+// the existing object is downloaded, apply queued operations
+static void fileio_stage_load_done (FileIO *fop)
 {
-    // update MD5 headers only if versioning is disabled
-    if (conf_get_boolean (application_get_conf (fop->app), "s3.versioning")) {
-        LOG_debug (FIO_LOG, INO_H"File uploaded !", INO_T (fop->ino));
-        fileio_destroy (fop);
-    } else {
-        if (!client_pool_get_client (application_get_write_client_pool (fop->app),
-            fileio_release_on_update_headers_con_cb, fop)) {
-            LOG_err (FIO_LOG, INO_H"Failed to get HTTP client !", INO_T (fop->ino));
-            fileio_destroy (fop);
-            return;
-        }
+    GQueue *q_ops;
+    FileStageOp *op;
+    gboolean release_pending;
+
+    fop->stage_loading = FALSE;
+
+    // callbacks can release a temporary FileIO (truncate of a closed file), don't touch FileIO after them
+    q_ops = fop->q_stage_ops;
+    fop->q_stage_ops = g_queue_new ();
+    release_pending = fop->release_pending;
+    fop->release_pending = FALSE;
+
+    while ((op = g_queue_pop_head (q_ops))) {
+        if (op->type == FSO_write)
+            fileio_stage_run_write (fop, op->buf, op->buf_size, op->off, op->on_buffer_written_cb, op->ctx);
+        else
+            fileio_stage_run_truncate (fop, op->size, op->type == FSO_allocate, op->on_truncated_cb, op->ctx);
+
+        g_free (op->buf);
+        g_free (op);
     }
+    g_queue_free (q_ops);
+
+    // FileIO was released while the object was being downloaded
+    if (release_pending)
+        fileio_release (fop);
 }
-/*}}}*/
 
-/*{{{ Complete Multipart Upload */
-// multipart is sent
-static void fileio_release_on_complete_cb (HttpConnection *con, void *ctx, gboolean success,
+// a part of the existing object is received
+static void fileio_stage_load_on_chunk_cb (G_GNUC_UNUSED HttpConnection *con, void *ctx,
+    const gchar *buf, size_t buf_len, guint64 offset)
+{
+    FileIO *fop = (FileIO *) ctx;
+
+    // the rest of the object is truncated
+    if (offset >= fop->object_size)
+        return;
+    buf_len = MIN (buf_len, fop->object_size - offset);
+
+    if (!fileio_stage_pwrite (fop, buf, buf_len, offset))
+        fop->upload_failed = TRUE;
+}
+
+static void fileio_stage_load_on_get_cb (HttpConnection *con, void *ctx, gboolean success,
     G_GNUC_UNUSED const gchar *buf, G_GNUC_UNUSED size_t buf_len,
     G_GNUC_UNUSED struct evkeyvalq *headers)
 {
     FileIO *fop = (FileIO *) ctx;
-    const gchar *versioning_header;
 
     http_connection_release (con);
 
     if (!success) {
-        LOG_err (FIO_LOG, INO_CON_H"Failed to send Multipart data to the server !", INO_T (fop->ino), con);
-        fileio_destroy (fop);
-        return;
-    }
-
-    versioning_header = http_find_header (headers, "x-amz-version-id");
-    if (versioning_header) {
-        cache_mng_update_version_id (application_get_cache_mng (fop->app),
-            fop->ino, versioning_header);
+        LOG_err (FIO_LOG, INO_CON_H"Failed to download the object to the staging file !", INO_T (fop->ino), con);
+        fop->upload_failed = TRUE;
+    } else {
+        LOG_debug (FIO_LOG, INO_H"Object is downloaded to the staging file, size: %"G_GUINT64_FORMAT,
+            INO_T (fop->ino), fop->stage_size);
     }
 
-    // done
-    LOG_debug (FIO_LOG, INO_CON_H"Multipart Upload is done !", INO_T (fop->ino), con);
-
-    // fileio_destroy (fop);
-    fileio_release_update_headers (fop);
+    fileio_stage_load_done (fop);
 }
 
-// got HttpConnection object
-static void fileio_release_on_complete_con_cb (gpointer client, gpointer ctx)
+static void fileio_stage_load_on_con_cb (gpointer client, gpointer ctx)
 {
     HttpConnection *con = (HttpConnection *) client;
     FileIO *fop = (FileIO *) ctx;
-    gchar *path;
+    gchar *range_hdr;
     gboolean res;
-    struct evbuffer *xml_buf;
-    GList *l;
 
-    xml_buf = evbuffer_new ();
-    evbuffer_add_printf (xml_buf, "%s", "<CompleteMultipartUpload>");
-    for (l = g_list_first (fop->l_parts); l; l = g_list_next (l)) {
-        FileIOPart *part = (FileIOPart *) l->data;
-        evbuffer_add_printf (xml_buf,
-            "<Part><PartNumber>%u</PartNumber><ETag>\"%s\"</ETag></Part>",
-            part->part_number, part->md5str);
-    }
-    evbuffer_add_printf (xml_buf, "%s", "</CompleteMultipartUpload>");
+    http_connection_acquire (con);
 
-    LOG_debug (FIO_LOG, INO_CON_H"Sending Multipart Final part..", INO_T (fop->ino), con);
+    range_hdr = g_strdup_printf ("bytes=0-%"G_GUINT64_FORMAT, fop->object_size - 1);
+    http_connection_add_output_header (con, "Range", range_hdr);
+    g_free (range_hdr);
 
-    http_connection_acquire (con);
+    http_connection_set_on_chunk_cb (con, fileio_stage_load_on_chunk_cb);
 
-    path = g_strdup_printf ("%s?uploadId=%s",
-        fop->fname, fop->uploadid);
     res = http_connection_make_request (con,
-        path, "POST", xml_buf, TRUE, NULL,
-        fileio_release_on_complete_cb,
+        fop->fname, "GET", NULL, TRUE, NULL,
+        fileio_stage_load_on_get_cb,
         fop
     );
-    g_free (path);
-    evbuffer_free (xml_buf);
 
-    if (!res) {
+    // fileio_stage_load_on_get_cb () is already called
+    if (!res)
         LOG_err (FIO_LOG, INO_CON_H"Failed to create HTTP request !", INO_T (fop->ino), con);
-        http_connection_release (con);
-        fileio_destroy (fop);
-        return;
-    }
 }
 
-static void fileio_release_complete_multipart (FileIO *fop)
+// sequentially written data is copied from the cache to the staging file
+static void fileio_stage_on_cached_cb (unsigned char *buf, size_t size, gboolean success, void *ctx)
 {
-    if (!fop->uploadid) {
-        LOG_err (FIO_LOG, INO_H"UploadID is not set, aborting operation !", INO_T (fop->ino));
-        fileio_destroy (fop);
-        return;
+    FileIO *fop = (FileIO *) ctx;
+
+    if (!success || !fileio_stage_pwrite (fop, (const char *) buf, size, fop->current_size - size)) {
+        LOG_err (FIO_LOG, INO_H"Failed to copy cached data to the staging file !", INO_T (fop->ino));
+        fop->upload_failed = TRUE;
     }
 
-    if (!client_pool_get_client (application_get_write_client_pool (fop->app),
-        fileio_release_on_complete_con_cb, fop)) {
-        LOG_err (FIO_LOG, INO_H"Failed to get HTTP client !", INO_T (fop->ino));
-        fileio_destroy (fop);
-        return;
-     }
+    // cached blocks are removed
+    cache_mng_unpin_file (application_get_cache_mng (fop->app), fop->ino);
+    fop->cache_pinned = FALSE;
+
+    fileio_stage_load_done (fop);
 }
-/*}}}*/
 
-/*{{{ sent part*/
-// file is sent
-static void fileio_release_on_part_sent_cb (HttpConnection *con, void *ctx, gboolean success,
-    G_GNUC_UNUSED const gchar *buf, G_GNUC_UNUSED size_t buf_len,
-    G_GNUC_UNUSED struct evkeyvalq *headers)
+// switch FileIO to the staging file, the existing object is downloaded to it in background
+static gboolean fileio_stage_start (FileIO *fop)
 {
-    FileIO *fop = (FileIO *) ctx;
-    const gchar *versioning_header;
+    WriteBack *wb = application_get_write_back (fop->app);
+    gssize copied = -1;
+    size_t len;
 
-    http_connection_release (con);
+    if (fileio_is_staged (fop))
+        return TRUE;
 
-    if (!success) {
-        LOG_err (FIO_LOG, INO_CON_H"Failed to send bufer to server !", INO_T (fop->ino), con);
-        fileio_destroy (fop);
-        return;
+    // parts are already sent to the server, they can't be modified
+    if (fop->multipart_initiated) {
+        LOG_err (FIO_LOG, INO_H"Multipart upload is started, random writes are not allowed !", INO_T (fop->ino));
+        return FALSE;
     }
 
-    versioning_header = http_find_header (headers, "x-amz-version-id");
-    if (versioning_header) {
-        cache_mng_update_version_id (application_get_cache_mng (fop->app),
-            fop->ino, versioning_header);
-    }
-    // if it's a multi part upload - Complete Multipart Upload
-    if (fop->multipart_initiated) {
-        fileio_release_complete_multipart (fop);
+    if (wb) {
+        fop->wb_file = write_back_file_create (wb, fop->fname + 1, fop->ino);
+        if (!fop->wb_file)
+            return FALSE;
 
-    // or we are done
+        // the previous version of the object is not uploaded yet
+        if (fop->object_size)
+            copied = write_back_file_copy_committed (fop->wb_file, fop->object_size);
     } else {
-        fileio_release_update_headers (fop);
-        //fileio_destroy (fop);
+        const gchar *dir = conf_get_string (application_get_conf (fop->app), "filesystem.cache_dir");
+        gchar *path;
+
+        g_mkdir_with_parents (dir, 0700);
+        path = g_strdup_printf ("%s/stage-XXXXXX", dir);
+        fop->stage_fd = g_mkstemp (path);
+        if (fop->stage_fd < 0) {
+            LOG_err (FIO_LOG, INO_H"Failed to create staging file %s: %s", INO_T (fop->ino), path, strerror (errno));
+            g_free (path);
+            return FALSE;
+        }
+        // the file is removed when it's closed
+        unlink (path);
+        g_free (path);
+    }
+    fop->stage_size = copied > 0 ? (guint64) copied : 0;
+
+    LOG_debug (FIO_LOG, INO_H"Using staging file, object size: %"G_GUINT64_FORMAT, INO_T (fop->ino), fop->object_size);
+
+    // cached blocks don't match the object anymore
+    // pinned blocks are removed when they are copied to the staging file
+    cache_mng_remove_file (application_get_cache_mng (fop->app), fop->ino);
+
+    // data which is written sequentially, but is not sent yet
+    len = fop->current_size - fop->part_start;
+    fop->part_start = fop->current_size;
+    if (len && fop->part_source == FPS_cache) {
+        fop->stage_loading = TRUE;
+        cache_mng_retrieve_file_buf (application_get_cache_mng (fop->app), fop->ino, len, fop->current_size - len,
+            fileio_stage_on_cached_cb, fop);
+    } else if (len) {
+        if (!fileio_stage_pwrite (fop, (const char *) evbuffer_pullup (fop->write_buf, -1), len, fop->current_size - len))
+            fop->upload_failed = TRUE;
+        evbuffer_drain (fop->write_buf, len);
     }
-}
 
-// got HttpConnection object
-static void fileio_release_on_part_con_cb (gpointer client, gpointer ctx)
-{
-    HttpConnection *con = (HttpConnection *) client;
-    FileIO *fop = (FileIO *) ctx;
-    gchar *path;
-    gboolean res;
-    FileIOPart *part;
-    size_t buf_len;
-    const gchar *buf;
+    if (copied < 0 && fop->object_size > 0) {
+        fop->stage_loading = TRUE;
+        if (!client_pool_get_client (application_get_read_client_pool (fop->app), fileio_stage_load_on_con_cb, fop)) {
+            LOG_err (FIO_LOG, INO_H"Failed to get HTTP client !", INO_T (fop->ino));
+            fop->stage_loading = FALSE;
+            fop->upload_failed = TRUE;
+        }
+    }
 
-    LOG_debug (FIO_LOG, INO_CON_H"Releasing fop. Size: %zu", INO_T (fop->ino), con, evbuffer_get_length (fop->write_buf));
+    return TRUE;
+}
 
-    // add part information to the list
-    part = g_new0 (FileIOPart, 1);
-    part->part_number = fop->part_number;
-    buf_len = evbuffer_get_length (fop->write_buf);
-    buf = (const gchar *)evbuffer_pullup (fop->write_buf, buf_len);
+static void fileio_stage_write (FileIO *fop, const char *buf, size_t buf_size, off_t off,
+    FileIO_on_buffer_written_cb on_buffer_written_cb, gpointer ctx)
+{
+    FileStageOp *op;
 
-    // XXX: move to separate thread
-    // 1. calculate MD5 of a part.
-    get_md5_sum (buf, buf_len, &part->md5str, &part->md5b);
-    // 2. calculate MD5 of multiple message blocks
-    MD5_Update (&fop->md5, buf, buf_len);
+    if (!fileio_stage_start (fop)) {
+        on_buffer_written_cb (fop, ctx, FALSE, 0);
+        return;
+    }
 
-    fop->l_parts = g_list_append (fop->l_parts, part);
+    // "buf" is valid only during this call
+    if (fop->stage_loading) {
+        op = g_new0 (FileStageOp, 1);
+        op->type = FSO_write;
+        op->buf = g_memdup (buf, buf_size);
+        op->buf_size = buf_size;
+        op->off = off;
+        op->on_buffer_written_cb = on_buffer_written_cb;
+        op->ctx = ctx;
+        g_queue_push_tail (fop->q_stage_ops, op);
+        return;
+    }
 
-    // if this is a multipart
-    if (fop->multipart_initiated) {
+    fileio_stage_run_write (fop, buf, buf_size, off, on_buffer_written_cb, ctx);
+}
 
-        if (!fop->uploadid) {
-            LOG_err (FIO_LOG, INO_CON_H"UploadID is not set, aborting operation !", INO_T (fop->ino), con);
-            fileio_destroy (fop);
-            return;
-        }
+void fileio_truncate (FileIO *fop, guint64 size, FileIO_on_truncated_cb on_truncated_cb, gpointer ctx)
+{
+    FileStageOp *op;
 
-        path = g_strdup_printf ("%s?partNumber=%u&uploadId=%s",
-            fop->fname, fop->part_number, fop->uploadid);
-        fop->part_number++;
+    // data beyond the new size is not downloaded
+    if (!fileio_is_staged (fop))
+        fop->object_size = MIN (fop->object_size, size);
 
-    } else {
-        path = g_strdup (fop->fname);
+    if (!fileio_stage_start (fop)) {
+        on_truncated_cb (fop, ctx, FALSE);
+        return;
     }
 
-#ifdef MAGIC_ENABLED
-    // guess MIME type
-    gchar *mime_type = magic_buffer (application_get_magic_ctx (fop->app), buf, buf_len);
-    if (mime_type) {
-        LOG_debug (FIO_LOG, "Guessed MIME type of %s as %s", path, mime_type);
-        fop->content_type = g_strdup (mime_type);
-    } else {
-        LOG_err (FIO_LOG, "Failed to guess MIME type of %s !", path);
+    if (fop->stage_loading) {
+        op = g_new0 (FileStageOp, 1);
+        op->type = FSO_truncate;
+        op->size = size;
+        op->on_truncated_cb = on_truncated_cb;
+        op->ctx = ctx;
+        g_queue_push_tail (fop->q_stage_ops, op);
+        return;
     }
-#endif
 
-#ifdef USE_MIMETYPES
+    fileio_stage_run_truncate (fop, size, FALSE, on_truncated_cb, ctx);
+}
+
+void fileio_allocate (FileIO *fop, guint64 size, FileIO_on_truncated_cb on_allocated_cb, gpointer ctx)
+{
+    FileStageOp *op;
+
+    fileio_set_size_hint (fop, size);
+
+    // the file is already large enough, keep the sequential upload going
+    if (!fileio_is_staged (fop) && size <= MAX (fop->current_size, fop->object_size)) {
+        on_allocated_cb (fop, ctx, TRUE);
+        return;
+    }
+
+    if (!fileio_stage_start (fop)) {
+        on_allocated_cb (fop, ctx, FALSE);
+        return;
+    }
+
+    if (fop->stage_loading) {
+        op = g_new0 (FileStageOp, 1);
+        op->type = FSO_allocate;
+        op->size = size;
+        op->on_truncated_cb = on_allocated_cb;
+        op->ctx = ctx;
+        g_queue_push_tail (fop->q_stage_ops, op);
+        return;
+    }
+
+    fileio_stage_run_truncate (fop, size, TRUE, on_allocated_cb, ctx);
+}
+/*}}}*/
+
+/*{{{ part data */
+
+static void fileio_upload_part_on_hashed_cb (gpointer ctx, const gchar *md5str, const gchar *md5b);
+static void fileio_release_on_part_hashed_cb (gpointer ctx, const gchar *md5str, const gchar *md5b);
+
+static void fileio_bufvec_free (struct fuse_bufvec *bufv)
+{
+    size_t i;
+
+    for (i = 0; i < bufv->count; i++) {
+        struct fuse_buf *fbuf = &bufv->buf[i];
+
+        if (fbuf->flags & FUSE_BUF_IS_FD) {
+            if (fbuf->fd >= 0)
+                close (fbuf->fd);
+        } else {
+            g_free (fbuf->mem);
+        }
+    }
+    g_free (bufv);
+}
+
+// "bufv" is valid only during the cache callback: duplicate descriptors and copy memory blocks
+static struct fuse_bufvec *fileio_bufvec_dup (struct fuse_bufvec *bufv)
+{
+    struct fuse_bufvec *copy;
+    size_t i;
+
+    copy = g_malloc0 (sizeof (struct fuse_bufvec) + (MAX (bufv->count, 1) - 1) * sizeof (struct fuse_buf));
+    for (i = 0; i < bufv->count; i++) {
+        struct fuse_buf *fbuf = &copy->buf[i];
+
+        *fbuf = bufv->buf[i];
+        copy->count++;
+        if (fbuf->flags & FUSE_BUF_IS_FD) {
+            fbuf->fd = dup (bufv->buf[i].fd);
+            if (fbuf->fd < 0) {
+                LOG_err (FIO_LOG, "Failed to duplicate file descriptor: %s", strerror (errno));
+                fileio_bufvec_free (copy);
+                return NULL;
+            }
+        } else {
+            fbuf->mem = g_memdup (bufv->buf[i].mem, bufv->buf[i].size);
+        }
+    }
+
+    return copy;
+}
+
+static void fileio_upload_part_free (FileUploadPart *upart)
+{
+    if (upart->buf)
+        evbuffer_free (upart->buf);
+    if (upart->bufv)
+        fileio_bufvec_free (upart->bufv);
+    g_free (upart);
+}
+
+// memory block of the cache is sent
+static void fileio_upload_part_on_mem_free_cb (const void *data, G_GNUC_UNUSED size_t datalen, G_GNUC_UNUSED void *extra)
+{
+    g_free ((gpointer) data);
+}
+
+// move the part data to the body of the next request, no data is copied
+static void fileio_upload_part_add_body (HttpConnection *con, FileUploadPart *upart)
+{
+    size_t i;
+
+    if (upart->buf) {
+        http_connection_add_output_buffer (con, upart->buf);
+        return;
+    }
+
+    for (i = 0; upart->bufv && i < upart->bufv->count; i++) {
+        struct fuse_buf *fbuf = &upart->bufv->buf[i];
+
+        if (fbuf->flags & FUSE_BUF_IS_FD) {
+            http_connection_add_output_file (con, fbuf->fd, fbuf->pos, fbuf->size);
+            fbuf->fd = -1;
+        } else {
+            struct evbuffer *buf = evbuffer_new ();
+
+            evbuffer_add_reference (buf, fbuf->mem, fbuf->size, fileio_upload_part_on_mem_free_cb, NULL);
+            fbuf->mem = NULL;
+            http_connection_add_output_buffer (con, buf);
+            evbuffer_free (buf);
+        }
+    }
+}
+
+#ifdef MAGIC_ENABLED
+// copy the beginning of the part data to "buf", return the number of copied bytes
+static size_t fileio_upload_part_peek (FileUploadPart *upart, gchar *buf, size_t len)
+{
+    struct fuse_buf *fbuf;
+    ssize_t bytes;
+
+    if (upart->buf) {
+        bytes = evbuffer_copyout (upart->buf, buf, len);
+        return bytes > 0 ? (size_t) bytes : 0;
+    }
+
+    if (!upart->bufv || !upart->bufv->count)
+        return 0;
+
+    fbuf = &upart->bufv->buf[0];
+    len = MIN (len, fbuf->size);
+    if (!(fbuf->flags & FUSE_BUF_IS_FD)) {
+        memcpy (buf, fbuf->mem, len);
+        return len;
+    }
+
+    bytes = pread (fbuf->fd, buf, len, fbuf->pos);
+    return bytes > 0 ? (size_t) bytes : 0;
+}
+#endif
+
+// parts are added to the object's MD5 sum in order, the data of the next part might be not retrieved yet
+static void fileio_parts_hash_loaded (FileIO *fop)
+{
+    HashPool *hpool = application_get_hash_pool (fop->app);
+    FileUploadPart *upart;
+    GList *l_ready = NULL;
+    GList *l;
+
+    // hashing callbacks might be called at once and release FileIO
+    while ((upart = g_queue_peek_head (fop->q_parts_loading)) && upart->loaded)
+        l_ready = g_list_append (l_ready, g_queue_pop_head (fop->q_parts_loading));
+
+    for (l = g_list_first (l_ready); l; l = g_list_next (l)) {
+        HashPool_on_md5_cb on_md5_cb;
+
+        upart = (FileUploadPart *) l->data;
+        on_md5_cb = upart->is_single ? fileio_release_on_part_hashed_cb : fileio_upload_part_on_hashed_cb;
+
+        if (upart->buf)
+            hash_pool_md5_evbuffer (hpool, upart->buf, &upart->fop->md5, on_md5_cb, upart);
+        else if (upart->bufv)
+            hash_pool_md5_bufvec (hpool, upart->bufv, &upart->fop->md5, on_md5_cb, upart);
+        else
+            on_md5_cb (upart, NULL, NULL);
+    }
+    g_list_free (l_ready);
+}
+
+// part data is retrieved from the cache
+static void fileio_part_on_retrieved_cb (struct fuse_bufvec *bufv, gboolean success, void *ctx)
+{
+    FileUploadPart *upart = (FileUploadPart *) ctx;
+
+    if (success)
+        upart->bufv = fileio_bufvec_dup (bufv);
+    if (!upart->bufv)
+        LOG_err (FIO_LOG, INO_H"Failed to retrieve [%"G_GUINT64_FORMAT" %"G_GUINT64_FORMAT"] from the cache !",
+            INO_T (upart->fop->ino), upart->off, upart->size);
+    upart->loaded = TRUE;
+
+    fileio_parts_hash_loaded (upart->fop);
+}
+
+// hand off written data which is not sent yet to the uploader,
+// the part is sent when its data is retrieved and its MD5 sum is calculated
+static void fileio_take_part (FileIO *fop, gboolean is_single)
+{
+    FileUploadPart *upart;
+
+    upart = g_new0 (FileUploadPart, 1);
+    upart->fop = fop;
+    upart->is_single = is_single;
+    upart->off = fop->part_start;
+    upart->size = fop->current_size - fop->part_start;
+    fop->part_start = fop->current_size;
+
+    // add part information to the list
+    upart->part = g_new0 (FileIOPart, 1);
+    upart->part->part_number = fop->part_number;
+    fop->l_parts = g_list_append (fop->l_parts, upart->part);
+    if (!is_single)
+        fop->part_number++;
+
+    g_queue_push_tail (fop->q_parts_loading, upart);
+
+    if (fop->part_source == FPS_cache && upart->size) {
+        cache_mng_retrieve_file_bufvec (application_get_cache_mng (fop->app), fop->ino, upart->size, upart->off,
+            fileio_part_on_retrieved_cb, upart);
+        return;
+    }
+
+    if (fop->part_source == FPS_file && upart->size) {
+        upart->bufv = g_new0 (struct fuse_bufvec, 1);
+        upart->bufv->count = 1;
+        upart->bufv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        upart->bufv->buf[0].fd = dup (fop->upload_fd);
+        upart->bufv->buf[0].pos = upart->off;
+        upart->bufv->buf[0].size = upart->size;
+        if (upart->bufv->buf[0].fd < 0) {
+            LOG_err (FIO_LOG, INO_H"Failed to duplicate file descriptor: %s", INO_T (fop->ino), strerror (errno));
+            fileio_bufvec_free (upart->bufv);
+            upart->bufv = NULL;
+        }
+    } else {
+        upart->buf = fop->write_buf;
+        fop->write_buf = evbuffer_new ();
+    }
+    upart->loaded = TRUE;
+
+    fileio_parts_hash_loaded (fop);
+}
+/*}}}*/
+
+/*{{{ fileio_release*/
+
+static void fileio_upload_part (FileIO *fop);
+
+/*{{{ update headers on uploaded object */
+static void fileio_release_on_update_header_cb (HttpConnection *con, void *ctx, gboolean success,
+    G_GNUC_UNUSED const gchar *buf, G_GNUC_UNUSED size_t buf_len,
+    G_GNUC_UNUSED struct evkeyvalq *headers)
+{
+    FileIO *fop = (FileIO *) ctx;
+
+    http_connection_release (con);
+
+    if (!success) {
+        LOG_err (FIO_LOG, INO_CON_H"Failed to update headers on the server !", INO_T (fop->ino), con);
+        fileio_destroy (fop);
+        return;
+    }
+
+    // done
+    LOG_debug (FIO_LOG, INO_CON_H"Headers are updated !", INO_T (fop->ino), con);
+
+    fileio_destroy (fop);
+}
+
+// got HttpConnection object
+static void fileio_release_on_update_headers_con_cb (gpointer client, gpointer ctx)
+{
+    HttpConnection *con = (HttpConnection *) client;
+    FileIO *fop = (FileIO *) ctx;
+    gchar *path;
+    gchar *cpy_path;
+    gboolean res;
+    unsigned char digest[16];
+    gchar *md5str;
+    size_t i;
+    const gchar *cc_header = NULL;
+    const gchar *cp_src = NULL;
+    const gchar *key_prefix = NULL;
+
+    LOG_debug (FIO_LOG, INO_CON_H"Updating object's headers..", INO_T (fop->ino), con);
+
+    http_connection_acquire (con);
+
+    if (fop->content_type)
+        http_connection_add_output_header (con, "Content-Type", fop->content_type);
+    http_connection_add_output_header (con, "x-amz-metadata-directive", "REPLACE");
+    http_connection_add_output_header (con, "x-amz-storage-class", conf_get_string (application_get_conf (con->app), "s3.storage_type"));
+
+    cc_header = conf_get_string(application_get_conf(con->app),"s3.cache_control");
+    if( cc_header != NULL && strlen(cc_header) ) {
+    	http_connection_add_output_header(con,"Cache-Control",cc_header);
+    }
+
+    md5_mb_final (digest, &fop->md5);
+    md5str = g_malloc (33);
+    for (i = 0; i < 16; ++i)
+        sprintf(&md5str[i*2], "%02x", (unsigned int)digest[i]);
+    http_connection_add_output_header (con, "x-amz-meta-md5", md5str);
+    g_free (md5str);
+
+    key_prefix = conf_get_string(application_get_conf(fop->app),"s3.key_prefix");
+    if( strlen(key_prefix) )
+        cpy_path = g_strdup_printf ("%s%s%s", conf_get_string (application_get_conf (fop->app), "s3.bucket_name"), key_prefix, fop->fname+1);
+    else
+        cpy_path = g_strdup_printf ("%s%s", conf_get_string (application_get_conf (fop->app), "s3.bucket_name"), fop->fname);
+
+    http_connection_add_output_header (con, "x-amz-copy-source", cpy_path);
+    g_free (cpy_path);
+
+    path = g_strdup_printf ("%s", fop->fname);
+    res = http_connection_make_request (con,
+        path, "PUT", NULL, TRUE, NULL,
+        fileio_release_on_update_header_cb,
+        fop
+    );
+    g_free (path);
+
+    // the response callback is already called
+    if (!res)
+        LOG_err (FIO_LOG, INO_CON_H"Failed to create HTTP request !", INO_T (fop->ino), con);
+}
+
+static void fileio_release_update_headers (FileIO *fop)
+{
+    // update MD5 headers only if versioning is disabled
+    if (conf_get_boolean (application_get_conf (fop->app), "s3.versioning")) {
+        LOG_debug (FIO_LOG, INO_H"File uploaded !", INO_T (fop->ino));
+        fileio_destroy (fop);
+    // headers are updated by a copy request, S3 doesn't copy objects larger than 5 GB at once,
+    // MD5 of the whole file is not known yet when the multipart upload is initiated, so it's not set
+    } else if (fop->current_size > FIVEG) {
+        LOG_debug (FIO_LOG, INO_H"File uploaded, it's too large to update MD5 header !", INO_T (fop->ino));
+        fileio_destroy (fop);
+    } else {
+        if (!client_pool_get_client (application_get_write_client_pool (fop->app),
+            fileio_release_on_update_headers_con_cb, fop)) {
+            LOG_err (FIO_LOG, INO_H"Failed to get HTTP client !", INO_T (fop->ino));
+            fileio_destroy (fop);
+            return;
+        }
+    }
+}
+/*}}}*/
+
+/*{{{ Abort Multipart Upload */
+// abort is sent, the upload is failed anyway
+static void fileio_release_on_abort_cb (HttpConnection *con, void *ctx, gboolean success,
+    G_GNUC_UNUSED const gchar *buf, G_GNUC_UNUSED size_t buf_len,
+    G_GNUC_UNUSED struct evkeyvalq *headers)
+{
+    FileIO *fop = (FileIO *) ctx;
+
+    http_connection_release (con);
+
+    if (!success)
+        LOG_err (FIO_LOG, INO_CON_H"Failed to abort Multipart Upload !", INO_T (fop->ino), con);
+    else
+        LOG_debug (FIO_LOG, INO_CON_H"Multipart Upload is aborted", INO_T (fop->ino), con);
+
+    fileio_destroy (fop);
+}
+
+static void fileio_release_on_abort_con_cb (gpointer client, gpointer ctx)
+{
+    HttpConnection *con = (HttpConnection *) client;
+    FileIO *fop = (FileIO *) ctx;
+    fuse_ino_t ino = fop->ino;
+    gchar *path;
+    gboolean res;
+
+    http_connection_acquire (con);
+
+    path = g_strdup_printf ("%s?uploadId=%s", fop->fname, fop->uploadid);
+    res = http_connection_make_request (con,
+        path, "DELETE", NULL, TRUE, NULL,
+        fileio_release_on_abort_cb,
+        fop
+    );
+    g_free (path);
+
+    // the response callback is already called, it destroys FileIO
+    if (!res)
+        LOG_err (FIO_LOG, INO_CON_H"Failed to create HTTP request !", INO_T (ino), con);
+}
+
+// remove already uploaded parts from the server, they are stored (and billed) until the upload is aborted
+static void fileio_release_abort_multipart (FileIO *fop)
+{
+    if (!fop->uploadid) {
+        fileio_destroy (fop);
+        return;
+    }
+
+    if (!client_pool_get_client (application_get_write_client_pool (fop->app),
+        fileio_release_on_abort_con_cb, fop)) {
+        LOG_err (FIO_LOG, INO_H"Failed to get HTTP client !", INO_T (fop->ino));
+        fileio_destroy (fop);
+        return;
+    }
+}
+/*}}}*/
+
+/*{{{ Complete Multipart Upload */
+// multipart is sent
+static void fileio_release_on_complete_cb (HttpConnection *con, void *ctx, gboolean success,
+    G_GNUC_UNUSED const gchar *buf, G_GNUC_UNUSED size_t buf_len,
+    G_GNUC_UNUSED struct evkeyvalq *headers)
+{
+    FileIO *fop = (FileIO *) ctx;
+    const gchar *versioning_header;
+
+    http_connection_release (con);
+
+    if (!success) {
+        LOG_err (FIO_LOG, INO_CON_H"Failed to send Multipart data to the server !", INO_T (fop->ino), con);
+        fop->upload_failed = TRUE;
+        fileio_release_abort_multipart (fop);
+        return;
+    }
+
+    versioning_header = http_find_header (headers, "x-amz-version-id");
+    if (versioning_header) {
+        cache_mng_update_version_id (application_get_cache_mng (fop->app),
+            fop->ino, versioning_header);
+    }
+
+    // done
+    LOG_debug (FIO_LOG, INO_CON_H"Multipart Upload is done !", INO_T (fop->ino), con);
+
+    // fileio_destroy (fop);
+    fileio_release_update_headers (fop);
+}
+
+// got HttpConnection object
+static void fileio_release_on_complete_con_cb (gpointer client, gpointer ctx)
+{
+    HttpConnection *con = (HttpConnection *) client;
+    FileIO *fop = (FileIO *) ctx;
+    gchar *path;
+    gboolean res;
+    struct evbuffer *xml_buf;
+    GList *l;
+
+    xml_buf = evbuffer_new ();
+    evbuffer_add_printf (xml_buf, "%s", "<CompleteMultipartUpload>");
+    for (l = g_list_first (fop->l_parts); l; l = g_list_next (l)) {
+        FileIOPart *part = (FileIOPart *) l->data;
+        evbuffer_add_printf (xml_buf,
+            "<Part><PartNumber>%u</PartNumber><ETag>\"%s\"</ETag></Part>",
+            part->part_number, part->etag ? part->etag : part->md5str);
+    }
+    evbuffer_add_printf (xml_buf, "%s", "</CompleteMultipartUpload>");
+
+    LOG_debug (FIO_LOG, INO_CON_H"Sending Multipart Final part..", INO_T (fop->ino), con);
+
+    http_connection_acquire (con);
+
+    path = g_strdup_printf ("%s?uploadId=%s",
+        fop->fname, fop->uploadid);
+    res = http_connection_make_request (con,
+        path, "POST", xml_buf, TRUE, NULL,
+        fileio_release_on_complete_cb,
+        fop
+    );
+    g_free (path);
+    evbuffer_free (xml_buf);
+
+    // the response callback is already called
+    if (!res)
+        LOG_err (FIO_LOG, INO_CON_H"Failed to create HTTP request !", INO_T (fop->ino), con);
+}
+
+static void fileio_release_complete_multipart (FileIO *fop)
+{
+    if (!fop->uploadid) {
+        LOG_err (FIO_LOG, INO_H"UploadID is not set, aborting operation !", INO_T (fop->ino));
+        fop->upload_failed = TRUE;
+        fileio_destroy (fop);
+        return;
+    }
+
+    if (!client_pool_get_client (application_get_write_client_pool (fop->app),
+        fileio_release_on_complete_con_cb, fop)) {
+        LOG_err (FIO_LOG, INO_H"Failed to get HTTP client !", INO_T (fop->ino));
+        fop->upload_failed = TRUE;
+        fileio_release_abort_multipart (fop);
+        return;
+     }
+}
+
+// all parts are sent
+static void fileio_release_finish_multipart (FileIO *fop)
+{
+    fop->release_pending = FALSE;
+
+    if (fop->upload_failed) {
+        LOG_err (FIO_LOG, INO_H"Failed to upload parts, aborting operation !", INO_T (fop->ino));
+        fileio_release_abort_multipart (fop);
+        return;
+    }
+
+    fileio_release_complete_multipart (fop);
+}
+/*}}}*/
+
+/*{{{ sent part*/
+// file is sent
+static void fileio_release_on_part_sent_cb (HttpConnection *con, void *ctx, gboolean success,
+    G_GNUC_UNUSED const gchar *buf, G_GNUC_UNUSED size_t buf_len,
+    G_GNUC_UNUSED struct evkeyvalq *headers)
+{
+    FileUploadPart *upart = (FileUploadPart *) ctx;
+    FileIO *fop = upart->fop;
+    const gchar *versioning_header;
+
+    http_connection_release (con);
+    fileio_upload_part_free (upart);
+
+    if (!success) {
+        LOG_err (FIO_LOG, INO_CON_H"Failed to send bufer to server !", INO_T (fop->ino), con);
+        fop->upload_failed = TRUE;
+        fileio_destroy (fop);
+        return;
+    }
+
+    versioning_header = http_find_header (headers, "x-amz-version-id");
+    if (versioning_header) {
+        cache_mng_update_version_id (application_get_cache_mng (fop->app),
+            fop->ino, versioning_header);
+    }
+
+    // we are done
+    fileio_release_update_headers (fop);
+}
+
+// got HttpConnection object
+static void fileio_release_on_part_con_cb (gpointer client, gpointer ctx)
+{
+    HttpConnection *con = (HttpConnection *) client;
+    FileUploadPart *upart = (FileUploadPart *) ctx;
+    FileIO *fop = upart->fop;
+    gchar *path;
+    gboolean res;
+    time_t t;
+    gchar time_str[50];
+
+    LOG_debug (FIO_LOG, INO_CON_H"Releasing fop. Size: %"G_GUINT64_FORMAT, INO_T (fop->ino), con, upart->size);
+
+    path = g_strdup (fop->fname);
+
+#ifdef MAGIC_ENABLED
+    // guess MIME type by the beginning of the file
+    gchar magic_buf[FIO_MAGIC_PEEK_SIZE];
+    size_t magic_len = fileio_upload_part_peek (upart, magic_buf, sizeof (magic_buf));
+    gchar *mime_type = magic_len ? (gchar *) magic_buffer (application_get_magic_ctx (fop->app), magic_buf, magic_len) : NULL;
+    if (mime_type) {
+        LOG_debug (FIO_LOG, "Guessed MIME type of %s as %s", path, mime_type);
+        fop->content_type = g_strdup (mime_type);
+    } else {
+        LOG_err (FIO_LOG, "Failed to guess MIME type of %s !", path);
+    }
+#endif
+
+#ifdef USE_MIMETYPES
     gchar *mime_type = (gchar *)mimetypes_find(path);
     if( mime_type ) {
         LOG_debug(FIO_LOG,"mime.types says %s is %s",path,mime_type);
@@ -385,63 +1149,155 @@ static void fileio_release_on_part_con_cb (gpointer client, gpointer ctx)
 
     http_connection_acquire (con);
 
-    // add output headers
-    http_connection_add_output_header (con, "Content-MD5", part->md5b);
+    // add output headers, MD5 sum is already calculated
+    http_connection_add_output_header (con, "Content-MD5", upart->part->md5b);
     if (fop->content_type)
         http_connection_add_output_header (con, "Content-Type", fop->content_type);
 
 
-    // if this is the full file
-    if (!fop->multipart_initiated) {
-        time_t t;
-        gchar time_str[50];
+    // Add current time
+    t = time (NULL);
+    if (strftime (time_str, sizeof (time_str), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&t))) {
+        http_connection_add_output_header (con, "x-amz-meta-date", time_str);
+    }
 
-        // Add current time
-        t = time (NULL);
-        if (strftime (time_str, sizeof (time_str), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&t))) {
-            http_connection_add_output_header (con, "x-amz-meta-date", time_str);
-        }
+    http_connection_add_output_header (con, "x-amz-storage-class", conf_get_string (application_get_conf (con->app), "s3.storage_type"));
 
-        http_connection_add_output_header (con, "x-amz-storage-class", conf_get_string (application_get_conf (con->app), "s3.storage_type"));
-    }
+    fileio_upload_part_add_body (con, upart);
 
     res = http_connection_make_request (con,
-        path, "PUT", fop->write_buf, TRUE, NULL,
+        path, "PUT", NULL, TRUE, NULL,
         fileio_release_on_part_sent_cb,
-        fop
+        upart
     );
     g_free (path);
 
-    if (!res) {
+    // the response callback is already called
+    if (!res)
         LOG_err (FIO_LOG, INO_CON_H"Failed to create HTTP request !", INO_T (fop->ino), con);
-        http_connection_release (con);
+}
+/*}}}*/
+
+/*{{{ upload staging file */
+static void fileio_release_on_staged_upload_cb (gpointer ctx, gboolean success)
+{
+    FileIO *fop = (FileIO *) ctx;
+
+    if (!success) {
+        LOG_err (FIO_LOG, INO_H"Failed to upload staging file !", INO_T (fop->ino));
+        fop->upload_failed = TRUE;
+    }
+
+    fileio_destroy (fop);
+}
+
+static gboolean fileio_release_staged (FileIO *fop)
+{
+    gboolean res;
+
+    // wait for the existing object to be downloaded
+    if (fop->stage_loading) {
+        fop->release_pending = TRUE;
+        return TRUE;
+    }
+
+    // write-back mode: add the staging file to the upload queue
+    if (fop->wb_file) {
+        if (fop->upload_failed) {
+            write_back_file_abort (fop->wb_file);
+            res = FALSE;
+        } else {
+            res = write_back_file_commit (fop->wb_file);
+        }
+        fop->wb_file = NULL;
+        fileio_destroy (fop);
+        return res;
+    }
+
+    if (fop->upload_failed) {
+        LOG_err (FIO_LOG, INO_H"Staging file is not complete, discarding changes !", INO_T (fop->ino));
+        fileio_destroy (fop);
+        return FALSE;
+    }
+
+    // staging file is closed when FileIO is destroyed
+    fileio_upload_file (fop->app, fop->fname + 1, fop->ino, fop->stage_fd, fop->stage_size,
+        fileio_release_on_staged_upload_cb, fop);
+
+    return TRUE;
+}
+/*}}}*/
+
+// MD5 sum of the file data is calculated, send it
+static void fileio_release_on_part_hashed_cb (gpointer ctx, const gchar *md5str, const gchar *md5b)
+{
+    FileUploadPart *upart = (FileUploadPart *) ctx;
+    FileIO *fop = upart->fop;
+
+    if (!md5str) {
+        LOG_err (FIO_LOG, INO_H"Failed to calculate MD5 sum !", INO_T (fop->ino));
+        fop->upload_failed = TRUE;
+        fileio_upload_part_free (upart);
         fileio_destroy (fop);
         return;
     }
+
+    upart->part->md5str = g_strdup (md5str);
+    upart->part->md5b = g_strdup (md5b);
+
+    if (!client_pool_get_client (application_get_write_client_pool (fop->app),
+        fileio_release_on_part_con_cb, upart)) {
+        LOG_err (FIO_LOG, INO_H"Failed to get HTTP client !", INO_T (fop->ino));
+        fop->upload_failed = TRUE;
+        fileio_upload_part_free (upart);
+        fileio_destroy (fop);
+    }
 }
-/*}}}*/
 
 // file is released, finish all operations
-void fileio_release (FileIO *fop)
+gboolean fileio_release (FileIO *fop)
 {
-    // if write buffer has some data left - send it to the server
+    gboolean res = !fop->upload_failed;
+
+    // random writes: upload the staging file
+    if (fileio_is_staged (fop))
+        return fileio_release_staged (fop);
+
+    // if it's a multi part upload - send the rest of data as the last part
+    // and Complete Multipart Upload when all parts are sent
+    if (fop->multipart_initiated) {
+        if (fop->current_size > fop->part_start && fop->uploadid && !fop->upload_failed)
+            fileio_upload_part (fop);
+
+        fop->release_pending = TRUE;
+        if (!fop->parts_inflight)
+            fileio_release_finish_multipart (fop);
+
+    // if there is some data which is not sent - send it to the server
     // or an empty file was created
-    if (evbuffer_get_length (fop->write_buf) || fop->assume_new) {
-        if (!client_pool_get_client (application_get_write_client_pool (fop->app),
-            fileio_release_on_part_con_cb, fop)) {
-            LOG_err (FIO_LOG, INO_H"Failed to get HTTP client !", INO_T (fop->ino));
-            fileio_destroy (fop);
-            return;
-        }
-    } else {
-        // if it's a multi part upload - Complete Multipart Upload
-        if (fop->multipart_initiated) {
-            fileio_release_complete_multipart (fop);
+    } else if (fop->current_size > fop->part_start || fop->assume_new) {
+        // calculate MD5 sums of the data and of the whole object in background
+        fileio_take_part (fop, TRUE);
 
-        // just a "small" file
-        } else
-            fileio_destroy (fop);
+    // just a "small" file
+    } else
+        fileio_destroy (fop);
+
+    return res;
+}
+
+gboolean fileio_flush (FileIO *fop)
+{
+    if (fop->upload_failed)
+        return FALSE;
+
+    // written data must survive a crash, before the staging file is committed
+    if (fop->wb_file && !write_back_file_sync (fop->wb_file)) {
+        fop->upload_failed = TRUE;
+        return FALSE;
     }
+
+    return TRUE;
 }
 /*}}}*/
 
@@ -458,400 +1314,957 @@ typedef struct {
 
 /*{{{ send part */
 
-// buffer is sent
-static void fileio_write_on_send_cb (HttpConnection *con, void *ctx, gboolean success,
+static void fileio_write_send_part (FileWriteData *wdata);
+
+// the maximum number of parts which are uploaded at once
+static guint fileio_upload_max_parts (FileIO *fop)
+{
+    guint max_parts;
+
+    max_parts = conf_get_uint (application_get_conf (fop->app), "s3.upload_max_parts_inflight");
+    if (max_parts > (guint) client_pool_get_client_count (application_get_write_client_pool (fop->app)))
+        max_parts = client_pool_get_client_count (application_get_write_client_pool (fop->app));
+
+    return MAX (max_parts, 1);
+}
+
+// size of the next part of the multipart upload
+// part size is doubled every FIO_PART_SIZE_STEP parts: with 5 MB parts 10000 parts hold about 5 TB,
+// if the file size is known, the rest of it is spread over the remaining parts
+static guint64 fileio_upload_part_size (FileIO *fop)
+{
+    guint64 part_size;
+    guint part_number = MAX (fop->part_number, 1);
+
+    part_size = conf_get_uint (application_get_conf (fop->app), "s3.part_size");
+    part_size <<= MIN ((part_number - 1) / FIO_PART_SIZE_STEP, 10);
+
+    if (fop->size_hint > fop->part_start && part_number <= FIO_MAX_PARTS) {
+        guint64 parts_left = FIO_MAX_PARTS - part_number + 1;
+
+        part_size = MAX (part_size, (fop->size_hint - fop->part_start + parts_left - 1) / parts_left);
+    }
+
+    part_size = (part_size + FIO_PART_SIZE_ALIGN - 1) / FIO_PART_SIZE_ALIGN * FIO_PART_SIZE_ALIGN;
+
+    return MIN (part_size, FIO_MAX_PART_SIZE);
+}
+
+// answer writers which wait for Multipart Init or for a free upload slot
+static void fileio_write_resume_writers (FileIO *fop)
+{
+    while (!g_queue_is_empty (fop->q_writers) &&
+        (fop->upload_failed || (fop->uploadid && fop->parts_inflight < fileio_upload_max_parts (fop))))
+        fileio_write_send_part ((FileWriteData *) g_queue_pop_head (fop->q_writers));
+}
+
+static void fileio_upload_part_done (FileUploadPart *upart, gboolean success)
+{
+    FileIO *fop = upart->fop;
+
+    fileio_upload_part_free (upart);
+
+    fop->parts_inflight--;
+    if (!success)
+        fop->upload_failed = TRUE;
+
+    fileio_write_resume_writers (fop);
+
+    // FileIO is released and all parts are sent
+    if (fop->release_pending && !fop->parts_inflight)
+        fileio_release_finish_multipart (fop);
+}
+
+// part is sent
+static void fileio_upload_part_on_sent_cb (HttpConnection *con, void *ctx, gboolean success,
     G_GNUC_UNUSED const gchar *buf, G_GNUC_UNUSED size_t buf_len,
-    G_GNUC_UNUSED struct evkeyvalq *headers)
+    struct evkeyvalq *headers)
 {
-    FileWriteData *wdata = (FileWriteData *) ctx;
-    const char *versioning_header;
+    FileUploadPart *upart = (FileUploadPart *) ctx;
+    const char *etag_header;
 
     http_connection_release (con);
 
     if (!success) {
-        LOG_err (FIO_LOG, INO_CON_H"Failed to send bufer to server !", INO_T (wdata->ino), con);
-        wdata->on_buffer_written_cb (wdata->fop, wdata->ctx, FALSE, 0);
-        g_free (wdata);
+        LOG_err (FIO_LOG, INO_CON_H"Failed to send part %u to server !", INO_T (upart->fop->ino), con, upart->part->part_number);
+        fileio_upload_part_done (upart, FALSE);
         return;
     }
 
-    versioning_header = http_find_header (headers, "x-amz-version-id");
-    if (versioning_header) {
-        cache_mng_update_version_id (application_get_cache_mng (wdata->fop->app),
-            wdata->ino, versioning_header);
-    }
+    // remember ETag, it's required to complete the upload
+    etag_header = http_find_header (headers, "ETag");
+    if (etag_header)
+        upart->part->etag = str_remove_quotes (g_strdup (etag_header));
 
-    // empty part buffer
-    evbuffer_drain (wdata->fop->write_buf, -1);
+    LOG_debug (FIO_LOG, INO_CON_H"Part %u is sent", INO_T (upart->fop->ino), con, upart->part->part_number);
 
-    // done sending part
-    wdata->on_buffer_written_cb (wdata->fop, wdata->ctx, TRUE, wdata->buf_size);
-    g_free (wdata);
+    fileio_upload_part_done (upart, TRUE);
 }
 
 // got HttpConnection object
-static void fileio_write_on_send_con_cb (gpointer client, gpointer ctx)
+static void fileio_upload_part_on_con_cb (gpointer client, gpointer ctx)
 {
     HttpConnection *con = (HttpConnection *) client;
-    FileWriteData *wdata = (FileWriteData *) ctx;
+    FileUploadPart *upart = (FileUploadPart *) ctx;
     gchar *path;
     gboolean res;
-    FileIOPart *part;
-    size_t buf_len;
-    const gchar *buf;
 
     http_connection_acquire (con);
 
-    // add part information to the list
-    part = g_new0 (FileIOPart, 1);
-    part->part_number = wdata->fop->part_number;
-    buf_len = evbuffer_get_length (wdata->fop->write_buf);
-    buf = (const gchar *) evbuffer_pullup (wdata->fop->write_buf, buf_len);
-
-    // XXX: move to separate thread
-    // 1. calculate MD5 of a part.
-    get_md5_sum (buf, buf_len, &part->md5str, &part->md5b);
-    // 2. calculate MD5 of multiple message blocks
-    MD5_Update (&wdata->fop->md5, buf, buf_len);
-
-    wdata->fop->l_parts = g_list_append (wdata->fop->l_parts, part);
-
     path = g_strdup_printf ("%s?partNumber=%u&uploadId=%s",
-        wdata->fop->fname, wdata->fop->part_number, wdata->fop->uploadid);
-
-    // increase part number
-    wdata->fop->part_number++;
-    // XXX: check that part_number does not exceeds 10000
+        upart->fop->fname, upart->part->part_number, upart->fop->uploadid);
 
     // add output headers
-    http_connection_add_output_header (con, "Content-MD5", part->md5b);
+    http_connection_add_output_header (con, "Content-MD5", upart->part->md5b);
+
+    fileio_upload_part_add_body (con, upart);
 
     res = http_connection_make_request (con,
-        path, "PUT", wdata->fop->write_buf, TRUE, NULL,
-        fileio_write_on_send_cb,
-        wdata
+        path, "PUT", NULL, TRUE, NULL,
+        fileio_upload_part_on_sent_cb,
+        upart
     );
     g_free (path);
 
-    if (!res) {
-        LOG_err (FIO_LOG, INO_CON_H"Failed to create HTTP request !", INO_T (wdata->ino), con);
-        http_connection_release (con);
-        wdata->on_buffer_written_cb (wdata->fop, wdata->ctx, FALSE, 0);
-        g_free (wdata);
+    // fileio_upload_part_on_sent_cb () is already called
+    if (!res)
+        LOG_err (FIO_LOG, INO_CON_H"Failed to create HTTP request !", INO_T (upart->fop->ino), con);
+}
+
+// MD5 sum of the part is calculated, send it
+static void fileio_upload_part_on_hashed_cb (gpointer ctx, const gchar *md5str, const gchar *md5b)
+{
+    FileUploadPart *upart = (FileUploadPart *) ctx;
+    FileIO *fop = upart->fop;
+
+    if (!md5str) {
+        LOG_err (FIO_LOG, INO_H"Failed to calculate MD5 sum of part %u !", INO_T (fop->ino), upart->part->part_number);
+        fileio_upload_part_done (upart, FALSE);
+        return;
+    }
+
+    upart->part->md5str = g_strdup (md5str);
+    upart->part->md5b = g_strdup (md5b);
+
+    if (!client_pool_get_client (application_get_write_client_pool (fop->app),
+        fileio_upload_part_on_con_cb, upart)) {
+        LOG_err (FIO_LOG, INO_H"Failed to get HTTP client !", INO_T (fop->ino));
+        fileio_upload_part_done (upart, FALSE);
+    }
+}
+
+// hand off written data to the uploader
+static void fileio_upload_part (FileIO *fop)
+{
+    // S3 doesn't accept more parts, the object can't be completed
+    if (fop->part_number > FIO_MAX_PARTS) {
+        LOG_err (FIO_LOG, INO_H"The number of parts exceeds %u, aborting operation !", INO_T (fop->ino), FIO_MAX_PARTS);
+        fop->upload_failed = TRUE;
         return;
     }
+
+    LOG_debug (FIO_LOG, INO_H"Uploading part %u, size: %"G_GUINT64_FORMAT", parts in flight: %u",
+        INO_T (fop->ino), fop->part_number, fop->current_size - fop->part_start, fop->parts_inflight + 1);
+
+    fop->parts_inflight++;
+
+    fileio_take_part (fop, FALSE);
 }
 
+// write buffer is filled, start uploading it and answer the writer
 static void fileio_write_send_part (FileWriteData *wdata)
 {
-    if (!wdata->fop->uploadid) {
-        LOG_err (FIO_LOG, INO_H"UploadID is not set, aborting operation !", INO_T (wdata->ino));
-        wdata->on_buffer_written_cb (wdata->fop, wdata->ctx, FALSE, 0);
+    FileIO *fop = wdata->fop;
+
+    if (fop->upload_failed) {
+        LOG_err (FIO_LOG, INO_H"Multipart upload failed, aborting operation !", INO_T (wdata->ino));
+        wdata->on_buffer_written_cb (fop, wdata->ctx, FALSE, 0);
         g_free (wdata);
         return;
     }
 
-    if (!client_pool_get_client (application_get_write_client_pool (wdata->fop->app),
-        fileio_write_on_send_con_cb, wdata)) {
-        LOG_err (FIO_LOG, INO_H"Failed to get HTTP client !", INO_T (wdata->ino));
-        wdata->on_buffer_written_cb (wdata->fop, wdata->ctx, FALSE, 0);
-        g_free (wdata);
+    // Multipart Upload is being initiated or all upload slots are busy, wait
+    if (!fop->uploadid || fop->parts_inflight >= fileio_upload_max_parts (fop)) {
+        g_queue_push_tail (fop->q_writers, wdata);
         return;
     }
+
+    // data might be already sent by one of the previous writers
+    if (fop->current_size - fop->part_start >= fileio_upload_part_size (fop))
+        fileio_upload_part (fop);
+
+    // done, the part is uploaded in background
+    wdata->on_buffer_written_cb (fop, wdata->ctx, TRUE, wdata->buf_size);
+    g_free (wdata);
 }
 /*}}}*/
 
 /*{{{ Multipart Init */
 
-static gchar *get_uploadid (const char *xml, size_t xml_len) {
-    xmlDocPtr doc;
-    xmlXPathContextPtr ctx;
-    xmlXPathObjectPtr uploadid_xp;
-    xmlNodeSetPtr nodes;
-    gchar *uploadid = NULL;
+static void fileio_write_on_multipart_init_cb (HttpConnection *con, void *ctx, gboolean success,
+    const gchar *buf, size_t buf_len,
+    G_GNUC_UNUSED struct evkeyvalq *headers)
+{
+    FileWriteData *wdata = (FileWriteData *) ctx;
+    gchar *uploadid;
+
+    http_connection_release (con);
+
+    if (!success || !buf_len) {
+        LOG_err (FIO_LOG, INO_CON_H"Failed to get multipart init data from the server !", INO_T (wdata->ino), con);
+        wdata->fop->upload_failed = TRUE;
+        fileio_write_send_part (wdata);
+        fileio_write_resume_writers (wdata->fop);
+        return;
+    }
+
+    uploadid = xml_get_value (buf, buf_len, "//s3:UploadId");
+    if (!uploadid) {
+        LOG_err (FIO_LOG, INO_CON_H"Failed to parse multipart init data!", INO_T (wdata->ino), con);
+        wdata->fop->upload_failed = TRUE;
+        fileio_write_send_part (wdata);
+        fileio_write_resume_writers (wdata->fop);
+        return;
+    }
+    wdata->fop->uploadid = uploadid;
+
+    // done, resume uploading parts
+    wdata->fop->part_number = 1;
+    fileio_write_send_part (wdata);
+    fileio_write_resume_writers (wdata->fop);
+}
+
+// got HttpConnection object
+static void fileio_write_on_multipart_init_con_cb (gpointer client, gpointer ctx)
+{
+    HttpConnection *con = (HttpConnection *) client;
+    FileWriteData *wdata = (FileWriteData *) ctx;
+    gboolean res;
+    gchar *path;
+    const gchar *cc_header;
+
+    http_connection_acquire (con);
+
+    path = g_strdup_printf ("%s?uploads", wdata->fop->fname);
 
-    doc = xmlReadMemory (xml, xml_len, "", NULL, 0);
-    ctx = xmlXPathNewContext (doc);
-    xmlXPathRegisterNs (ctx, (xmlChar *) "s3", (xmlChar *) "http://s3.amazonaws.com/doc/2006-03-01/");
+    // send storage class with the init request
+    http_connection_add_output_header (con, "x-amz-storage-class", conf_get_string (application_get_conf (con->app), "s3.storage_type"));
 
-    uploadid_xp = xmlXPathEvalExpression ((xmlChar *) "//s3:UploadId", ctx);
-    if (!uploadid_xp) {
-        LOG_err (FIO_LOG, "S3 returned incorrect XML !");
-        xmlXPathFreeContext (ctx);
-        xmlFreeDoc (doc);
-        return NULL;
+    // headers which don't depend on the file data, objects larger than 5 GB keep them without headers update
+    cc_header = conf_get_string (application_get_conf (con->app), "s3.cache_control");
+    if (cc_header && strlen (cc_header))
+        http_connection_add_output_header (con, "Cache-Control", cc_header);
+#ifdef USE_MIMETYPES
+    {
+        const gchar *mime_type = mimetypes_find ((char *) wdata->fop->fname);
+        if (mime_type)
+            http_connection_add_output_header (con, "Content-Type", mime_type);
     }
+#endif
+
+    res = http_connection_make_request (con,
+        path, "POST", NULL, TRUE, NULL,
+        fileio_write_on_multipart_init_cb,
+        wdata
+    );
+    g_free (path);
 
-    nodes = uploadid_xp->nodesetval;
-    if (!nodes) {
-        LOG_err (FIO_LOG, "S3 returned incorrect XML !");
-        xmlXPathFreeObject (uploadid_xp);
-        xmlXPathFreeContext (ctx);
-        xmlFreeDoc (doc);
-        return NULL;
+    // fileio_write_on_multipart_init_cb () is already called
+    if (!res)
+        LOG_err (FIO_LOG, INO_CON_H"Failed to create HTTP request !", INO_T (wdata->ino), con);
+}
+
+static void fileio_write_init_multipart (FileWriteData *wdata)
+{
+    // writers wait for UploadID from now on
+    wdata->fop->multipart_initiated = TRUE;
+
+    if (!client_pool_get_client (application_get_write_client_pool (wdata->fop->app),
+        fileio_write_on_multipart_init_con_cb, wdata)) {
+        LOG_err (FIO_LOG, INO_H"Failed to get HTTP client !", INO_T (wdata->ino));
+        wdata->fop->upload_failed = TRUE;
+        fileio_write_send_part (wdata);
+        return;
     }
+}
+/*}}}*/
+
+// hand off the written data to the uploader if it exceeds "part_size", answer the writer
+static void fileio_write_append_done (FileWriteData *wdata)
+{
+    FileIO *fop = wdata->fop;
+
+    // if data which is not sent exceeds "part_size" - this is a multipart upload
+    if (fop->current_size - fop->part_start >= fileio_upload_part_size (fop)) {
+        // init multipart upload
+        if (!fop->multipart_initiated) {
+            fileio_write_init_multipart (wdata);
+
+        // else hand off the current part to the uploader
+        } else {
+            fileio_write_send_part (wdata);
+        }
 
-    if (!nodes || nodes->nodeNr < 1) {
-        uploadid = NULL;
+    // or just notify client that we are ready for more data
     } else {
-        uploadid = (char *) xmlNodeListGetString (doc, nodes->nodeTab[0]->xmlChildrenNode, 1);
+        wdata->on_buffer_written_cb (fop, wdata->ctx, TRUE, wdata->buf_size);
+        g_free (wdata);
     }
+}
+
+// FPS_cache: the cache file is the only copy of the written data, the writer is answered when it's stored
+static void fileio_write_on_cache_stored_cb (gboolean success, void *ctx)
+{
+    FileWriteData *wdata = (FileWriteData *) ctx;
 
-    xmlXPathFreeObject (uploadid_xp);
-    xmlXPathFreeContext (ctx);
-    xmlFreeDoc (doc);
+    if (!success) {
+        LOG_err (FIO_LOG, INO_H"Failed to store written data in the cache, aborting upload !", INO_T (wdata->ino));
+        wdata->fop->upload_failed = TRUE;
+        wdata->on_buffer_written_cb (wdata->fop, wdata->ctx, FALSE, 0);
+        g_free (wdata);
+        return;
+    }
 
-    return uploadid;
+    fileio_write_append_done (wdata);
 }
 
-static void fileio_write_on_multipart_init_cb (HttpConnection *con, void *ctx, gboolean success,
+// append data to the sequentially written file, "buf" is NULL if data is taken from the uploaded file (FPS_file)
+static void fileio_write_append (FileIO *fop,
+    const char *buf, size_t buf_size, off_t off, fuse_ino_t ino,
+    FileIO_on_buffer_written_cb on_buffer_written_cb, gpointer ctx)
+{
+    FileWriteData *wdata;
+
+    // one of the parts failed to upload, the object can't be completed
+    if (fop->upload_failed) {
+        LOG_err (FIO_LOG, INO_H"Multipart upload failed, aborting operation !", INO_T (ino));
+        on_buffer_written_cb (fop, ctx, FALSE, 0);
+        return;
+    }
+
+    // add data to output buffer, otherwise parts are sent straight from the cache files (or the uploaded file)
+    if (fop->part_source == FPS_memory)
+        evbuffer_add (fop->write_buf, buf, buf_size);
+    fop->current_size += buf_size;
+
+    LOG_debug (FIO_LOG, INO_H"Write buf size: %"G_GUINT64_FORMAT, INO_T (ino), fop->current_size - fop->part_start);
+
+    // init helper struct
+    wdata = g_new0 (FileWriteData, 1);
+    wdata->fop = fop;
+    wdata->buf_size = buf_size;
+    wdata->off = off;
+    wdata->ino = ino;
+    wdata->on_buffer_written_cb = on_buffer_written_cb;
+    wdata->ctx = ctx;
+
+    // CacheMng, data of staging files is not cached
+    if (!fop->is_staged_upload) {
+        // cached data doesn't match the remote object anymore
+        cache_mng_update_etag (application_get_cache_mng (fop->app), ino, NULL);
+
+        // blocks are kept in the cache until they are uploaded
+        if (fop->part_source == FPS_cache) {
+            if (!fop->cache_pinned) {
+                cache_mng_pin_file (application_get_cache_mng (fop->app), fop->ino);
+                fop->cache_pinned = TRUE;
+            }
+            cache_mng_store_file_buf (application_get_cache_mng (fop->app),
+                ino, buf_size, off, (unsigned char *) buf,
+                fileio_write_on_cache_stored_cb, wdata);
+            return;
+        }
+
+        cache_mng_store_file_buf (application_get_cache_mng (fop->app),
+            ino, buf_size, off, (unsigned char *) buf,
+            NULL, NULL);
+    }
+
+    fileio_write_append_done (wdata);
+}
+
+void fileio_write_buffer (FileIO *fop,
+    const char *buf, size_t buf_size, off_t off, fuse_ino_t ino,
+    FileIO_on_buffer_written_cb on_buffer_written_cb, gpointer ctx)
+{
+    // random write, overwrite of the existing object or write-back mode: use the local staging file
+    if (fileio_is_staged (fop) || fop->object_size > 0 ||
+        (off >= 0 && fop->current_size != (guint64)off) ||
+        (!fop->is_staged_upload && application_get_write_back (fop->app))) {
+        fileio_stage_write (fop, buf, buf_size, off, on_buffer_written_cb, ctx);
+        return;
+    }
+
+    fileio_write_append (fop, buf, buf_size, off, ino, on_buffer_written_cb, ctx);
+}
+/*}}}*/
+
+/*{{{ fileio_read_buffer*/
+
+typedef struct {
+    FileIO *fop;
+    guint64 size;
+    off_t off;
+    fuse_ino_t ino;
+    guint64 block; // block which is being downloaded
+    FileIO_on_buffer_read_cb on_buffer_read_cb;
+    gpointer ctx;
+} FileReadData;
+
+static void fileio_read_get_buf (FileReadData *rdata);
+
+// return the range of file covered by block
+static void fileio_read_block_range (FileIO *fop, guint64 block, guint64 *start, guint64 *len)
+{
+    guint64 block_size = conf_get_uint (application_get_conf (fop->app), "s3.read_block_size");
+
+    *start = block * block_size;
+    *len = MIN (block_size, fop->file_size - *start);
+}
+
+// remember which version of the object the cached data belongs to
+static void fileio_read_update_cache_id (FileIO *fop, fuse_ino_t ino, struct evkeyvalq *headers)
+{
+    const char *versioning_header;
+    const char *etag_header;
+
+    versioning_header = http_find_header (headers, "x-amz-version-id");
+    if (versioning_header)
+        cache_mng_update_version_id (application_get_cache_mng (fop->app), ino, versioning_header);
+
+    etag_header = http_find_header (headers, "ETag");
+    if (etag_header) {
+        gchar *etag = str_remove_quotes (g_strdup (etag_header));
+        cache_mng_update_etag (application_get_cache_mng (fop->app), ino, etag);
+        g_free (etag);
+    }
+}
+
+/*{{{ read-ahead */
+
+typedef struct {
+    FileIO *fop;
+    guint64 block;
+    guint64 off;
+    guint64 size;
+    struct timeval start_tv;
+} FileReadAheadData;
+
+static void fileio_readahead_schedule (FileIO *fop);
+
+// read-ahead data is received
+static void fileio_readahead_on_get_cb (HttpConnection *con, void *ctx, gboolean success,
     const gchar *buf, size_t buf_len,
-    G_GNUC_UNUSED struct evkeyvalq *headers)
+    struct evkeyvalq *headers)
 {
-    FileWriteData *wdata = (FileWriteData *) ctx;
-    gchar *uploadid;
+    FileReadAheadData *radata = (FileReadAheadData *) ctx;
+    FileIO *fop = radata->fop;
+    struct timeval end_tv;
+    guint64 msec;
+    guint64 rate;
 
     http_connection_release (con);
 
-    wdata->fop->multipart_initiated = TRUE;
+    fop->ra_inflight--;
 
-    if (!success || !buf_len) {
-        LOG_err (FIO_LOG, INO_CON_H"Failed to get multipart init data from the server !", INO_T (wdata->ino), con);
-        wdata->on_buffer_written_cb (wdata->fop, wdata->ctx, FALSE, 0);
-        g_free (wdata);
+    if (!success) {
+        LOG_debug (FIO_LOG, INO_CON_H"Failed to read-ahead [%"G_GUINT64_FORMAT" %"G_GUINT64_FORMAT"]",
+            INO_T (fop->ino), con, radata->off, radata->size);
+        cache_mng_fetch_done (application_get_cache_mng (fop->app), fop->ino, radata->block, FALSE);
+        // let the reader request the data again
+        if (fop->ra_end > radata->off)
+            fop->ra_end = radata->off;
+        fop->ra_window = 0;
+        g_free (radata);
+
+        if (fop->destroy_pending && !fileio_requests_inflight (fop))
+            fileio_destroy (fop);
+        return;
+    }
+
+    // store data even if FileIO is released, other readers might wait for it
+    cache_mng_store_file_buf (application_get_cache_mng (fop->app),
+        fop->ino, buf_len, radata->off, (unsigned char *) buf,
+        NULL, NULL);
+    fileio_read_update_cache_id (fop, fop->ino, headers);
+    cache_mng_fetch_done (application_get_cache_mng (fop->app), fop->ino, radata->block, TRUE);
+
+    if (fop->destroy_pending) {
+        g_free (radata);
+        if (!fileio_requests_inflight (fop))
+            fileio_destroy (fop);
         return;
     }
 
-    uploadid = get_uploadid (buf, buf_len);
-    if (!uploadid) {
-        LOG_err (FIO_LOG, INO_CON_H"Failed to parse multipart init data!", INO_T (wdata->ino), con);
-        wdata->on_buffer_written_cb (wdata->fop, wdata->ctx, FALSE, 0);
-        g_free (wdata);
-        return;
+    // adjust the window: if throughput drops to less than a half of the best observed value,
+    // the link is saturated and the window is too large
+    gettimeofday (&end_tv, NULL);
+    msec = timeval_diff (&radata->start_tv, &end_tv);
+    if (msec == 0)
+        msec = 1;
+    rate = (guint64) buf_len * 1000 / msec;
+    if (rate > fop->ra_best_rate)
+        fop->ra_best_rate = rate;
+    else if (rate < fop->ra_best_rate / 2 && fop->ra_window > conf_get_uint (application_get_conf (fop->app), "s3.read_block_size")) {
+        fop->ra_window /= 2;
+        LOG_debug (FIO_LOG, INO_H"Throughput dropped, shrinking read-ahead window to %"G_GUINT64_FORMAT,
+            INO_T (fop->ino), fop->ra_window);
     }
-    wdata->fop->uploadid = g_strdup (uploadid);
-    xmlFree (uploadid);
 
-    // done, resume uploading part
-    wdata->fop->part_number = 1;
-    fileio_write_send_part (wdata);
+    LOG_debug (FIO_LOG, INO_H"Read-ahead stored [%"G_GUINT64_FORMAT" %zu] in %"G_GUINT64_FORMAT" ms",
+        INO_T (fop->ino), radata->off, buf_len, msec);
+
+    g_free (radata);
+
+    // keep the pipeline full
+    fileio_readahead_schedule (fop);
 }
 
 // got HttpConnection object
-static void fileio_write_on_multipart_init_con_cb (gpointer client, gpointer ctx)
+static void fileio_readahead_on_con_cb (gpointer client, gpointer ctx)
 {
     HttpConnection *con = (HttpConnection *) client;
-    FileWriteData *wdata = (FileWriteData *) ctx;
+    FileReadAheadData *radata = (FileReadAheadData *) ctx;
+    FileIO *fop = radata->fop;
+    fuse_ino_t ino = fop->ino;
+    gchar *range_hdr;
     gboolean res;
-    gchar *path;
 
     http_connection_acquire (con);
 
-    path = g_strdup_printf ("%s?uploads", wdata->fop->fname);
+    range_hdr = g_strdup_printf ("bytes=%"G_GUINT64_FORMAT"-%"G_GUINT64_FORMAT,
+        radata->off, radata->off + radata->size - 1);
+    http_connection_add_output_header (con, "Range", range_hdr);
+    g_free (range_hdr);
 
-    // send storage class with the init request
-    http_connection_add_output_header (con, "x-amz-storage-class", conf_get_string (application_get_conf (con->app), "s3.storage_type"));
+    gettimeofday (&radata->start_tv, NULL);
 
     res = http_connection_make_request (con,
-        path, "POST", NULL, TRUE, NULL,
-        fileio_write_on_multipart_init_cb,
-        wdata
+        fop->fname, "GET", NULL, TRUE, NULL,
+        fileio_readahead_on_get_cb,
+        radata
     );
-    g_free (path);
 
-    if (!res) {
-        LOG_err (FIO_LOG, INO_CON_H"Failed to create HTTP request !", INO_T (wdata->ino), con);
-        http_connection_release (con);
-        wdata->on_buffer_written_cb (wdata->fop, wdata->ctx, FALSE, 0);
-        g_free (wdata);
-        return;
-    }
+    // the response callback is already called, FileIO could be destroyed by it
+    if (!res)
+        LOG_err (FIO_LOG, INO_CON_H"Failed to create HTTP request !", INO_T (ino), con);
 }
 
-static void fileio_write_init_multipart (FileWriteData *wdata)
+// send read-ahead requests until the window is filled
+static void fileio_readahead_schedule (FileIO *fop)
 {
-    if (!client_pool_get_client (application_get_write_client_pool (wdata->fop->app),
-        fileio_write_on_multipart_init_con_cb, wdata)) {
-        LOG_err (FIO_LOG, INO_H"Failed to get HTTP client !", INO_T (wdata->ino));
-        wdata->on_buffer_written_cb (wdata->fop, wdata->ctx, FALSE, 0);
-        g_free (wdata);
+    ConfData *conf = application_get_conf (fop->app);
+    ClientPool *pool = application_get_read_client_pool (fop->app);
+    CacheMng *cmng = application_get_cache_mng (fop->app);
+    guint64 block_size;
+    guint64 window_end;
+    guint max_inflight;
+
+    if (!fop->ra_window || fop->destroy_pending)
         return;
+
+    block_size = conf_get_uint (conf, "s3.read_block_size");
+
+    // always leave one connection for the reader
+    max_inflight = conf_get_uint (conf, "s3.readahead_max_requests");
+    if (client_pool_get_client_count (pool) > 1 && max_inflight >= (guint) client_pool_get_client_count (pool))
+        max_inflight = client_pool_get_client_count (pool) - 1;
+    if (!max_inflight)
+        max_inflight = 1;
+
+    window_end = fop->ra_next_off + fop->ra_window;
+    if (window_end > fop->file_size)
+        window_end = fop->file_size;
+
+    // requests are aligned to blocks
+    if (fop->ra_end < fop->ra_next_off)
+        fop->ra_end = (fop->ra_next_off / block_size) * block_size;
+
+    while (fop->ra_inflight < max_inflight && fop->ra_end < window_end) {
+        FileReadAheadData *radata;
+        guint64 block, start, size;
+
+        block = fop->ra_end / block_size;
+        fileio_read_block_range (fop, block, &start, &size);
+        fop->ra_end = start + size;
+
+        // already stored in local cache or is being downloaded
+        if (cache_mng_contains (cmng, fop->ino, size, start) ||
+            !cache_mng_fetch_begin (cmng, fop->ino, block, NULL, NULL))
+            continue;
+
+        radata = g_new0 (FileReadAheadData, 1);
+        radata->fop = fop;
+        radata->block = block;
+        radata->off = start;
+        radata->size = size;
+
+        LOG_debug (FIO_LOG, INO_H"Read-ahead [%"G_GUINT64_FORMAT" %"G_GUINT64_FORMAT"], window: %"G_GUINT64_FORMAT,
+            INO_T (fop->ino), radata->off, radata->size, fop->ra_window);
+
+        fop->ra_inflight++;
+
+        if (!client_pool_get_client (pool, fileio_readahead_on_con_cb, radata)) {
+            LOG_debug (FIO_LOG, INO_H"Failed to get HTTP client for read-ahead !", INO_T (fop->ino));
+            cache_mng_fetch_done (cmng, fop->ino, block, FALSE);
+            fop->ra_inflight--;
+            fop->ra_end = radata->off;
+            g_free (radata);
+            break;
+        }
     }
 }
-/*}}}*/
 
-void fileio_write_buffer (FileIO *fop,
-    const char *buf, size_t buf_size, off_t off, fuse_ino_t ino,
-    FileIO_on_buffer_written_cb on_buffer_written_cb, gpointer ctx)
+// track the access pattern of reader
+static void fileio_readahead_update (FileIO *fop, size_t size, off_t off)
 {
-    FileWriteData *wdata;
+    ConfData *conf = application_get_conf (fop->app);
 
-    // XXX: allow only sequentially write
-    // current written bytes should be always match offset
-    if (off >= 0 && fop->current_size != (guint64)off) {
-        LOG_err (FIO_LOG, INO_H"Write call with offset %"OFF_FMT" is not allowed !", INO_T (ino), off);
-        on_buffer_written_cb (fop, ctx, FALSE, 0);
+    if (!conf_get_boolean (conf, "s3.readahead_enabled"))
         return;
-    }
-
-    // add data to output buffer
-    evbuffer_add (fop->write_buf, buf, buf_size);
-    fop->current_size += buf_size;
 
-    LOG_debug (FIO_LOG, INO_H"Write buf size: %zd", INO_T (ino), evbuffer_get_length (fop->write_buf));
+    if (off >= 0 && (guint64) off == fop->ra_next_off) {
+        fop->ra_seq_count++;
+    } else {
+        // random access, drop the window
+        if (fop->ra_window)
+            LOG_debug (FIO_LOG, INO_H"Random access detected, disabling read-ahead", INO_T (fop->ino));
+        fop->ra_seq_count = 0;
+        fop->ra_window = 0;
+        fop->ra_end = 0;
+    }
 
-    // CacheMng
-    cache_mng_store_file_buf (application_get_cache_mng (fop->app),
-        ino, buf_size, off, (unsigned char *) buf,
-        NULL, NULL);
+    fop->ra_next_off = off + size;
 
-    // if current write buffer exceeds "part_size" - this is a multipart upload
-    if (evbuffer_get_length (fop->write_buf) >= conf_get_uint (application_get_conf (fop->app), "s3.part_size")) {
-        // init helper struct
-        wdata = g_new0 (FileWriteData, 1);
-        wdata->fop = fop;
-        wdata->buf_size = buf_size;
-        wdata->off = off;
-        wdata->ino = ino;
-        wdata->on_buffer_written_cb = on_buffer_written_cb;
-        wdata->ctx = ctx;
+    if (fop->ra_seq_count >= FIO_RA_SEQ_THRESHOLD && !fop->ra_window)
+        fop->ra_window = conf_get_uint (conf, "s3.read_block_size");
+}
 
-        // init multipart upload
-        if (!fop->multipart_initiated) {
-            fileio_write_init_multipart (wdata);
+// reader has to wait for the data, the window is too small
+static void fileio_readahead_grow (FileIO *fop)
+{
+    guint64 max_window;
 
-        // else send the current part
-        } else {
-            fileio_write_send_part (wdata);
-        }
+    if (!fop->ra_window)
+        return;
 
-    // or just notify client that we are ready for more data
-    } else {
-        on_buffer_written_cb (fop, ctx, TRUE, buf_size);
+    max_window = conf_get_uint (application_get_conf (fop->app), "s3.readahead_max_window");
+    if (fop->ra_window * 2 <= max_window) {
+        fop->ra_window *= 2;
+        LOG_debug (FIO_LOG, INO_H"Growing read-ahead window to %"G_GUINT64_FORMAT, INO_T (fop->ino), fop->ra_window);
     }
 }
 /*}}}*/
 
-/*{{{ fileio_read_buffer*/
+/*{{{ GET request */
+
+// return the first block of the requested range which is not stored in local cache
+static guint64 fileio_read_first_missing_block (FileReadData *rdata)
+{
+    guint64 block_size = conf_get_uint (application_get_conf (rdata->fop->app), "s3.read_block_size");
+    guint64 block, last_block;
+    guint64 start, len;
+
+    block = rdata->off / block_size;
+    last_block = rdata->size ? (rdata->off + rdata->size - 1) / block_size : block;
+
+    for (; block < last_block; block++) {
+        fileio_read_block_range (rdata->fop, block, &start, &len);
+        if (!cache_mng_contains (application_get_cache_mng (rdata->fop->app), rdata->ino, len, start))
+            break;
+    }
+
+    return block;
+}
 
+// block download, the block is requested using one or several ranges at once
+// and its data is stored in local cache as soon as it arrives
 typedef struct {
     FileIO *fop;
-    guint64 size;
-    off_t off;
     fuse_ino_t ino;
-    off_t request_offset;
-    FileIO_on_buffer_read_cb on_buffer_read_cb;
-    gpointer ctx;
-} FileReadData;
+    guint64 block;
+    GList *l_readers; // list of FileReadData, readers which are not answered yet
+    guint parts_left;
+    gboolean failed;
+} FileReadFetch;
 
-static void fileio_read_get_buf (FileReadData *rdata);
+typedef struct {
+    FileReadFetch *fetch;
+    guint64 off;
+    guint64 size;
+} FileReadFetchPart;
 
-/*{{{ GET request */
-static void fileio_read_on_get_cb (HttpConnection *con, void *ctx, gboolean success,
-    const gchar *buf, size_t buf_len,
-    G_GNUC_UNUSED struct evkeyvalq *headers)
+// return the download of the block, if it's requested by this FileIO
+static FileReadFetch *fileio_read_find_fetch (FileIO *fop, guint64 block)
 {
-    FileReadData *rdata = (FileReadData *) ctx;
-    const char *versioning_header = NULL;
+    GList *l;
 
-    // release HttpConnection
-    http_connection_release (con);
+    for (l = g_list_first (fop->l_fetches); l; l = g_list_next (l)) {
+        FileReadFetch *fetch = (FileReadFetch *) l->data;
+        if (fetch->block == block)
+            return fetch;
+    }
 
-    if (!success) {
-        LOG_err (FIO_LOG, INO_CON_H"Failed to get file from server !", INO_T (rdata->ino), con);
-        rdata->on_buffer_read_cb (rdata->ctx, FALSE, NULL, 0);
-        g_free (rdata);
+    return NULL;
+}
+
+// answer readers which requested ranges are already stored in local cache
+static void fileio_read_fetch_check_readers (FileReadFetch *fetch)
+{
+    GList *l, *l_next;
+
+    for (l = g_list_first (fetch->l_readers); l; l = l_next) {
+        FileReadData *rdata = (FileReadData *) l->data;
+        guint64 end;
+
+        l_next = g_list_next (l);
+
+        end = MIN ((guint64) rdata->off + rdata->size, fetch->fop->file_size);
+        if ((guint64) rdata->off >= end ||
+            !cache_mng_contains (application_get_cache_mng (fetch->fop->app), rdata->ino, end - rdata->off, rdata->off))
+            continue;
+
+        LOG_debug (FIO_LOG, INO_H"Range [%"OFF_FMT" %"G_GUINT64_FORMAT"] is received, answering the reader",
+            INO_T (rdata->ino), rdata->off, end - rdata->off);
+
+        fetch->l_readers = g_list_delete_link (fetch->l_readers, l);
+        fileio_read_get_buf (rdata);
+    }
+}
+
+static void fileio_read_fetch_part_done (FileReadFetch *fetch)
+{
+    FileIO *fop = fetch->fop;
+    GList *l;
+
+    if (--fetch->parts_left)
         return;
+
+    // all parts are received
+    fop->l_fetches = g_list_remove (fop->l_fetches, fetch);
+
+    // notify readers which wait for the same block
+    cache_mng_fetch_done (application_get_cache_mng (fop->app), fetch->ino, fetch->block, !fetch->failed);
+
+    for (l = g_list_first (fetch->l_readers); l; l = g_list_next (l)) {
+        FileReadData *rdata = (FileReadData *) l->data;
+
+        if (fetch->failed) {
+            rdata->on_buffer_read_cb (rdata->ctx, FALSE, NULL);
+            g_free (rdata);
+        } else
+            fileio_read_get_buf (rdata);
     }
+    g_list_free (fetch->l_readers);
+    g_free (fetch);
+
+    if (fop->destroy_pending && !fileio_requests_inflight (fop))
+        fileio_destroy (fop);
+}
+
+// a part of the response body is received
+static void fileio_read_fetch_on_chunk_cb (G_GNUC_UNUSED HttpConnection *con, void *ctx,
+    const gchar *buf, size_t buf_len, guint64 offset)
+{
+    FileReadFetchPart *part = (FileReadFetchPart *) ctx;
+    FileReadFetch *fetch = part->fetch;
 
     // store it in the local cache
-    cache_mng_store_file_buf (application_get_cache_mng (rdata->fop->app),
-        rdata->ino, buf_len, rdata->request_offset, (unsigned char *) buf,
+    cache_mng_store_file_buf (application_get_cache_mng (fetch->fop->app),
+        fetch->ino, buf_len, part->off + offset, (unsigned char *) buf,
         NULL, NULL);
 
-    // update version ID
-    versioning_header = http_find_header (headers, "x-amz-version-id");
-    if (versioning_header) {
-        cache_mng_update_version_id (application_get_cache_mng (rdata->fop->app), rdata->ino, versioning_header);
+    fileio_read_fetch_check_readers (fetch);
+}
+
+static void fileio_read_fetch_on_get_cb (HttpConnection *con, void *ctx, gboolean success,
+    G_GNUC_UNUSED const gchar *buf, G_GNUC_UNUSED size_t buf_len,
+    struct evkeyvalq *headers)
+{
+    FileReadFetchPart *part = (FileReadFetchPart *) ctx;
+    FileReadFetch *fetch = part->fetch;
+
+    // release HttpConnection
+    http_connection_release (con);
+
+    if (!success) {
+        LOG_err (FIO_LOG, INO_CON_H"Failed to get file range [%"G_GUINT64_FORMAT" %"G_GUINT64_FORMAT"] from server !",
+            INO_T (fetch->ino), con, part->off, part->size);
+        fetch->failed = TRUE;
+    } else {
+        // update version ID and ETag
+        fileio_read_update_cache_id (fetch->fop, fetch->ino, headers);
+
+        LOG_debug (FIO_LOG, INO_H"Stored [%"G_GUINT64_FORMAT" %"G_GUINT64_FORMAT"]", INO_T (fetch->ino), part->off, part->size);
     }
 
-    LOG_debug (FIO_LOG, INO_H"Storing [%"G_GUINT64_FORMAT" %zu]", INO_T(rdata->ino), rdata->request_offset, buf_len);
+    g_free (part);
 
-    // and read it
-    fileio_read_get_buf (rdata);
+    fileio_read_fetch_part_done (fetch);
 }
 
 // got HttpConnection object
-static void fileio_read_on_con_cb (gpointer client, gpointer ctx)
+static void fileio_read_fetch_on_con_cb (gpointer client, gpointer ctx)
 {
     HttpConnection *con = (HttpConnection *) client;
-    FileReadData *rdata = (FileReadData *) ctx;
+    FileReadFetchPart *part = (FileReadFetchPart *) ctx;
+    FileReadFetch *fetch = part->fetch;
     gboolean res;
-    guint64 part_size;
 
     http_connection_acquire (con);
 
-    part_size = conf_get_uint (application_get_conf (rdata->fop->app), "s3.part_size");
-
-    // small file - get the whole file at once
-    if (rdata->fop->file_size < part_size)
-        rdata->request_offset = 0;
-
-    // calculate offset
-    else {
+    // small file is requested at once
+    if (part->off > 0 || part->size < fetch->fop->file_size) {
         gchar *range_hdr;
 
-        if (part_size < rdata->size)
-            part_size = rdata->size;
-
-        rdata->request_offset = rdata->off;
         range_hdr = g_strdup_printf ("bytes=%"G_GUINT64_FORMAT"-%"G_GUINT64_FORMAT,
-            (gint64)rdata->request_offset, (gint64)(rdata->request_offset + part_size));
+            part->off, part->off + part->size - 1);
         http_connection_add_output_header (con, "Range", range_hdr);
         g_free (range_hdr);
     }
 
+    // deliver the body while it's being received
+    http_connection_set_on_chunk_cb (con, fileio_read_fetch_on_chunk_cb);
+
     res = http_connection_make_request (con,
-        rdata->fop->fname, "GET", NULL, TRUE, NULL,
-        fileio_read_on_get_cb,
-        rdata
+        fetch->fop->fname, "GET", NULL, TRUE, NULL,
+        fileio_read_fetch_on_get_cb,
+        part
     );
 
-    if (!res) {
-        LOG_err (FIO_LOG, INO_CON_H"Failed to create HTTP request !", INO_T (rdata->ino), con);
-        http_connection_release (con);
-        rdata->on_buffer_read_cb (rdata->ctx, FALSE, NULL, 0);
-        g_free (rdata);
-        return;
+    // fileio_read_fetch_on_get_cb () is already called
+    if (!res)
+        LOG_err (FIO_LOG, INO_CON_H"Failed to create HTTP request !", INO_T (fetch->ino), con);
+}
+
+// download the block requested by the reader,
+// large block is split into aligned sub-ranges which are requested using several connections at once
+static void fileio_read_fetch_block (FileReadData *rdata)
+{
+    FileIO *fop = rdata->fop;
+    ClientPool *pool = application_get_read_client_pool (fop->app);
+    FileReadFetch *fetch;
+    guint64 start, len, end, sub_size, off;
+    guint parts;
+
+    fileio_read_block_range (fop, rdata->block, &start, &len);
+    end = start + len;
+
+    parts = conf_get_uint (application_get_conf (fop->app), "s3.parallel_get_parts");
+    if (parts > (guint) client_pool_get_client_count (pool))
+        parts = client_pool_get_client_count (pool);
+
+    if (parts < 2 || len < 2 * FIO_FANOUT_ALIGN) {
+        sub_size = len;
+    } else {
+        // sub-range size, aligned to FIO_FANOUT_ALIGN
+        sub_size = len / parts;
+        sub_size = ((sub_size + FIO_FANOUT_ALIGN - 1) / FIO_FANOUT_ALIGN) * FIO_FANOUT_ALIGN;
+
+        LOG_debug (FIO_LOG, INO_H"Requesting [%"G_GUINT64_FORMAT" %"G_GUINT64_FORMAT"] in ranges of %"G_GUINT64_FORMAT" bytes",
+            INO_T (rdata->ino), start, len, sub_size);
+    }
+
+    fetch = g_new0 (FileReadFetch, 1);
+    fetch->fop = fop;
+    fetch->ino = rdata->ino;
+    fetch->block = rdata->block;
+    fetch->l_readers = g_list_append (NULL, rdata);
+    fetch->failed = FALSE;
+    // hold an extra reference, so fetch can't be finished before all parts are sent
+    fetch->parts_left = 1;
+
+    fop->l_fetches = g_list_prepend (fop->l_fetches, fetch);
+
+    for (off = start; off < end && !fetch->failed; off += sub_size) {
+        FileReadFetchPart *part;
+
+        part = g_new0 (FileReadFetchPart, 1);
+        part->fetch = fetch;
+        part->off = off;
+        part->size = MIN (sub_size, end - off);
+
+        fetch->parts_left++;
+        if (!client_pool_get_client (pool, fileio_read_fetch_on_con_cb, part)) {
+            LOG_err (FIO_LOG, INO_H"Failed to get HTTP client !", INO_T (rdata->ino));
+            fetch->failed = TRUE;
+            fetch->parts_left--;
+            g_free (part);
+        }
     }
+
+    fileio_read_fetch_part_done (fetch);
+}
+
+static void fileio_read_on_cache_cb (struct fuse_bufvec *bufv, gboolean success, void *ctx);
+
+// other reader has downloaded the block we are waiting for
+static void fileio_read_on_fetch_done_cb (gboolean success, void *ctx)
+{
+    FileReadData *rdata = (FileReadData *) ctx;
+
+    // try to read it from cache, or download it by ourselves
+    if (success)
+        fileio_read_get_buf (rdata);
+    else
+        fileio_read_on_cache_cb (NULL, FALSE, rdata);
 }
 
-static void fileio_read_on_cache_cb (unsigned char *buf, size_t size, gboolean success, void *ctx)
+static void fileio_read_on_cache_cb (struct fuse_bufvec *bufv, gboolean success, void *ctx)
 {
     FileReadData *rdata = (FileReadData *) ctx;
+    FileReadFetch *fetch;
+    guint64 start, len;
 
     // we got data from the cache
     if (success) {
+        FileIO *fop = rdata->fop;
+
         LOG_debug (FIO_LOG, INO_H"Reading from cache", INO_T (rdata->ino));
-        rdata->on_buffer_read_cb (rdata->ctx, TRUE, (char *)buf, size);
+        rdata->on_buffer_read_cb (rdata->ctx, TRUE, bufv);
         g_free (rdata);
-    } else {
-        LOG_debug (FIO_LOG, INO_H"Reading from server !", INO_T (rdata->ino));
-        if (!client_pool_get_client (application_get_read_client_pool (rdata->fop->app), fileio_read_on_con_cb, rdata)) {
-            LOG_err (FIO_LOG, INO_H"Failed to get HTTP client !", INO_T (rdata->ino));
-            rdata->on_buffer_read_cb (rdata->ctx, FALSE, NULL, 0);
-            g_free (rdata);
-            return;
-        }
+
+        // fetch data ahead of the reader
+        fileio_readahead_schedule (fop);
+        return;
+    }
+
+    // sequential reader is waiting for the data
+    fileio_readahead_grow (rdata->fop);
+
+    rdata->block = fileio_read_first_missing_block (rdata);
+
+    // the block is being downloaded for this file, wait for the requested range
+    fetch = fileio_read_find_fetch (rdata->fop, rdata->block);
+    if (fetch) {
+        fetch->l_readers = g_list_append (fetch->l_readers, rdata);
+        fileio_read_fetch_check_readers (fetch);
+        return;
     }
+
+    // the block is already being downloaded by other reader
+    if (!cache_mng_fetch_begin (application_get_cache_mng (rdata->fop->app), rdata->ino, rdata->block,
+        fileio_read_on_fetch_done_cb, rdata))
+        return;
+
+    LOG_debug (FIO_LOG, INO_H"Reading block %"G_GUINT64_FORMAT" from server !", INO_T (rdata->ino), rdata->block);
+
+    // do not read-ahead the data we are requesting now
+    fileio_read_block_range (rdata->fop, rdata->block, &start, &len);
+    if (rdata->fop->ra_window && rdata->fop->ra_end < start + len)
+        rdata->fop->ra_end = start + len;
+
+    fileio_read_fetch_block (rdata);
 }
 
 static void fileio_read_get_buf (FileReadData *rdata)
 {
     if ((guint64)rdata->off >= rdata->fop->file_size) {
         // requested range is outsize the file size
+        struct fuse_bufvec bufv = FUSE_BUFVEC_INIT (0);
+
         LOG_debug (FIO_LOG, INO_H"requested size is beyond the file size!", INO_T (rdata->ino));
-        fileio_read_on_cache_cb (NULL, 0, TRUE, rdata);
+        fileio_read_on_cache_cb (&bufv, TRUE, rdata);
         return;
     }
 
@@ -875,7 +2288,7 @@ static void fileio_read_get_buf (FileReadData *rdata)
     LOG_debug (FIO_LOG, INO_H"requesting [%"OFF_FMT": %"G_GUINT64_FORMAT"], file size: %"G_GUINT64_FORMAT,
         INO_T (rdata->ino), rdata->off, rdata->size, rdata->fop->file_size);
 
-    cache_mng_retrieve_file_buf (application_get_cache_mng (rdata->fop->app),
+    cache_mng_retrieve_file_bufvec (application_get_cache_mng (rdata->fop->app),
         rdata->ino, rdata->size, rdata->off,
         fileio_read_on_cache_cb, rdata);
 }
@@ -883,12 +2296,46 @@ static void fileio_read_get_buf (FileReadData *rdata)
 
 /*{{{ HEAD request*/
 
+typedef struct {
+    FileReadData *rdata;
+    gchar *remote_md5;
+} FileReadMD5Check;
+
+// local MD5 sum of cached file is calculated
+static void fileio_read_on_md5_cb (const gchar *md5str, void *ctx)
+{
+    FileReadMD5Check *mcheck = (FileReadMD5Check *) ctx;
+    FileReadData *rdata = mcheck->rdata;
+
+    // at this point we have both remote and local MD5 sums
+    if (md5str) {
+        if (!strncmp (mcheck->remote_md5, md5str, 32)) {
+            LOG_debug (FIO_LOG, INO_H"MD5 sums match, using local cached file!", INO_T (rdata->ino));
+        } else {
+            LOG_debug (FIO_LOG, INO_H"MD5 sums do not match, invalidating local cached file!", INO_T (rdata->ino));
+            cache_mng_remove_file (application_get_cache_mng (rdata->fop->app), rdata->ino);
+        }
+    } else {
+        LOG_debug (FIO_LOG, INO_H"Failed to get local MD5 sum, invalidating local cached file!", INO_T (rdata->ino));
+        cache_mng_remove_file (application_get_cache_mng (rdata->fop->app), rdata->ino);
+    }
+
+    g_free (mcheck->remote_md5);
+    g_free (mcheck);
+
+    // resume downloading file
+    fileio_read_get_buf (rdata);
+}
+
 static void fileio_read_on_head_cb (HttpConnection *con, void *ctx, gboolean success,
     G_GNUC_UNUSED const gchar *buf, G_GNUC_UNUSED size_t buf_len,
     struct evkeyvalq *headers)
 {
     FileReadData *rdata = (FileReadData *) ctx;
     const char *content_len_header;
+    const char *etag_header;
+    const char *versioning_header = NULL;
+    gchar *etag = NULL;
     DirTree *dtree;
 
     // release HttpConnection
@@ -896,7 +2343,7 @@ static void fileio_read_on_head_cb (HttpConnection *con, void *ctx, gboolean suc
 
     if (!success) {
         LOG_err (FIO_LOG, INO_CON_H"Failed to get HEAD from server !", INO_T (rdata->ino), con);
-        rdata->on_buffer_read_cb (rdata->ctx, FALSE, NULL, 0);
+        rdata->on_buffer_read_cb (rdata->ctx, FALSE, NULL);
         g_free (rdata);
         return;
     }
@@ -908,10 +2355,15 @@ static void fileio_read_on_head_cb (HttpConnection *con, void *ctx, gboolean suc
 
     // consistency checking:
 
-    // 1. check local and remote file sizes
+    // 0. cached file matches ETag or version ID of the remote object
+    etag_header = http_find_header (headers, "ETag");
+    if (etag_header)
+        etag = str_remove_quotes (g_strdup (etag_header));
+    if (conf_get_boolean (application_get_conf (rdata->fop->app), "s3.versioning"))
+        versioning_header = http_find_header (headers, "x-amz-version-id");
+
     content_len_header = http_find_header (headers, "Content-Length");
     if (content_len_header) {
-        guint64 local_size = 0;
         gint64 size = 0;
 
         size = strtoll ((char *)content_len_header, NULL, 10);
@@ -922,6 +2374,20 @@ static void fileio_read_on_head_cb (HttpConnection *con, void *ctx, gboolean suc
 
         rdata->fop->file_size = size;
         LOG_debug (FIO_LOG, INO_H"Remote file size: %"G_GUINT64_FORMAT, INO_T (rdata->ino), rdata->fop->file_size);
+    }
+
+    if (cache_mng_validate_file (application_get_cache_mng (rdata->fop->app), rdata->ino,
+        rdata->fop->fname, etag, versioning_header)) {
+        LOG_debug (FIO_LOG, INO_H"ETag or version ID match, using local cached file!", INO_T (rdata->ino));
+        g_free (etag);
+        fileio_read_get_buf (rdata);
+        return;
+    }
+    g_free (etag);
+
+    // 1. check local and remote file sizes
+    if (content_len_header) {
+        guint64 local_size = 0;
 
         local_size = cache_mng_get_file_length (application_get_cache_mng (rdata->fop->app), rdata->ino);
         if (local_size != rdata->fop->file_size) {
@@ -935,7 +2401,7 @@ static void fileio_read_on_head_cb (HttpConnection *con, void *ctx, gboolean suc
     // if versioning is enabled: compare version IDs
     // if bucket has versioning disabled: compare MD5 sums
     if (conf_get_boolean (application_get_conf (rdata->fop->app), "s3.versioning")) {
-        const char *versioning_header = http_find_header (headers, "x-amz-version-id");
+        versioning_header = http_find_header (headers, "x-amz-version-id");
         if (versioning_header) {
             const gchar *local_version_id = cache_mng_get_version_id (application_get_cache_mng (rdata->fop->app), rdata->ino);
             if (local_version_id && !strcmp (local_version_id, versioning_header)) {
@@ -956,23 +2422,15 @@ static void fileio_read_on_head_cb (HttpConnection *con, void *ctx, gboolean suc
     } else  {
         const char *md5_header = http_find_header (headers, "x-amz-meta-md5");
         if (md5_header) {
-            gchar *md5str = NULL;
-
-            // at this point we have both remote and local MD5 sums
-            if (cache_mng_get_md5 (application_get_cache_mng (rdata->fop->app), rdata->ino, &md5str)) {
-                if (!strncmp (md5_header, md5str, 32)) {
-                    LOG_debug (FIO_LOG, INO_H"MD5 sums match, using local cached file!", INO_T (rdata->ino));
-                } else {
-                    LOG_debug (FIO_LOG, INO_H"MD5 sums do not match, invalidating local cached file!", INO_T (rdata->ino));
-                    cache_mng_remove_file (application_get_cache_mng (rdata->fop->app), rdata->ino);
-                }
-            } else {
-                LOG_debug (FIO_LOG, INO_H"Failed to get local MD5 sum, invalidating local cached file!", INO_T (rdata->ino));
-                cache_mng_remove_file (application_get_cache_mng (rdata->fop->app), rdata->ino);
-            }
-
-            if (md5str)
-                g_free (md5str);
+            FileReadMD5Check *mcheck;
+
+            // local MD5 sum is calculated in background, downloading is resumed when it's done
+            mcheck = g_new0 (FileReadMD5Check, 1);
+            mcheck->rdata = rdata;
+            mcheck->remote_md5 = g_strdup (md5_header);
+            cache_mng_get_md5 (application_get_cache_mng (rdata->fop->app), rdata->ino,
+                fileio_read_on_md5_cb, mcheck);
+            return;
 
         // header was not found
         } else {
@@ -1003,13 +2461,51 @@ static void fileio_read_on_head_con_cb (gpointer client, gpointer ctx)
     if (!res) {
         LOG_err (FIO_LOG, INO_CON_H"Failed to create HTTP request !", INO_T (rdata->ino), con);
         http_connection_release (con);
-        rdata->on_buffer_read_cb (rdata->ctx, FALSE, NULL, 0);
+        rdata->on_buffer_read_cb (rdata->ctx, FALSE, NULL);
         g_free (rdata);
         return;
     }
 }
 /*}}}*/
 
+// read data from the local staging file
+// return FALSE if the object is not staged
+static gboolean fileio_read_staged (FileIO *fop, size_t size, off_t off,
+    FileIO_on_buffer_read_cb on_buffer_read_cb, gpointer ctx)
+{
+    WriteBack *wb = application_get_write_back (fop->app);
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT (0);
+    gchar *buf;
+    gssize bytes;
+
+    // the existing object is not downloaded yet, the server has the same data
+    if (fop->stage_loading)
+        return FALSE;
+
+    if (fop->stage_fd >= 0) {
+        buf = g_malloc (size);
+        bytes = pread (fop->stage_fd, buf, size, off);
+    } else if (wb && write_back_is_staged (wb, fop->fname + 1)) {
+        buf = g_malloc (size);
+        bytes = write_back_read (wb, fop->fname + 1, buf, size, off);
+    } else
+        return FALSE;
+
+    if (bytes < 0) {
+        g_free (buf);
+        return FALSE;
+    }
+
+    LOG_debug (FIO_LOG, INO_H"Reading [%"OFF_FMT" %zd] from staging file", INO_T (fop->ino), off, bytes);
+
+    bufv.buf[0].mem = buf;
+    bufv.buf[0].size = bytes;
+    on_buffer_read_cb (ctx, TRUE, &bufv);
+    g_free (buf);
+
+    return TRUE;
+}
+
 // if it's the first fuse read() request - send HEAD request to server
 // else try to get data from local cache, otherwise download from the server
 void fileio_read_buffer (FileIO *fop,
@@ -1018,6 +2514,10 @@ void fileio_read_buffer (FileIO *fop,
 {
     FileReadData *rdata;
 
+    // the object has local data which is not uploaded yet
+    if (fileio_read_staged (fop, size, off, on_buffer_read_cb, ctx))
+        return;
+
     rdata = g_new0 (FileReadData, 1);
     rdata->fop = fop;
     rdata->size = size;
@@ -1025,14 +2525,15 @@ void fileio_read_buffer (FileIO *fop,
     rdata->ino = ino;
     rdata->on_buffer_read_cb = on_buffer_read_cb;
     rdata->ctx = ctx;
-    rdata->request_offset = off;
+
+    fileio_readahead_update (fop, size, off);
 
     // send HEAD request first
     if (!rdata->fop->head_req_sent) {
          // get HTTP connection to download manifest or a full file
         if (!client_pool_get_client (application_get_read_client_pool (rdata->fop->app), fileio_read_on_head_con_cb, rdata)) {
             LOG_err (FIO_LOG, INO_H"Failed to get HTTP client !", INO_T (rdata->ino));
-            rdata->on_buffer_read_cb (rdata->ctx, FALSE, NULL, 0);
+            rdata->on_buffer_read_cb (rdata->ctx, FALSE, NULL);
             g_free (rdata);
         }
 
@@ -1043,6 +2544,67 @@ void fileio_read_buffer (FileIO *fop,
 }
 /*}}}*/
 
+/*{{{ fileio_upload_file */
+typedef struct {
+    FileIO *fop;
+    guint64 size;
+} FileIOFileUpload;
+
+static void fileio_upload_file_next (FileIOFileUpload *fup);
+
+static void fileio_upload_file_on_written_cb (FileIO *fop, gpointer ctx, gboolean success, G_GNUC_UNUSED size_t count)
+{
+    FileIOFileUpload *fup = (FileIOFileUpload *) ctx;
+
+    if (!success)
+        fop->upload_failed = TRUE;
+
+    fileio_upload_file_next (fup);
+}
+
+// pass the next part of the file to the uploader, the data is sent straight from the file
+static void fileio_upload_file_next (FileIOFileUpload *fup)
+{
+    FileIO *fop = fup->fop;
+
+    if (!fop->upload_failed && fop->current_size < fup->size) {
+        fileio_write_append (fop, NULL, MIN (fileio_upload_part_size (fop), fup->size - fop->current_size), fop->current_size, fop->ino,
+            fileio_upload_file_on_written_cb, fup);
+        return;
+    }
+
+    g_free (fup);
+
+    // multipart upload is completed (or aborted) when all parts are sent
+    if (fop->upload_failed && !fop->multipart_initiated)
+        fileio_destroy (fop);
+    else
+        fileio_release (fop);
+}
+
+void fileio_upload_file (Application *app, const gchar *fname, fuse_ino_t ino, int fd, guint64 size,
+    FileIO_on_upload_file_cb on_upload_file_cb, gpointer ctx)
+{
+    FileIOFileUpload *fup;
+    FileIO *fop;
+
+    fop = fileio_create (app, fname, ino, TRUE);
+    fop->is_staged_upload = TRUE;
+    fop->part_source = FPS_file;
+    fop->upload_fd = fd;
+    fop->on_upload_file_cb = on_upload_file_cb;
+    fop->upload_file_ctx = ctx;
+
+    fup = g_new0 (FileIOFileUpload, 1);
+    fup->fop = fop;
+    fup->size = size;
+    // parts are large enough to upload the whole file
+    fileio_set_size_hint (fop, size);
+
+    fileio_upload_file_next (fup);
+}
+/*}}}*/
+
 /*{{{ fileio_simple_upload*/
 typedef struct {
     gchar *fname;
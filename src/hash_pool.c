@@ -0,0 +1,490 @@
+/*
+ * Copyright (C) 2012-2014 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012-2014 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "hash_pool.h"
+#include "utils.h"
+
+/*{{{ struct */
+
+typedef struct _HashJob HashJob;
+
+// worker threads run a single lane each, so jobs of a lane are processed in the order they are submitted
+typedef struct {
+    GThreadPool *pool;
+    GAsyncQueue *q_jobs; // submitted HashJob, the lane itself is pushed to the thread pool to wake it up
+    HashJob *held; // the first job of the next batch, accessed by the lane thread only
+} HashLane;
+
+// MD5 sums are calculated by worker threads, results are passed back to the main thread
+struct _HashPool {
+    Application *app;
+    HashLane *lanes; // jobs of the same running MD5 sum always go to the same lane, so they are ordered
+    guint lanes_num;
+    guint next_lane; // lane for jobs without running MD5 sum
+    GAsyncQueue *q_done; // completed HashJob
+    int done_fds[2]; // pipe, used to wake up the main thread
+    struct event *ev_done;
+    guint jobs_inflight;
+    gboolean destroying; // do not call user callbacks
+};
+
+typedef enum {
+    HJ_buf = 0,
+    HJ_files = 1,
+    HJ_bufvec = 2,
+} HashJobType;
+
+struct _HashJob {
+    HashJobType type;
+    struct evbuffer_iovec *vecs; // HJ_buf: chains of the buffer
+    int vecs_num;
+    struct fuse_bufvec *bufv; // HJ_bufvec: not owned by the job
+    Md5MbCtx *md5_ctx;
+    GList *l_paths;
+
+    // hashing state, used by the worker thread
+    Md5MbCtx ctx;
+    int vec_cur; // HJ_buf, HJ_bufvec: chain (buffer) which is being hashed
+    size_t off; // HJ_buf, HJ_bufvec: number of hashed bytes of the chain (buffer)
+    GList *l_cur; // HJ_files: file which is being read
+    int fd;
+    unsigned char *chunk;
+    gboolean done;
+
+    unsigned char digest[MD5_MB_DIGEST_LENGTH];
+    gboolean success;
+    HashPool_on_md5_cb on_md5_cb;
+    gpointer ctx;
+};
+
+#define HPOOL_LOG "hash"
+
+// jobs of a batch are hashed by chunks of this size, it's also the size of chunks which are read from files
+#define HASH_POOL_CHUNK_SIZE 65536
+
+static void hash_pool_on_done_cb (evutil_socket_t fd, short flags, void *ctx);
+static void hash_pool_worker (gpointer data, gpointer user_data);
+static void hash_pool_drain (HashPool *hpool);
+/*}}}*/
+
+/*{{{ create / destroy */
+
+HashPool *hash_pool_create (Application *app)
+{
+    HashPool *hpool;
+
+    hpool = g_new0 (HashPool, 1);
+    hpool->app = app;
+    hpool->jobs_inflight = 0;
+    hpool->destroying = FALSE;
+    hpool->next_lane = 0;
+
+    hpool->q_done = g_async_queue_new ();
+    if (pipe (hpool->done_fds) != 0) {
+        LOG_err (HPOOL_LOG, "Failed to create pipe: %s", strerror (errno));
+        hpool->done_fds[0] = hpool->done_fds[1] = -1;
+        hash_pool_destroy (hpool);
+        return NULL;
+    }
+    evutil_make_socket_nonblocking (hpool->done_fds[0]);
+    evutil_make_socket_nonblocking (hpool->done_fds[1]);
+    hpool->ev_done = event_new (application_get_evbase (app), hpool->done_fds[0], EV_READ | EV_PERSIST,
+        hash_pool_on_done_cb, hpool);
+
+    hpool->lanes_num = conf_get_uint (application_get_conf (app), "filesystem.md5_threads");
+    if (hpool->lanes_num) {
+        guint i;
+
+        hpool->lanes = g_new0 (HashLane, hpool->lanes_num);
+        for (i = 0; i < hpool->lanes_num; i++) {
+            hpool->lanes[i].q_jobs = g_async_queue_new ();
+            hpool->lanes[i].pool = g_thread_pool_new (hash_pool_worker, hpool, 1, FALSE, NULL);
+        }
+    }
+
+    LOG_debug (HPOOL_LOG, "MD5 backend: %s, lanes: %u", md5_mb_get_backend (), md5_mb_get_lanes ());
+
+    return hpool;
+}
+
+void hash_pool_destroy (HashPool *hpool)
+{
+    // wait for all jobs, their callbacks are not called
+    hpool->destroying = TRUE;
+    if (hpool->lanes) {
+        guint i;
+
+        for (i = 0; i < hpool->lanes_num; i++) {
+            g_thread_pool_free (hpool->lanes[i].pool, FALSE, TRUE);
+            g_async_queue_unref (hpool->lanes[i].q_jobs);
+        }
+        g_free (hpool->lanes);
+        hpool->lanes = NULL;
+        hpool->lanes_num = 0;
+    }
+    if (hpool->q_done) {
+        hash_pool_drain (hpool);
+        g_async_queue_unref (hpool->q_done);
+    }
+    if (hpool->ev_done)
+        event_free (hpool->ev_done);
+    if (hpool->done_fds[0] >= 0)
+        close (hpool->done_fds[0]);
+    if (hpool->done_fds[1] >= 0)
+        close (hpool->done_fds[1]);
+
+    g_free (hpool);
+}
+/*}}}*/
+
+/*{{{ jobs */
+
+// get the next chunk of job data, return FALSE if there is no more data or on error
+static gboolean hash_job_next_chunk (HashJob *job, const unsigned char **data, size_t *len)
+{
+    if (job->type == HJ_buf) {
+        while (job->vec_cur < job->vecs_num) {
+            struct evbuffer_iovec *vec = &job->vecs[job->vec_cur];
+
+            if (job->off < vec->iov_len) {
+                *data = (const unsigned char *) vec->iov_base + job->off;
+                *len = MIN (vec->iov_len - job->off, HASH_POOL_CHUNK_SIZE);
+                job->off += *len;
+                return TRUE;
+            }
+
+            job->vec_cur++;
+            job->off = 0;
+        }
+        return FALSE;
+    }
+
+    if (job->type == HJ_bufvec) {
+        while (job->vec_cur < (int) job->bufv->count) {
+            struct fuse_buf *fbuf = &job->bufv->buf[job->vec_cur];
+            ssize_t bytes;
+
+            if (job->off >= fbuf->size) {
+                job->vec_cur++;
+                job->off = 0;
+                continue;
+            }
+
+            if (!(fbuf->flags & FUSE_BUF_IS_FD)) {
+                *data = (const unsigned char *) fbuf->mem + job->off;
+                *len = MIN (fbuf->size - job->off, HASH_POOL_CHUNK_SIZE);
+                job->off += *len;
+                return TRUE;
+            }
+
+            bytes = pread (fbuf->fd, job->chunk, MIN (fbuf->size - job->off, HASH_POOL_CHUNK_SIZE), fbuf->pos + job->off);
+            if (bytes < 0 && errno == EINTR)
+                continue;
+            // file is shorter than the buffer
+            if (bytes <= 0) {
+                job->success = FALSE;
+                return FALSE;
+            }
+            *data = job->chunk;
+            *len = bytes;
+            job->off += bytes;
+            return TRUE;
+        }
+        return FALSE;
+    }
+
+    while (job->l_cur) {
+        ssize_t bytes;
+
+        if (job->fd < 0) {
+            job->fd = open ((const gchar *) job->l_cur->data, O_RDONLY);
+            if (job->fd < 0) {
+                job->success = FALSE;
+                return FALSE;
+            }
+        }
+
+        bytes = read (job->fd, job->chunk, HASH_POOL_CHUNK_SIZE);
+        if (bytes < 0) {
+            if (errno == EINTR)
+                continue;
+            job->success = FALSE;
+            return FALSE;
+        }
+        if (bytes > 0) {
+            *data = job->chunk;
+            *len = bytes;
+            return TRUE;
+        }
+
+        close (job->fd);
+        job->fd = -1;
+        job->l_cur = g_list_next (job->l_cur);
+    }
+
+    return FALSE;
+}
+
+// executed by one of the worker threads
+// jobs are hashed chunk by chunk, chunks of all jobs are passed to the multi-buffer MD5 at once
+static void hash_pool_run_batch (HashJob **jobs, guint jobs_num)
+{
+    Md5MbCtx *ctxs[MD5_MB_MAX_LANES * 2];
+    const unsigned char *data[MD5_MB_MAX_LANES * 2];
+    size_t lens[MD5_MB_MAX_LANES * 2];
+    guint i, streams;
+
+    for (i = 0; i < jobs_num; i++) {
+        HashJob *job = jobs[i];
+
+        md5_mb_init (&job->ctx);
+        job->success = TRUE;
+        job->done = FALSE;
+        job->vec_cur = 0;
+        job->off = 0;
+        job->fd = -1;
+        job->l_cur = g_list_first (job->l_paths);
+        if (job->type == HJ_files || job->type == HJ_bufvec)
+            job->chunk = g_malloc (HASH_POOL_CHUNK_SIZE);
+    }
+
+    do {
+        streams = 0;
+        for (i = 0; i < jobs_num; i++) {
+            HashJob *job = jobs[i];
+            const unsigned char *chunk;
+            size_t len;
+
+            if (job->done)
+                continue;
+            if (!hash_job_next_chunk (job, &chunk, &len)) {
+                job->done = TRUE;
+                continue;
+            }
+
+            ctxs[streams] = &job->ctx;
+            data[streams] = chunk;
+            lens[streams++] = len;
+            // running MD5 sum is one more stream of the same data
+            if (job->md5_ctx) {
+                ctxs[streams] = job->md5_ctx;
+                data[streams] = chunk;
+                lens[streams++] = len;
+            }
+        }
+
+        if (streams)
+            md5_mb_update_multi (ctxs, data, lens, streams);
+    } while (streams);
+
+    for (i = 0; i < jobs_num; i++) {
+        HashJob *job = jobs[i];
+
+        if (job->fd >= 0)
+            close (job->fd);
+        g_free (job->chunk);
+        job->chunk = NULL;
+        md5_mb_final (job->digest, &job->ctx);
+    }
+}
+
+static gboolean hash_pool_batch_has_md5_ctx (HashJob **jobs, guint jobs_num, Md5MbCtx *md5_ctx)
+{
+    guint i;
+
+    if (!md5_ctx)
+        return FALSE;
+
+    for (i = 0; i < jobs_num; i++) {
+        if (jobs[i]->md5_ctx == md5_ctx)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+// takes all pending jobs of the lane which fit into SIMD lanes of the MD5 backend
+static void hash_pool_worker (gpointer data, gpointer user_data)
+{
+    HashLane *lane = (HashLane *) data;
+    HashPool *hpool = (HashPool *) user_data;
+    HashJob *jobs[MD5_MB_MAX_LANES];
+    guint jobs_num = 0;
+    guint streams = 0;
+    guint i;
+    char c = 0;
+    G_GNUC_UNUSED ssize_t res;
+
+    for (;;) {
+        HashJob *job;
+        guint job_streams;
+
+        if (lane->held) {
+            job = lane->held;
+            lane->held = NULL;
+        } else {
+            job = g_async_queue_try_pop (lane->q_jobs);
+        }
+        if (!job)
+            break;
+
+        job_streams = job->md5_ctx ? 2 : 1;
+        // buffers of the same running MD5 sum must be hashed one after another
+        if (jobs_num && (jobs_num == MD5_MB_MAX_LANES || streams + job_streams > md5_mb_get_lanes () ||
+            hash_pool_batch_has_md5_ctx (jobs, jobs_num, job->md5_ctx))) {
+            lane->held = job;
+            break;
+        }
+
+        jobs[jobs_num++] = job;
+        streams += job_streams;
+    }
+
+    // jobs were hashed with the previous batch
+    if (!jobs_num)
+        return;
+
+    hash_pool_run_batch (jobs, jobs_num);
+
+    for (i = 0; i < jobs_num; i++)
+        g_async_queue_push (hpool->q_done, jobs[i]);
+    // write fails only if the pipe is full: the main thread has wake ups to process already
+    res = write (hpool->done_fds[1], &c, 1);
+}
+
+// format the result and pass it to the caller, executed in the main thread
+static void hash_job_complete (HashPool *hpool, HashJob *job)
+{
+    if (!hpool || !hpool->destroying) {
+        if (job->success) {
+            gchar md5str[MD5_MB_DIGEST_LENGTH * 2 + 1];
+            gchar *md5b;
+            size_t i;
+
+            for (i = 0; i < MD5_MB_DIGEST_LENGTH; ++i)
+                sprintf (&md5str[i*2], "%02x", (unsigned int) job->digest[i]);
+            md5b = get_base64 ((const gchar *) job->digest, MD5_MB_DIGEST_LENGTH);
+
+            job->on_md5_cb (job->ctx, md5str, md5b);
+            g_free (md5b);
+        } else {
+            job->on_md5_cb (job->ctx, NULL, NULL);
+        }
+    }
+
+    g_list_free_full (job->l_paths, g_free);
+    g_free (job->vecs);
+    g_free (job);
+}
+
+// process all completed jobs
+static void hash_pool_drain (HashPool *hpool)
+{
+    HashJob *job;
+
+    while ((job = g_async_queue_try_pop (hpool->q_done))) {
+        hpool->jobs_inflight--;
+        hash_job_complete (hpool, job);
+    }
+}
+
+static void hash_pool_on_done_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short flags, void *ctx)
+{
+    HashPool *hpool = (HashPool *) ctx;
+    char buf[256];
+
+    while (read (hpool->done_fds[0], buf, sizeof (buf)) > 0);
+
+    hash_pool_drain (hpool);
+
+    // do not keep the event loop running without jobs
+    if (!hpool->jobs_inflight)
+        event_del (hpool->ev_done);
+}
+
+static void hash_pool_submit (HashPool *hpool, HashJob *job)
+{
+    guint lane;
+
+    // no worker threads: calculate it right away
+    if (!hpool || !hpool->lanes_num) {
+        hash_pool_run_batch (&job, 1);
+        hash_job_complete (hpool, job);
+        return;
+    }
+
+    if (!hpool->jobs_inflight)
+        event_add (hpool->ev_done, NULL);
+    hpool->jobs_inflight++;
+
+    if (job->md5_ctx)
+        lane = (g_direct_hash (job->md5_ctx) * 2654435761U) % hpool->lanes_num;
+    else
+        lane = hpool->next_lane++ % hpool->lanes_num;
+
+    g_async_queue_push (hpool->lanes[lane].q_jobs, job);
+    g_thread_pool_push (hpool->lanes[lane].pool, &hpool->lanes[lane], NULL);
+}
+/*}}}*/
+
+void hash_pool_md5_evbuffer (HashPool *hpool, struct evbuffer *buf, Md5MbCtx *md5_ctx,
+    HashPool_on_md5_cb on_md5_cb, gpointer ctx)
+{
+    HashJob *job;
+
+    job = g_new0 (HashJob, 1);
+    job->type = HJ_buf;
+    job->vecs_num = evbuffer_peek (buf, -1, NULL, NULL, 0);
+    job->vecs = g_new0 (struct evbuffer_iovec, job->vecs_num);
+    evbuffer_peek (buf, -1, NULL, job->vecs, job->vecs_num);
+    job->md5_ctx = md5_ctx;
+    job->on_md5_cb = on_md5_cb;
+    job->ctx = ctx;
+
+    hash_pool_submit (hpool, job);
+}
+
+void hash_pool_md5_bufvec (HashPool *hpool, struct fuse_bufvec *bufv, Md5MbCtx *md5_ctx,
+    HashPool_on_md5_cb on_md5_cb, gpointer ctx)
+{
+    HashJob *job;
+
+    job = g_new0 (HashJob, 1);
+    job->type = HJ_bufvec;
+    job->bufv = bufv;
+    job->md5_ctx = md5_ctx;
+    job->on_md5_cb = on_md5_cb;
+    job->ctx = ctx;
+
+    hash_pool_submit (hpool, job);
+}
+
+void hash_pool_md5_files (HashPool *hpool, GList *l_paths,
+    HashPool_on_md5_cb on_md5_cb, gpointer ctx)
+{
+    HashJob *job;
+    GList *l;
+
+    job = g_new0 (HashJob, 1);
+    job->type = HJ_files;
+    for (l = g_list_first (l_paths); l; l = g_list_next (l))
+        job->l_paths = g_list_append (job->l_paths, g_strdup ((const gchar *) l->data));
+    job->on_md5_cb = on_md5_cb;
+    job->ctx = ctx;
+
+    hash_pool_submit (hpool, job);
+}
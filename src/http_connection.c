@@ -33,6 +33,7 @@ typedef struct {
 static void http_connection_on_close (struct evhttp_connection *evcon, void *ctx);
 static gboolean http_connection_init (HttpConnection *con);
 static void http_connection_free_headers (GList *l_headers);
+static void http_request_body_free_segments (GList *l_segments);
 
 /*}}}*/
 
@@ -51,6 +52,8 @@ gpointer http_connection_create (Application *app)
 
     con->app = app;
     con->l_output_headers = NULL;
+    con->l_output_body = NULL;
+    con->on_chunk_cb = NULL;
     con->cur_cmd_type = CMD_IDLE;
     con->cur_url = NULL;
     con->cur_time_start = 0;
@@ -146,6 +149,7 @@ void http_connection_destroy (gpointer data)
 
     if (con->cur_url)
         g_free (con->cur_url);
+    http_request_body_free_segments (con->l_output_body);
     if (con->evcon)
         evhttp_connection_free (con->evcon);
     g_free (con);
@@ -257,7 +261,8 @@ static gchar *http_connection_get_auth_string (Application *app,
     // Element are: acl, lifecycle, location, logging, notification, partNumber, policy,
     // requestPayment, torrent, uploadId, uploads, versionId, versioning, versions and website.
     if (strlen (resource) > 2 && resource[1] == '?') {
-        if (strstr (resource, "?acl") || strstr (resource, "?versioning") || strstr (resource, "?versions"))
+        if (strstr (resource, "?acl") || strstr (resource, "?versioning") || strstr (resource, "?versions") ||
+            !strcmp (resource, "/?delete"))
             tmp = g_strdup_printf ("/%s%s", conf_get_string (application_get_conf (app), "s3.bucket_name"), resource);
         else
             tmp = g_strdup_printf ("/%s/", conf_get_string (application_get_conf (app), "s3.bucket_name"));
@@ -350,6 +355,205 @@ static gchar *parse_aws_error (const char *xml, size_t xml_len) {
     return msg;
 }
 
+/*{{{ request body */
+
+// part of the request body: memory data or a range of file
+typedef struct {
+    struct evbuffer *buf; // NULL for a file range
+    int fd; // owned by the segment
+    off_t offset;
+    size_t length;
+} HttpRequestBodySegment;
+
+// request body, shared by all (re)sent requests
+// requests reference the data of body chains, the body is freed when the last reference is released
+typedef struct {
+    guint refs;
+    GList *l_segments; // list of HttpRequestBodySegment
+} HttpRequestBody;
+
+static void http_request_body_free_segments (GList *l_segments)
+{
+    GList *l;
+
+    for (l = g_list_first (l_segments); l; l = g_list_next (l)) {
+        HttpRequestBodySegment *seg = (HttpRequestBodySegment *) l->data;
+
+        if (seg->buf)
+            evbuffer_free (seg->buf);
+        else
+            close (seg->fd);
+        g_free (seg);
+    }
+    g_list_free (l_segments);
+}
+
+// takes "l_segments", no data is copied
+static HttpRequestBody *http_request_body_create (GList *l_segments)
+{
+    HttpRequestBody *body;
+
+    body = g_new0 (HttpRequestBody, 1);
+    body->refs = 1;
+    body->l_segments = l_segments;
+
+    return body;
+}
+
+static void http_request_body_unref (HttpRequestBody *body)
+{
+    if (--body->refs)
+        return;
+
+    http_request_body_free_segments (body->l_segments);
+    g_free (body);
+}
+
+// data chain is sent or the request is freed
+static void http_request_body_on_chain_free_cb (G_GNUC_UNUSED const void *data, G_GNUC_UNUSED size_t datalen, void *extra)
+{
+    http_request_body_unref ((HttpRequestBody *) extra);
+}
+
+// add references to memory chains of the segment to the request output buffer
+static gboolean http_request_body_add_buffer (HttpRequestBody *body, struct evbuffer *buf, struct evbuffer *output)
+{
+    struct evbuffer_iovec *vecs;
+    int vecs_num;
+    int i;
+
+    vecs_num = evbuffer_peek (buf, -1, NULL, NULL, 0);
+    vecs = g_new (struct evbuffer_iovec, vecs_num);
+    evbuffer_peek (buf, -1, NULL, vecs, vecs_num);
+
+    for (i = 0; i < vecs_num; i++) {
+        if (!vecs[i].iov_len)
+            continue;
+
+        body->refs++;
+        if (evbuffer_add_reference (output, vecs[i].iov_base, vecs[i].iov_len,
+            http_request_body_on_chain_free_cb, body) < 0) {
+            body->refs--;
+            g_free (vecs);
+            return FALSE;
+        }
+    }
+    g_free (vecs);
+
+    return TRUE;
+}
+
+// read the file range into the output buffer
+static gboolean http_request_body_read_file (HttpRequestBodySegment *seg, struct evbuffer *output)
+{
+    struct evbuffer_iovec vec;
+    size_t done = 0;
+    ssize_t res;
+
+    // a single vector is contiguous
+    if (evbuffer_reserve_space (output, seg->length, &vec, 1) < 1) {
+        LOG_err (CON_LOG, "Failed to allocate %zu bytes !", seg->length);
+        return FALSE;
+    }
+
+    while (done < seg->length) {
+        res = pread (seg->fd, (char *) vec.iov_base + done, seg->length - done, seg->offset + done);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0) {
+            LOG_err (CON_LOG, "Failed to read request body: %s", res < 0 ? strerror (errno) : "unexpected end of file");
+            return FALSE;
+        }
+        done += res;
+    }
+
+    vec.iov_len = seg->length;
+
+    return evbuffer_commit_space (output, &vec, 1) == 0;
+}
+
+// add body data to the request output buffer
+// file ranges are added as file segments, libevent sends them with sendfile () or maps them into memory
+// SSL bufferevents can't send file segments, file ranges are read into memory if "file_segments" is FALSE
+static gboolean http_request_body_add_to (HttpRequestBody *body, struct evbuffer *output, gboolean file_segments)
+{
+    GList *l;
+
+    for (l = g_list_first (body->l_segments); l; l = g_list_next (l)) {
+        HttpRequestBodySegment *seg = (HttpRequestBodySegment *) l->data;
+        int fd;
+
+        if (seg->buf) {
+            if (!http_request_body_add_buffer (body, seg->buf, output))
+                return FALSE;
+            continue;
+        }
+
+        if (!seg->length)
+            continue;
+
+        if (!file_segments) {
+            if (!http_request_body_read_file (seg, output))
+                return FALSE;
+            continue;
+        }
+
+        // output buffer closes its descriptor when the data is sent
+        fd = dup (seg->fd);
+        if (fd < 0) {
+            LOG_err (CON_LOG, "Failed to duplicate file descriptor: %s", strerror (errno));
+            return FALSE;
+        }
+        if (evbuffer_add_file (output, fd, seg->offset, seg->length) < 0)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static size_t http_request_body_get_length (GList *l_segments)
+{
+    GList *l;
+    size_t len = 0;
+
+    for (l = g_list_first (l_segments); l; l = g_list_next (l)) {
+        HttpRequestBodySegment *seg = (HttpRequestBodySegment *) l->data;
+
+        len += seg->buf ? evbuffer_get_length (seg->buf) : seg->length;
+    }
+
+    return len;
+}
+
+// append the content of "buf" to the body of the next request, "buf" is left empty
+void http_connection_add_output_buffer (HttpConnection *con, struct evbuffer *buf)
+{
+    HttpRequestBodySegment *seg;
+
+    seg = g_new0 (HttpRequestBodySegment, 1);
+    seg->buf = evbuffer_new ();
+    evbuffer_add_buffer (seg->buf, buf);
+    seg->fd = -1;
+
+    con->l_output_body = g_list_append (con->l_output_body, seg);
+}
+
+// append [offset, offset + length) range of file to the body of the next request
+// the file is not read into memory, "fd" is owned by HttpConnection from now on
+void http_connection_add_output_file (HttpConnection *con, int fd, off_t offset, size_t length)
+{
+    HttpRequestBodySegment *seg;
+
+    seg = g_new0 (HttpRequestBodySegment, 1);
+    seg->buf = NULL;
+    seg->fd = fd;
+    seg->offset = offset;
+    seg->length = length;
+
+    con->l_output_body = g_list_append (con->l_output_body, seg);
+}
+/*}}}*/
+
 typedef struct {
     HttpConnection *con;
     HttpConnection_responce_cb responce_cb;
@@ -361,7 +565,7 @@ typedef struct {
     // original values
     gchar *resource_path;
     gchar *http_cmd;
-    struct evbuffer *out_buffer;
+    HttpRequestBody *body; // NULL if request has no body
     size_t out_size;
 
     struct timeval start_tv;
@@ -370,17 +574,62 @@ typedef struct {
     gboolean enable_retry;
 
     GList *l_output_headers;
+
+    // streaming mode
+    HttpConnection_on_chunk_cb on_chunk_cb;
+    guint64 chunk_offset; // number of body bytes delivered so far
+    struct evbuffer *err_buf; // body of unsuccessful response
 } RequestData;
 
 static void request_data_free (RequestData *data)
 {
     http_connection_free_headers (data->l_output_headers);
-    evbuffer_free (data->out_buffer);
+    if (data->err_buf)
+        evbuffer_free (data->err_buf);
+    if (data->body)
+        http_request_body_unref (data->body);
     g_free (data->resource_path);
     g_free (data->http_cmd);
     g_free (data);
 }
 
+// body part is received
+static void http_connection_on_body_chunk_cb (struct evhttp_request *req, void *ctx)
+{
+    RequestData *data = (RequestData *) ctx;
+    struct evbuffer *inbuf;
+    size_t buf_len;
+
+    inbuf = evhttp_request_get_input_buffer (req);
+    buf_len = evbuffer_get_length (inbuf);
+    if (!buf_len)
+        return;
+
+    data->con->total_bytes_in += buf_len;
+
+    // keep the body of error and redirect responses, it's parsed when the request is completed
+    if (evhttp_request_get_response_code (req) != 200 &&
+        evhttp_request_get_response_code (req) != 206) {
+        evbuffer_add_buffer (data->err_buf, inbuf);
+        return;
+    }
+
+    data->on_chunk_cb (data->con, data->ctx,
+        (const gchar *) evbuffer_pullup (inbuf, buf_len), buf_len, data->chunk_offset);
+    data->chunk_offset += buf_len;
+
+    // libevent drains input buffer when this function returns
+}
+
+// returns the buffer which holds response body
+static struct evbuffer *http_connection_get_body_buffer (RequestData *data, struct evhttp_request *req)
+{
+    if (data->on_chunk_cb)
+        return data->err_buf;
+    else
+        return evhttp_request_get_input_buffer (req);
+}
+
 static void http_connection_on_responce_cb (struct evhttp_request *req, void *ctx)
 {
     RequestData *data = (RequestData *) ctx;
@@ -488,7 +737,7 @@ static void http_connection_on_responce_cb (struct evhttp_request *req, void *ct
                 if (data->responce_cb)
                     data->responce_cb (data->con, data->ctx, FALSE, NULL, 0, NULL);
             } else {
-                if (!http_connection_make_request (data->con, data->resource_path, data->http_cmd, data->out_buffer, data->enable_retry, data,
+                if (!http_connection_make_request (data->con, data->resource_path, data->http_cmd, NULL, data->enable_retry, data,
                     data->responce_cb, data->ctx)) {
                     LOG_err (CON_LOG, CON_H"Failed to send request !", con);
                     if (data->responce_cb)
@@ -525,7 +774,7 @@ static void http_connection_on_responce_cb (struct evhttp_request *req, void *ct
 
         loc = http_find_header (headers, "Location");
         if (!loc) {
-            inbuf = evhttp_request_get_input_buffer (req);
+            inbuf = http_connection_get_body_buffer (data, req);
             buf_len = evbuffer_get_length (inbuf);
             buf = (const char *) evbuffer_pullup (inbuf, buf_len);
 
@@ -560,7 +809,7 @@ static void http_connection_on_responce_cb (struct evhttp_request *req, void *ct
         }
 
         // re-send request
-        if (!http_connection_make_request (data->con, data->resource_path, data->http_cmd, data->out_buffer, data->enable_retry, data,
+        if (!http_connection_make_request (data->con, data->resource_path, data->http_cmd, NULL, data->enable_retry, data,
             data->responce_cb, data->ctx)) {
             LOG_err (CON_LOG, CON_H"Failed to send request !", con);
             if (data->responce_cb)
@@ -571,7 +820,7 @@ static void http_connection_on_responce_cb (struct evhttp_request *req, void *ct
         goto done;
     }
 
-    inbuf = evhttp_request_get_input_buffer (req);
+    inbuf = http_connection_get_body_buffer (data, req);
     buf_len = evbuffer_get_length (inbuf);
     buf = (const char *) evbuffer_pullup (inbuf, buf_len);
 
@@ -606,7 +855,7 @@ static void http_connection_on_responce_cb (struct evhttp_request *req, void *ct
                 if (data->responce_cb)
                     data->responce_cb (data->con, data->ctx, FALSE, NULL, 0, NULL);
             } else {
-                if (!http_connection_make_request (data->con, data->resource_path, data->http_cmd, data->out_buffer, data->enable_retry, data,
+                if (!http_connection_make_request (data->con, data->resource_path, data->http_cmd, NULL, data->enable_retry, data,
                     data->responce_cb, data->ctx)) {
                     LOG_err (CON_LOG, CON_H"Failed to send request !", con);
                     if (data->responce_cb)
@@ -648,6 +897,11 @@ void http_connection_add_output_header (HttpConnection *con, const gchar *key, c
     con->l_output_headers = g_list_insert_sorted (con->l_output_headers, header, (GCompareFunc) hdr_compare);
 }
 
+void http_connection_set_on_chunk_cb (HttpConnection *con, HttpConnection_on_chunk_cb on_chunk_cb)
+{
+    con->on_chunk_cb = on_chunk_cb;
+}
+
 static void http_connection_free_headers (GList *l_headers)
 {
     GList *l;
@@ -689,6 +943,9 @@ gboolean http_connection_make_request (HttpConnection *con,
     if (!con->evcon)
         if (!http_connection_init (con)) {
             LOG_err (CON_LOG, CON_H"Failed to init HTTP connection !", con);
+            con->on_chunk_cb = NULL;
+            http_request_body_free_segments (con->l_output_body);
+            con->l_output_body = NULL;
             if (responce_cb)
                 responce_cb (con, ctx, FALSE, NULL, 0, NULL);
             return FALSE;
@@ -700,21 +957,19 @@ gboolean http_connection_make_request (HttpConnection *con,
         data = g_new0 (RequestData, 1);
         data->redirects = 0;
         data->http_cmd = g_strdup (http_cmd);
-        data->out_buffer = evbuffer_new ();
         data->resource_path = url_escape(resource_path);
 
-        if (out_buffer) {
-            gchar *tmp;
-
-            data->out_size = evbuffer_get_length (out_buffer);
+        if (out_buffer && evbuffer_get_length (out_buffer))
+            http_connection_add_output_buffer (con, out_buffer);
 
-            tmp = g_new0 (gchar, data->out_size);
-            evbuffer_copyout (out_buffer, tmp, data->out_size);
-            evbuffer_add (data->out_buffer, tmp, data->out_size);
-
-            g_free (tmp);
-        } else
+        if (con->l_output_body) {
+            data->out_size = http_request_body_get_length (con->l_output_body);
+            data->body = http_request_body_create (con->l_output_body);
+            con->l_output_body = NULL;
+        } else {
             data->out_size = 0;
+            data->body = NULL;
+        }
 
         data->retry_id = 0;
         data->enable_retry = enable_retry;
@@ -736,6 +991,11 @@ gboolean http_connection_make_request (HttpConnection *con,
             http_connection_free_headers (con->l_output_headers);
             con->l_output_headers = NULL;
         }
+
+        data->on_chunk_cb = con->on_chunk_cb;
+        con->on_chunk_cb = NULL;
+        if (data->on_chunk_cb)
+            data->err_buf = evbuffer_new ();
     } else
         data = (RequestData *) parent_request_data;
 
@@ -773,7 +1033,8 @@ gboolean http_connection_make_request (HttpConnection *con,
     bucket_name = conf_get_string (application_get_conf (con->app), "s3.bucket_name");
 
     key_prefix = conf_get_string(application_get_conf(con->app),"s3.key_prefix");
-    if( strlen(key_prefix) && ( strcasecmp((char *)data->resource_path,"/?acl") != 0 && strcasecmp((char *)data->resource_path,"/?versioning") != 0 && strncasecmp((char *)data->resource_path,"/?del",5) != 0 ) ) {
+    // bucket requests ("/?acl", "/?delete", listings ..) are not prefixed, objects are selected by their parameters
+    if( strlen(key_prefix) && strncmp((char *)data->resource_path,"/?",2) != 0 ) {
 
        	tmp = g_strdup_printf("%s%s",key_prefix,data->resource_path+1);
     } else
@@ -793,6 +1054,13 @@ gboolean http_connection_make_request (HttpConnection *con,
         return FALSE;
     }
 
+    if (data->on_chunk_cb) {
+        // the body is delivered from the beginning by every (re)sent request
+        data->chunk_offset = 0;
+        evbuffer_drain (data->err_buf, evbuffer_get_length (data->err_buf));
+        evhttp_request_set_chunked_cb (req, http_connection_on_body_chunk_cb);
+    }
+
     evhttp_add_header (req->output_headers, "Authorization", auth_key);
     evhttp_add_header (req->output_headers, "Host", conf_get_string (application_get_conf (con->app), "s3.host"));
     evhttp_add_header (req->output_headers, "Date", time_str);
@@ -807,12 +1075,19 @@ gboolean http_connection_make_request (HttpConnection *con,
         );
     }
 
-    if (out_buffer) {
-        con->total_bytes_out += evbuffer_get_length (out_buffer);
-        // we don't want to destruct the original buffer
-        evbuffer_add (req->output_buffer, evbuffer_pullup (out_buffer, -1), evbuffer_get_length (out_buffer));
-        // a better approach, but requires "beta" libevent version
-        // evbuffer_add_buffer_reference (req->output_buffer, out_buffer);
+    if (data->body) {
+        con->total_bytes_out += data->out_size;
+        // every (re)sent request references the same body data
+        if (!http_request_body_add_to (data->body, req->output_buffer,
+            !conf_get_boolean (application_get_conf (con->app), "s3.ssl"))) {
+            LOG_err (CON_LOG, CON_H"Failed to add request body !", con);
+            evhttp_request_free (req);
+            if (data->responce_cb)
+                data->responce_cb (data->con, data->ctx, FALSE, NULL, 0, NULL);
+            request_data_free (data);
+            g_free (tmp);
+            return FALSE;
+        }
     }
 
     host = conf_get_string (application_get_conf (con->app), "s3.host");
@@ -831,7 +1106,7 @@ gboolean http_connection_make_request (HttpConnection *con,
 
     LOG_msg (CON_LOG, CON_H"%s %s  bucket: %s, host: %s, out_len: %zd", con,
         http_cmd, request_str, bucket_name, host,
-        out_buffer ? evbuffer_get_length (out_buffer) : 0);
+        data->out_size);
 
     // update stats info
     con->cur_cmd_type = cmd_type;
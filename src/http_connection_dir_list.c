@@ -17,382 +17,432 @@
  */
 #include "http_connection.h"
 #include "dir_tree.h"
+#include "list_parser.h"
+
+// large directories are listed by several ranges of keys at once:
+// when a range has received DIR_LIST_SPLIT_PAGES pages, the rest of its key space is split
+// and given to new ranges, each range uses its own connection.
+// The next page of a range is requested before the received page is parsed
+
+// number of pages a range receives before its key space is split
+#define DIR_LIST_SPLIT_PAGES 2
 
 typedef struct {
     Application *app;
     DirTree *dir_tree;
-    HttpConnection *con;
-    gchar *dir_path;
+    gchar *dir_path; // with trailing '/', empty for the root directory
+    gchar *prefix; // "s3.key_prefix" (without leading '/') and "dir_path", all listed keys start with it
+    size_t prefix_len;
     fuse_ino_t ino;
+    HttpConnection_directory_listing_page_callback directory_listing_page_callback;
     HttpConnection_directory_listing_callback directory_listing_callback;
     gpointer callback_data;
     guint max_keys;
+    guint max_ranges;
+    guint ranges_count; // ranges which are being listed
+    guint pages_pending; // received pages which wait to be parsed
+    gboolean failed;
 } DirListRequest;
 
+typedef struct {
+    DirListRequest *dir_req;
+    HttpConnection *con;
+    gchar *marker; // full name of the key to list after, NULL to list from the beginning
+    gchar *end; // full name of the last key of the range, NULL if the range is not bounded
+    guint pages;
+} DirListRange;
+
+typedef struct {
+    DirListRequest *dir_req;
+    gchar *buf;
+    size_t buf_len;
+} DirListPage;
+
 #define CON_DIR_LOG "con_dir"
 
-// parses  directory XML
-// returns TRUE if ok
-static gboolean parse_dir_xml (DirListRequest *dir_list, const char *xml, size_t xml_len)
+// return the name of object (or prefix) "key" relative to the listed directory,
+// NULL if "key" is outside of the directory
+static const gchar *dir_list_get_name (DirListRequest *dir_list, const gchar *key)
 {
-    xmlDocPtr doc;
-    xmlXPathContextPtr ctx;
-    xmlXPathObjectPtr contents_xp;
-    xmlNodeSetPtr content_nodes;
-    xmlXPathObjectPtr subdirs_xp;
-    xmlNodeSetPtr subdir_nodes;
-    int i;
-    xmlXPathObjectPtr key;
-    xmlNodeSetPtr key_nodes;
-    const gchar *key_prefix = conf_get_string(application_get_conf(dir_list->app),"s3.key_prefix");
-    int pfxlen = strlen(key_prefix);
-
-// checks value for NULL, continue if it fails
-#define XML_VAR_CHK(v) \
-    do { \
-        if ((v) == NULL) { \
-            LOG_err (CON_DIR_LOG, "S3 returned incorrect XML !"); \
-            continue; \
-        } \
-    } while (0)
-// checks value for NULL, continue if it fails, free key to avoid memleaks
-#define XML_VAR_CHK_KEY(v) \
-    do { \
-        if ((v) == NULL) { \
-            LOG_err (CON_DIR_LOG, "S3 returned incorrect XML !"); \
-            xmlXPathFreeObject (key); \
-            continue; \
-        } \
-    } while (0)
-
-    doc = xmlReadMemory (xml, xml_len, "", NULL, 0);
-    if (doc == NULL)
-        return FALSE;
-
-    ctx = xmlXPathNewContext (doc);
-    if (!ctx) {
-        LOG_err (CON_DIR_LOG, "S3 returned incorrect XML !");
-        xmlFreeDoc (doc);
-        return FALSE;
-    }
-    xmlXPathRegisterNs (ctx, (xmlChar *) "s3", (xmlChar *) "http://s3.amazonaws.com/doc/2006-03-01/");
-
-    // files
-    contents_xp = xmlXPathEvalExpression ((xmlChar *) "//s3:Contents", ctx);
-    if (!contents_xp) {
-        LOG_err (CON_DIR_LOG, "S3 returned incorrect XML !");
-        xmlXPathFreeContext (ctx);
-        xmlFreeDoc (doc);
-        return FALSE;
+    if (strncmp (key, dir_list->prefix, dir_list->prefix_len))
+        return NULL;
+
+    return key + dir_list->prefix_len;
+}
+
+// object of the directory listing
+static void dir_list_on_object (gpointer ctx, const ListParserObject *obj)
+{
+    DirListRequest *dir_list = (DirListRequest *) ctx;
+    const gchar *bname;
+
+    bname = dir_list_get_name (dir_list, obj->key);
+    // directory object itself
+    if (!bname || !*bname)
+        return;
+
+    if (!strcmp (bname, "/")) {
+        LOG_debug (CON_DIR_LOG, "Wrong file name !");
+        return;
     }
 
-    content_nodes = contents_xp->nodesetval;
-    if (!content_nodes) {
-        LOG_err (CON_DIR_LOG, "S3 returned incorrect XML !");
-        xmlXPathFreeObject (contents_xp);
-        xmlXPathFreeContext (ctx);
-        xmlFreeDoc (doc);
-        return FALSE;
+    dir_tree_update_entry (dir_list->dir_tree, dir_list->dir_path, DET_file, dir_list->ino,
+        bname, obj->size, obj->last_modified ? obj->last_modified : time (NULL), obj->etag);
+}
+
+// subdirectory of the directory listing
+static void dir_list_on_prefix (gpointer ctx, const gchar *prefix)
+{
+    DirListRequest *dir_list = (DirListRequest *) ctx;
+    const gchar *bname;
+    gchar *name;
+    size_t len;
+
+    bname = dir_list_get_name (dir_list, prefix);
+    if (!bname || !*bname)
+        return;
+
+    if (!strcmp (bname, "/")) {
+        LOG_debug (CON_DIR_LOG, "Wrong directory name !");
+        return;
     }
 
-    for(i = 0; i < content_nodes->nodeNr; i++) {
-        gchar *bname = NULL;
-        gint64 size = 0;
-        time_t last_modified = time (NULL);
-        gchar *name = NULL;
-        gchar *s_size = NULL;
-        gchar *s_last_modified = NULL;
-
-        ctx->node = content_nodes->nodeTab[i];
-
-        // object name
-        key = xmlXPathEvalExpression ((xmlChar *) "s3:Key", ctx);
-        XML_VAR_CHK (key);
-        key_nodes = key->nodesetval;
-        XML_VAR_CHK_KEY (key_nodes);
-        name = (gchar *)xmlNodeListGetString (doc, key_nodes->nodeTab[0]->xmlChildrenNode, 1);
-        xmlXPathFreeObject (key);
-        XML_VAR_CHK (name);
-
-        key = xmlXPathEvalExpression ((xmlChar *) "s3:Size", ctx);
-        XML_VAR_CHK (key);
-        key_nodes = key->nodesetval;
-        XML_VAR_CHK_KEY (key_nodes);
-        s_size = (gchar *)xmlNodeListGetString (doc, key_nodes->nodeTab[0]->xmlChildrenNode, 1);
-        if (s_size) {
-            size = strtoll (s_size, NULL, 10);
-            xmlFree (s_size);
-        }
-        xmlXPathFreeObject (key);
-
-        key = xmlXPathEvalExpression ((xmlChar *) "s3:LastModified", ctx);
-        XML_VAR_CHK (key);
-        key_nodes = key->nodesetval;
-        XML_VAR_CHK_KEY (key_nodes);
-        s_last_modified = (gchar *)xmlNodeListGetString (doc, key_nodes->nodeTab[0]->xmlChildrenNode, 1);
-        if (s_last_modified) {
-            struct tm tmp = {0};
-            // 2013-04-11T15:16
-            if (strptime (s_last_modified, "%Y-%m-%dT%H:%M:%S", &tmp))
-                last_modified = mktime (&tmp);
-            xmlFree (s_last_modified);
-        }
-        xmlXPathFreeObject (key);
+    // remove trailing '/' character
+    len = strlen (bname);
+    if (bname[len - 1] == '/')
+        len--;
+    name = g_strndup (bname, len);
 
-        //
-        if (!strncmp (name, dir_list->dir_path, strlen (name))) {
-            xmlFree (name);
-            continue;
-        }
+    // XXX: save / restore directory mtime
+    dir_tree_update_entry (dir_list->dir_tree, dir_list->dir_path, DET_dir, dir_list->ino,
+        name, 0, time (NULL), NULL);
 
-        bname = strstr (name, dir_list->dir_path);
-        bname = bname + strlen (dir_list->dir_path);
+    g_free (name);
+}
 
-        if (strlen (bname) == 1 && bname[0] == '/')  {
-            LOG_debug (CON_DIR_LOG, "Wrong file name !");
-            xmlFree (name);
-            continue;
-        }
+// free DirListRequest, call callback function
+static void directory_listing_done (DirListRequest *dir_req, gboolean success)
+{
+    // we are done, stop updating
+    // old entries are removed before the callback, so it sees the final content of the directory
+    dir_tree_stop_update (dir_req->dir_tree, dir_req->ino);
 
-        // make sure size is set correctly
-        if (size < 0) {
-            LOG_err (CON_DIR_LOG, "S3 returned incorrect file size for %s", bname);
-            size = 0;
-        }
+    if (dir_req->directory_listing_callback)
+        dir_req->directory_listing_callback (dir_req->callback_data, success);
+
+    g_free (dir_req->dir_path);
+    g_free (dir_req->prefix);
+    g_free (dir_req);
+}
+
+// listing is done when all ranges are listed and all pages are parsed
+static void dir_list_check_done (DirListRequest *dir_req)
+{
+    if (dir_req->ranges_count || dir_req->pages_pending)
+        return;
+
+    if (!dir_req->failed)
+        LOG_debug (CON_DIR_LOG, INO_H"Directory listing done !", INO_T (dir_req->ino));
 
-	if( pfxlen > 0 ) {
-		if( strncmp( (char *)bname, (char *)key_prefix+1, pfxlen-1 ) == 0 )
-			bname += pfxlen-1;
-	}
+    directory_listing_done (dir_req, !dir_req->failed);
+}
 
-	if( strlen(bname) ) {
-            dir_tree_update_entry (dir_list->dir_tree, dir_list->dir_path, DET_file, dir_list->ino,
-                bname, size, last_modified);
-	}
+/*{{{ pages */
 
-        xmlFree (name);
+static void dir_list_on_page_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short event, void *ctx)
+{
+    DirListPage *page = (DirListPage *) ctx;
+    DirListRequest *dir_req = page->dir_req;
+
+    if (!dir_req->failed) {
+        ListParserResult result;
+
+        if (!list_parser_parse (page->buf, page->buf_len, dir_list_on_object, dir_list_on_prefix, dir_req, &result)) {
+            LOG_err (CON_DIR_LOG, INO_H"Error parsing directory XML !", INO_T (dir_req->ino));
+            dir_req->failed = TRUE;
+        } else if (dir_req->directory_listing_page_callback)
+            dir_req->directory_listing_page_callback (dir_req->callback_data);
+        list_parser_result_clear (&result);
     }
 
-    xmlXPathFreeObject (contents_xp);
+    g_free (page->buf);
+    g_free (page);
+
+    dir_req->pages_pending--;
+    dir_list_check_done (dir_req);
+}
 
-    // directories
-    subdirs_xp = xmlXPathEvalExpression ((xmlChar *) "//s3:CommonPrefixes", ctx);
-    if (!subdirs_xp) {
-        xmlXPathFreeContext (ctx);
-        xmlFreeDoc (doc);
-        return TRUE;
+// parse the page on the next loop iteration, when the request for the next page is already sent
+static void dir_list_page_add (DirListRequest *dir_req, const gchar *buf, size_t buf_len)
+{
+    DirListPage *page;
+    struct timeval tv = {0, 0};
+
+    page = g_new0 (DirListPage, 1);
+    page->dir_req = dir_req;
+    page->buf = g_memdup (buf, buf_len);
+    page->buf_len = buf_len;
+    dir_req->pages_pending++;
+
+    if (event_base_once (application_get_evbase (dir_req->app), -1, EV_TIMEOUT, dir_list_on_page_cb, page, &tv) < 0) {
+        LOG_err (CON_DIR_LOG, INO_H"Failed to add event !", INO_T (dir_req->ino));
+        dir_list_on_page_cb (-1, 0, page);
     }
+}
+/*}}}*/
+
+/*{{{ ranges */
+
+// characters of split keys in the byte order, they are not escaped in the request
+static const gchar dir_list_split_chars[] = "-.0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ_abcdefghijklmnopqrstuvwxyz~";
+
+// return a key between "lo" and "hi" (NULL if unbounded), which splits the key space between them in halves,
+// NULL if there is no such key
+static gchar *dir_list_get_split_key (DirListRequest *dir_req, const gchar *lo, const gchar *hi)
+{
+    const gchar *lo_name;
+    const gchar *hi_name = NULL;
+    size_t i;
+
+    if (strncmp (lo, dir_req->prefix, dir_req->prefix_len))
+        return NULL;
+    lo_name = lo + dir_req->prefix_len;
 
-    subdir_nodes = subdirs_xp->nodesetval;
-    if (!subdir_nodes) {
-        xmlXPathFreeObject (subdirs_xp);
-        xmlXPathFreeContext (ctx);
-        xmlFreeDoc (doc);
-        return TRUE;
+    if (hi) {
+        if (strncmp (hi, dir_req->prefix, dir_req->prefix_len))
+            return NULL;
+        hi_name = hi + dir_req->prefix_len;
     }
 
-    for(i = 0; i < subdir_nodes->nodeNr; i++) {
-        gchar *bname = NULL;
-        gchar *name = NULL;
-        time_t last_modified;
-
-        ctx->node = subdir_nodes->nodeTab[i];
-
-        // object name
-        key = xmlXPathEvalExpression((xmlChar *) "s3:Prefix", ctx);
-        XML_VAR_CHK (key);
-        key_nodes = key->nodesetval;
-        XML_VAR_CHK_KEY (key_nodes);
-        name = (gchar *)xmlNodeListGetString (doc, key_nodes->nodeTab[0]->xmlChildrenNode, 1);
-        xmlXPathFreeObject (key);
-        XML_VAR_CHK (name);
-
-        bname = strstr (name, dir_list->dir_path);
-        bname = bname + strlen (dir_list->dir_path);
-
-        //XXX: remove trailing '/' characters
-        if (strlen (bname) > 1 && bname[strlen (bname) - 1] == '/') {
-            bname[strlen (bname) - 1] = '\0';
-        // XXX:
-        } else if (strlen (bname) == 1 && bname[0] == '/')  {
-            LOG_debug (CON_DIR_LOG, "Wrong directory name !");
-            xmlFree (name);
-            continue;
+    for (i = 0; ; i++) {
+        guchar l = (guchar) lo_name[i];
+        // split characters are less than 0x80
+        guchar h = hi_name ? (guchar) hi_name[i] : 0x80;
+        const gchar *c;
+        const gchar *first = NULL;
+        guint count = 0;
+
+        // "hi" is not greater than "lo"
+        if (l > h || (hi_name && !h))
+            return NULL;
+
+        for (c = dir_list_split_chars; *c; c++) {
+            if ((guchar) *c > l && (guchar) *c < h) {
+                if (!first)
+                    first = c;
+                count++;
+            }
         }
 
-        // XXX: save / restore directory mtime
-        last_modified = time (NULL);
+        if (count)
+            return g_strdup_printf ("%s%.*s%c", dir_req->prefix, (int) i, lo_name, first[count / 2]);
 
-	if( pfxlen > 0 ) {
-		if( strncmp( bname, (char *)key_prefix+1, pfxlen-1 ) == 0 )
-			bname += pfxlen-1;
-	}
+        // no room at this position, continue with the next character of "lo"
+        // these characters are the part of the split key, they must not change the request
+        if (!l || l == '&' || l == '=' || l == '+')
+            return NULL;
 
-	if( strlen(bname) ) {
-            dir_tree_update_entry (dir_list->dir_tree, dir_list->dir_path, DET_dir, dir_list->ino,
-                bname, 0, last_modified);
-	}
-
-        xmlFree (name);
+        // any key which starts with "lo" characters is less than "hi"
+        if (l < h)
+            hi_name = NULL;
     }
+}
+
+static void http_connection_on_directory_listing_data (HttpConnection *con, void *ctx, gboolean success,
+        const gchar *buf, size_t buf_len, G_GNUC_UNUSED struct evkeyvalq *headers);
+
+static void dir_list_range_done (DirListRange *range)
+{
+    DirListRequest *dir_req = range->dir_req;
 
-    xmlXPathFreeObject (subdirs_xp);
+    if (range->con)
+        http_connection_release (range->con);
 
-    xmlXPathFreeContext (ctx);
-    xmlFreeDoc (doc);
+    g_free (range->marker);
+    g_free (range->end);
+    g_free (range);
 
-    return TRUE;
+    dir_req->ranges_count--;
+    dir_list_check_done (dir_req);
 }
 
-static const char *get_next_marker(const char *xml, size_t xml_len) {
-    xmlDocPtr doc;
-    xmlXPathContextPtr ctx;
-    xmlXPathObjectPtr marker_xp;
-    xmlNodeSetPtr nodes;
-    char *next_marker = NULL;
+static void dir_list_range_request (DirListRange *range)
+{
+    DirListRequest *dir_req = range->dir_req;
+    gchar *req_path;
+    gboolean res;
 
-    doc = xmlReadMemory (xml, xml_len, "", NULL, 0);
-    if (!doc) {
-        LOG_err (CON_DIR_LOG, "S3 returned incorrect XML !");
-        return NULL;
-    }
+    if (range->marker)
+        req_path = g_strdup_printf ("/?delimiter=/&marker=%s&max-keys=%u&prefix=%s", range->marker, dir_req->max_keys, dir_req->prefix);
+    else
+        req_path = g_strdup_printf ("/?delimiter=/&max-keys=%u&prefix=%s", dir_req->max_keys, dir_req->prefix);
 
-    ctx = xmlXPathNewContext (doc);
-    if (!ctx) {
-        xmlFreeDoc (doc);
-        LOG_err (CON_DIR_LOG, "S3 returned incorrect XML !");
-        return NULL;
-    }
+    res = http_connection_make_request (range->con,
+        req_path, "GET",
+        NULL, TRUE, NULL,
+        http_connection_on_directory_listing_data,
+        range
+    );
+    g_free (req_path);
 
-    xmlXPathRegisterNs (ctx, (xmlChar *) "s3", (xmlChar *) "http://s3.amazonaws.com/doc/2006-03-01/");
-    marker_xp = xmlXPathEvalExpression ((xmlChar *) "//s3:NextMarker", ctx);
-    if (!marker_xp) {
-        LOG_err (CON_DIR_LOG, "S3 returned incorrect XML !");
-        next_marker = NULL;
-    } else {
-        nodes = marker_xp->nodesetval;
+    // http_connection_on_directory_listing_data () is already called
+    if (!res)
+        LOG_err (CON_DIR_LOG, INO_CON_H"Failed to create HTTP request !", INO_T (dir_req->ino), range->con);
+}
 
-        if (!nodes || nodes->nodeNr < 1) {
-            next_marker = NULL;
-        } else {
-            next_marker = (char *) xmlNodeListGetString (doc, nodes->nodeTab[0]->xmlChildrenNode, 1);
-        }
+static void dir_list_range_on_con_cb (gpointer client, gpointer ctx)
+{
+    HttpConnection *con = (HttpConnection *) client;
+    DirListRange *range = (DirListRange *) ctx;
 
-        xmlXPathFreeObject (marker_xp);
-    }
-    xmlXPathFreeContext (ctx);
-    xmlFreeDoc (doc);
+    range->con = con;
+    http_connection_acquire (con);
 
-    return next_marker;
+    dir_list_range_request (range);
 }
 
+// give the rest of the range key space to new ranges, while there are free connections
+static void dir_list_range_split (DirListRange *range)
+{
+    DirListRequest *dir_req = range->dir_req;
+
+    while (dir_req->ranges_count < dir_req->max_ranges) {
+        DirListRange *new_range;
+        gchar *split_key;
+
+        split_key = dir_list_get_split_key (dir_req, range->marker, range->end);
+        if (!split_key)
+            break;
+
+        LOG_debug (CON_DIR_LOG, INO_H"Splitting listing at %s, ranges: %u", INO_T (dir_req->ino), split_key, dir_req->ranges_count + 1);
+
+        // the range ends at the split key, the new range lists keys after it
+        new_range = g_new0 (DirListRange, 1);
+        new_range->dir_req = dir_req;
+        new_range->marker = g_strdup (split_key);
+        new_range->end = range->end;
+        range->end = split_key;
+        dir_req->ranges_count++;
+
+        if (!client_pool_get_client (application_get_ops_client_pool (dir_req->app),
+            dir_list_range_on_con_cb, new_range)) {
+            LOG_err (CON_DIR_LOG, INO_H"Failed to get HTTP client !", INO_T (dir_req->ino));
+            g_free (range->end);
+            range->end = new_range->end;
+            g_free (new_range->marker);
+            g_free (new_range);
+            dir_req->ranges_count--;
+            break;
+        }
+    }
+}
 
-// free DirListRequest, release HTTPConnection, call callback function
-static void directory_listing_done (HttpConnection *con, DirListRequest *dir_req, gboolean success)
+// continue listing of the range after "marker",
+// the range is done if "marker" is NULL or it's beyond the end of the range
+static void dir_list_range_next (DirListRange *range, const gchar *marker)
 {
-    if (dir_req->directory_listing_callback)
-        dir_req->directory_listing_callback (dir_req->callback_data, success);
+    DirListRequest *dir_req = range->dir_req;
 
-    // we are done, stop updating
-    dir_tree_stop_update (dir_req->dir_tree, dir_req->ino);
+    if (!marker || dir_req->failed || (range->end && strcmp (marker, range->end) >= 0)) {
+        LOG_debug (CON_DIR_LOG, INO_CON_H"Range is listed, pages: %u", INO_T (dir_req->ino), range->con, range->pages);
+        dir_list_range_done (range);
+        return;
+    }
 
-    // release HTTP client
-    if (con)
-        http_connection_release (con);
+    g_free (range->marker);
+    range->marker = g_strdup (marker);
 
-    g_free (dir_req->dir_path);
-    g_free (dir_req);
+    if (range->pages >= DIR_LIST_SPLIT_PAGES)
+        dir_list_range_split (range);
 
+    dir_list_range_request (range);
 }
+/*}}}*/
 
 // Directory read callback function
 static void http_connection_on_directory_listing_data (HttpConnection *con, void *ctx, gboolean success,
         const gchar *buf, size_t buf_len, G_GNUC_UNUSED struct evkeyvalq *headers)
 {
-    DirListRequest *dir_req = (DirListRequest *) ctx;
-    const gchar *next_marker = NULL;
-    gchar *req_path;
-    gboolean res;
-    const gchar *key_prefix = conf_get_string(application_get_conf(con->app),"s3.key_prefix");
-
-    if( strlen(key_prefix) )
-    	key_prefix++;
-
-    if (!buf_len || !buf) {
-        LOG_err (CON_DIR_LOG, INO_CON_H"Directory buffer is empty !", INO_T (dir_req->ino), con);
-        directory_listing_done (con, dir_req, FALSE);
-        return;
-    }
+    DirListRange *range = (DirListRange *) ctx;
+    DirListRequest *dir_req = range->dir_req;
+    ListParserResult result;
 
     if (!success) {
         LOG_err (CON_DIR_LOG, INO_CON_H"Error getting directory list !", INO_T (dir_req->ino), con);
-        directory_listing_done (con, dir_req, FALSE);
+        dir_req->failed = TRUE;
+        dir_list_range_done (range);
         return;
     }
 
-    if (!parse_dir_xml (dir_req, buf, buf_len)) {
-        LOG_err (CON_DIR_LOG, INO_CON_H"Error parsing directory XML !", INO_T (dir_req->ino), con);
-        directory_listing_done (con, dir_req, FALSE);
+    if (!buf_len || !buf) {
+        LOG_err (CON_DIR_LOG, INO_CON_H"Directory buffer is empty !", INO_T (dir_req->ino), con);
+        dir_req->failed = TRUE;
+        dir_list_range_done (range);
         return;
     }
 
-    // repeat starting from the mark
-    next_marker = get_next_marker (buf, buf_len);
+    range->pages++;
 
-    // check if we need to get more data
-    if (!g_strstr_len (buf, buf_len, "<IsTruncated>true</IsTruncated>") && !next_marker) {
-        LOG_debug (CON_DIR_LOG, INO_CON_H"Directory listing done !", INO_T (dir_req->ino), con);
-        directory_listing_done (con, dir_req, TRUE);
+    // S3 returns IsTruncated and NextMarker before objects,
+    // request the next page first and parse this one while the request is processed
+    if (list_parser_parse_head (buf, buf_len, &result) && result.is_truncated && result.next_marker) {
+        dir_list_page_add (dir_req, buf, buf_len);
+        dir_list_range_next (range, result.next_marker);
+        list_parser_result_clear (&result);
         return;
     }
+    list_parser_result_clear (&result);
 
-    // execute HTTP request
-    req_path = g_strdup_printf ("/?delimiter=/&marker=%s&max-keys=%u&prefix=%s%s", next_marker, dir_req->max_keys, (char *)key_prefix, dir_req->dir_path);
-    printf("req_path %s\n",req_path);
-
-    xmlFree ((void *) next_marker);
-
-    res = http_connection_make_request (dir_req->con,
-        req_path, "GET",
-        NULL, TRUE, NULL,
-        http_connection_on_directory_listing_data,
-        dir_req
-    );
-    g_free (req_path);
-
-    if (!res) {
-        LOG_err (CON_DIR_LOG, INO_CON_H"Failed to create HTTP request !", INO_T (dir_req->ino), con);
-        directory_listing_done (con, dir_req, FALSE);
+    if (!list_parser_parse (buf, buf_len, dir_list_on_object, dir_list_on_prefix, dir_req, &result)) {
+        LOG_err (CON_DIR_LOG, INO_CON_H"Error parsing directory XML !", INO_T (dir_req->ino), con);
+        list_parser_result_clear (&result);
+        dir_req->failed = TRUE;
+        dir_list_range_done (range);
         return;
     }
+
+    if (dir_req->directory_listing_page_callback)
+        dir_req->directory_listing_page_callback (dir_req->callback_data);
+
+    // repeat starting from the mark, NextMarker is returned if delimiter is specified
+    if (result.is_truncated)
+        dir_list_range_next (range, result.next_marker ? result.next_marker : result.last_key);
+    else
+        dir_list_range_next (range, NULL);
+    list_parser_result_clear (&result);
 }
 
 // create DirListRequest
 void http_connection_get_directory_listing (HttpConnection *con, const gchar *dir_path, fuse_ino_t ino,
+    HttpConnection_directory_listing_page_callback directory_listing_page_callback,
     HttpConnection_directory_listing_callback directory_listing_callback, gpointer callback_data)
 {
     DirListRequest *dir_req;
-    gchar *req_path;
-    gboolean res;
+    DirListRange *range;
     const gchar *key_prefix;
+    ClientPool *pool;
 
-    LOG_debug (CON_DIR_LOG, INO_CON_H"Getting directory listing for: >>%s<<", INO_T (con), con, dir_path);
+    LOG_debug (CON_DIR_LOG, INO_CON_H"Getting directory listing for: >>%s<<", INO_T (ino), con, dir_path);
 
     dir_req = g_new0 (DirListRequest, 1);
-    dir_req->con = con;
     dir_req->app = http_connection_get_app (con);
     dir_req->dir_tree = application_get_dir_tree (dir_req->app);
     dir_req->ino = ino;
-    dir_req->max_keys = conf_get_uint (application_get_conf (con->app), "s3.keys_per_request");
+    dir_req->max_keys = conf_get_uint (application_get_conf (dir_req->app), "s3.keys_per_request");
+    dir_req->directory_listing_page_callback = directory_listing_page_callback;
     dir_req->directory_listing_callback = directory_listing_callback;
     dir_req->callback_data = callback_data;
 
-    // acquire HTTP client
-    http_connection_acquire (con);
+    // additional ranges use "operations" connections
+    pool = application_get_ops_client_pool (dir_req->app);
+    dir_req->max_ranges = conf_get_uint (application_get_conf (dir_req->app), "s3.dir_list_max_requests_inflight");
+    if (dir_req->max_ranges > (guint) client_pool_get_client_count (pool))
+        dir_req->max_ranges = client_pool_get_client_count (pool);
+    dir_req->max_ranges = MAX (dir_req->max_ranges, 1);
 
-    key_prefix = conf_get_string(application_get_conf(con->app),"s3.key_prefix");
-    if( strlen(key_prefix) )
-    	key_prefix++;
+    key_prefix = conf_get_string (application_get_conf (dir_req->app), "s3.key_prefix");
+    if (strlen (key_prefix))
+        key_prefix++;
 
     //XXX: fix dir_path
     if (!strlen (dir_path)) {
@@ -400,23 +450,163 @@ void http_connection_get_directory_listing (HttpConnection *con, const gchar *di
     } else {
         dir_req->dir_path = g_strdup_printf ("%s/", dir_path);
     }
+    dir_req->prefix = g_strdup_printf ("%s%s", key_prefix, dir_req->dir_path);
+    dir_req->prefix_len = strlen (dir_req->prefix);
+
+    range = g_new0 (DirListRange, 1);
+    range->dir_req = dir_req;
+    range->con = con;
+    dir_req->ranges_count = 1;
 
-    req_path = g_strdup_printf ("/?delimiter=/&max-keys=%u&prefix=%s%s", dir_req->max_keys, key_prefix, dir_req->dir_path);
+    // acquire HTTP client
+    http_connection_acquire (con);
+
+    dir_list_range_request (range);
+}
+
+typedef struct {
+    Application *app;
+    HttpConnection *con;
+    gchar *prefix;
+    const gchar *key_prefix; // "s3.key_prefix" without leading '/'
+    size_t key_prefix_len;
+    GList *l_keys; // list of HttpConnectionKey, in the listing order
+    guint max_keys;
+    HttpConnection_key_listing_callback key_listing_callback;
+    gpointer callback_data;
+} KeyListRequest;
+
+void http_connection_key_free (HttpConnectionKey *key)
+{
+    g_free (key->key);
+    g_free (key->etag);
+    g_free (key);
+}
+
+// object of the recursive listing
+static void key_list_on_object (gpointer ctx, const ListParserObject *obj)
+{
+    KeyListRequest *key_req = (KeyListRequest *) ctx;
+    HttpConnectionKey *key;
+
+    // objects outside of the "s3.key_prefix" are not visible in the filesystem
+    if (key_req->key_prefix_len && strncmp (obj->key, key_req->key_prefix, key_req->key_prefix_len))
+        return;
 
-    res = http_connection_make_request (con,
+    key = g_new0 (HttpConnectionKey, 1);
+    key->key = g_strdup (obj->key + key_req->key_prefix_len);
+    key->size = obj->size;
+    key->last_modified = obj->last_modified;
+    key->etag = g_strdup (obj->etag);
+    key_req->l_keys = g_list_prepend (key_req->l_keys, key);
+}
+
+static gboolean http_connection_key_listing_request (KeyListRequest *key_req, const gchar *marker);
+
+// free KeyListRequest, release HTTPConnection, call callback function
+static void key_listing_done (KeyListRequest *key_req, gboolean success)
+{
+    GList *l_keys;
+
+    l_keys = g_list_reverse (key_req->l_keys);
+    key_req->l_keys = NULL;
+
+    if (!success) {
+        g_list_free_full (l_keys, (GDestroyNotify) http_connection_key_free);
+        l_keys = NULL;
+    }
+
+    http_connection_release (key_req->con);
+
+    if (key_req->key_listing_callback)
+        key_req->key_listing_callback (key_req->callback_data, success, l_keys);
+    else
+        g_list_free_full (l_keys, (GDestroyNotify) http_connection_key_free);
+
+    g_free (key_req->prefix);
+    g_free (key_req);
+}
+
+static void http_connection_on_key_listing_data (HttpConnection *con, void *ctx, gboolean success,
+        const gchar *buf, size_t buf_len, G_GNUC_UNUSED struct evkeyvalq *headers)
+{
+    KeyListRequest *key_req = (KeyListRequest *) ctx;
+    ListParserResult result;
+
+    if (!success || !buf_len || !buf) {
+        LOG_err (CON_DIR_LOG, CON_H"Error getting key list for %s !", con, key_req->prefix);
+        key_listing_done (key_req, FALSE);
+        return;
+    }
+
+    if (!list_parser_parse (buf, buf_len, key_list_on_object, NULL, key_req, &result)) {
+        LOG_err (CON_DIR_LOG, CON_H"Error parsing key list XML !", con);
+        list_parser_result_clear (&result);
+        key_listing_done (key_req, FALSE);
+        return;
+    }
+
+    // NextMarker is returned only if delimiter is specified, continue from the last key
+    if (!result.is_truncated || !result.last_key) {
+        LOG_debug (CON_DIR_LOG, CON_H"Key listing done for %s: %u keys", con, key_req->prefix, g_list_length (key_req->l_keys));
+        list_parser_result_clear (&result);
+        key_listing_done (key_req, TRUE);
+        return;
+    }
+
+    http_connection_key_listing_request (key_req, result.last_key);
+    list_parser_result_clear (&result);
+}
+
+// request the next page of the listing, starting after "marker" (full object name), if it's not NULL
+static gboolean http_connection_key_listing_request (KeyListRequest *key_req, const gchar *marker)
+{
+    gchar *req_path;
+    gboolean res;
+
+    if (marker)
+        req_path = g_strdup_printf ("/?marker=%s&max-keys=%u&prefix=%s%s", marker, key_req->max_keys, key_req->key_prefix, key_req->prefix);
+    else
+        req_path = g_strdup_printf ("/?max-keys=%u&prefix=%s%s", key_req->max_keys, key_req->key_prefix, key_req->prefix);
+
+    res = http_connection_make_request (key_req->con,
         req_path, "GET",
         NULL, TRUE, NULL,
-        http_connection_on_directory_listing_data,
-        dir_req
+        http_connection_on_key_listing_data,
+        key_req
     );
-
     g_free (req_path);
 
-    if (!res) {
-        LOG_err (CON_DIR_LOG, INO_CON_H"Failed to create HTTP request !", INO_T (dir_req->ino), con);
-        directory_listing_done (con, dir_req, FALSE);
-        return;
-    }
+    // http_connection_on_key_listing_data () is already called
+    if (!res)
+        LOG_err (CON_DIR_LOG, CON_H"Failed to create HTTP request !", key_req->con);
+
+    return res;
+}
+
+void http_connection_get_key_listing (HttpConnection *con, const gchar *prefix,
+    HttpConnection_key_listing_callback key_listing_callback, gpointer callback_data)
+{
+    KeyListRequest *key_req;
+    const gchar *key_prefix;
+
+    LOG_debug (CON_DIR_LOG, CON_H"Getting key listing for: >>%s<<", con, prefix);
+
+    key_req = g_new0 (KeyListRequest, 1);
+    key_req->con = con;
+    key_req->app = http_connection_get_app (con);
+    key_req->prefix = g_strdup (prefix);
+    key_prefix = conf_get_string (application_get_conf (key_req->app), "s3.key_prefix");
+    if (strlen (key_prefix))
+        key_prefix++;
+    key_req->key_prefix = key_prefix;
+    key_req->key_prefix_len = strlen (key_prefix);
+    key_req->max_keys = conf_get_uint (application_get_conf (key_req->app), "s3.keys_per_request");
+    key_req->key_listing_callback = key_listing_callback;
+    key_req->callback_data = callback_data;
+
+    // acquire HTTP client
+    http_connection_acquire (con);
 
-    return;
+    http_connection_key_listing_request (key_req, NULL);
 }
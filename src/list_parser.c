@@ -0,0 +1,525 @@
+/*
+ * Copyright (C) 2012-2014 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012-2014 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "list_parser.h"
+
+// elements of ListBucketResult document, other elements are skipped
+typedef enum {
+    LPE_other = 0,
+    LPE_root,
+    LPE_contents,
+    LPE_common_prefixes,
+    LPE_key,
+    LPE_size,
+    LPE_last_modified,
+    LPE_etag,
+    LPE_prefix,
+    LPE_next_marker,
+    LPE_is_truncated,
+} ListParserElement;
+
+typedef struct {
+    ListParser_on_object_cb on_object_cb;
+    ListParser_on_prefix_cb on_prefix_cb;
+    gpointer ctx;
+    ListParserResult *result;
+
+    gboolean head_only; // stop at the first Contents or CommonPrefixes
+    gboolean has_is_truncated;
+
+    guint depth; // number of open elements
+    ListParserElement container; // Contents or CommonPrefixes which is being parsed, or LPE_other
+
+    // values of the current container
+    GString *key; // Key of Contents or Prefix of CommonPrefixes
+    gboolean has_key;
+    guint64 size;
+    time_t last_modified;
+    GString *etag;
+    gboolean has_etag;
+
+    // LastModified values are converted by mktime (), which is slow,
+    // objects are usually uploaded in batches, so the start of the last hour is cached
+    gchar time_hour[13]; // "2013-04-11T15"
+    time_t time_hour_start;
+
+    GString *text; // decoded text of the last leaf element
+    GString *last_key; // Key of the last reported object
+} ListParser;
+
+/*{{{ helpers */
+
+// return element type by its local name (namespace prefix is skipped)
+static ListParserElement list_parser_element (const gchar *name, size_t len)
+{
+    const gchar *colon;
+
+    colon = memchr (name, ':', len);
+    if (colon) {
+        len -= colon + 1 - name;
+        name = colon + 1;
+    }
+
+#define LP_IS(s) (len == sizeof (s) - 1 && !memcmp (name, s, sizeof (s) - 1))
+    switch (len) {
+        case 3:
+            if (LP_IS ("Key")) return LPE_key;
+            break;
+        case 4:
+            if (LP_IS ("Size")) return LPE_size;
+            if (LP_IS ("ETag")) return LPE_etag;
+            break;
+        case 6:
+            if (LP_IS ("Prefix")) return LPE_prefix;
+            break;
+        case 8:
+            if (LP_IS ("Contents")) return LPE_contents;
+            break;
+        case 10:
+            if (LP_IS ("NextMarker")) return LPE_next_marker;
+            break;
+        case 11:
+            if (LP_IS ("IsTruncated")) return LPE_is_truncated;
+            break;
+        case 12:
+            if (LP_IS ("LastModified")) return LPE_last_modified;
+            break;
+        case 14:
+            if (LP_IS ("CommonPrefixes")) return LPE_common_prefixes;
+            break;
+        case 16:
+            if (LP_IS ("ListBucketResult")) return LPE_root;
+            break;
+        default:
+            break;
+    }
+#undef LP_IS
+
+    return LPE_other;
+}
+
+// decode text "s" of "len" bytes into "out", XML entities are replaced
+// returns FALSE on incorrect entity
+static gboolean list_parser_decode (GString *out, const gchar *s, size_t len)
+{
+    const gchar *end = s + len;
+
+    g_string_truncate (out, 0);
+
+    while (s < end) {
+        const gchar *amp;
+        const gchar *semi;
+        const gchar *ent;
+        size_t ent_len;
+
+        amp = memchr (s, '&', end - s);
+        if (!amp) {
+            g_string_append_len (out, s, end - s);
+            break;
+        }
+        g_string_append_len (out, s, amp - s);
+
+        semi = memchr (amp, ';', end - amp);
+        if (!semi)
+            return FALSE;
+
+        ent = amp + 1;
+        ent_len = semi - ent;
+        if (ent_len == 2 && !memcmp (ent, "lt", 2)) {
+            g_string_append_c (out, '<');
+        } else if (ent_len == 2 && !memcmp (ent, "gt", 2)) {
+            g_string_append_c (out, '>');
+        } else if (ent_len == 3 && !memcmp (ent, "amp", 3)) {
+            g_string_append_c (out, '&');
+        } else if (ent_len == 4 && !memcmp (ent, "quot", 4)) {
+            g_string_append_c (out, '"');
+        } else if (ent_len == 4 && !memcmp (ent, "apos", 4)) {
+            g_string_append_c (out, '\'');
+        } else if (ent_len > 1 && ent[0] == '#') {
+            gunichar c = 0;
+            size_t i = 1;
+            guint base = 10;
+
+            if (ent[1] == 'x') {
+                base = 16;
+                i++;
+            }
+            if (i == ent_len)
+                return FALSE;
+            for (; i < ent_len; i++) {
+                gint digit = base == 16 ? g_ascii_xdigit_value (ent[i]) : g_ascii_digit_value (ent[i]);
+                if (digit < 0 || c > 0x10FFFF)
+                    return FALSE;
+                c = c * base + digit;
+            }
+            if (!g_unichar_validate (c))
+                return FALSE;
+            g_string_append_unichar (out, c);
+        } else {
+            return FALSE;
+        }
+
+        s = semi + 1;
+    }
+
+    return TRUE;
+}
+
+static guint64 list_parser_parse_uint (const gchar *s, size_t len)
+{
+    guint64 val = 0;
+    size_t i;
+
+    for (i = 0; i < len && g_ascii_isdigit (s[i]); i++)
+        val = val * 10 + (s[i] - '0');
+
+    return val;
+}
+
+// parse "2013-04-11T15:16:02.000Z", the same as strptime (s, "%Y-%m-%dT%H:%M:%S") and mktime ()
+static time_t list_parser_parse_time (ListParser *parser, const gchar *s, size_t len)
+{
+    struct tm tmp = {0};
+
+    if (len < 19 || s[4] != '-' || s[7] != '-' || s[10] != 'T' || s[13] != ':' || s[16] != ':')
+        return 0;
+
+    // tm_isdst is not set, so mktime () is linear within an hour
+    if (memcmp (parser->time_hour, s, sizeof (parser->time_hour))) {
+        tmp.tm_year = (gint) list_parser_parse_uint (s, 4) - 1900;
+        tmp.tm_mon = list_parser_parse_uint (s + 5, 2) - 1;
+        tmp.tm_mday = list_parser_parse_uint (s + 8, 2);
+        tmp.tm_hour = list_parser_parse_uint (s + 11, 2);
+        parser->time_hour_start = mktime (&tmp);
+        memcpy (parser->time_hour, s, sizeof (parser->time_hour));
+    }
+
+    return parser->time_hour_start + list_parser_parse_uint (s + 14, 2) * 60 + list_parser_parse_uint (s + 17, 2);
+}
+
+// return the end of "needle" in [p, end), or NULL
+static const gchar *list_parser_skip_past (const gchar *p, const gchar *end, const gchar *needle)
+{
+    const gchar *found;
+
+    found = g_strstr_len (p, end - p, needle);
+    if (!found)
+        return NULL;
+
+    return found + strlen (needle);
+}
+
+// return the closing '>' of the tag, quoted attribute values are skipped
+static const gchar *list_parser_tag_end (const gchar *p, const gchar *end)
+{
+    gchar quote = 0;
+
+    for (; p < end; p++) {
+        if (quote) {
+            if (*p == quote)
+                quote = 0;
+        } else if (*p == '"' || *p == '\'') {
+            quote = *p;
+        } else if (*p == '>') {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+/*}}}*/
+
+/*{{{ elements */
+
+// leaf element is open, "text" is its content up to the next tag
+static gboolean list_parser_on_leaf (ListParser *parser, ListParserElement el, const gchar *text, size_t len)
+{
+    ListParserResult *result = parser->result;
+
+    switch (el) {
+        case LPE_key:
+        case LPE_prefix:
+            if (!list_parser_decode (parser->key, text, len))
+                return FALSE;
+            parser->has_key = TRUE;
+            break;
+        case LPE_size:
+            parser->size = list_parser_parse_uint (text, len);
+            break;
+        case LPE_last_modified:
+            parser->last_modified = list_parser_parse_time (parser, text, len);
+            break;
+        case LPE_etag:
+            if (!list_parser_decode (parser->etag, text, len))
+                return FALSE;
+            // ETag is quoted
+            if (parser->etag->len >= 2 && parser->etag->str[0] == '"' &&
+                parser->etag->str[parser->etag->len - 1] == '"') {
+                g_string_truncate (parser->etag, parser->etag->len - 1);
+                g_string_erase (parser->etag, 0, 1);
+            }
+            parser->has_etag = TRUE;
+            break;
+        case LPE_next_marker:
+            if (!list_parser_decode (parser->text, text, len))
+                return FALSE;
+            g_free (result->next_marker);
+            result->next_marker = g_strndup (parser->text->str, parser->text->len);
+            break;
+        case LPE_is_truncated:
+            result->is_truncated = (len == 4 && !memcmp (text, "true", 4));
+            parser->has_is_truncated = TRUE;
+            break;
+        default:
+            break;
+    }
+
+    return TRUE;
+}
+
+// returns TRUE if the element of type "el" is parsed at the current depth,
+// the depth is the number of open elements including "el"
+static gboolean list_parser_is_leaf (ListParser *parser, ListParserElement el)
+{
+    switch (el) {
+        case LPE_key:
+        case LPE_size:
+        case LPE_last_modified:
+        case LPE_etag:
+            return parser->depth == 3 && parser->container == LPE_contents;
+        case LPE_prefix:
+            return parser->depth == 3 && parser->container == LPE_common_prefixes;
+        case LPE_next_marker:
+        case LPE_is_truncated:
+            return parser->depth == 2;
+        default:
+            return FALSE;
+    }
+}
+
+static gboolean list_parser_on_start (ListParser *parser, ListParserElement el)
+{
+    parser->depth++;
+
+    if (parser->depth == 1)
+        return el == LPE_root;
+
+    if (parser->depth == 2 && (el == LPE_contents || el == LPE_common_prefixes)) {
+        parser->container = el;
+        parser->has_key = FALSE;
+        parser->has_etag = FALSE;
+        parser->size = 0;
+        parser->last_modified = 0;
+    }
+
+    return TRUE;
+}
+
+static gboolean list_parser_on_end (ListParser *parser)
+{
+    ListParserResult *result = parser->result;
+
+    if (!parser->depth)
+        return FALSE;
+
+    if (parser->depth == 2 && parser->container == LPE_contents) {
+        // Contents without Key are skipped
+        if (parser->has_key) {
+            ListParserObject obj;
+
+            obj.key = parser->key->str;
+            obj.size = parser->size;
+            obj.last_modified = parser->last_modified;
+            obj.etag = parser->has_etag ? parser->etag->str : NULL;
+
+            result->objects_count++;
+            if (parser->on_object_cb)
+                parser->on_object_cb (parser->ctx, &obj);
+            g_string_truncate (parser->last_key, 0);
+            g_string_append_len (parser->last_key, parser->key->str, parser->key->len);
+        }
+        parser->container = LPE_other;
+    } else if (parser->depth == 2 && parser->container == LPE_common_prefixes) {
+        if (parser->has_key) {
+            result->prefixes_count++;
+            if (parser->on_prefix_cb)
+                parser->on_prefix_cb (parser->ctx, parser->key->str);
+        }
+        parser->container = LPE_other;
+    }
+
+    parser->depth--;
+
+    return TRUE;
+}
+/*}}}*/
+
+static void list_parser_init (ListParser *parser, ListParserResult *result)
+{
+    memset (result, 0, sizeof (ListParserResult));
+    memset (parser, 0, sizeof (ListParser));
+    parser->result = result;
+    parser->container = LPE_other;
+    parser->key = g_string_sized_new (256);
+    parser->etag = g_string_sized_new (64);
+    parser->text = g_string_sized_new (256);
+    parser->last_key = g_string_sized_new (256);
+}
+
+static void list_parser_free (ListParser *parser)
+{
+    g_string_free (parser->key, TRUE);
+    g_string_free (parser->etag, TRUE);
+    g_string_free (parser->text, TRUE);
+    g_string_free (parser->last_key, TRUE);
+}
+
+// returns FALSE if the document is incorrect,
+// in the "head_only" mode the document can end at the first Contents or CommonPrefixes
+static gboolean list_parser_scan (ListParser *parser, const gchar *xml, size_t xml_len)
+{
+    const gchar *p = xml;
+    const gchar *end = xml + xml_len;
+    gboolean root_seen = FALSE;
+
+    while (p < end) {
+        const gchar *tag_end;
+        const gchar *name;
+        size_t name_len;
+        ListParserElement el;
+
+        p = memchr (p, '<', end - p);
+        if (!p)
+            break;
+        p++;
+        if (p >= end)
+            return FALSE;
+
+        // XML declaration, processing instruction, comment, DOCTYPE
+        if (*p == '?' || *p == '!') {
+            if (*p == '?')
+                p = list_parser_skip_past (p, end, "?>");
+            else if (end - p >= 3 && !memcmp (p, "!--", 3))
+                p = list_parser_skip_past (p, end, "-->");
+            else if (end - p >= 8 && !memcmp (p, "![CDATA[", 8))
+                p = list_parser_skip_past (p, end, "]]>");
+            else
+                p = list_parser_skip_past (p, end, ">");
+            if (!p)
+                return FALSE;
+            continue;
+        }
+
+        // end tag
+        if (*p == '/') {
+            tag_end = memchr (p, '>', end - p);
+            if (!tag_end || !list_parser_on_end (parser))
+                return FALSE;
+            p = tag_end + 1;
+            continue;
+        }
+
+        // start tag
+        tag_end = list_parser_tag_end (p, end);
+        if (!tag_end)
+            return FALSE;
+        name = p;
+        for (name_len = 0; name + name_len < tag_end; name_len++) {
+            gchar c = name[name_len];
+            if (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '/')
+                break;
+        }
+        el = list_parser_element (name, name_len);
+        p = tag_end + 1;
+
+        if (parser->depth == 0) {
+            // only one root element is allowed
+            if (root_seen)
+                return FALSE;
+            root_seen = TRUE;
+        }
+
+        if (!list_parser_on_start (parser, el))
+            return FALSE;
+
+        if (parser->head_only && parser->container != LPE_other)
+            return TRUE;
+
+        // empty element
+        if (tag_end[-1] == '/') {
+            if (!list_parser_on_end (parser))
+                return FALSE;
+            continue;
+        }
+
+        if (list_parser_is_leaf (parser, el)) {
+            const gchar *text_end;
+
+            text_end = memchr (p, '<', end - p);
+            if (!text_end || !list_parser_on_leaf (parser, el, p, text_end - p))
+                return FALSE;
+            p = text_end;
+        }
+    }
+
+    // document must be complete
+    return root_seen && !parser->depth;
+}
+
+gboolean list_parser_parse (const gchar *xml, size_t xml_len,
+    ListParser_on_object_cb on_object_cb, ListParser_on_prefix_cb on_prefix_cb, gpointer ctx,
+    ListParserResult *result)
+{
+    ListParser parser;
+    gboolean res;
+
+    list_parser_init (&parser, result);
+    parser.on_object_cb = on_object_cb;
+    parser.on_prefix_cb = on_prefix_cb;
+    parser.ctx = ctx;
+
+    res = list_parser_scan (&parser, xml, xml_len);
+
+    if (result->objects_count)
+        result->last_key = g_strndup (parser.last_key->str, parser.last_key->len);
+
+    list_parser_free (&parser);
+
+    return res;
+}
+
+gboolean list_parser_parse_head (const gchar *xml, size_t xml_len, ListParserResult *result)
+{
+    ListParser parser;
+    gboolean res;
+
+    list_parser_init (&parser, result);
+    parser.head_only = TRUE;
+
+    res = list_parser_scan (&parser, xml, xml_len) && parser.has_is_truncated;
+
+    list_parser_free (&parser);
+
+    return res;
+}
+
+void list_parser_result_clear (ListParserResult *result)
+{
+    g_free (result->next_marker);
+    g_free (result->last_key);
+    memset (result, 0, sizeof (ListParserResult));
+}
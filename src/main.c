@@ -22,6 +22,8 @@
 #include "utils.h"
 #include "client_pool.h"
 #include "cache_mng.h"
+#include "write_back.h"
+#include "hash_pool.h"
 #include "stat_srv.h"
 #include "conf_keys.h"
 
@@ -41,6 +43,8 @@ struct _Application {
     RFuse *rfuse;
     DirTree *dir_tree;
     CacheMng *cmng;
+    WriteBack *wb;
+    HashPool *hpool;
     StatSrv *stat_srv;
 
     // initial bucket ACL request
@@ -121,6 +125,16 @@ CacheMng *application_get_cache_mng (Application *app)
     return app->cmng;
 }
 
+WriteBack *application_get_write_back (Application *app)
+{
+    return app->wb;
+}
+
+HashPool *application_get_hash_pool (Application *app)
+{
+    return app->hpool;
+}
+
 StatSrv *application_get_stat_srv (Application *app)
 {
     return app->stat_srv;
@@ -406,6 +420,15 @@ static gint application_finish_initialization_and_run (Application *app)
     }
 /*}}}*/
 
+/*{{{ HashPool */
+    app->hpool = hash_pool_create (app);
+    if (!app->hpool) {
+        LOG_err (APP_LOG, "Failed to create HashPool !");
+        application_exit (app);
+        return -1;
+    }
+/*}}}*/
+
 /*{{{ CacheMng */
     app->cmng = cache_mng_create (app);
     if (!app->cmng) {
@@ -415,6 +438,17 @@ static gint application_finish_initialization_and_run (Application *app)
     }
 /*}}}*/
 
+/*{{{ WriteBack */
+    if (conf_get_boolean (app->conf, "filesystem.write_back_enabled")) {
+        app->wb = write_back_create (app);
+        if (!app->wb) {
+            LOG_err (APP_LOG, "Failed to create WriteBack !");
+            application_exit (app);
+            return -1;
+        }
+    }
+/*}}}*/
+
 /*{{{ DirTree*/
     app->dir_tree = dir_tree_create (app);
     if (!app->dir_tree) {
@@ -550,9 +584,15 @@ static void application_destroy (Application *app)
     if (app->dir_tree)
         dir_tree_destroy (app->dir_tree);
 
+    if (app->wb)
+        write_back_destroy (app->wb);
+
     if (app->cmng)
         cache_mng_destroy (app->cmng);
 
+    if (app->hpool)
+        hash_pool_destroy (app->hpool);
+
     if (app->sigint_ev)
         event_free (app->sigint_ev);
     if (app->sigterm_ev)
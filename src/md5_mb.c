@@ -0,0 +1,425 @@
+/*
+ * Copyright (C) 2012-2014 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012-2014 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "md5_mb.h"
+
+/*{{{ MD5 rounds */
+
+// the same round code is used by the scalar and all SIMD backends,
+// SIMD backends rely on GCC vector extensions, operations are applied to every lane
+
+#define MD5_MB_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD5_MB_G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define MD5_MB_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD5_MB_I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+#define MD5_MB_STEP(f, a, b, c, d, x, t, s) \
+    (a) += f ((b), (c), (d)) + (x) + (t); \
+    (a) = ((a) << (s)) | ((a) >> (32 - (s))); \
+    (a) += (b)
+
+#define MD5_MB_ROUNDS(a, b, c, d, X) \
+    MD5_MB_STEP (MD5_MB_F, a, b, c, d, (X)[0], 0xd76aa478U, 7); \
+    MD5_MB_STEP (MD5_MB_F, d, a, b, c, (X)[1], 0xe8c7b756U, 12); \
+    MD5_MB_STEP (MD5_MB_F, c, d, a, b, (X)[2], 0x242070dbU, 17); \
+    MD5_MB_STEP (MD5_MB_F, b, c, d, a, (X)[3], 0xc1bdceeeU, 22); \
+    MD5_MB_STEP (MD5_MB_F, a, b, c, d, (X)[4], 0xf57c0fafU, 7); \
+    MD5_MB_STEP (MD5_MB_F, d, a, b, c, (X)[5], 0x4787c62aU, 12); \
+    MD5_MB_STEP (MD5_MB_F, c, d, a, b, (X)[6], 0xa8304613U, 17); \
+    MD5_MB_STEP (MD5_MB_F, b, c, d, a, (X)[7], 0xfd469501U, 22); \
+    MD5_MB_STEP (MD5_MB_F, a, b, c, d, (X)[8], 0x698098d8U, 7); \
+    MD5_MB_STEP (MD5_MB_F, d, a, b, c, (X)[9], 0x8b44f7afU, 12); \
+    MD5_MB_STEP (MD5_MB_F, c, d, a, b, (X)[10], 0xffff5bb1U, 17); \
+    MD5_MB_STEP (MD5_MB_F, b, c, d, a, (X)[11], 0x895cd7beU, 22); \
+    MD5_MB_STEP (MD5_MB_F, a, b, c, d, (X)[12], 0x6b901122U, 7); \
+    MD5_MB_STEP (MD5_MB_F, d, a, b, c, (X)[13], 0xfd987193U, 12); \
+    MD5_MB_STEP (MD5_MB_F, c, d, a, b, (X)[14], 0xa679438eU, 17); \
+    MD5_MB_STEP (MD5_MB_F, b, c, d, a, (X)[15], 0x49b40821U, 22); \
+    MD5_MB_STEP (MD5_MB_G, a, b, c, d, (X)[1], 0xf61e2562U, 5); \
+    MD5_MB_STEP (MD5_MB_G, d, a, b, c, (X)[6], 0xc040b340U, 9); \
+    MD5_MB_STEP (MD5_MB_G, c, d, a, b, (X)[11], 0x265e5a51U, 14); \
+    MD5_MB_STEP (MD5_MB_G, b, c, d, a, (X)[0], 0xe9b6c7aaU, 20); \
+    MD5_MB_STEP (MD5_MB_G, a, b, c, d, (X)[5], 0xd62f105dU, 5); \
+    MD5_MB_STEP (MD5_MB_G, d, a, b, c, (X)[10], 0x02441453U, 9); \
+    MD5_MB_STEP (MD5_MB_G, c, d, a, b, (X)[15], 0xd8a1e681U, 14); \
+    MD5_MB_STEP (MD5_MB_G, b, c, d, a, (X)[4], 0xe7d3fbc8U, 20); \
+    MD5_MB_STEP (MD5_MB_G, a, b, c, d, (X)[9], 0x21e1cde6U, 5); \
+    MD5_MB_STEP (MD5_MB_G, d, a, b, c, (X)[14], 0xc33707d6U, 9); \
+    MD5_MB_STEP (MD5_MB_G, c, d, a, b, (X)[3], 0xf4d50d87U, 14); \
+    MD5_MB_STEP (MD5_MB_G, b, c, d, a, (X)[8], 0x455a14edU, 20); \
+    MD5_MB_STEP (MD5_MB_G, a, b, c, d, (X)[13], 0xa9e3e905U, 5); \
+    MD5_MB_STEP (MD5_MB_G, d, a, b, c, (X)[2], 0xfcefa3f8U, 9); \
+    MD5_MB_STEP (MD5_MB_G, c, d, a, b, (X)[7], 0x676f02d9U, 14); \
+    MD5_MB_STEP (MD5_MB_G, b, c, d, a, (X)[12], 0x8d2a4c8aU, 20); \
+    MD5_MB_STEP (MD5_MB_H, a, b, c, d, (X)[5], 0xfffa3942U, 4); \
+    MD5_MB_STEP (MD5_MB_H, d, a, b, c, (X)[8], 0x8771f681U, 11); \
+    MD5_MB_STEP (MD5_MB_H, c, d, a, b, (X)[11], 0x6d9d6122U, 16); \
+    MD5_MB_STEP (MD5_MB_H, b, c, d, a, (X)[14], 0xfde5380cU, 23); \
+    MD5_MB_STEP (MD5_MB_H, a, b, c, d, (X)[1], 0xa4beea44U, 4); \
+    MD5_MB_STEP (MD5_MB_H, d, a, b, c, (X)[4], 0x4bdecfa9U, 11); \
+    MD5_MB_STEP (MD5_MB_H, c, d, a, b, (X)[7], 0xf6bb4b60U, 16); \
+    MD5_MB_STEP (MD5_MB_H, b, c, d, a, (X)[10], 0xbebfbc70U, 23); \
+    MD5_MB_STEP (MD5_MB_H, a, b, c, d, (X)[13], 0x289b7ec6U, 4); \
+    MD5_MB_STEP (MD5_MB_H, d, a, b, c, (X)[0], 0xeaa127faU, 11); \
+    MD5_MB_STEP (MD5_MB_H, c, d, a, b, (X)[3], 0xd4ef3085U, 16); \
+    MD5_MB_STEP (MD5_MB_H, b, c, d, a, (X)[6], 0x04881d05U, 23); \
+    MD5_MB_STEP (MD5_MB_H, a, b, c, d, (X)[9], 0xd9d4d039U, 4); \
+    MD5_MB_STEP (MD5_MB_H, d, a, b, c, (X)[12], 0xe6db99e5U, 11); \
+    MD5_MB_STEP (MD5_MB_H, c, d, a, b, (X)[15], 0x1fa27cf8U, 16); \
+    MD5_MB_STEP (MD5_MB_H, b, c, d, a, (X)[2], 0xc4ac5665U, 23); \
+    MD5_MB_STEP (MD5_MB_I, a, b, c, d, (X)[0], 0xf4292244U, 6); \
+    MD5_MB_STEP (MD5_MB_I, d, a, b, c, (X)[7], 0x432aff97U, 10); \
+    MD5_MB_STEP (MD5_MB_I, c, d, a, b, (X)[14], 0xab9423a7U, 15); \
+    MD5_MB_STEP (MD5_MB_I, b, c, d, a, (X)[5], 0xfc93a039U, 21); \
+    MD5_MB_STEP (MD5_MB_I, a, b, c, d, (X)[12], 0x655b59c3U, 6); \
+    MD5_MB_STEP (MD5_MB_I, d, a, b, c, (X)[3], 0x8f0ccc92U, 10); \
+    MD5_MB_STEP (MD5_MB_I, c, d, a, b, (X)[10], 0xffeff47dU, 15); \
+    MD5_MB_STEP (MD5_MB_I, b, c, d, a, (X)[1], 0x85845dd1U, 21); \
+    MD5_MB_STEP (MD5_MB_I, a, b, c, d, (X)[8], 0x6fa87e4fU, 6); \
+    MD5_MB_STEP (MD5_MB_I, d, a, b, c, (X)[15], 0xfe2ce6e0U, 10); \
+    MD5_MB_STEP (MD5_MB_I, c, d, a, b, (X)[6], 0xa3014314U, 15); \
+    MD5_MB_STEP (MD5_MB_I, b, c, d, a, (X)[13], 0x4e0811a1U, 21); \
+    MD5_MB_STEP (MD5_MB_I, a, b, c, d, (X)[4], 0xf7537e82U, 6); \
+    MD5_MB_STEP (MD5_MB_I, d, a, b, c, (X)[11], 0xbd3af235U, 10); \
+    MD5_MB_STEP (MD5_MB_I, c, d, a, b, (X)[2], 0x2ad7d2bbU, 15); \
+    MD5_MB_STEP (MD5_MB_I, b, c, d, a, (X)[9], 0xeb86d391U, 21);
+
+#define MD5_MB_LE32(p) \
+    ((guint32) (p)[0] | ((guint32) (p)[1] << 8) | ((guint32) (p)[2] << 16) | ((guint32) (p)[3] << 24))
+
+static void md5_mb_compress (guint32 *state, const unsigned char *data, size_t nblocks)
+{
+    guint32 a, b, c, d;
+    guint32 X[16];
+    size_t blk;
+    guint w;
+
+    for (blk = 0; blk < nblocks; blk++, data += MD5_MB_BLOCK_SIZE) {
+        for (w = 0; w < 16; w++)
+            X[w] = MD5_MB_LE32 (data + w * 4);
+
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+
+        MD5_MB_ROUNDS (a, b, c, d, X);
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+    }
+}
+
+// process "nblocks" of every lane, all lanes must be set
+// message words are transposed, so each vector holds the same word of all lanes
+#define MD5_MB_DEFINE_BLOCKS(name, vtype, lanes, attrs) \
+attrs static void name (guint32 **states, const unsigned char **data, size_t nblocks) \
+{ \
+    vtype a, b, c, d, aa, bb, cc, dd; \
+    vtype X[16]; \
+    guint32 words[16][lanes] __attribute__ ((aligned (64))); \
+    guint32 block[lanes][16] __attribute__ ((aligned (64))); \
+    size_t blk; \
+    guint l, w; \
+\
+    for (l = 0; l < lanes; l++) \
+        for (w = 0; w < 4; w++) \
+            words[w][l] = states[l][w]; \
+    memcpy (&a, words[0], sizeof (a)); \
+    memcpy (&b, words[1], sizeof (b)); \
+    memcpy (&c, words[2], sizeof (c)); \
+    memcpy (&d, words[3], sizeof (d)); \
+\
+    for (blk = 0; blk < nblocks; blk++) { \
+        for (l = 0; l < lanes; l++) \
+            memcpy (block[l], data[l] + blk * MD5_MB_BLOCK_SIZE, MD5_MB_BLOCK_SIZE); \
+        for (w = 0; w < 16; w++) \
+            for (l = 0; l < lanes; l++) \
+                words[w][l] = GUINT32_FROM_LE (block[l][w]); \
+        memcpy (X, words, sizeof (X)); \
+\
+        aa = a; \
+        bb = b; \
+        cc = c; \
+        dd = d; \
+\
+        MD5_MB_ROUNDS (a, b, c, d, X); \
+\
+        a += aa; \
+        b += bb; \
+        c += cc; \
+        d += dd; \
+    } \
+\
+    memcpy (words[0], &a, sizeof (a)); \
+    memcpy (words[1], &b, sizeof (b)); \
+    memcpy (words[2], &c, sizeof (c)); \
+    memcpy (words[3], &d, sizeof (d)); \
+    for (l = 0; l < lanes; l++) \
+        for (w = 0; w < 4; w++) \
+            states[l][w] = words[w][l]; \
+}
+/*}}}*/
+
+/*{{{ backends */
+
+typedef void (*Md5MbBlocksFunc) (guint32 **states, const unsigned char **data, size_t nblocks);
+
+typedef struct {
+    const gchar *name;
+    guint lanes;
+    Md5MbBlocksFunc blocks; // NULL for the scalar backend
+} Md5MbBackend;
+
+#if defined(__GNUC__) && defined(__x86_64__)
+    #define MD5_MB_X86 1
+    typedef guint32 md5_mb_v4 __attribute__ ((vector_size (16)));
+    typedef guint32 md5_mb_v8 __attribute__ ((vector_size (32)));
+    typedef guint32 md5_mb_v16 __attribute__ ((vector_size (64)));
+
+    // SSE2 is always available on x86_64
+    MD5_MB_DEFINE_BLOCKS (md5_mb_blocks_sse2, md5_mb_v4, 4, )
+    MD5_MB_DEFINE_BLOCKS (md5_mb_blocks_avx2, md5_mb_v8, 8, __attribute__ ((target ("avx2"))))
+    MD5_MB_DEFINE_BLOCKS (md5_mb_blocks_avx512, md5_mb_v16, 16, __attribute__ ((target ("avx512f"))))
+#elif defined(__GNUC__) && (defined(__aarch64__) || defined(__ARM_NEON))
+    #define MD5_MB_VEC4 1
+    typedef guint32 md5_mb_v4 __attribute__ ((vector_size (16)));
+
+    MD5_MB_DEFINE_BLOCKS (md5_mb_blocks_vec4, md5_mb_v4, 4, )
+#endif
+
+// ordered from the best one
+static const Md5MbBackend md5_mb_backends[] = {
+#ifdef MD5_MB_X86
+    { "avx512", 16, md5_mb_blocks_avx512 },
+    { "avx2", 8, md5_mb_blocks_avx2 },
+    { "sse2", 4, md5_mb_blocks_sse2 },
+#endif
+#ifdef MD5_MB_VEC4
+    { "vec4", 4, md5_mb_blocks_vec4 },
+#endif
+    { "scalar", 1, NULL },
+};
+
+static const Md5MbBackend *md5_mb_backend = NULL;
+
+static gboolean md5_mb_backend_supported (const Md5MbBackend *backend)
+{
+#ifdef MD5_MB_X86
+    __builtin_cpu_init ();
+    if (!strcmp (backend->name, "avx512"))
+        return __builtin_cpu_supports ("avx512f");
+    if (!strcmp (backend->name, "avx2"))
+        return __builtin_cpu_supports ("avx2");
+#endif
+    return TRUE;
+}
+
+static const Md5MbBackend *md5_mb_get_current (void)
+{
+    static gsize backend_init = 0;
+
+    if (g_once_init_enter (&backend_init)) {
+        guint i;
+
+        for (i = 0; i < G_N_ELEMENTS (md5_mb_backends); i++) {
+            if (md5_mb_backend_supported (&md5_mb_backends[i])) {
+                md5_mb_backend = &md5_mb_backends[i];
+                break;
+            }
+        }
+        g_once_init_leave (&backend_init, 1);
+    }
+
+    return md5_mb_backend;
+}
+
+const gchar *md5_mb_get_backend (void)
+{
+    return md5_mb_get_current ()->name;
+}
+
+guint md5_mb_get_lanes (void)
+{
+    return md5_mb_get_current ()->lanes;
+}
+
+// not thread safe, must be called before hashing starts
+gboolean md5_mb_set_backend (const gchar *name)
+{
+    guint i;
+
+    md5_mb_get_current ();
+
+    for (i = 0; i < G_N_ELEMENTS (md5_mb_backends); i++) {
+        if (!strcmp (name, "auto") || !strcmp (name, md5_mb_backends[i].name)) {
+            if (!md5_mb_backend_supported (&md5_mb_backends[i]))
+                continue;
+            md5_mb_backend = &md5_mb_backends[i];
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+/*}}}*/
+
+/*{{{ hashing */
+
+void md5_mb_init (Md5MbCtx *ctx)
+{
+    ctx->state[0] = 0x67452301U;
+    ctx->state[1] = 0xefcdab89U;
+    ctx->state[2] = 0x98badcfeU;
+    ctx->state[3] = 0x10325476U;
+    ctx->len = 0;
+}
+
+// update up to "backend->lanes" contexts
+static void md5_mb_update_group (const Md5MbBackend *backend, Md5MbCtx **ctxs, const unsigned char **data,
+    const size_t *lens, guint n)
+{
+    const unsigned char *p[MD5_MB_MAX_LANES];
+    size_t left[MD5_MB_MAX_LANES];
+    guint active[MD5_MB_MAX_LANES];
+    guint32 *states[MD5_MB_MAX_LANES];
+    const unsigned char *blocks[MD5_MB_MAX_LANES];
+    guint32 unused_states[MD5_MB_MAX_LANES][4];
+    guint i, count;
+
+    for (i = 0; i < n; i++) {
+        size_t used = ctxs[i]->len % MD5_MB_BLOCK_SIZE;
+
+        p[i] = data[i];
+        left[i] = lens[i];
+
+        // complete the incomplete block first
+        if (used) {
+            size_t bytes = MIN (MD5_MB_BLOCK_SIZE - used, left[i]);
+
+            memcpy (ctxs[i]->block + used, p[i], bytes);
+            ctxs[i]->len += bytes;
+            p[i] += bytes;
+            left[i] -= bytes;
+            if (used + bytes == MD5_MB_BLOCK_SIZE)
+                md5_mb_compress (ctxs[i]->state, ctxs[i]->block, 1);
+        }
+    }
+
+    // hash the number of blocks all remaining buffers have, until only one buffer is left
+    for (;;) {
+        size_t nblocks = 0;
+
+        count = 0;
+        for (i = 0; i < n; i++) {
+            size_t lane_blocks = left[i] / MD5_MB_BLOCK_SIZE;
+
+            if (!lane_blocks)
+                continue;
+            if (!count || lane_blocks < nblocks)
+                nblocks = lane_blocks;
+            active[count++] = i;
+        }
+
+        if (!count)
+            break;
+
+        if (count == 1) {
+            i = active[0];
+            nblocks = left[i] / MD5_MB_BLOCK_SIZE;
+            md5_mb_compress (ctxs[i]->state, p[i], nblocks);
+        } else {
+            for (i = 0; i < backend->lanes; i++) {
+                if (i < count) {
+                    states[i] = ctxs[active[i]]->state;
+                    blocks[i] = p[active[i]];
+                } else {
+                    // idle lanes hash the first buffer once more
+                    memset (unused_states[i], 0, sizeof (unused_states[i]));
+                    states[i] = unused_states[i];
+                    blocks[i] = p[active[0]];
+                }
+            }
+            backend->blocks (states, blocks, nblocks);
+        }
+
+        for (i = 0; i < count; i++) {
+            p[active[i]] += nblocks * MD5_MB_BLOCK_SIZE;
+            left[active[i]] -= nblocks * MD5_MB_BLOCK_SIZE;
+            ctxs[active[i]]->len += nblocks * MD5_MB_BLOCK_SIZE;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        if (left[i]) {
+            memcpy (ctxs[i]->block, p[i], left[i]);
+            ctxs[i]->len += left[i];
+        }
+    }
+}
+
+void md5_mb_update_multi (Md5MbCtx **ctxs, const unsigned char **data, const size_t *lens, guint n)
+{
+    const Md5MbBackend *backend = md5_mb_get_current ();
+    guint i;
+
+    for (i = 0; i < n; i += backend->lanes)
+        md5_mb_update_group (backend, ctxs + i, data + i, lens + i, MIN (backend->lanes, n - i));
+}
+
+void md5_mb_update (Md5MbCtx *ctx, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *) data;
+
+    md5_mb_update_multi (&ctx, &p, &len, 1);
+}
+
+void md5_mb_final (unsigned char *digest, Md5MbCtx *ctx)
+{
+    unsigned char pad[MD5_MB_BLOCK_SIZE * 2];
+    guint64 bits = ctx->len * 8;
+    size_t used = ctx->len % MD5_MB_BLOCK_SIZE;
+    size_t pad_len;
+    guint i;
+
+    // 0x80, zeros and the message length in bits, up to the end of a block
+    pad_len = (used < 56) ? 56 - used : 120 - used;
+    memset (pad, 0, sizeof (pad));
+    pad[0] = 0x80;
+    for (i = 0; i < 8; i++)
+        pad[pad_len + i] = (unsigned char) (bits >> (i * 8));
+    md5_mb_update (ctx, pad, pad_len + 8);
+
+    for (i = 0; i < 4; i++) {
+        digest[i * 4] = (unsigned char) ctx->state[i];
+        digest[i * 4 + 1] = (unsigned char) (ctx->state[i] >> 8);
+        digest[i * 4 + 2] = (unsigned char) (ctx->state[i] >> 16);
+        digest[i * 4 + 3] = (unsigned char) (ctx->state[i] >> 24);
+    }
+}
+
+void md5_mb (const void *buf, size_t len, unsigned char *digest)
+{
+    Md5MbCtx ctx;
+
+    md5_mb_init (&ctx);
+    md5_mb_update (&ctx, buf, len);
+    md5_mb_final (digest, &ctx);
+}
+/*}}}*/
@@ -163,3 +163,13 @@ void range_print (Range *range)
         g_printf ("[%"G_GUINT64_FORMAT" %"G_GUINT64_FORMAT"]\n", in->start, in->end);
     }
 }
+
+void range_foreach (Range *range, RangeFunc func, gpointer ctx)
+{
+    GList *l;
+
+    for (l = g_list_first (range->l_intervals); l; l = g_list_next (l)) {
+        Interval *in = (Interval *) l->data;
+        func (in->start, in->end, ctx);
+    }
+}
@@ -98,6 +98,7 @@ static void rfuse_statfs (fuse_req_t req, fuse_ino_t ino);
 static void rfuse_symlink (fuse_req_t req, const char *link, fuse_ino_t parent_ino, const char *name);
 static void rfuse_readlink (fuse_req_t req, fuse_ino_t ino);
 static void rfuse_flush (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+static void rfuse_fallocate (fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi);
 
 static struct fuse_lowlevel_ops rfuse_opers = {
     .init       = rfuse_init,
@@ -124,6 +125,7 @@ static struct fuse_lowlevel_ops rfuse_opers = {
     .symlink    = rfuse_symlink,
     .readlink   = rfuse_readlink,
     .flush      = rfuse_flush,
+    .fallocate  = rfuse_fallocate,
 };
 /*}}}*/
 
@@ -328,6 +330,16 @@ static void rfuse_on_timer (evutil_socket_t fd, short what, void *arg)
 static void rfuse_init (G_GNUC_UNUSED void *userdata, struct fuse_conn_info *conn)
 {
     conn->async_read = 0;
+#ifdef FUSE_CAP_SPLICE_WRITE
+    // let the kernel splice read replies straight from the cache files
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+#endif
+#ifdef FUSE_CAP_ATOMIC_O_TRUNC
+    // get O_TRUNC in open () flags instead of a separate truncate request
+    if (conn->capable & FUSE_CAP_ATOMIC_O_TRUNC)
+        conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
+#endif
 }
 
 static void rfuse_dest (void *userdata)
@@ -675,7 +687,10 @@ static void rfuse_release (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info
 
     LOG_debug (FUSE_LOG, INO_FI_H"release  inode, flags: %d", INO_T (ino), fi, fi->flags);
 
-    dir_tree_file_release (rfuse->dir_tree, ino, fi);
+    if (!dir_tree_file_release (rfuse->dir_tree, ino, fi)) {
+        fuse_reply_err (req, EIO);
+        return;
+    }
 
     fuse_reply_err (req, 0);
 }
@@ -684,21 +699,23 @@ static void rfuse_release (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info
 /*{{{ read operation */
 
 // read callback
-static void rfuse_read_cb (fuse_req_t req, gboolean success, const char *buf, size_t buf_size)
+static void rfuse_read_cb (fuse_req_t req, gboolean success, struct fuse_bufvec *bufv)
 {
 
-    LOG_debug (FUSE_LOG, "[req: %p] <<<<< read_cb  success: %s IN buf: %zu", req, success?"YES":"NO", buf_size);
+    LOG_debug (FUSE_LOG, "[req: %p] <<<<< read_cb  success: %s IN buf: %zu", req, success?"YES":"NO",
+        success ? fuse_buf_size (bufv) : 0);
 
     if (!success) {
         fuse_reply_err (req, ENOENT);
         return;
     }
 
-    fuse_reply_buf (req, buf, buf_size);
+    // buffers may refer to cache files, FUSE splices them if possible
+    fuse_reply_data (req, bufv, FUSE_BUF_SPLICE_MOVE);
 }
 
 // FUSE lowlevel operation: read
-// Valid replies: fuse_reply_buf() fuse_reply_err()
+// Valid replies: fuse_reply_buf() fuse_reply_data() fuse_reply_err()
 static void rfuse_read (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
 {
     RFuse *rfuse = fuse_req_userdata (req);
@@ -876,6 +893,12 @@ static void rfuse_rename (fuse_req_t req, fuse_ino_t parent, const char *name, f
     LOG_debug (FUSE_LOG, "rename  parent_ino: %"INO_FMT", name: %s new_parent_in: %"INO_FMT", newname: %s",
         INO parent, name, INO newparent, newname);
 
+    // objects of the directory are copied one by one, opened files can't follow them
+    if (dir_tree_rename_is_busy (rfuse->dir_tree, parent, name)) {
+        fuse_reply_err (req, EBUSY);
+        return;
+    }
+
     dir_tree_rename (rfuse->dir_tree, parent, name, newparent, newname, rfuse_rename_cb, req);
 }
 /*}}}*/
@@ -1027,25 +1050,69 @@ static void rfuse_readlink (fuse_req_t req, fuse_ino_t ino)
 /*}}}*/
 
 /*{{{ flush */
-// XXX: currently just a placeholder, does nothing
 static void rfuse_flush_cb (fuse_req_t req, gboolean success)
 {
     LOG_debug (FUSE_LOG, "[req: %p] flush_cb  success: %s", req, success?"YES":"NO");
 
+    // close () fails, written data is lost
     if (!success) {
-        fuse_reply_err (req, ENOENT);
+        fuse_reply_err (req, EIO);
         return;
     }
 
     fuse_reply_err (req, 0);
 }
 
+// FUSE lowlevel operation: flush
+// called on each close () of the file descriptor, the data is uploaded when the file is released
+// Valid replies: fuse_reply_err()
 static void rfuse_flush (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
     RFuse *rfuse = fuse_req_userdata (req);
 
     LOG_debug (FUSE_LOG, "[%p][req: %p] flush ino: %"INO_FMT, rfuse, req, INO ino);
 
-    rfuse_flush_cb (req, TRUE);
+    rfuse_flush_cb (req, dir_tree_file_flush (rfuse->dir_tree, ino, fi));
+}
+/*}}}*/
+
+/*{{{ fallocate */
+static void rfuse_fallocate_cb (fuse_req_t req, gboolean success)
+{
+    LOG_debug (FUSE_LOG, "[req: %p] fallocate_cb  success: %s", req, success?"YES":"NO");
+
+    if (!success) {
+        fuse_reply_err (req, ENOENT);
+        return;
+    }
+
+    fuse_reply_err (req, 0);
+}
+
+// FUSE lowlevel operation: fallocate
+// only allocation is supported, the size is used as a hint of the final file size
+// with FALLOC_FL_KEEP_SIZE the file size grows when data is written
+// Valid replies: fuse_reply_err()
+static void rfuse_fallocate (fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
+{
+    RFuse *rfuse = fuse_req_userdata (req);
+    gboolean keep_size = FALSE;
+
+    LOG_debug (FUSE_LOG, INO_FI_H"fallocate inode, mode: %d, off: %"OFF_FMT", len: %"OFF_FMT,
+        INO_T (ino), fi, mode, offset, length);
+
+#ifdef FALLOC_FL_KEEP_SIZE
+    if (mode & ~FALLOC_FL_KEEP_SIZE) {
+#else
+    if (mode) {
+#endif
+        fuse_reply_err (req, EOPNOTSUPP);
+        return;
+    }
+#ifdef FALLOC_FL_KEEP_SIZE
+    keep_size = (mode & FALLOC_FL_KEEP_SIZE) != 0;
+#endif
+
+    dir_tree_file_fallocate (rfuse->dir_tree, ino, offset, length, keep_size, rfuse_fallocate_cb, req, fi);
 }
 /*}}}*/
@@ -16,6 +16,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  */
 #include "utils.h"
+#include "md5_mb.h"
 
 gchar *get_random_string (size_t len, gboolean readable)
 {
@@ -48,8 +49,7 @@ gboolean get_md5_sum (const gchar *buf, size_t len, gchar **md5str, gchar **md5b
     if (!md5b && !md5str)
         return TRUE;
 
-    MD5 ((const unsigned char *)buf, len, digest);
-
+    md5_mb (buf, len, digest);
 
     if (md5b)
         *md5b = get_base64 ((const gchar *)digest, 16);
@@ -164,6 +164,81 @@ guint64 timeval_diff (struct timeval *starttime, struct timeval *finishtime)
     return msec;
 }
 
+// return value of the first node matching "xpath" ("s3" prefix is bound to the S3 namespace)
+gchar *xml_get_value (const char *xml, size_t xml_len, const gchar *xpath)
+{
+    xmlDocPtr doc;
+    xmlXPathContextPtr ctx;
+    xmlXPathObjectPtr xp;
+    xmlChar *value;
+    gchar *out = NULL;
+
+    if (!xml || !xml_len)
+        return NULL;
+
+    doc = xmlReadMemory (xml, xml_len, "", NULL, 0);
+    if (!doc)
+        return NULL;
+
+    ctx = xmlXPathNewContext (doc);
+    xmlXPathRegisterNs (ctx, (xmlChar *) "s3", (xmlChar *) "http://s3.amazonaws.com/doc/2006-03-01/");
+
+    xp = xmlXPathEvalExpression ((xmlChar *) xpath, ctx);
+    if (xp && xp->nodesetval && xp->nodesetval->nodeNr > 0) {
+        value = xmlNodeListGetString (doc, xp->nodesetval->nodeTab[0]->xmlChildrenNode, 1);
+        if (value) {
+            out = g_strdup ((const gchar *) value);
+            xmlFree (value);
+        }
+    }
+
+    if (xp)
+        xmlXPathFreeObject (xp);
+    xmlXPathFreeContext (ctx);
+    xmlFreeDoc (doc);
+
+    return out;
+}
+
+// return values of all nodes matching "xpath", list of gchar *
+GList *xml_get_values (const char *xml, size_t xml_len, const gchar *xpath)
+{
+    xmlDocPtr doc;
+    xmlXPathContextPtr ctx;
+    xmlXPathObjectPtr xp;
+    xmlChar *value;
+    GList *l_values = NULL;
+    int i;
+
+    if (!xml || !xml_len)
+        return NULL;
+
+    doc = xmlReadMemory (xml, xml_len, "", NULL, 0);
+    if (!doc)
+        return NULL;
+
+    ctx = xmlXPathNewContext (doc);
+    xmlXPathRegisterNs (ctx, (xmlChar *) "s3", (xmlChar *) "http://s3.amazonaws.com/doc/2006-03-01/");
+
+    xp = xmlXPathEvalExpression ((xmlChar *) xpath, ctx);
+    if (xp && xp->nodesetval) {
+        for (i = 0; i < xp->nodesetval->nodeNr; i++) {
+            value = xmlNodeListGetString (doc, xp->nodesetval->nodeTab[i]->xmlChildrenNode, 1);
+            if (value) {
+                l_values = g_list_prepend (l_values, g_strdup ((const gchar *) value));
+                xmlFree (value);
+            }
+        }
+    }
+
+    if (xp)
+        xmlXPathFreeObject (xp);
+    xmlXPathFreeContext (ctx);
+    xmlFreeDoc (doc);
+
+    return g_list_reverse (l_values);
+}
+
 // removes leading and trailing double quotes from str
 gchar *str_remove_quotes (gchar *str)
 {
@@ -0,0 +1,733 @@
+/*
+ * Copyright (C) 2012-2014 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012-2014 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "write_back.h"
+#include "file_io_ops.h"
+#include "utils.h"
+
+/*{{{ struct */
+
+// written files are stored in the staging directory and uploaded in background
+// each committed file has a ".meta" file, which makes the upload queue persistent
+struct _WriteBack {
+    Application *app;
+    gchar *dir; // staging directory
+    GQueue *q_files; // committed WriteBackFile, which wait for upload
+    GHashTable *h_staged; // object name -> the latest WriteBackFile of the object
+    GHashTable *h_uploading; // object name -> WriteBackFile, which is being uploaded
+    GList *l_waiters; // list of WriteBackWaiter
+    guint max_uploads;
+};
+
+struct _WriteBackFile {
+    WriteBack *wb;
+    gchar *id; // name of staging files
+    gchar *fname; // object name
+    fuse_ino_t ino; // 0 if the file is staged by previous mount
+    int fd; // opened while the file is written or uploaded
+    guint64 size;
+    gint64 commit_time; // used to restore the order of files staged by previous mount
+    guint attempts; // number of failed uploads
+    time_t next_attempt;
+};
+
+typedef struct {
+    gchar *fname;
+    WriteBack_on_flushed_cb on_flushed_cb;
+    gpointer ctx;
+} WriteBackWaiter;
+
+#define WB_LOG "wb"
+
+#define WRITE_BACK_DATA_SUFFIX ".data"
+#define WRITE_BACK_META_SUFFIX ".meta"
+#define WRITE_BACK_META_GROUP "object"
+// maximum delay between upload attempts (seconds)
+#define WRITE_BACK_RETRY_MAX_DELAY 300
+
+static void write_back_load (WriteBack *wb);
+static void write_back_schedule (WriteBack *wb);
+/*}}}*/
+
+/*{{{ create / destroy */
+
+WriteBack *write_back_create (Application *app)
+{
+    WriteBack *wb;
+    const gchar *bucket_name;
+    const gchar *key_prefix;
+    gchar *name;
+
+    wb = g_new0 (WriteBack, 1);
+    wb->app = app;
+    wb->q_files = g_queue_new ();
+    wb->h_staged = g_hash_table_new (g_str_hash, g_str_equal);
+    wb->h_uploading = g_hash_table_new (g_str_hash, g_str_equal);
+    wb->l_waiters = NULL;
+    wb->max_uploads = MAX (conf_get_uint (application_get_conf (app), "filesystem.write_back_max_uploads"), 1);
+
+    // the same folder is used for the same bucket and prefix
+    bucket_name = conf_get_string (application_get_conf (app), "s3.bucket_name");
+    key_prefix = conf_get_string (application_get_conf (app), "s3.key_prefix");
+    name = g_strdup_printf ("%s%s", bucket_name ? bucket_name : "default", key_prefix ? key_prefix : "");
+    g_strdelimit (name, "/", '_');
+    wb->dir = g_strdup_printf ("%s/%s",
+        conf_get_string (application_get_conf (app), "filesystem.write_back_dir"), name);
+    g_free (name);
+
+    if (g_mkdir_with_parents (wb->dir, 0700) != 0) {
+        LOG_err (WB_LOG, "Failed to create directory: %s", wb->dir);
+        write_back_destroy (wb);
+        return NULL;
+    }
+
+    // upload files staged by previous mounts
+    write_back_load (wb);
+    write_back_schedule (wb);
+
+    return wb;
+}
+
+static void write_back_file_free (WriteBackFile *wfile)
+{
+    if (wfile->fd >= 0)
+        close (wfile->fd);
+    g_free (wfile->id);
+    g_free (wfile->fname);
+    g_free (wfile);
+}
+
+// staging files are kept, they are uploaded by the next mount
+void write_back_destroy (WriteBack *wb)
+{
+    GHashTableIter iter;
+    gpointer value;
+    GList *l;
+
+    if (g_queue_get_length (wb->q_files) || g_hash_table_size (wb->h_uploading))
+        LOG_msg (WB_LOG, "%u staged files are not uploaded yet",
+            g_queue_get_length (wb->q_files) + g_hash_table_size (wb->h_uploading));
+
+    g_queue_free_full (wb->q_files, (GDestroyNotify) write_back_file_free);
+    g_hash_table_iter_init (&iter, wb->h_uploading);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+        write_back_file_free ((WriteBackFile *) value);
+    g_hash_table_destroy (wb->h_uploading);
+    g_hash_table_destroy (wb->h_staged);
+
+    for (l = g_list_first (wb->l_waiters); l; l = g_list_next (l)) {
+        WriteBackWaiter *waiter = (WriteBackWaiter *) l->data;
+        g_free (waiter->fname);
+        g_free (waiter);
+    }
+    g_list_free (wb->l_waiters);
+
+    g_free (wb->dir);
+    g_free (wb);
+}
+/*}}}*/
+
+/*{{{ staging files */
+
+static gchar *write_back_file_get_path (WriteBackFile *wfile, const gchar *suffix)
+{
+    return g_strdup_printf ("%s/%s%s", wfile->wb->dir, wfile->id, suffix);
+}
+
+static WriteBackFile *write_back_file_new (WriteBack *wb, const gchar *id, const gchar *fname, fuse_ino_t ino)
+{
+    WriteBackFile *wfile;
+
+    wfile = g_new0 (WriteBackFile, 1);
+    wfile->wb = wb;
+    wfile->id = g_strdup (id);
+    wfile->fname = g_strdup (fname);
+    wfile->ino = ino;
+    wfile->fd = -1;
+    wfile->size = 0;
+    wfile->commit_time = 0;
+    wfile->attempts = 0;
+    wfile->next_attempt = 0;
+
+    return wfile;
+}
+
+// remove staging files and free the object
+static void write_back_file_remove (WriteBackFile *wfile)
+{
+    WriteBack *wb = wfile->wb;
+    gchar *path;
+
+    if (g_hash_table_lookup (wb->h_staged, wfile->fname) == wfile)
+        g_hash_table_remove (wb->h_staged, wfile->fname);
+
+    path = write_back_file_get_path (wfile, WRITE_BACK_META_SUFFIX);
+    unlink (path);
+    g_free (path);
+
+    path = write_back_file_get_path (wfile, WRITE_BACK_DATA_SUFFIX);
+    unlink (path);
+    g_free (path);
+
+    write_back_file_free (wfile);
+}
+
+WriteBackFile *write_back_file_create (WriteBack *wb, const gchar *fname, fuse_ino_t ino)
+{
+    WriteBackFile *wfile;
+    gchar *id;
+    gchar *path;
+
+    id = get_random_string (16, TRUE);
+    wfile = write_back_file_new (wb, id, fname, ino);
+    g_free (id);
+
+    path = write_back_file_get_path (wfile, WRITE_BACK_DATA_SUFFIX);
+    wfile->fd = open (path, O_CREAT | O_TRUNC | O_RDWR, 0600);
+    if (wfile->fd < 0) {
+        LOG_err (WB_LOG, INO_H"Failed to create staging file %s: %s", INO_T (ino), path, strerror (errno));
+        g_free (path);
+        write_back_file_free (wfile);
+        return NULL;
+    }
+    g_free (path);
+
+    // reads of the object are served from this file from now on
+    g_hash_table_replace (wb->h_staged, wfile->fname, wfile);
+
+    LOG_debug (WB_LOG, INO_H"Staging %s as %s", INO_T (ino), fname, wfile->id);
+
+    return wfile;
+}
+
+gboolean write_back_file_write (WriteBackFile *wfile, const char *buf, size_t size, off_t off)
+{
+    size_t written = 0;
+    ssize_t res;
+
+    while (written < size) {
+        res = pwrite (wfile->fd, buf + written, size - written, off + written);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG_err (WB_LOG, INO_H"Failed to write staging file %s: %s", INO_T (wfile->ino), wfile->id, strerror (errno));
+            return FALSE;
+        }
+        written += res;
+    }
+
+    if ((guint64) off + size > wfile->size)
+        wfile->size = off + size;
+
+    return TRUE;
+}
+
+gboolean write_back_file_truncate (WriteBackFile *wfile, guint64 size)
+{
+    if (ftruncate (wfile->fd, size) != 0) {
+        LOG_err (WB_LOG, INO_H"Failed to truncate staging file %s: %s", INO_T (wfile->ino), wfile->id, strerror (errno));
+        return FALSE;
+    }
+
+    wfile->size = size;
+
+    return TRUE;
+}
+
+// return the latest committed file of the object, which is not uploaded yet
+static WriteBackFile *write_back_find_committed (WriteBack *wb, const gchar *fname)
+{
+    GList *l;
+
+    for (l = wb->q_files->tail; l; l = g_list_previous (l)) {
+        WriteBackFile *wfile = (WriteBackFile *) l->data;
+        if (!strcmp (wfile->fname, fname))
+            return wfile;
+    }
+
+    return g_hash_table_lookup (wb->h_uploading, fname);
+}
+
+gssize write_back_file_copy_committed (WriteBackFile *wfile, guint64 max_size)
+{
+    WriteBackFile *committed;
+    gchar *path;
+    gchar buf[65536];
+    guint64 copied = 0;
+    ssize_t res;
+    int fd;
+
+    committed = write_back_find_committed (wfile->wb, wfile->fname);
+    if (!committed)
+        return -1;
+
+    path = write_back_file_get_path (committed, WRITE_BACK_DATA_SUFFIX);
+    fd = open (path, O_RDONLY);
+    if (fd < 0) {
+        LOG_err (WB_LOG, "Failed to open staging file %s: %s", path, strerror (errno));
+        g_free (path);
+        return -1;
+    }
+    g_free (path);
+
+    while (copied < max_size) {
+        res = pread (fd, buf, MIN (sizeof (buf), max_size - copied), copied);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0) {
+            LOG_err (WB_LOG, "Failed to read staging file %s: %s", committed->id, strerror (errno));
+            close (fd);
+            return -1;
+        }
+        if (res == 0)
+            break;
+
+        if (!write_back_file_write (wfile, buf, res, copied)) {
+            close (fd);
+            return -1;
+        }
+        copied += res;
+    }
+    close (fd);
+
+    LOG_debug (WB_LOG, INO_H"Copied %"G_GUINT64_FORMAT" bytes of %s from %s", INO_T (wfile->ino), copied, wfile->fname, committed->id);
+
+    return copied;
+}
+
+// write ".meta" file, which makes the staged file visible to the next mount
+static gboolean write_back_file_save_meta (WriteBackFile *wfile)
+{
+    GKeyFile *key_file;
+    gchar *data;
+    gsize len;
+    gchar *path;
+    GError *error = NULL;
+    gboolean res;
+
+    key_file = g_key_file_new ();
+    g_key_file_set_string (key_file, WRITE_BACK_META_GROUP, "key", wfile->fname);
+    g_key_file_set_uint64 (key_file, WRITE_BACK_META_GROUP, "size", wfile->size);
+    g_key_file_set_int64 (key_file, WRITE_BACK_META_GROUP, "time", wfile->commit_time);
+    data = g_key_file_to_data (key_file, &len, NULL);
+    g_key_file_free (key_file);
+
+    path = write_back_file_get_path (wfile, WRITE_BACK_META_SUFFIX);
+    res = g_file_set_contents (path, data, len, &error);
+    if (!res) {
+        LOG_err (WB_LOG, "Failed to save %s: %s", path, error->message);
+        g_error_free (error);
+    }
+    g_free (path);
+    g_free (data);
+
+    return res;
+}
+
+// add committed file to the upload queue
+static void write_back_enqueue (WriteBack *wb, WriteBackFile *wfile)
+{
+    GList *l;
+
+    // an older version of the object, which is not uploaded yet, is replaced
+    for (l = wb->q_files->head; l; l = g_list_next (l)) {
+        WriteBackFile *old = (WriteBackFile *) l->data;
+
+        if (!strcmp (old->fname, wfile->fname)) {
+            LOG_debug (WB_LOG, "Dropping staged file %s of %s, a newer one is staged", old->id, old->fname);
+            g_queue_delete_link (wb->q_files, l);
+            write_back_file_remove (old);
+            break;
+        }
+    }
+
+    if (!g_hash_table_lookup (wb->h_staged, wfile->fname))
+        g_hash_table_replace (wb->h_staged, wfile->fname, wfile);
+
+    g_queue_push_tail (wb->q_files, wfile);
+}
+
+gboolean write_back_file_sync (WriteBackFile *wfile)
+{
+    if (fsync (wfile->fd) != 0) {
+        LOG_err (WB_LOG, INO_H"Failed to sync staging file %s: %s", INO_T (wfile->ino), wfile->id, strerror (errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+gboolean write_back_file_commit (WriteBackFile *wfile)
+{
+    WriteBack *wb = wfile->wb;
+    gboolean res;
+
+    // data must be on disk before the file is added to the persistent queue
+    if (!write_back_file_sync (wfile)) {
+        write_back_file_abort (wfile);
+        return FALSE;
+    }
+    close (wfile->fd);
+    wfile->fd = -1;
+
+    wfile->commit_time = g_get_real_time ();
+    // the file is not visible to the next mount, but it's still uploaded by this one
+    res = write_back_file_save_meta (wfile);
+
+    LOG_debug (WB_LOG, INO_H"Staged %s, size: %"G_GUINT64_FORMAT, INO_T (wfile->ino), wfile->fname, wfile->size);
+
+    write_back_enqueue (wb, wfile);
+    write_back_schedule (wb);
+
+    return res;
+}
+
+void write_back_file_abort (WriteBackFile *wfile)
+{
+    WriteBack *wb = wfile->wb;
+    WriteBackFile *committed;
+    gchar *fname;
+
+    LOG_debug (WB_LOG, INO_H"Dropping staging file %s of %s", INO_T (wfile->ino), wfile->id, wfile->fname);
+
+    fname = g_strdup (wfile->fname);
+    write_back_file_remove (wfile);
+
+    // reads are served from the previous staged version again
+    committed = write_back_find_committed (wb, fname);
+    if (committed && !g_hash_table_lookup (wb->h_staged, fname))
+        g_hash_table_replace (wb->h_staged, committed->fname, committed);
+    g_free (fname);
+}
+
+static gint write_back_file_cmp_time (const WriteBackFile *a, const WriteBackFile *b)
+{
+    return a->commit_time < b->commit_time ? -1 : (a->commit_time > b->commit_time ? 1 : 0);
+}
+
+// load the queue of files committed by previous mounts, remove files which were never committed
+static void write_back_load (WriteBack *wb)
+{
+    GDir *dir;
+    const gchar *name;
+    GList *l_files = NULL;
+    GList *l;
+    GHashTable *h_ids;
+
+    dir = g_dir_open (wb->dir, 0, NULL);
+    if (!dir)
+        return;
+
+    h_ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    while ((name = g_dir_read_name (dir))) {
+        GKeyFile *key_file;
+        gchar *path;
+        gchar *id;
+        gchar *fname;
+        WriteBackFile *wfile;
+
+        if (!g_str_has_suffix (name, WRITE_BACK_META_SUFFIX))
+            continue;
+
+        id = g_strndup (name, strlen (name) - strlen (WRITE_BACK_META_SUFFIX));
+        path = g_strdup_printf ("%s/%s", wb->dir, name);
+        key_file = g_key_file_new ();
+        fname = NULL;
+        if (g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, NULL))
+            fname = g_key_file_get_string (key_file, WRITE_BACK_META_GROUP, "key", NULL);
+
+        if (!fname) {
+            LOG_err (WB_LOG, "Failed to load %s !", path);
+            unlink (path);
+            g_key_file_free (key_file);
+            g_free (path);
+            g_free (id);
+            continue;
+        }
+
+        wfile = write_back_file_new (wb, id, fname, 0);
+        wfile->size = g_key_file_get_uint64 (key_file, WRITE_BACK_META_GROUP, "size", NULL);
+        wfile->commit_time = g_key_file_get_int64 (key_file, WRITE_BACK_META_GROUP, "time", NULL);
+        l_files = g_list_prepend (l_files, wfile);
+        g_hash_table_add (h_ids, id);
+
+        g_key_file_free (key_file);
+        g_free (path);
+        g_free (fname);
+    }
+
+    // remove data of uncommitted files
+    g_dir_rewind (dir);
+    while ((name = g_dir_read_name (dir))) {
+        gchar *id;
+
+        if (!g_str_has_suffix (name, WRITE_BACK_DATA_SUFFIX))
+            continue;
+
+        id = g_strndup (name, strlen (name) - strlen (WRITE_BACK_DATA_SUFFIX));
+        if (!g_hash_table_contains (h_ids, id)) {
+            gchar *path = g_strdup_printf ("%s/%s", wb->dir, name);
+            LOG_debug (WB_LOG, "Removing uncommitted staging file: %s", path);
+            unlink (path);
+            g_free (path);
+        }
+        g_free (id);
+    }
+    g_dir_close (dir);
+    g_hash_table_destroy (h_ids);
+
+    // newer versions of the same object replace older ones
+    l_files = g_list_sort (l_files, (GCompareFunc) write_back_file_cmp_time);
+    for (l = g_list_first (l_files); l; l = g_list_next (l)) {
+        WriteBackFile *wfile = (WriteBackFile *) l->data;
+        g_hash_table_replace (wb->h_staged, wfile->fname, wfile);
+        write_back_enqueue (wb, wfile);
+    }
+
+    if (l_files)
+        LOG_msg (WB_LOG, "%u staged files are loaded from %s", g_queue_get_length (wb->q_files), wb->dir);
+    g_list_free (l_files);
+}
+/*}}}*/
+
+/*{{{ uploader */
+
+// return TRUE if the object has committed files which are not uploaded yet
+static gboolean write_back_has_committed (WriteBack *wb, const gchar *fname)
+{
+    GList *l;
+
+    if (g_hash_table_lookup (wb->h_uploading, fname))
+        return TRUE;
+
+    for (l = wb->q_files->head; l; l = g_list_next (l)) {
+        WriteBackFile *wfile = (WriteBackFile *) l->data;
+        if (!strcmp (wfile->fname, fname))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+// notify waiters when all files of the object are uploaded, or if the upload failed
+static void write_back_notify_waiters (WriteBack *wb, const gchar *fname, gboolean success)
+{
+    GList *l, *l_next;
+
+    if (success && write_back_has_committed (wb, fname))
+        return;
+
+    for (l = g_list_first (wb->l_waiters); l; l = l_next) {
+        WriteBackWaiter *waiter = (WriteBackWaiter *) l->data;
+
+        l_next = g_list_next (l);
+        if (strcmp (waiter->fname, fname))
+            continue;
+
+        wb->l_waiters = g_list_delete_link (wb->l_waiters, l);
+        waiter->on_flushed_cb (waiter->ctx, success);
+        g_free (waiter->fname);
+        g_free (waiter);
+    }
+}
+
+static void write_back_on_retry_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short event, void *ctx)
+{
+    write_back_schedule ((WriteBack *) ctx);
+}
+
+static void write_back_on_uploaded_cb (gpointer ctx, gboolean success)
+{
+    WriteBackFile *wfile = (WriteBackFile *) ctx;
+    WriteBack *wb = wfile->wb;
+    gchar *fname;
+
+    close (wfile->fd);
+    wfile->fd = -1;
+    g_hash_table_remove (wb->h_uploading, wfile->fname);
+    fname = g_strdup (wfile->fname);
+
+    if (success) {
+        LOG_debug (WB_LOG, INO_H"Staged file %s is uploaded as %s", INO_T (wfile->ino), wfile->id, wfile->fname);
+        write_back_file_remove (wfile);
+
+    // a newer version of the object is staged
+    } else if (g_hash_table_lookup (wb->h_staged, wfile->fname) != wfile) {
+        LOG_err (WB_LOG, "Failed to upload %s, a newer version is staged", wfile->fname);
+        write_back_file_remove (wfile);
+
+    // try again later, the file stays in the queue until it's uploaded
+    } else {
+        struct timeval tv;
+        guint delay;
+
+        wfile->attempts++;
+        delay = MIN ((guint) 1 << MIN (wfile->attempts, 16), WRITE_BACK_RETRY_MAX_DELAY);
+        wfile->next_attempt = time (NULL) + delay;
+
+        LOG_err (WB_LOG, "Failed to upload %s (attempt %u), retrying in %u seconds",
+            wfile->fname, wfile->attempts, delay);
+
+        g_queue_push_tail (wb->q_files, wfile);
+
+        tv.tv_sec = delay;
+        tv.tv_usec = 0;
+        event_base_once (application_get_evbase (wb->app), -1, EV_TIMEOUT, write_back_on_retry_cb, wb, &tv);
+    }
+
+    write_back_notify_waiters (wb, fname, success);
+    g_free (fname);
+
+    write_back_schedule (wb);
+}
+
+static void write_back_file_upload (WriteBackFile *wfile)
+{
+    WriteBack *wb = wfile->wb;
+    gchar *path;
+
+    path = write_back_file_get_path (wfile, WRITE_BACK_DATA_SUFFIX);
+    wfile->fd = open (path, O_RDONLY);
+    if (wfile->fd < 0) {
+        gchar *fname = g_strdup (wfile->fname);
+
+        LOG_err (WB_LOG, "Failed to open staging file %s: %s, dropping it", path, strerror (errno));
+        g_free (path);
+        write_back_file_remove (wfile);
+        write_back_notify_waiters (wb, fname, FALSE);
+        g_free (fname);
+        return;
+    }
+    g_free (path);
+
+    LOG_debug (WB_LOG, INO_H"Uploading %s, size: %"G_GUINT64_FORMAT, INO_T (wfile->ino), wfile->fname, wfile->size);
+
+    g_hash_table_insert (wb->h_uploading, wfile->fname, wfile);
+    fileio_upload_file (wb->app, wfile->fname, wfile->ino, wfile->fd, wfile->size,
+        write_back_on_uploaded_cb, wfile);
+}
+
+// start uploads of queued files, only one file of the same object is uploaded at once
+static void write_back_schedule (WriteBack *wb)
+{
+    GList *l, *l_next;
+    time_t now = time (NULL);
+
+    for (l = wb->q_files->head; l && g_hash_table_size (wb->h_uploading) < wb->max_uploads; l = l_next) {
+        WriteBackFile *wfile = (WriteBackFile *) l->data;
+
+        l_next = g_list_next (l);
+        if (wfile->next_attempt > now || g_hash_table_lookup (wb->h_uploading, wfile->fname))
+            continue;
+
+        g_queue_delete_link (wb->q_files, l);
+        write_back_file_upload (wfile);
+    }
+}
+/*}}}*/
+
+/*{{{ object operations */
+
+gboolean write_back_is_staged (WriteBack *wb, const gchar *fname)
+{
+    return g_hash_table_lookup (wb->h_staged, fname) != NULL;
+}
+
+gssize write_back_read (WriteBack *wb, const gchar *fname, char *buf, size_t size, off_t off)
+{
+    WriteBackFile *wfile;
+    gchar *path;
+    int fd;
+    gssize res;
+
+    wfile = g_hash_table_lookup (wb->h_staged, fname);
+    if (!wfile)
+        return -1;
+
+    if (wfile->fd >= 0) {
+        fd = wfile->fd;
+    } else {
+        path = write_back_file_get_path (wfile, WRITE_BACK_DATA_SUFFIX);
+        fd = open (path, O_RDONLY);
+        g_free (path);
+        if (fd < 0) {
+            LOG_err (WB_LOG, "Failed to open staging file %s: %s", wfile->id, strerror (errno));
+            return -1;
+        }
+    }
+
+    res = pread (fd, buf, size, off);
+    if (res < 0)
+        LOG_err (WB_LOG, "Failed to read staging file %s: %s", wfile->id, strerror (errno));
+
+    if (fd != wfile->fd)
+        close (fd);
+
+    return res;
+}
+
+void write_back_flush (WriteBack *wb, const gchar *fname, WriteBack_on_flushed_cb on_flushed_cb, gpointer ctx)
+{
+    WriteBackWaiter *waiter;
+    GList *l;
+
+    if (!write_back_has_committed (wb, fname)) {
+        on_flushed_cb (ctx, TRUE);
+        return;
+    }
+
+    // upload files of the object first
+    for (l = wb->q_files->head; l; l = g_list_next (l)) {
+        WriteBackFile *wfile = (WriteBackFile *) l->data;
+
+        if (!strcmp (wfile->fname, fname)) {
+            g_queue_unlink (wb->q_files, l);
+            g_queue_push_head_link (wb->q_files, l);
+            wfile->next_attempt = 0;
+            break;
+        }
+    }
+
+    waiter = g_new0 (WriteBackWaiter, 1);
+    waiter->fname = g_strdup (fname);
+    waiter->on_flushed_cb = on_flushed_cb;
+    waiter->ctx = ctx;
+    wb->l_waiters = g_list_append (wb->l_waiters, waiter);
+
+    write_back_schedule (wb);
+}
+
+void write_back_discard (WriteBack *wb, const gchar *fname)
+{
+    GList *l, *l_next;
+
+    for (l = wb->q_files->head; l; l = l_next) {
+        WriteBackFile *wfile = (WriteBackFile *) l->data;
+
+        l_next = g_list_next (l);
+        if (strcmp (wfile->fname, fname))
+            continue;
+
+        LOG_debug (WB_LOG, "Discarding staged file %s of %s", wfile->id, wfile->fname);
+        g_queue_delete_link (wb->q_files, l);
+        write_back_file_remove (wfile);
+    }
+
+    write_back_notify_waiters (wb, fname, TRUE);
+}
+/*}}}*/
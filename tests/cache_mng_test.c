@@ -17,6 +17,7 @@
  */
 #include "cache_mng.h"
 #include "test_application.h"
+#include "utils.h"
 
 struct test_ctx {
     gboolean success;
@@ -154,6 +155,342 @@ static void cache_mng_test_zero_size (CacheMng **cmng, gconstpointer test_data)
     g_assert (test_ctx.buf == NULL);
 }
 
+static void cache_mng_test_blocks (CacheMng **cmng, gconstpointer test_data)
+{
+    struct test_ctx test_ctx = {FALSE, NULL, 0};
+    CacheMng *bcmng;
+    int i;
+    unsigned char buf[256];
+
+    for (i = 0; i < (int) sizeof (buf); i++)
+        buf[i] = i % 256;
+
+    // use small blocks, so the data is spread over several blocks
+    conf_set_uint (application_get_conf (app), "filesystem.cache_block_size", 64);
+    bcmng = cache_mng_create (app);
+
+    cache_mng_store_file_buf (bcmng, 1, sizeof (buf), 10, buf, store_cb, &test_ctx);
+    app_dispatch (app);
+
+    g_assert (test_ctx.success);
+    g_assert (cache_mng_size (bcmng) == sizeof (buf));
+    g_assert (cache_mng_get_file_length (bcmng, 1) == sizeof (buf));
+    g_assert (cache_mng_contains (bcmng, 1, 50, 200));
+    g_assert (!cache_mng_contains (bcmng, 1, 100, 0));
+
+    cache_mng_retrieve_file_buf (bcmng, 1, 100, 100, retrieve_cb, &test_ctx);
+    app_dispatch (app);
+
+    g_assert (test_ctx.success);
+    g_assert (test_ctx.buflen == 100);
+    g_assert (memcmp (test_ctx.buf, buf + 90, test_ctx.buflen) == 0);
+    g_free (test_ctx.buf);
+
+    cache_mng_remove_file (bcmng, 1);
+    g_assert (cache_mng_size (bcmng) == 0);
+
+    cache_mng_destroy (bcmng);
+    conf_set_uint (application_get_conf (app), "filesystem.cache_block_size", 0);
+}
+
+static void cache_mng_test_mem (CacheMng **cmng, gconstpointer test_data)
+{
+    struct test_ctx test_ctx = {FALSE, NULL, 0};
+    CacheMng *mcmng;
+    int i;
+    unsigned char buf[256];
+
+    for (i = 0; i < (int) sizeof (buf); i++)
+        buf[i] = i % 256;
+
+    // two blocks fit in memory
+    conf_set_uint (application_get_conf (app), "filesystem.cache_block_size", 64);
+    conf_set_uint (application_get_conf (app), "filesystem.cache_mem_max_size", 128);
+    mcmng = cache_mng_create (app);
+
+    cache_mng_store_file_buf (mcmng, 1, sizeof (buf), 0, buf, store_cb, &test_ctx);
+    app_dispatch (app);
+    g_assert (test_ctx.success);
+
+    // read all blocks twice: from disk and from memory
+    for (i = 0; i < 2; i++) {
+        cache_mng_retrieve_file_buf (mcmng, 1, 200, 20, retrieve_cb, &test_ctx);
+        app_dispatch (app);
+        g_assert (test_ctx.success);
+        g_assert (test_ctx.buflen == 200);
+        g_assert (memcmp (test_ctx.buf, buf + 20, test_ctx.buflen) == 0);
+        g_free (test_ctx.buf);
+    }
+
+    // memory copy is updated on write
+    memset (buf + 200, 0xff, 10);
+    cache_mng_store_file_buf (mcmng, 1, 10, 200, buf + 200, store_cb, &test_ctx);
+    app_dispatch (app);
+    g_assert (test_ctx.success);
+
+    cache_mng_retrieve_file_buf (mcmng, 1, 60, 190, retrieve_cb, &test_ctx);
+    app_dispatch (app);
+    g_assert (test_ctx.success);
+    g_assert (memcmp (test_ctx.buf, buf + 190, 60) == 0);
+    g_free (test_ctx.buf);
+
+    cache_mng_destroy (mcmng);
+    conf_set_uint (application_get_conf (app), "filesystem.cache_mem_max_size", 0);
+    conf_set_uint (application_get_conf (app), "filesystem.cache_block_size", 0);
+}
+
+static void retrieve_bufvec_cb (struct fuse_bufvec *bufv, gboolean success, void *ctx)
+{
+    struct test_ctx *test_ctx = (struct test_ctx *) ctx;
+    size_t i;
+
+    test_ctx->success = success;
+    if (!success)
+        return;
+
+    test_ctx->buflen = fuse_buf_size (bufv);
+    test_ctx->buf = g_malloc (test_ctx->buflen);
+
+    // copy data out of file descriptors before they are closed
+    for (i = 0, test_ctx->buflen = 0; i < bufv->count; i++) {
+        const struct fuse_buf *fbuf = &bufv->buf[i];
+
+        if (fbuf->flags & FUSE_BUF_IS_FD)
+            g_assert (pread (fbuf->fd, test_ctx->buf + test_ctx->buflen, fbuf->size, fbuf->pos) == (ssize_t) fbuf->size);
+        else
+            memcpy (test_ctx->buf + test_ctx->buflen, fbuf->mem, fbuf->size);
+        test_ctx->buflen += fbuf->size;
+    }
+}
+
+static void cache_mng_test_bufvec (CacheMng **cmng, gconstpointer test_data)
+{
+    struct test_ctx test_ctx = {FALSE, NULL, 0};
+    CacheMng *bcmng;
+    int i;
+    unsigned char buf[256];
+
+    for (i = 0; i < (int) sizeof (buf); i++)
+        buf[i] = i % 256;
+
+    conf_set_uint (application_get_conf (app), "filesystem.cache_block_size", 64);
+    bcmng = cache_mng_create (app);
+
+    cache_mng_store_file_buf (bcmng, 1, sizeof (buf), 0, buf, store_cb, &test_ctx);
+    app_dispatch (app);
+    g_assert (test_ctx.success);
+
+    // range is spread over 4 blocks
+    cache_mng_retrieve_file_bufvec (bcmng, 1, 150, 30, retrieve_bufvec_cb, &test_ctx);
+    app_dispatch (app);
+    g_assert (test_ctx.success);
+    g_assert (test_ctx.buflen == 150);
+    g_assert (memcmp (test_ctx.buf, buf + 30, test_ctx.buflen) == 0);
+    g_free (test_ctx.buf);
+
+    // not cached
+    cache_mng_retrieve_file_bufvec (bcmng, 1, 100, 200, retrieve_bufvec_cb, &test_ctx);
+    app_dispatch (app);
+    g_assert (!test_ctx.success);
+
+    cache_mng_destroy (bcmng);
+    conf_set_uint (application_get_conf (app), "filesystem.cache_block_size", 0);
+}
+
+static void cache_mng_test_threads (CacheMng **cmng, gconstpointer test_data)
+{
+    struct test_ctx test_ctx = {FALSE, NULL, 0};
+    CacheMng *tcmng;
+    int i;
+    unsigned char buf[1024];
+
+    for (i = 0; i < (int) sizeof (buf); i++)
+        buf[i] = i % 256;
+
+    conf_set_uint (application_get_conf (app), "filesystem.cache_block_size", 64);
+    conf_set_uint (application_get_conf (app), "filesystem.cache_io_threads", 4);
+    tcmng = cache_mng_create (app);
+
+    // reads are queued after writes of the same blocks
+    cache_mng_store_file_buf (tcmng, 1, sizeof (buf), 0, buf, store_cb, &test_ctx);
+    cache_mng_retrieve_file_buf (tcmng, 1, 500, 300, retrieve_cb, &test_ctx);
+    app_dispatch (app);
+    g_assert (test_ctx.success);
+    g_assert (test_ctx.buflen == 500);
+    g_assert (memcmp (test_ctx.buf, buf + 300, test_ctx.buflen) == 0);
+    g_free (test_ctx.buf);
+
+    cache_mng_retrieve_file_bufvec (tcmng, 1, 700, 10, retrieve_bufvec_cb, &test_ctx);
+    app_dispatch (app);
+    g_assert (test_ctx.success);
+    g_assert (test_ctx.buflen == 700);
+    g_assert (memcmp (test_ctx.buf, buf + 10, test_ctx.buflen) == 0);
+    g_free (test_ctx.buf);
+
+    // file is removed while it's being written
+    cache_mng_store_file_buf (tcmng, 2, sizeof (buf), 0, buf, store_cb, &test_ctx);
+    cache_mng_remove_file (tcmng, 2);
+    app_dispatch (app);
+    g_assert (cache_mng_size (tcmng) == sizeof (buf));
+
+    cache_mng_destroy (tcmng);
+    conf_set_uint (application_get_conf (app), "filesystem.cache_io_threads", 0);
+    conf_set_uint (application_get_conf (app), "filesystem.cache_block_size", 0);
+}
+
+static void md5_cb (const gchar *md5str, void *ctx)
+{
+    gchar **out = (gchar **) ctx;
+
+    *out = g_strdup (md5str);
+}
+
+static void cache_mng_test_md5 (CacheMng **cmng, gconstpointer test_data)
+{
+    struct test_ctx test_ctx = {FALSE, NULL, 0};
+    gchar *md5str = NULL;
+    gchar *expected = NULL;
+    int i;
+    unsigned char buf[1000];
+
+    for (i = 0; i < (int) sizeof (buf); i++)
+        buf[i] = i % 256;
+
+    get_md5_sum ((const gchar *) buf, sizeof (buf), &expected, NULL);
+
+    // object has a gap
+    cache_mng_store_file_buf (*cmng, 1, 100, 0, buf, store_cb, &test_ctx);
+    cache_mng_store_file_buf (*cmng, 1, 100, 900, buf + 900, store_cb, &test_ctx);
+    app_dispatch (app);
+    cache_mng_get_md5 (*cmng, 1, md5_cb, &md5str);
+    app_dispatch (app);
+    g_assert (md5str == NULL);
+
+    cache_mng_store_file_buf (*cmng, 1, 800, 100, buf + 100, store_cb, &test_ctx);
+    app_dispatch (app);
+    g_assert (test_ctx.success);
+    cache_mng_get_md5 (*cmng, 1, md5_cb, &md5str);
+    app_dispatch (app);
+    g_assert_cmpstr (md5str, ==, expected);
+
+    g_free (md5str);
+    g_free (expected);
+}
+
+static void cache_mng_test_persistent (CacheMng **cmng, gconstpointer test_data)
+{
+    struct test_ctx test_ctx = {FALSE, NULL, 0};
+    CacheMng *pcmng;
+    int i;
+    unsigned char buf[100];
+
+    for (i = 0; i < (int) sizeof (buf); i++)
+        buf[i] = i % 256;
+
+    conf_set_boolean (application_get_conf (app), "filesystem.cache_persistent", TRUE);
+    conf_set_string (application_get_conf (app), "s3.bucket_name", "test_bucket");
+
+    pcmng = cache_mng_create (app);
+    cache_mng_store_file_buf (pcmng, 1, sizeof (buf), 0, buf, store_cb, &test_ctx);
+    app_dispatch (app);
+    g_assert (test_ctx.success);
+
+    // ETag is not known yet
+    g_assert (!cache_mng_validate_file (pcmng, 1, "dir/file", "etag1", NULL));
+    cache_mng_update_etag (pcmng, 1, "etag1");
+    g_assert (cache_mng_validate_file (pcmng, 1, "dir/file", "etag1", NULL));
+    cache_mng_destroy (pcmng);
+
+    // cached data is found by the object key after remount
+    pcmng = cache_mng_create (app);
+    g_assert (cache_mng_size (pcmng) == sizeof (buf));
+    g_assert (cache_mng_validate_file (pcmng, 5, "dir/file", "etag1", NULL));
+    g_assert (cache_mng_contains (pcmng, 5, sizeof (buf), 0));
+
+    cache_mng_retrieve_file_buf (pcmng, 5, sizeof (buf), 0, retrieve_cb, &test_ctx);
+    app_dispatch (app);
+    g_assert (test_ctx.success);
+    g_assert (test_ctx.buflen == sizeof (buf));
+    g_assert (memcmp (test_ctx.buf, buf, test_ctx.buflen) == 0);
+    g_free (test_ctx.buf);
+
+    // object is changed
+    g_assert (!cache_mng_validate_file (pcmng, 5, "dir/file", "etag2", NULL));
+    g_assert (cache_mng_size (pcmng) == 0);
+    cache_mng_destroy (pcmng);
+
+    conf_set_boolean (application_get_conf (app), "filesystem.cache_persistent", FALSE);
+}
+
+static void cache_mng_test_pin (CacheMng **cmng, gconstpointer test_data)
+{
+    struct test_ctx test_ctx = {FALSE, NULL, 0};
+    int i;
+    unsigned char buf[256];
+
+    for (i = 0; i < (int) sizeof (buf); i++)
+        buf[i] = i % 256;
+
+    cache_mng_store_file_buf (*cmng, 1, sizeof (buf), 0, buf, store_cb, &test_ctx);
+    app_dispatch (app);
+    g_assert (test_ctx.success);
+
+    // removal of the pinned file is postponed
+    cache_mng_pin_file (*cmng, 1);
+    cache_mng_pin_file (*cmng, 1);
+    cache_mng_remove_file (*cmng, 1);
+    cache_mng_retrieve_file_buf (*cmng, 1, sizeof (buf), 0, retrieve_cb, &test_ctx);
+    app_dispatch (app);
+
+    g_assert (test_ctx.success);
+    g_assert (memcmp (test_ctx.buf, buf, sizeof (buf)) == 0);
+    g_free (test_ctx.buf);
+    test_ctx.buf = NULL;
+
+    cache_mng_unpin_file (*cmng, 1);
+    g_assert (cache_mng_size (*cmng) == sizeof (buf));
+
+    // the file is removed when the last pin is released
+    cache_mng_unpin_file (*cmng, 1);
+    cache_mng_retrieve_file_buf (*cmng, 1, 1, 0, retrieve_cb, &test_ctx);
+    app_dispatch (app);
+    g_assert (!test_ctx.success);
+    g_assert (cache_mng_size (*cmng) == 0);
+}
+
+static void fetch_done_cb (gboolean success, void *ctx)
+{
+    int *waiters_done = (int *) ctx;
+
+    if (success)
+        (*waiters_done)++;
+}
+
+static void cache_mng_test_fetch (CacheMng **cmng, gconstpointer test_data)
+{
+    int waiters_done = 0;
+
+    // the first caller must download the block
+    g_assert (cache_mng_fetch_begin (*cmng, 1, 0, fetch_done_cb, &waiters_done));
+    // other callers are waiting for it
+    g_assert (!cache_mng_fetch_begin (*cmng, 1, 0, fetch_done_cb, &waiters_done));
+    g_assert (!cache_mng_fetch_begin (*cmng, 1, 0, fetch_done_cb, &waiters_done));
+    g_assert (!cache_mng_fetch_begin (*cmng, 1, 0, NULL, NULL));
+    // different block or inode
+    g_assert (cache_mng_fetch_begin (*cmng, 1, 1, fetch_done_cb, &waiters_done));
+    g_assert (cache_mng_fetch_begin (*cmng, 2, 0, fetch_done_cb, &waiters_done));
+
+    cache_mng_fetch_done (*cmng, 1, 0, TRUE);
+    g_assert (waiters_done == 2);
+
+    // block can be requested again
+    g_assert (cache_mng_fetch_begin (*cmng, 1, 0, fetch_done_cb, &waiters_done));
+    cache_mng_fetch_done (*cmng, 1, 0, TRUE);
+    cache_mng_fetch_done (*cmng, 1, 1, TRUE);
+    cache_mng_fetch_done (*cmng, 2, 0, TRUE);
+    g_assert (waiters_done == 2);
+}
+
 int main (int argc, char *argv[])
 {
     app = app_create ();
@@ -163,6 +500,14 @@ int main (int argc, char *argv[])
     g_test_add ("/cache_mng/cache_mng_test_remove", CacheMng *, 0, cache_mng_test_setup, cache_mng_test_remove, cache_mng_test_destroy);
     g_test_add ("/cache_mng/cache_mng_test_lru", CacheMng *, 0, cache_mng_test_setup, cache_mng_test_lru, cache_mng_test_destroy);
     g_test_add ("/cache_mng/cache_mng_test_zero_size", CacheMng *, 0, cache_mng_test_setup, cache_mng_test_zero_size, cache_mng_test_destroy);
+    g_test_add ("/cache_mng/cache_mng_test_blocks", CacheMng *, 0, cache_mng_test_setup, cache_mng_test_blocks, cache_mng_test_destroy);
+    g_test_add ("/cache_mng/cache_mng_test_mem", CacheMng *, 0, cache_mng_test_setup, cache_mng_test_mem, cache_mng_test_destroy);
+    g_test_add ("/cache_mng/cache_mng_test_bufvec", CacheMng *, 0, cache_mng_test_setup, cache_mng_test_bufvec, cache_mng_test_destroy);
+    g_test_add ("/cache_mng/cache_mng_test_threads", CacheMng *, 0, cache_mng_test_setup, cache_mng_test_threads, cache_mng_test_destroy);
+    g_test_add ("/cache_mng/cache_mng_test_md5", CacheMng *, 0, cache_mng_test_setup, cache_mng_test_md5, cache_mng_test_destroy);
+    g_test_add ("/cache_mng/cache_mng_test_persistent", CacheMng *, 0, cache_mng_test_setup, cache_mng_test_persistent, cache_mng_test_destroy);
+    g_test_add ("/cache_mng/cache_mng_test_fetch", CacheMng *, 0, cache_mng_test_setup, cache_mng_test_fetch, cache_mng_test_destroy);
+    g_test_add ("/cache_mng/cache_mng_test_pin", CacheMng *, 0, cache_mng_test_setup, cache_mng_test_pin, cache_mng_test_destroy);
 
     return g_test_run ();
 }
@@ -0,0 +1,358 @@
+/*
+ * Copyright (C) 2012-2014 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012-2014 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "list_parser.h"
+
+// run with "-m perf" to get the benchmark results
+#define BENCH_PAGES 2000
+#define BENCH_KEYS_PER_PAGE 1000
+
+typedef struct {
+    GList *l_objects; // ListParserObject, strings are copied
+    GList *l_prefixes; // gchar *
+} ParseData;
+
+static void on_object (gpointer ctx, const ListParserObject *obj)
+{
+    ParseData *data = (ParseData *) ctx;
+    ListParserObject *copy;
+
+    copy = g_new0 (ListParserObject, 1);
+    copy->key = g_strdup (obj->key);
+    copy->size = obj->size;
+    copy->last_modified = obj->last_modified;
+    copy->etag = g_strdup (obj->etag);
+    data->l_objects = g_list_append (data->l_objects, copy);
+}
+
+static void on_prefix (gpointer ctx, const gchar *prefix)
+{
+    ParseData *data = (ParseData *) ctx;
+
+    data->l_prefixes = g_list_append (data->l_prefixes, g_strdup (prefix));
+}
+
+static void object_free (ListParserObject *obj)
+{
+    g_free ((gchar *) obj->key);
+    g_free ((gchar *) obj->etag);
+    g_free (obj);
+}
+
+static void parse_data_clear (ParseData *data)
+{
+    g_list_free_full (data->l_objects, (GDestroyNotify) object_free);
+    g_list_free_full (data->l_prefixes, g_free);
+    data->l_objects = NULL;
+    data->l_prefixes = NULL;
+}
+
+// a page of the listing, as it's returned by S3
+static gchar *make_page (guint objects, guint prefixes, gboolean truncated)
+{
+    GString *s;
+    guint i;
+
+    s = g_string_new ("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<ListBucketResult xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">"
+        "<Name>bucket</Name><Prefix>dir/</Prefix><Marker></Marker><MaxKeys>1000</MaxKeys>"
+        "<Delimiter>/</Delimiter>");
+    g_string_append_printf (s, "<IsTruncated>%s</IsTruncated>", truncated ? "true" : "false");
+    if (truncated)
+        g_string_append_printf (s, "<NextMarker>dir/file-%06u</NextMarker>", objects - 1);
+
+    // objects are uploaded one after another, every 7 seconds
+    for (i = 0; i < objects; i++) {
+        g_string_append_printf (s, "<Contents><Key>dir/file-%06u</Key>"
+            "<LastModified>2013-04-11T%02u:%02u:%02u.000Z</LastModified>"
+            "<ETag>&quot;%032x&quot;</ETag><Size>%u</Size>"
+            "<Owner><ID>75aa57f09aa0c8caeab4f8c24e99d10f8e7faeebf76c078efc7c6caea54ba06a</ID>"
+            "<DisplayName>owner</DisplayName></Owner><StorageClass>STANDARD</StorageClass></Contents>",
+            i, (i * 7 / 3600) % 24, (i * 7 / 60) % 60, (i * 7) % 60, i, i * 1024);
+    }
+
+    for (i = 0; i < prefixes; i++)
+        g_string_append_printf (s, "<CommonPrefixes><Prefix>dir/sub-%06u/</Prefix></CommonPrefixes>", i);
+
+    g_string_append (s, "</ListBucketResult>");
+
+    return g_string_free (s, FALSE);
+}
+
+static void list_parser_test_page (void)
+{
+    ParseData data = { NULL, NULL };
+    ListParserResult result;
+    ListParserObject *obj;
+    gchar *xml;
+    guint i;
+
+    xml = make_page (1000, 10, TRUE);
+    g_assert (list_parser_parse (xml, strlen (xml), on_object, on_prefix, &data, &result));
+
+    g_assert (result.is_truncated);
+    g_assert_cmpstr (result.next_marker, ==, "dir/file-000999");
+    g_assert_cmpstr (result.last_key, ==, "dir/file-000999");
+    g_assert_cmpuint (result.objects_count, ==, 1000);
+    g_assert_cmpuint (result.prefixes_count, ==, 10);
+    g_assert_cmpuint (g_list_length (data.l_objects), ==, 1000);
+    g_assert_cmpuint (g_list_length (data.l_prefixes), ==, 10);
+
+    obj = (ListParserObject *) g_list_nth_data (data.l_objects, 3);
+    g_assert_cmpstr (obj->key, ==, "dir/file-000003");
+    g_assert_cmpuint (obj->size, ==, 3 * 1024);
+    g_assert_cmpstr (obj->etag, ==, "00000000000000000000000000000003");
+
+    // time of every object, across several hours
+    for (i = 0; i < 1000; i += 13) {
+        struct tm tmp = {0};
+        gchar *s_time;
+
+        obj = (ListParserObject *) g_list_nth_data (data.l_objects, i);
+        s_time = g_strdup_printf ("2013-04-11T%02u:%02u:%02u", (i * 7 / 3600) % 24, (i * 7 / 60) % 60, (i * 7) % 60);
+        strptime (s_time, "%Y-%m-%dT%H:%M:%S", &tmp);
+        g_assert (obj->last_modified == mktime (&tmp));
+        g_free (s_time);
+    }
+
+    g_assert_cmpstr (g_list_nth_data (data.l_prefixes, 9), ==, "dir/sub-000009/");
+
+    list_parser_result_clear (&result);
+    parse_data_clear (&data);
+    g_free (xml);
+
+    // the last page
+    xml = make_page (5, 0, FALSE);
+    g_assert (list_parser_parse (xml, strlen (xml), on_object, on_prefix, &data, &result));
+    g_assert (!result.is_truncated);
+    g_assert (!result.next_marker);
+    g_assert_cmpstr (result.last_key, ==, "dir/file-000004");
+    list_parser_result_clear (&result);
+    parse_data_clear (&data);
+    g_free (xml);
+
+    // empty directory
+    xml = make_page (0, 0, FALSE);
+    g_assert (list_parser_parse (xml, strlen (xml), on_object, on_prefix, &data, &result));
+    g_assert (!result.last_key);
+    g_assert (!data.l_objects);
+    list_parser_result_clear (&result);
+    g_free (xml);
+}
+
+// entities, namespace prefixes, comments and empty elements
+static void list_parser_test_syntax (void)
+{
+    ParseData data = { NULL, NULL };
+    ListParserResult result;
+    ListParserObject *obj;
+    const gchar *xml =
+        "<?xml version='1.0'?><!-- comment --><s3:ListBucketResult xmlns:s3='http://s3.amazonaws.com/doc/2006-03-01/' a='>'>"
+        "<s3:Contents><s3:Key>a &amp; b &lt;&gt;&apos;&#65;&#x42;&#x44d;</s3:Key><s3:Size>12</s3:Size>"
+        "<s3:ETag>\"etag-1\"</s3:ETag></s3:Contents>"
+        "<s3:Contents><s3:Key>k</s3:Key><s3:Size/></s3:Contents>"
+        "<s3:Contents><s3:Key/><s3:Size>1</s3:Size></s3:Contents>"
+        "<s3:Contents><s3:Size>1</s3:Size></s3:Contents>"
+        "<s3:CommonPrefixes>\n  <s3:Prefix>p/</s3:Prefix>\n</s3:CommonPrefixes>"
+        "<s3:IsTruncated>false</s3:IsTruncated>"
+        "</s3:ListBucketResult>\n";
+
+    g_assert (list_parser_parse (xml, strlen (xml), on_object, on_prefix, &data, &result));
+    g_assert (!result.is_truncated);
+    // Contents without Key are skipped
+    g_assert_cmpuint (g_list_length (data.l_objects), ==, 2);
+
+    obj = (ListParserObject *) g_list_nth_data (data.l_objects, 0);
+    g_assert_cmpstr (obj->key, ==, "a & b <>'AB\xd1\x8d");
+    g_assert_cmpuint (obj->size, ==, 12);
+    g_assert_cmpstr (obj->etag, ==, "etag-1");
+    g_assert (obj->last_modified == 0);
+
+    obj = (ListParserObject *) g_list_nth_data (data.l_objects, 1);
+    g_assert_cmpstr (obj->key, ==, "k");
+    g_assert_cmpuint (obj->size, ==, 0);
+    g_assert (!obj->etag);
+
+    g_assert_cmpstr (g_list_nth_data (data.l_prefixes, 0), ==, "p/");
+
+    list_parser_result_clear (&result);
+    parse_data_clear (&data);
+}
+
+// IsTruncated and NextMarker are read without parsing objects
+static void list_parser_test_head (void)
+{
+    ListParserResult result;
+    const gchar *xml;
+    gchar *page;
+
+    page = make_page (1000, 0, TRUE);
+    // cut in the middle of the objects
+    g_assert (list_parser_parse_head (page, strlen (page) / 2, &result));
+    g_assert (result.is_truncated);
+    g_assert_cmpstr (result.next_marker, ==, "dir/file-000999");
+    g_assert_cmpuint (result.objects_count, ==, 0);
+    g_assert (!result.last_key);
+    list_parser_result_clear (&result);
+    g_free (page);
+
+    page = make_page (0, 0, FALSE);
+    g_assert (list_parser_parse_head (page, strlen (page), &result));
+    g_assert (!result.is_truncated);
+    list_parser_result_clear (&result);
+    g_free (page);
+
+    // IsTruncated follows objects
+    xml = "<ListBucketResult><Contents><Key>a</Key></Contents><IsTruncated>true</IsTruncated></ListBucketResult>";
+    g_assert (!list_parser_parse_head (xml, strlen (xml), &result));
+    list_parser_result_clear (&result);
+}
+
+static void list_parser_test_incorrect (void)
+{
+    ListParserResult result;
+    const gchar *docs[] = {
+        "",
+        "not xml",
+        "<Error><Code>AccessDenied</Code></Error>",
+        "<ListBucketResult><Contents><Key>a &bad; b</Key></Contents></ListBucketResult>",
+        "<ListBucketResult><Contents><Key>a &#xZZ; b</Key></Contents></ListBucketResult>",
+        "<ListBucketResult></ListBucketResult><ListBucketResult></ListBucketResult>",
+        "<ListBucketResult></ListBucketResult></ListBucketResult>",
+        "<ListBucketResult><Contents",
+    };
+    gchar *xml;
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (docs); i++) {
+        g_assert (!list_parser_parse (docs[i], strlen (docs[i]), NULL, NULL, NULL, &result));
+        list_parser_result_clear (&result);
+    }
+
+    // response is cut
+    xml = make_page (10, 0, TRUE);
+    for (i = 1; i < strlen (xml) - 1; i += 7) {
+        g_assert (!list_parser_parse (xml, i, NULL, NULL, NULL, &result));
+        list_parser_result_clear (&result);
+    }
+    g_free (xml);
+}
+
+/*{{{ benchmark */
+
+// the same work as the XPath based parser did: Key, Size and LastModified of each object,
+// NextMarker from the second parse of the document and IsTruncated by the string search
+static guint xpath_parse (const gchar *xml, size_t xml_len)
+{
+    const gchar *exprs[] = { "s3:Key", "s3:Size", "s3:LastModified" };
+    xmlDocPtr doc;
+    xmlXPathContextPtr ctx;
+    xmlXPathObjectPtr contents_xp;
+    xmlXPathObjectPtr marker_xp;
+    guint count = 0;
+    int i;
+    guint e;
+
+    doc = xmlReadMemory (xml, xml_len, "", NULL, 0);
+    ctx = xmlXPathNewContext (doc);
+    xmlXPathRegisterNs (ctx, (xmlChar *) "s3", (xmlChar *) "http://s3.amazonaws.com/doc/2006-03-01/");
+    contents_xp = xmlXPathEvalExpression ((xmlChar *) "//s3:Contents", ctx);
+    for (i = 0; i < contents_xp->nodesetval->nodeNr; i++) {
+        for (e = 0; e < G_N_ELEMENTS (exprs); e++) {
+            xmlXPathObjectPtr key;
+            xmlChar *val;
+
+            ctx->node = contents_xp->nodesetval->nodeTab[i];
+            key = xmlXPathEvalExpression ((xmlChar *) exprs[e], ctx);
+            val = xmlNodeListGetString (doc, key->nodesetval->nodeTab[0]->xmlChildrenNode, 1);
+            xmlFree (val);
+            xmlXPathFreeObject (key);
+        }
+        count++;
+    }
+    xmlXPathFreeObject (contents_xp);
+    xmlXPathFreeContext (ctx);
+    xmlFreeDoc (doc);
+
+    doc = xmlReadMemory (xml, xml_len, "", NULL, 0);
+    ctx = xmlXPathNewContext (doc);
+    xmlXPathRegisterNs (ctx, (xmlChar *) "s3", (xmlChar *) "http://s3.amazonaws.com/doc/2006-03-01/");
+    marker_xp = xmlXPathEvalExpression ((xmlChar *) "//s3:NextMarker", ctx);
+    xmlXPathFreeObject (marker_xp);
+    xmlXPathFreeContext (ctx);
+    xmlFreeDoc (doc);
+
+    g_assert (g_strstr_len (xml, xml_len, "<IsTruncated>true</IsTruncated>"));
+
+    return count;
+}
+
+static void bench_on_object (gpointer ctx, G_GNUC_UNUSED const ListParserObject *obj)
+{
+    guint *count = (guint *) ctx;
+
+    (*count)++;
+}
+
+static void list_parser_test_bench (void)
+{
+    gchar *xml;
+    size_t xml_len;
+    guint count;
+    guint i;
+    gdouble elapsed;
+
+    xml = make_page (BENCH_KEYS_PER_PAGE, 0, TRUE);
+    xml_len = strlen (xml);
+
+    count = 0;
+    g_test_timer_start ();
+    for (i = 0; i < BENCH_PAGES; i++) {
+        ListParserResult result;
+
+        list_parser_parse (xml, xml_len, bench_on_object, NULL, &count, &result);
+        list_parser_result_clear (&result);
+    }
+    elapsed = g_test_timer_elapsed ();
+    g_assert_cmpuint (count, ==, BENCH_PAGES * BENCH_KEYS_PER_PAGE);
+    g_test_maximized_result (BENCH_PAGES / elapsed, "list_parser: %.0f pages/s", BENCH_PAGES / elapsed);
+
+    count = 0;
+    g_test_timer_start ();
+    for (i = 0; i < BENCH_PAGES; i++)
+        count += xpath_parse (xml, xml_len);
+    elapsed = g_test_timer_elapsed ();
+    g_assert_cmpuint (count, ==, BENCH_PAGES * BENCH_KEYS_PER_PAGE);
+    g_test_maximized_result (BENCH_PAGES / elapsed, "XPath: %.0f pages/s", BENCH_PAGES / elapsed);
+
+    g_free (xml);
+}
+/*}}}*/
+
+int main (int argc, char *argv[])
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/list_parser/list_parser_test_page", list_parser_test_page);
+    g_test_add_func ("/list_parser/list_parser_test_syntax", list_parser_test_syntax);
+    g_test_add_func ("/list_parser/list_parser_test_head", list_parser_test_head);
+    g_test_add_func ("/list_parser/list_parser_test_incorrect", list_parser_test_incorrect);
+    if (g_test_perf ())
+        g_test_add_func ("/list_parser/list_parser_test_bench", list_parser_test_bench);
+
+    return g_test_run ();
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2012-2014 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012-2014 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "md5_mb.h"
+
+// run with "-m perf" to get the benchmark results
+// size of data hashed by every benchmark run
+#define BENCH_SIZE (256 * 1024 * 1024)
+
+static const gchar *backends[] = { "avx512", "avx2", "sse2", "vec4", "scalar" };
+
+static unsigned char *test_data (size_t len)
+{
+    unsigned char *buf;
+    size_t i;
+
+    buf = g_malloc (len);
+    for (i = 0; i < len; i++)
+        buf[i] = (i * 31 + (i >> 8)) % 256;
+
+    return buf;
+}
+
+static void md5_mb_test_single (gconstpointer test_data_name)
+{
+    const gchar *name = (const gchar *) test_data_name;
+    size_t lens[] = { 0, 1, 55, 56, 63, 64, 65, 119, 120, 128, 1000, 65536, 1048577 };
+    unsigned char *buf;
+    guint i;
+
+    if (!md5_mb_set_backend (name)) {
+        g_test_message ("%s is not supported", name);
+        return;
+    }
+
+    buf = test_data (1048577);
+    for (i = 0; i < G_N_ELEMENTS (lens); i++) {
+        unsigned char digest[MD5_MB_DIGEST_LENGTH];
+        unsigned char expected[MD5_MB_DIGEST_LENGTH];
+
+        md5_mb (buf, lens[i], digest);
+        MD5 (buf, lens[i], expected);
+        g_assert (memcmp (digest, expected, MD5_MB_DIGEST_LENGTH) == 0);
+    }
+    g_free (buf);
+
+    md5_mb_set_backend ("auto");
+}
+
+// contexts of different lengths, data is added by pieces which are not aligned to blocks
+static void md5_mb_test_multi (gconstpointer test_data_name)
+{
+    const gchar *name = (const gchar *) test_data_name;
+    Md5MbCtx ctx[MD5_MB_MAX_LANES + 3];
+    Md5MbCtx *ctxs[MD5_MB_MAX_LANES + 3];
+    const unsigned char *data[MD5_MB_MAX_LANES + 3];
+    size_t lens[MD5_MB_MAX_LANES + 3];
+    size_t totals[MD5_MB_MAX_LANES + 3];
+    unsigned char *buf;
+    guint n, i, piece;
+
+    if (!md5_mb_set_backend (name)) {
+        g_test_message ("%s is not supported", name);
+        return;
+    }
+
+    buf = test_data (300000);
+    for (n = 1; n <= G_N_ELEMENTS (ctx); n++) {
+        for (i = 0; i < n; i++) {
+            md5_mb_init (&ctx[i]);
+            ctxs[i] = &ctx[i];
+            totals[i] = 0;
+        }
+
+        for (piece = 0; piece < 4; piece++) {
+            for (i = 0; i < n; i++) {
+                data[i] = buf + i + totals[i];
+                lens[i] = (i * 7919 + piece * 4099) % 50000 + piece;
+                totals[i] += lens[i];
+            }
+            md5_mb_update_multi (ctxs, data, lens, n);
+        }
+
+        for (i = 0; i < n; i++) {
+            unsigned char digest[MD5_MB_DIGEST_LENGTH];
+            unsigned char expected[MD5_MB_DIGEST_LENGTH];
+
+            md5_mb_final (digest, &ctx[i]);
+            MD5 (buf + i, totals[i], expected);
+            g_assert (memcmp (digest, expected, MD5_MB_DIGEST_LENGTH) == 0);
+        }
+    }
+    g_free (buf);
+
+    md5_mb_set_backend ("auto");
+}
+
+// throughput of a single thread which hashes as many buffers as backend has lanes
+static void md5_mb_test_bench (gconstpointer test_data_name)
+{
+    const gchar *name = (const gchar *) test_data_name;
+    Md5MbCtx ctx[MD5_MB_MAX_LANES];
+    Md5MbCtx *ctxs[MD5_MB_MAX_LANES];
+    const unsigned char *data[MD5_MB_MAX_LANES];
+    size_t lens[MD5_MB_MAX_LANES];
+    unsigned char *buf;
+    guint i, lanes;
+    gdouble elapsed;
+
+    if (!md5_mb_set_backend (name)) {
+        g_test_message ("%s is not supported", name);
+        return;
+    }
+
+    lanes = md5_mb_get_lanes ();
+    buf = test_data (BENCH_SIZE);
+    for (i = 0; i < lanes; i++) {
+        md5_mb_init (&ctx[i]);
+        ctxs[i] = &ctx[i];
+        data[i] = buf + i * (BENCH_SIZE / lanes);
+        lens[i] = BENCH_SIZE / lanes;
+    }
+
+    g_test_timer_start ();
+    md5_mb_update_multi (ctxs, data, lens, lanes);
+    elapsed = g_test_timer_elapsed ();
+
+    g_test_maximized_result (BENCH_SIZE / elapsed / 1e9, "%s, %u lanes: %.2f GB/s per core",
+        name, lanes, BENCH_SIZE / elapsed / 1e9);
+
+    g_free (buf);
+    md5_mb_set_backend ("auto");
+}
+
+int main (int argc, char *argv[])
+{
+    guint i;
+
+    g_test_init (&argc, &argv, NULL);
+
+    for (i = 0; i < G_N_ELEMENTS (backends); i++) {
+        gchar *path;
+
+        path = g_strdup_printf ("/md5_mb/md5_mb_test_single/%s", backends[i]);
+        g_test_add_data_func (path, backends[i], md5_mb_test_single);
+        g_free (path);
+
+        path = g_strdup_printf ("/md5_mb/md5_mb_test_multi/%s", backends[i]);
+        g_test_add_data_func (path, backends[i], md5_mb_test_multi);
+        g_free (path);
+
+        if (g_test_perf ()) {
+            path = g_strdup_printf ("/md5_mb/md5_mb_test_bench/%s", backends[i]);
+            g_test_add_data_func (path, backends[i], md5_mb_test_bench);
+            g_free (path);
+        }
+    }
+
+    return g_test_run ();
+}
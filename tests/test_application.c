@@ -42,6 +42,11 @@ StatSrv *application_get_stat_srv (Application *app)
     return NULL;
 }
 
+HashPool *application_get_hash_pool (Application *app)
+{
+    return NULL;
+}
+
 void stats_srv_add_op_history (StatSrv *stat_srv, const gchar *str)
 {
 }
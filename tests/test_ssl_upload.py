@@ -0,0 +1,86 @@
+import os
+import re
+import shutil
+import signal
+import unittest
+import tempfile
+import hashlib
+import subprocess
+
+from riofs_server import wait_until
+
+# uploads go through https endpoint, parts are sent from local cache and staging files
+# requires a real bucket: RIOFS_TEST_BUCKET, AWSACCESSKEYID and AWSSECRETACCESSKEY
+BUCKET = os.getenv("RIOFS_TEST_BUCKET")
+BASE_PATH = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+PART_SIZE = 5 * 1024 * 1024
+
+
+class SSLUploadTestCase(unittest.TestCase):
+
+    def setUp(self):
+        self.tmp = tempfile.mkdtemp()
+        self.procs = []
+
+        conf = open(os.path.join(BASE_PATH, "riofs.conf.xml")).read()
+        conf = re.sub(r"<endpoint type=\"string\">[^<]*</endpoint>",
+            "<endpoint type=\"string\">https://s3.amazonaws.com</endpoint>", conf)
+        conf = re.sub(r"<upload_from_cache type=\"boolean\">[^<]*</upload_from_cache>",
+            "<upload_from_cache type=\"boolean\">True</upload_from_cache>", conf)
+        self.conf = os.path.join(self.tmp, "riofs.conf.xml")
+        open(self.conf, "w").write(conf)
+
+        self.write_dir = self.mount("write")
+
+    def tearDown(self):
+        for mnt, pid in self.procs:
+            subprocess.call(["fusermount", "-u", mnt])
+            try:
+                os.kill(pid, signal.SIGTERM)
+                os.waitpid(pid, 0)
+            except OSError:
+                pass
+        shutil.rmtree(self.tmp, True)
+
+    def mount(self, name):
+        mnt = os.path.join(self.tmp, name)
+        cache = os.path.join(self.tmp, name + "_cache")
+        os.mkdir(mnt)
+        args = [os.path.join(BASE_PATH, "src", "riofs"), "-f", "--disable-stats",
+            "-c", self.conf, "--cache-dir=" + cache, "--part-size=%d" % PART_SIZE, BUCKET, mnt]
+        proc = subprocess.Popen(args)
+        self.procs.append((mnt, proc.pid))
+        wait_until(os.path.ismount, mnt)
+        return mnt
+
+    def check_uploaded(self, name, data):
+        # fresh mount with an empty cache reads the object from the server
+        read_dir = self.mount("read")
+        path = os.path.join(read_dir, name)
+        wait_until(os.path.exists, path, timeout=60)
+        self.assertEqual(hashlib.md5(open(path, "rb").read()).hexdigest(), hashlib.md5(data).hexdigest())
+        os.unlink(path)
+
+    def test_multipart_upload(self):
+        # parts are sent from the local cache files
+        data = os.urandom(PART_SIZE * 3 + 12345)
+        with open(os.path.join(self.write_dir, "ssl_multipart"), "wb") as f:
+            f.write(data)
+        self.check_uploaded("ssl_multipart", data)
+
+    def test_staged_upload(self):
+        # random writes are uploaded from the staging file
+        data = bytearray(os.urandom(PART_SIZE + 4096))
+        with open(os.path.join(self.write_dir, "ssl_staged"), "wb") as f:
+            f.seek(4096)
+            f.write(data[4096:])
+            f.seek(0)
+            f.write(data[:4096])
+        self.check_uploaded("ssl_staged", str(data))
+
+
+if __name__ == "__main__":
+    if not BUCKET:
+        print "RIOFS_TEST_BUCKET is not set, skipping"
+    else:
+        unittest.main()